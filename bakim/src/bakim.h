@@ -0,0 +1,79 @@
+/*
+ * libbakim: bakim backups from inside another program.
+ *
+ * a context owns its backup roots, today's branch under each, its
+ * options and filters and the state a run builds up, and keeps them
+ * between calls, so backing up a few paths at a time costs what the
+ * paths cost.  calls may come from any thread; those on one context
+ * take turns, while contexts on different roots run side by side.  the
+ * process umask is left alone; archived entries get their modes
+ * exactly.
+ */
+#ifndef BAKIM_H
+#define BAKIM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct bakim;
+
+struct bakim_opts {
+	/*
+	 * when set, the paths are entries below this source root and only
+	 * they and the directories above them are backed up, as with
+	 * --from0.  when NULL each path is a root and is walked in full.
+	 */
+	const char *root;
+};
+
+/*
+ * told about each entry as it is stored in a target, or fails to be,
+ * and about files left for a later call because they were still being
+ * written (-D).  message gets each line the command would print to
+ * stderr, without the newline.  calls come from the run's threads, one
+ * at a time.
+ */
+struct bakim_callbacks {
+	void *arg;
+	void (*stored) (void *arg, const char *path, const char *slot);
+	void (*failed) (void *arg, const char *path);
+	void (*deferred) (void *arg, const char *path);
+	void (*message) (void *arg, const char *msg);
+};
+
+/*
+ * targets is a NULL terminated list of backup roots, NULL for /big.
+ * NULL with errno set if one is not a directory (ENOTDIR or what stat
+ * said), there are more than 16 (EINVAL) or memory ran out.
+ */
+struct bakim *bakim_open (const char *const *targets);
+
+/*
+ * a backup option for every later call, as its command line letter
+ * and value: 'x', 's', 'V' and so on.  -b, -c, -L and -t have no
+ * library equivalent.  -1 for one that is unknown or bad.
+ */
+int bakim_option (struct bakim *b, int opt, const char *value);
+
+/*
+ * back up a NULL terminated list of paths to every target.  -1 if
+ * anything could not be backed up; the rest still is.
+ */
+int bakim_backup_paths (struct bakim *b, const char *const *paths,
+			const struct bakim_opts *opts,
+			const struct bakim_callbacks *cb);
+
+/*
+ * what made the last call on b fail: the first message it reported.
+ * the library prints nothing itself.
+ */
+const char *bakim_error (struct bakim *b);
+
+void bakim_close (struct bakim *b);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,589 @@
+#include "libbakim.h"
+
+/* the chunk store under .bakim/chunks, and freeing what is unused */
+
+/* chunks some recipe names, and what bakim prune freed of the rest */
+struct hash_table chunk_live;
+long chunk_gc_files;
+long long chunk_gc_bytes;
+
+static int chunk_gc_cb (const char *fpath, const struct stat *sb, int tflag,
+			struct FTW *ftwbuf);
+
+/*
+ * chunked files.  a file from chunk_threshold up is cut into chunks at
+ * content-defined boundaries, and each chunk is stored once, under
+ * .bakim/chunks by its SHA-256, however many files and branches share
+ * it.  the file itself becomes a recipe, a count and then a list of
+ * chunk hashes and lengths, kept in a pack of kind "recipe" whose index
+ * records the file's stat and whole-file checksum as for packed files.
+ * with -Z a chunk may be stored deflated; it then is shorter than the
+ * length its recipe gives, which is how readers tell.
+ */
+
+/* the chunk named sha under root, into fn of PATH_MAX bytes */
+void
+chunk_path (const char *root, const unsigned char *sha, char *fn)
+{
+	char *p;
+	int idx;
+
+	p = fn + snprintf (fn, PATH_MAX - 2 * SHA256_LEN - 2,
+			   "%s/.bakim/chunks/", root);
+
+	for (idx = 0; idx < SHA256_LEN; idx++) {
+		p += sprintf (p, "%02x", sha[idx]);
+		if (idx == 0)
+			*p++ = '/';
+	}
+}
+
+/*
+ * give the complete chunk written to tmp its name fn.  1 if it was
+ * new, 0 if another writer stored it first, -1 on error.
+ */
+int
+chunk_commit (const char *tmp, const char *fn)
+{
+	int r;
+
+	r = 1;
+
+	if (link (tmp, fn) == -1) {
+		if (errno == EEXIST) {
+			r = 0;
+		} else {
+			report ("failed to store chunk %s: %m\n", fn);
+			r = -1;
+		}
+	}
+
+	unlink (tmp);
+
+	if (r == 1)
+		set_immutable (fn);
+
+	return (r);
+}
+
+/* store a chunk unless the store has it; as chunk_commit() */
+int
+chunk_put (const char *root, const unsigned char *sha,
+	   const unsigned char *data, size_t len, unsigned char *zbuf)
+{
+	char fn[PATH_MAX], tmp[PATH_MAX], *p;
+	struct stat sb;
+	uLongf zlen;
+	int fd;
+
+	chunk_path (root, sha, fn);
+
+	if (lstat (fn, &sb) == 0)
+		return (0);
+
+	p = strrchr (fn, '/');
+	sprintf (tmp, "%.*s/.tmp.%ld", (int) (p - fn), fn,
+		 (long) syscall (SYS_gettid));
+
+	if ((fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0444)) == -1
+	    && errno == ENOENT) {
+		*p = 0;
+		make_dir (fn, 0755);
+		*p = '/';
+		fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0444);
+	}
+
+	if (fd == -1) {
+		report ("failed to create chunk %s: %m\n", tmp);
+		return (-1);
+	}
+	fchmod (fd, 0444);
+
+	/* kept compressed only where that saves something */
+	zlen = compressBound (len);
+	if (zbuf && compress2 (zbuf, &zlen, data, len, bk->chunk_level) == Z_OK
+	    && zlen < len - len / 16) {
+		data = zbuf;
+		len = zlen;
+	}
+
+	throttle_take (&bk->write_limit, len);
+
+	if (write_all (fd, data, len) == -1) {
+		report ("error writing chunk %s:"
+			" possibly out of space\n", tmp);
+		close (fd);
+		unlink (tmp);
+		return (-1);
+	}
+
+	if (close (fd) == -1) {
+		report ("error writing chunk %s: %m\n", tmp);
+		unlink (tmp);
+		return (-1);
+	}
+
+	return (chunk_commit (tmp, fn));
+}
+
+/*
+ * chunk a file into the store and append its recipe to pk, a recipe
+ * pack; fresh gets the bytes of chunks that were new.  pk->lock is
+ * only taken for the append, so files of one slot chunk in parallel.
+ */
+int
+recipe_store (struct pack *pk, const char *fpath, const char *path,
+	      const struct stat *sb, uint64_t *fresh)
+{
+	unsigned char *buf, *ents, *zbuf, sha[SHA256_LEN];
+	char rec_buf[sizeof (struct pack_rec) + PATH_MAX];
+	struct sha256_state sh;
+	struct xxh64_state st;
+	struct pack_rec *pr;
+	size_t have, pos, cut, n_ents, alloc;
+	uint64_t size;
+	ssize_t n, w;
+	int fd, eof, r;
+
+	if ((fd = open (fpath, O_RDONLY | O_NOFOLLOW)) == -1) {
+		report ("cannot open src file %s: %m\n", fpath);
+		return (-1);
+	}
+
+	buf = xcalloc (1, CDC_BUFSIZE);
+	alloc = 1024;
+	ents = xcalloc (alloc, 4 + SHA256_LEN);
+	n_ents = 0;
+
+	xxh64_init (&st);
+	have = pos = 0;
+	n = 0;
+	size = 0;
+	eof = 0;
+	r = 0;
+	zbuf = NULL;
+
+	while (1) {
+		/* keep a whole maximal chunk ahead of the cut search */
+		if (!eof && have - pos < CDC_MAX) {
+			memmove (buf, buf + pos, have - pos);
+			have -= pos;
+			pos = 0;
+
+			while (have < CDC_BUFSIZE
+			       && (n = read (fd, buf + have,
+					     CDC_BUFSIZE - have)) > 0) {
+				throttle_take (&bk->read_limit, n);
+				xxh64_update (&st, buf + have, n);
+				have += n;
+			}
+
+			if (have < CDC_BUFSIZE && n == -1) {
+				report ("error reading %s: %m\n",
+					fpath);
+				r = -1;
+				break;
+			}
+			eof = have < CDC_BUFSIZE;
+
+			if (bk->chunk_level && size == 0
+			    && compressible (fpath, buf, have))
+				zbuf = xcalloc (1, compressBound (CDC_MAX));
+		}
+
+		if (pos == have)
+			break;
+
+		cut = cdc_cut (buf + pos, have - pos);
+
+		sha256_init (&sh);
+		sha256_update (&sh, buf + pos, cut);
+		sha256_final (&sh, sha);
+
+		if ((n = chunk_put (cur->tgt->root, sha, buf + pos, cut,
+				    zbuf)) == -1) {
+			r = -1;
+			break;
+		}
+		if (n == 1)
+			*fresh += cut;
+
+		if (n_ents == alloc) {
+			alloc *= 2;
+			if ((ents = realloc (ents, alloc * (4 + SHA256_LEN)))
+			    == NULL) {
+				report ("out of memory\n");
+				exit (1);
+			}
+		}
+
+		memcpy (ents + n_ents * (4 + SHA256_LEN), sha, SHA256_LEN);
+		put_le32 (ents + n_ents * (4 + SHA256_LEN) + SHA256_LEN, cut);
+		n_ents++;
+
+		pos += cut;
+		size += cut;
+	}
+
+	close (fd);
+	free (buf);
+	free (zbuf);
+
+	/* chunks already stored stay, for the next run or prune to judge */
+	if (r == -1) {
+		free (ents);
+		return (-1);
+	}
+
+	pthread_mutex_lock (&pk->lock);
+
+	if (pack_begin (pk) == -1) {
+		pthread_mutex_unlock (&pk->lock);
+		free (ents);
+		return (-1);
+	}
+
+	pr = xcalloc (1, sizeof *pr);
+	pr->offset = pk->end;
+	pr->size = size;
+	pr->hash = xxh64_final (&st);
+	pr->mtime = sb->st_mtime;
+	pr->atime = sb->st_atime;
+	pr->mode = sb->st_mode;
+	pr->uid = sb->st_uid;
+	pr->gid = sb->st_gid;
+	pr->path_len = strlen (path);
+
+	put_le32 ((unsigned char *) rec_buf, n_ents);
+
+	if (write_all (pk->data_fd, rec_buf, 4) == -1
+	    || write_all (pk->data_fd, ents, n_ents * (4 + SHA256_LEN)) == -1) {
+		report ("error writing recipes of %s:"
+			" possibly out of space\n", pk->slot);
+		/* what did go in stays, unreferenced */
+		free (ents);
+		free (pr);
+		pack_end (pk);
+		pthread_mutex_unlock (&pk->lock);
+		return (-1);
+	}
+
+	pk->end += 4 + n_ents * (4 + SHA256_LEN);
+	free (ents);
+
+	memcpy (rec_buf, pr, sizeof *pr);
+	memcpy (rec_buf + sizeof *pr, path, pr->path_len);
+
+	if ((w = write (pk->idx_fd, rec_buf, sizeof *pr + pr->path_len))
+	    != (ssize_t) (sizeof *pr + pr->path_len)) {
+		report ("error writing recipe index of %s: %m\n",
+			pk->slot);
+		/* a torn record would hide the ones after it */
+		if (w > 0)
+			ftruncate (pk->idx_fd,
+				   lseek (pk->idx_fd, 0, SEEK_END) - w);
+		free (pr);
+		pack_end (pk);
+		pthread_mutex_unlock (&pk->lock);
+		return (-1);
+	}
+
+	pack_end (pk);
+	hash_insert (&pk->recs, path, pr->path_len, pr);
+
+	pthread_mutex_unlock (&pk->lock);
+
+	return (0);
+}
+
+/*
+ * backup_file() for files from chunk_threshold up, into the recipe pack
+ * of the slot choose_slot() finds
+ */
+int
+backup_chunked (const char *fpath, const struct stat *sb, struct FTW *ftwbuf)
+{
+	const char *path, *slot_path;
+	char dst_name[PATH_MAX];
+	struct pack *pk;
+	struct dir_data *dp;
+	uint64_t fresh;
+	int count, r;
+
+	path = fpath + cur->base_off;
+
+	if ((r = choose_slot (fpath, sb, cur->tgt->directory, &count,
+			      dst_name)) <= 0)
+		return (r);
+
+	if (count < 0) {
+		slot_path = cur->tgt->directory;
+	} else {
+		if ((dp = collision_dir (count)) == NULL)
+			return (-1);
+		slot_path = dp->path;
+	}
+
+	pk = pack_get (&bk->recipes, "recipe", slot_path);
+
+	fresh = 0;
+	r = recipe_store (pk, fpath, path, sb, &fresh);
+
+	if (r == -1)
+		return (-1);
+
+	acct_add (slot_path, 1, fresh, sb->st_size - fresh);
+	index_note (slot_path, path);
+
+	return (update_newest (slot_path, path, ftwbuf->level, "recipe"));
+}
+
+/*
+ * the recipe at offset of the recipe pack fd: n entries of a chunk
+ * hash and a little-endian length, 4 + SHA256_LEN bytes each.
+ */
+unsigned char *
+recipe_chunks (int fd, uint64_t offset, uint32_t *n)
+{
+	unsigned char hdr[4], *ents;
+	size_t len;
+
+	if (pread (fd, hdr, 4, offset) != 4)
+		return (NULL);
+
+	*n = get_le32 (hdr);
+	len = (size_t) *n * (4 + SHA256_LEN);
+	ents = xcalloc (1, len + 1);
+
+	if (pread (fd, ents, len, offset + 4) != len) {
+		free (ents);
+		return (NULL);
+	}
+
+	return (ents);
+}
+
+/* the chunk named sha under root, open for reading */
+int
+chunk_open (const char *root, const unsigned char *sha)
+{
+	char fn[PATH_MAX];
+	int fd;
+
+	chunk_path (root, sha, fn);
+
+	if ((fd = open (fn, O_RDONLY | O_NOATIME)) == -1)
+		fd = open (fn, O_RDONLY);
+
+	return (fd);
+}
+
+/*
+ * whether to try compressing fpath's chunks: not for formats that are
+ * compressed already, nor when its first SAMPLE_LEN bytes, in data,
+ * shrink by less than a tenth.
+ */
+int
+compressible (const char *fpath, const unsigned char *data, size_t len)
+{
+	static const char *const packed[] = {
+		"7z", "avi", "bz2", "flac", "gif", "gz", "heic", "jpeg", "jpg",
+		"lz4", "m4a", "m4v", "mkv", "mov", "mp3", "mp4", "ogg", "png",
+		"rar", "tgz", "txz", "webm", "webp", "xz", "zip", "zst", NULL
+	};
+	const char *ext;
+	unsigned char *zbuf;
+	uLongf zlen;
+	int idx, r;
+
+	if ((ext = strrchr (fpath, '.')) != NULL && !strchr (ext, '/')) {
+		for (idx = 0; packed[idx]; idx++) {
+			if (strcasecmp (ext + 1, packed[idx]) == 0)
+				return (0);
+		}
+	}
+
+	if (len > SAMPLE_LEN)
+		len = SAMPLE_LEN;
+
+	zlen = compressBound (len);
+	zbuf = xcalloc (1, zlen);
+	r = compress2 (zbuf, &zlen, data, len, 1) == Z_OK
+		&& zlen < len - len / 10;
+	free (zbuf);
+
+	return (r);
+}
+
+/* whether the chunk open on fd, len bytes of data, is stored deflated */
+int
+chunk_compressed (int fd, uint32_t len)
+{
+	struct stat sb;
+
+	return (fstat (fd, &sb) == 0 && sb.st_size < len);
+}
+
+/* the len bytes of data of the deflated chunk open on fd, into buf */
+int
+chunk_inflate (int fd, unsigned char *buf, uint32_t len)
+{
+	unsigned char *zbuf;
+	struct stat sb;
+	uLongf out;
+	int r;
+
+	if (fstat (fd, &sb) == -1)
+		return (-1);
+
+	zbuf = xcalloc (1, sb.st_size + 1);
+	out = len;
+	r = -1;
+
+	if (pread (fd, zbuf, sb.st_size, 0) == sb.st_size) {
+		throttle_take (&bk->read_limit, sb.st_size);
+		if (uncompress (buf, &out, zbuf, sb.st_size) == Z_OK
+		    && out == len)
+			r = 0;
+		else
+			errno = EIO;
+	}
+
+	free (zbuf);
+
+	return (r);
+}
+
+
+/*
+ * chunks no remaining recipe names, after branches were removed; a
+ * stale temporary file is one a run left behind over a day ago
+ */
+static int
+chunk_gc_cb (const char *fpath, const struct stat *sb, int tflag,
+	     struct FTW *ftwbuf)
+{
+	const char *key;
+
+	if (tflag != FTW_F || ftwbuf->level != 2)
+		return (0);
+
+	key = fpath + ftwbuf->base - 3;
+
+	if (strncmp (fpath + ftwbuf->base, ".tmp.", 5) == 0) {
+		if (sb->st_mtime > time (NULL) - 24 * 60 * 60)
+			return (0);
+	} else if (hash_lookup (&chunk_live, key, strlen (key))) {
+		return (0);
+	}
+
+	if (unlink_entry_at (AT_FDCWD, fpath) == -1) {
+		report ("failed to remove %s: %m\n", fpath);
+		return (0);
+	}
+
+	chunk_gc_files++;
+	chunk_gc_bytes += sb->st_size;
+
+	return (0);
+}
+
+void
+chunk_mark (const unsigned char *sha)
+{
+	char fn[PATH_MAX], *key;
+
+	chunk_path ("", sha, fn);
+	key = fn + strlen (fn) - 2 * SHA256_LEN - 1;
+
+	if (!hash_lookup (&chunk_live, key, strlen (key)))
+		hash_insert (&chunk_live, key, strlen (key), NULL);
+}
+
+/* drop the chunks no recipe names; -1 if that can't be known */
+int
+chunk_gc (void)
+{
+	char **branches, *fn;
+	unsigned char *ents;
+	struct hash_table recs;
+	struct hash_entry *hp;
+	unsigned long bucket;
+	uint32_t jdx, n;
+	int idx, n_branches, fd, lock, blind;
+
+	/* wait for running backups, and keep new ones out */
+	if ((lock = lock_path (bk->backup_root, LOCK_EX)) == -1) {
+		report ("failed to lock %s: %m\n", bk->backup_root);
+		return (-1);
+	}
+
+	if ((n_branches = list_all_branches (&branches)) == -1) {
+		close (lock);
+		return (-1);
+	}
+
+	memset (&chunk_live, 0, sizeof chunk_live);
+	blind = 0;
+
+	for (idx = 0; idx < n_branches; idx++) {
+		memset (&recs, 0, sizeof recs);
+		if (blind || pack_load ("recipe", branches[idx], &recs) == -1) {
+			free (branches[idx]);
+			continue;
+		}
+
+		fn = pack_path ("recipe", branches[idx], "pack");
+		if ((fd = open (fn, O_RDONLY)) == -1) {
+			/* without it nothing can be known to be unused */
+			report ("cannot open %s: %m, leaving chunks alone\n",
+				fn);
+			blind = 1;
+			free (fn);
+			free_pack_recs (&recs);
+			free (branches[idx]);
+			continue;
+		}
+		free (fn);
+
+		for (bucket = 0; bucket < recs.size; bucket++) {
+			for (hp = recs.buckets[bucket]; hp; hp = hp->next) {
+				ents = recipe_chunks (fd, ((struct pack_rec *)
+							   hp->val)->offset,
+						      &n);
+				for (jdx = 0; ents && jdx < n; jdx++)
+					chunk_mark (ents + jdx
+						    * (4 + SHA256_LEN));
+				free (ents);
+			}
+		}
+
+		close (fd);
+		free_pack_recs (&recs);
+		free (branches[idx]);
+	}
+	free (branches);
+
+	if (blind) {
+		hash_clear (&chunk_live);
+		close (lock);
+		return (-1);
+	}
+
+	fn = meta_path ("chunks", NULL);
+	chunk_gc_files = chunk_gc_bytes = 0;
+	if (nftw (fn, chunk_gc_cb, MAX_DIRS_OPEN, FTW_PHYS) == -1
+	    && errno != ENOENT)
+		report ("failed to walk %s: %m\n", fn);
+	free (fn);
+
+	hash_clear (&chunk_live);
+
+	if (chunk_gc_files)
+		printf ("removed %ld unused chunks, %lld bytes\n",
+			chunk_gc_files, chunk_gc_bytes);
+
+	close (lock);
+
+	return (0);
+}
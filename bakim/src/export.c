@@ -0,0 +1,564 @@
+#include "libbakim.h"
+
+static int export_cb (const char *fpath, const struct stat *sb, int tflag,
+		      struct FTW *ftwbuf);
+static int export_newest_cb (const char *fpath, const struct stat *sb,
+			     int tflag, struct FTW *ftwbuf);
+
+/*
+ * bakim export: a branch, or what newest/ points at, as a ustar stream
+ * on stdout.  names that don't fit ustar get a pax header.  file data
+ * goes to the output with splice or sendfile, not through our buffers.
+ * a bare date takes in its -xx slots too, each path as the newest has it.
+ */
+/* hard linked files already written, by dev:ino, to their tar name */
+struct hash_table export_links;
+
+uint64_t export_files, export_bytes;
+
+/* how file data can reach stdout: 0 splice, 1 sendfile, 2 copy */
+int export_mode;
+
+void
+export_write (const void *p, size_t n)
+{
+	if (write_all (1, p, n) == -1) {
+		report ("failed to write archive: %m\n");
+		exit (1);
+	}
+}
+
+/* an octal number in a field of len bytes, or -1 if it won't fit */
+int
+tar_octal (char *field, int len, uint64_t v)
+{
+	int idx;
+
+	for (idx = len - 2; idx >= 0; idx--, v >>= 3)
+		field[idx] = '0' + (v & 7);
+	field[len - 1] = 0;
+
+	if (v) {
+		memset (field, '0', len - 1);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/* append one "LEN key=value\n" pax record to b */
+void
+pax_record (struct buf *b, const char *key, const char *val)
+{
+	char num[24];
+	int n, len;
+
+	n = strlen (key) + strlen (val) + 3;
+	for (len = n + 1; len != n + sprintf (num, "%d", len);)
+		len = n + strlen (num);
+
+	sprintf (num, "%d ", len);
+	buf_put (b, num, strlen (num));
+	buf_put (b, key, strlen (key));
+	buf_put (b, "=", 1);
+	buf_put (b, val, strlen (val));
+	buf_put (b, "\n", 1);
+}
+
+void
+tar_pad (uint64_t size)
+{
+	static const char zero[512];
+
+	if (size % 512)
+		export_write (zero, 512 - size % 512);
+}
+
+/* magic and checksum of a header block otherwise filled in */
+void
+tar_seal (unsigned char *h)
+{
+	unsigned int sum;
+	int idx;
+
+	memcpy (h + 257, "ustar", 6);
+	memcpy (h + 263, "00", 2);
+
+	memset (h + 148, ' ', 8);
+	for (sum = 0, idx = 0; idx < 512; idx++)
+		sum += h[idx];
+	snprintf ((char *) h + 148, 8, "%06o", sum);
+	h[155] = ' ';
+}
+
+/* the header block(s) of one member; link is the target for '1' and '2' */
+void
+tar_header (const char *name, const struct stat *sb, int type,
+	    const char *link)
+{
+	unsigned char h[512], x[512];
+	char num[24];
+	struct buf pax;
+	const char *base, *split;
+	int len;
+
+	memset (h, 0, sizeof h);
+	memset (&pax, 0, sizeof pax);
+
+	len = strlen (name);
+	split = NULL;
+
+	if (len <= 100) {
+		memcpy (h, name, len);
+	} else {
+		/* ustar: a prefix up to 155 bytes, split at a slash */
+		for (split = name + len - 101; *split && *split != '/'; split++)
+			;
+		if (*split && split - name <= 155 && split[1]) {
+			memcpy (h + 345, name, split - name);
+			memcpy (h, split + 1, len - (split - name) - 1);
+		} else {
+			pax_record (&pax, "path", name);
+			memcpy (h, name, 100);
+		}
+	}
+
+	if (link) {
+		if (strlen (link) > 100)
+			pax_record (&pax, "linkpath", link);
+		memcpy (h + 157, link, strlen (link) > 100 ? 100
+			: strlen (link));
+	}
+
+	tar_octal ((char *) h + 100, 8, sb->st_mode & 07777);
+
+	if (tar_octal ((char *) h + 108, 8, sb->st_uid) == -1) {
+		sprintf (num, "%u", (unsigned int) sb->st_uid);
+		pax_record (&pax, "uid", num);
+	}
+	if (tar_octal ((char *) h + 116, 8, sb->st_gid) == -1) {
+		sprintf (num, "%u", (unsigned int) sb->st_gid);
+		pax_record (&pax, "gid", num);
+	}
+	if (tar_octal ((char *) h + 124, 12, type == '0' ? sb->st_size
+		       : 0) == -1) {
+		sprintf (num, "%llu", (unsigned long long) sb->st_size);
+		pax_record (&pax, "size", num);
+	}
+	if (tar_octal ((char *) h + 136, 12, sb->st_mtime < 0 ? 0
+		       : sb->st_mtime) == -1 || sb->st_mtime < 0) {
+		sprintf (num, "%lld", (long long) sb->st_mtime);
+		pax_record (&pax, "mtime", num);
+	}
+
+	h[156] = type;
+	tar_seal (h);
+
+	if (pax.len) {
+		memset (x, 0, sizeof x);
+		base = strrchr (name, '/');
+		snprintf ((char *) x, 100, "PaxHeaders/%.80s",
+			  base && base[1] ? base + 1 : name);
+		tar_octal ((char *) x + 100, 8, 0644);
+		tar_octal ((char *) x + 108, 8, 0);
+		tar_octal ((char *) x + 116, 8, 0);
+		tar_octal ((char *) x + 124, 12, pax.len);
+		tar_octal ((char *) x + 136, 12, 0);
+		x[156] = 'x';
+		tar_seal (x);
+
+		export_write (x, 512);
+		export_write (pax.data, pax.len);
+		tar_pad (pax.len);
+		free (pax.data);
+	}
+
+	export_write (h, 512);
+}
+
+/* up to size bytes of fd from offset to stdout; what couldn't be read */
+uint64_t
+tar_send (int fd, uint64_t offset, uint64_t size)
+{
+	char buf[64 * 1024];
+	loff_t off;
+	ssize_t n;
+	uint64_t left;
+
+	off = offset;
+	left = size;
+	n = 0;
+
+	while (left > 0) {
+		if (export_mode == 0)
+			n = splice (fd, &off, 1, NULL, left < 1 << 30 ? left
+				    : 1 << 30, SPLICE_F_MORE);
+		else if (export_mode == 1)
+			n = sendfile (1, fd, &off, left < 1 << 30 ? left
+				      : 1 << 30);
+		else if ((n = pread (fd, buf, left < sizeof buf ? left
+				     : sizeof buf, off)) > 0) {
+			export_write (buf, n);
+			off += n;
+		}
+
+		/* not every filesystem or output can do it without a copy */
+		if (n == -1 && export_mode < 2 && off == offset
+		    && (errno == EINVAL || errno == ENOSYS)) {
+			export_mode++;
+			continue;
+		}
+
+		if (n <= 0)
+			break;
+
+		throttle_take (&bk->read_limit, n);
+		left -= n;
+	}
+
+	if (left && n == -1 && errno == EPIPE) {
+		report ("failed to write archive: %m\n");
+		exit (1);
+	}
+
+	return (left);
+}
+
+/* zeros in place of data that couldn't be read, to keep the archive whole */
+void
+tar_zero (uint64_t left)
+{
+	static const char zero[64 * 1024];
+
+	while (left > 0) {
+		export_write (zero, left < sizeof zero ? left : sizeof zero);
+		left -= left < sizeof zero ? left : sizeof zero;
+	}
+}
+
+/* the end of a member's size bytes of data */
+void
+tar_end (uint64_t size)
+{
+	tar_pad (size);
+
+	export_files++;
+	export_bytes += size;
+}
+
+/* size bytes of fd from offset as a member's data; -1 if it came up short */
+int
+tar_data (int fd, uint64_t offset, uint64_t size)
+{
+	uint64_t left;
+
+	left = tar_send (fd, offset, size);
+	tar_zero (left);
+	tar_end (size);
+
+	return (left ? -1 : 0);
+}
+
+/* one member named name, for the archived entry fn with stat sb */
+int
+export_entry (const char *name, const char *fn, const struct stat *sb)
+{
+	char key[50], tar[PATH_MAX], dir_name[PATH_MAX];
+	struct hash_entry *hp;
+	int fd, r;
+
+	if (S_ISDIR (sb->st_mode)) {
+		snprintf (dir_name, sizeof dir_name, "%s/", name);
+		tar_header (dir_name, sb, '5', NULL);
+		return (0);
+	}
+
+	if (S_ISLNK (sb->st_mode)) {
+		if ((r = readlink (fn, tar, sizeof tar - 1)) == -1) {
+			report ("failed to read link %s: %m\n", fn);
+			return (-1);
+		}
+		tar[r] = 0;
+		tar_header (name, sb, '2', tar);
+		return (0);
+	}
+
+	if (!S_ISREG (sb->st_mode))
+		return (0);
+
+	if (sb->st_nlink > 1) {
+		sprintf (key, "%llx:%llx", (unsigned long long) sb->st_dev,
+			 (unsigned long long) sb->st_ino);
+		if ((hp = hash_lookup (&export_links, key,
+				       strlen (key))) != NULL) {
+			tar_header (name, sb, '1', hp->val);
+			return (0);
+		}
+	}
+
+	if ((fd = open (fn, O_RDONLY | O_NOATIME)) == -1
+	    && (fd = open (fn, O_RDONLY)) == -1) {
+		report ("failed to open %s: %m\n", fn);
+		return (-1);
+	}
+
+	posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	tar_header (name, sb, '0', NULL);
+	r = tar_data (fd, 0, sb->st_size);
+
+	posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+	close (fd);
+
+	if (r == -1)
+		report ("%s changed size while exporting\n", fn);
+	else if (sb->st_nlink > 1)
+		hash_insert (&export_links, key, strlen (key), xstrdup (name));
+
+	return (r);
+}
+
+int
+export_packed (const char *name, struct pack_view *pv,
+	       const struct pack_rec *pr)
+{
+	struct stat sb;
+
+	pack_rec_stat (pr, &sb);
+	tar_header (name, &sb, '0', NULL);
+
+	if (tar_data (pv->fd, pr->offset, pr->size) == -1) {
+		report ("pack data for %s is short\n", name);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/* a chunked file, its data gathered from the chunk store */
+int
+export_chunked (const char *name, struct pack_view *pv,
+		const struct pack_rec *pr)
+{
+	struct stat sb;
+	unsigned char *ents, *ent, *buf;
+	uint64_t done, len, left;
+	uint32_t idx, n, clen;
+	int fd, r;
+
+	pack_rec_stat (pr, &sb);
+	tar_header (name, &sb, '0', NULL);
+
+	if ((ents = recipe_chunks (pv->cfd, pr->offset, &n)) == NULL)
+		n = 0;
+
+	buf = NULL;
+	done = 0;
+	r = 0;
+
+	for (idx = 0; idx < n && done < pr->size; idx++) {
+		ent = ents + idx * (4 + SHA256_LEN);
+		len = clen = get_le32 (ent + SHA256_LEN);
+		if (len > pr->size - done)
+			len = pr->size - done;
+
+		left = len;
+		if ((fd = chunk_open (bk->backup_root, ent)) != -1) {
+			if (!chunk_compressed (fd, clen)) {
+				left = tar_send (fd, 0, len);
+			} else {
+				if (!buf)
+					buf = xcalloc (1, CDC_MAX);
+				if (clen <= CDC_MAX
+				    && chunk_inflate (fd, buf, clen) == 0) {
+					export_write (buf, len);
+					left = 0;
+				}
+			}
+			close (fd);
+		}
+		if (left) {
+			tar_zero (left);
+			r = -1;
+		}
+		done += len;
+	}
+
+	free (ents);
+	free (buf);
+
+	if (done < pr->size || r == -1) {
+		report ("chunk data for %s is missing\n", name);
+		r = -1;
+	}
+
+	tar_zero (pr->size - done);
+	tar_end (pr->size);
+
+	return (r);
+}
+
+int export_skip, export_errors;
+
+static int
+export_cb (const char *fpath, const struct stat *sb, int tflag,
+	   struct FTW *ftwbuf)
+{
+	if (!fpath[export_skip] || slot_taken (fpath + export_skip + 1))
+		return (0);
+
+	if (tflag == FTW_DNR || tflag == FTW_NS) {
+		report ("failed to read %s\n", fpath);
+		export_errors++;
+		return (0);
+	}
+
+	if (export_entry (fpath + export_skip + 1, fpath, sb) == -1)
+		export_errors++;
+
+	return (0);
+}
+
+/* newest/: directories as they are, links as what they resolve to */
+static int
+export_newest_cb (const char *fpath, const struct stat *sb, int tflag,
+		  struct FTW *ftwbuf)
+{
+	char fn[PATH_MAX];
+	const char *name;
+	struct stat tar_sb;
+	struct pack_view *pv;
+	struct pack_rec *pr;
+
+	if (!fpath[export_skip])
+		return (0);
+
+	name = fpath + export_skip + 1;
+
+	if (tflag != FTW_SL)
+		return (export_cb (fpath, sb, tflag, ftwbuf));
+
+	switch (resolve_newest (fpath, ftwbuf->base, fn, &tar_sb, &pv, &pr)) {
+	case 0:
+		if (export_entry (name, fn, &tar_sb) == -1)
+			export_errors++;
+		break;
+	case 1:
+		if (export_packed (name, pv, pr) == -1)
+			export_errors++;
+		break;
+	case 2:
+		if (export_chunked (name, pv, pr) == -1)
+			export_errors++;
+		break;
+	default:
+		export_errors++;
+	}
+
+	return (0);
+}
+
+int
+cmd_export (int argc, char **argv)
+{
+	int c, k, n_slots;
+	char *top, *prefix, *p, **slots;
+	unsigned long idx, n;
+	struct hash_entry *hp, **ents;
+	struct pack_view *pv;
+	struct stat sb;
+	static const char zero[1024];
+
+	while ((c = getopt (argc, argv, "R:")) != EOF) {
+		switch (c) {
+		case 'R':
+			bk->read_limit.rate = parse_size (optarg);
+			break;
+		default:
+			usage ();
+		}
+	}
+
+	if (optind + 1 != argc && optind + 2 != argc)
+		usage ();
+
+	if (isatty (1)) {
+		report ("refusing to write an archive to a terminal\n");
+		return (1);
+	}
+
+	if ((n_slots = walk_slots (argv[optind], &slots)) == -1)
+		return (1);
+
+	prefix = optind + 2 == argc ? argv[optind + 1] : "";
+	while (*prefix == '/')
+		prefix++;
+	for (p = prefix + strlen (prefix); p > prefix && p[-1] == '/';)
+		*--p = 0;
+
+	if (fstat (1, &sb) == 0 && !S_ISFIFO (sb.st_mode))
+		export_mode = 1;
+
+	top = xcalloc (1, strlen (bk->backup_root)
+			  + strlen (argv[optind]) + 5);
+	p = xcalloc (1, strlen (bk->backup_root) + strlen (argv[optind])
+			+ strlen (prefix) + 6);
+
+	/* a date's slots newest first, each path from the newest holding it */
+	for (k = n_slots - 1; k >= 0; k--) {
+		sprintf (top, "%s/%s", bk->backup_root, slots[k]);
+		export_skip = strlen (top);
+		sprintf (p, "%s%s%s", top, *prefix ? "/" : "", prefix);
+
+		if (nftw (p, strcmp (slots[k], "newest") == 0
+			  ? export_newest_cb : export_cb, MAX_DIRS_OPEN,
+			  FTW_PHYS) == -1
+		    && (errno != ENOENT || (!*prefix && !slot_merge))) {
+			report ("failed to walk %s: %m\n", p);
+			export_errors++;
+		}
+
+		/* packed and chunked files have no entry in the tree */
+		if (strcmp (slots[k], "newest") == 0)
+			continue;
+
+		pv = pack_view (slots[k]);
+		ents = branch_packed (slots[k], prefix, 0, &n);
+		for (idx = 0; idx < n; idx++) {
+			if (!slot_taken (ents[idx]->key)
+			    && export_packed (ents[idx]->key, pv,
+					      ents[idx]->val) == -1)
+				export_errors++;
+		}
+		free (ents);
+
+		ents = branch_packed (slots[k], prefix, 1, &n);
+		for (idx = 0; idx < n; idx++) {
+			if (!slot_taken (ents[idx]->key)
+			    && export_chunked (ents[idx]->key, pv,
+					       ents[idx]->val) == -1)
+				export_errors++;
+		}
+		free (ents);
+	}
+
+	export_write (zero, sizeof zero);
+
+	report ("%llu files, %llu bytes exported\n",
+		(unsigned long long) export_files,
+		(unsigned long long) export_bytes);
+
+	for (idx = 0; idx < export_links.size; idx++) {
+		for (hp = export_links.buckets[idx]; hp; hp = hp->next)
+			free (hp->val);
+	}
+	hash_clear (&export_links);
+
+	free_pack_views ();
+	free_slots (slots, n_slots);
+
+	free (p);
+	free (top);
+
+	return (export_errors ? 1 : 0);
+}
@@ -0,0 +1,1007 @@
+#include "libbakim.h"
+
+/* the path index under .bakim/index; bakim index, versions and find */
+
+static int cmp_journal (const void *a, const void *b);
+static int cmp_int (const void *a, const void *b);
+static int *add_slot (int *slots, int *n, int *alloc, int id);
+static void flush_block (FILE *f, FILE *bf, char **blk, size_t *blk_len,
+			 int n);
+static long journal_mine (void);
+static void journal_drop (long n);
+static int index_merge (const char *name, struct hash_table *gone);
+static void index_load_delta (struct hash_table *gone);
+static void index_load_journal (struct hash_table *gone);
+
+/* remember that path now exists in backup_path, for the path index */
+void
+index_note (const char *backup_path, const char *path)
+{
+	struct hash_entry *hp;
+	struct journal_ent *je;
+
+	pthread_mutex_lock (&bk->journal_lock);
+
+	if ((hp = hash_lookup (&bk->journal_slots, backup_path,
+			       strlen (backup_path))) == NULL) {
+		bk->journal_names = realloc (bk->journal_names,
+					     (bk->n_journal_names + 1)
+					     * sizeof *bk->journal_names);
+		if (!bk->journal_names) {
+			report ("out of memory\n");
+			exit (1);
+		}
+		bk->journal_names[bk->n_journal_names] = xstrdup (backup_path);
+		hp = hash_insert (&bk->journal_slots, backup_path,
+				  strlen (backup_path),
+				  (void *) (long) bk->n_journal_names++);
+	}
+
+	if (bk->n_journal == bk->journal_alloc) {
+		bk->journal_alloc = bk->journal_alloc
+				    ? bk->journal_alloc * 2 : 4096;
+		bk->journal = realloc (bk->journal, bk->journal_alloc
+				       * sizeof *bk->journal);
+		if (!bk->journal) {
+			report ("out of memory\n");
+			exit (1);
+		}
+	}
+
+	je = &bk->journal[bk->n_journal++];
+	je->path = xstrdup (path);
+	je->slot = (long) hp->val;
+
+	pthread_mutex_unlock (&bk->journal_lock);
+}
+
+void
+put_varint (FILE *f, uint64_t v)
+{
+	while (v >= 0x80) {
+		putc ((v & 0x7f) | 0x80, f);
+		v >>= 7;
+	}
+	putc (v, f);
+}
+
+uint64_t
+get_varint (const unsigned char **p, const unsigned char *end)
+{
+	uint64_t v;
+	int shift;
+
+	v = 0;
+	shift = 0;
+
+	while (*p < end && shift < 64) {
+		v |= (uint64_t) (**p & 0x7f) << shift;
+		if ((*(*p)++ & 0x80) == 0)
+			break;
+		shift += 7;
+	}
+
+	return (v);
+}
+
+/* map the path index; returns -1 if there is none or it is damaged */
+int
+index_open (struct index_reader *ir)
+{
+	return (index_open_file (ir, "index"));
+}
+
+/* map .bakim/NAME, the index or its delta */
+int
+index_open_file (struct index_reader *ir, const char *name)
+{
+	char *fn;
+	int fd;
+	uint32_t idx;
+	struct stat sb;
+	const unsigned char *p, *end, *e;
+
+	memset (ir, 0, sizeof *ir);
+
+	fn = meta_path (name, NULL);
+	fd = open (fn, O_RDONLY);
+	free (fn);
+
+	if (fd == -1)
+		return (-1);
+
+	if (fstat (fd, &sb) == -1 || sb.st_size < sizeof ir->ft) {
+		close (fd);
+		return (-1);
+	}
+
+	ir->size = sb.st_size;
+	ir->map = mmap (NULL, ir->size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (ir->map == MAP_FAILED)
+		return (-1);
+
+	memcpy (&ir->ft, ir->map + ir->size - sizeof ir->ft, sizeof ir->ft);
+
+	if (memcmp (ir->ft.magic, INDEX_MAGIC, 8) != 0
+	    || ir->ft.slots_off + 4 > ir->ft.blocks_off
+	    || ir->ft.blocks_off > ir->size - sizeof ir->ft
+	    || ir->ft.n_blocks > (ir->size - sizeof ir->ft
+				  - ir->ft.blocks_off) / 8)
+		goto damaged;
+
+	/* every block starts before the slot names, and each name ends */
+	ir->offs = (const uint64_t *) (ir->map + ir->ft.blocks_off);
+
+	for (idx = 0; idx < ir->ft.n_blocks; idx++) {
+		if (ir->offs[idx] >= ir->ft.slots_off)
+			goto damaged;
+	}
+
+	p = ir->map + ir->ft.slots_off;
+	end = ir->map + ir->ft.blocks_off;
+
+	memcpy (&idx, p, 4);
+	p += 4;
+
+	if (idx > end - p)
+		goto damaged;
+
+	ir->n_slots = idx;
+	ir->slots = xcalloc (ir->n_slots + 1, sizeof *ir->slots);
+	for (idx = 0; idx < ir->n_slots; idx++) {
+		if ((e = memchr (p, 0, end - p)) == NULL)
+			goto damaged;
+		ir->slots[idx] = (char *) p;
+		p = e + 1;
+	}
+
+	return (0);
+
+damaged:
+	report ("path index is damaged, rebuild it with bakim index -r\n");
+	index_close (ir);
+	return (-1);
+}
+
+void
+index_close (struct index_reader *ir)
+{
+	if (ir->map && ir->map != MAP_FAILED)
+		munmap (ir->map, ir->size);
+	free (ir->slots);
+	memset (ir, 0, sizeof *ir);
+}
+
+void
+index_iter_init (struct index_iter *it, struct index_reader *ir,
+		 uint64_t block)
+{
+	memset (it, 0, sizeof *it);
+	it->ir = ir;
+	it->block = block;
+}
+
+/* step to the next path; returns 0 at the end of the index */
+int
+index_iter_next (struct index_iter *it)
+{
+	const unsigned char *end;
+	uint64_t shared, len, n, idx, v;
+
+	end = it->ir->map + it->ir->ft.slots_off;
+
+	while (it->left == 0) {
+		if (it->block >= it->ir->ft.n_blocks)
+			return (0);
+
+		it->p = it->ir->map + it->ir->offs[it->block++];
+		it->left = get_varint (&it->p, end);
+	}
+
+	shared = get_varint (&it->p, end);
+	len = get_varint (&it->p, end);
+
+	if (shared + len >= PATH_MAX || it->p + len > end)
+		return (0);
+
+	memcpy (it->path + shared, it->p, len);
+	it->path[shared + len] = 0;
+	it->p += len;
+
+	if ((n = get_varint (&it->p, end)) > end - it->p)
+		return (0);
+
+	if (n > it->alloc) {
+		it->alloc = n;
+		it->slots = realloc (it->slots, n * sizeof *it->slots);
+		if (!it->slots) {
+			report ("out of memory\n");
+			exit (1);
+		}
+	}
+
+	for (idx = 0; idx < n; idx++) {
+		if ((v = get_varint (&it->p, end)) >= it->ir->n_slots)
+			return (0);
+		it->slots[idx] = v;
+	}
+
+	it->n_slots = n;
+	it->left--;
+
+	return (1);
+}
+
+/*
+ * position it on the first path not before PATH; returns 0 if there is
+ * none.  the first path of a block is stored whole after its shared
+ * prefix (0) and its length, and isn't NUL terminated.
+ */
+int
+index_seek (struct index_reader *ir, struct index_iter *it,
+	    const char *path)
+{
+	const unsigned char *p, *end;
+	uint64_t lo, hi, mid, len;
+	size_t pl;
+	int r;
+
+	end = ir->map + ir->ft.slots_off;
+	pl = strlen (path);
+
+	/* the last block whose first path is not after PATH */
+	lo = 0;
+	hi = ir->ft.n_blocks;
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		p = ir->map + ir->offs[mid];
+		get_varint (&p, end);
+		get_varint (&p, end);
+		len = get_varint (&p, end);
+		if (len > end - p)
+			len = end - p;
+		r = memcmp (p, path, len < pl ? len : pl);
+		if (r == 0)
+			r = len < pl ? -1 : len > pl;
+		if (r <= 0)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	index_iter_init (it, ir, lo);
+
+	while (index_iter_next (it)) {
+		if (strcmp (it->path, path) >= 0)
+			return (1);
+	}
+
+	return (0);
+}
+
+/* position it on PATH; returns 0 if the index doesn't hold it */
+int
+index_find (struct index_reader *ir, struct index_iter *it,
+	    const char *path)
+{
+	return (index_seek (ir, it, path) && strcmp (it->path, path) == 0);
+}
+
+static int
+cmp_journal (const void *a, const void *b)
+{
+	const struct journal_ent *ja, *jb;
+	int r;
+
+	ja = a;
+	jb = b;
+
+	if ((r = strcmp (ja->path, jb->path)) != 0)
+		return (r);
+
+	return (ja->slot - jb->slot);
+}
+
+static int
+cmp_int (const void *a, const void *b)
+{
+	return (*(const int *) a - *(const int *) b);
+}
+
+/* append id to a growable list of slot ids */
+static int *
+add_slot (int *slots, int *n, int *alloc, int id)
+{
+	if (*n == *alloc) {
+		*alloc = *alloc ? *alloc * 2 : 16;
+		if ((slots = realloc (slots, *alloc * sizeof *slots)) == NULL) {
+			report ("out of memory\n");
+			exit (1);
+		}
+	}
+
+	slots[(*n)++] = id;
+
+	return (slots);
+}
+
+/* a block's entry count comes first, so blocks are built in memory */
+static void
+flush_block (FILE *f, FILE *bf, char **blk, size_t *blk_len, int n)
+{
+	fflush (bf);
+	put_varint (f, n);
+	fwrite (*blk, 1, *blk_len, f);
+	rewind (bf);
+}
+
+/*
+ * move the journal entries under backup_root to its front, returning
+ * how many there are
+ */
+static long
+journal_mine (void)
+{
+	struct journal_ent tmp_je;
+	const char *name;
+	long jdx, n_mine;
+	int rl;
+
+	rl = strlen (bk->backup_root);
+
+	for (jdx = n_mine = 0; jdx < bk->n_journal; jdx++) {
+		name = bk->journal_names[bk->journal[jdx].slot];
+		if (strncmp (name, bk->backup_root, rl) != 0
+		    || name[rl] != '/')
+			continue;
+		tmp_je = bk->journal[n_mine];
+		bk->journal[n_mine++] = bk->journal[jdx];
+		bk->journal[jdx] = tmp_je;
+	}
+
+	return (n_mine);
+}
+
+/* drop the first n journal entries, and the slot names once it's empty */
+static void
+journal_drop (long n)
+{
+	long jdx;
+	int idx;
+
+	for (jdx = 0; jdx < n; jdx++)
+		free (bk->journal[jdx].path);
+	memmove (bk->journal, bk->journal + n,
+		 (bk->n_journal - n) * sizeof *bk->journal);
+	bk->n_journal -= n;
+
+	if (bk->n_journal)
+		return;
+
+	free (bk->journal);
+	bk->journal = NULL;
+	bk->n_journal = bk->journal_alloc = 0;
+
+	for (idx = 0; idx < bk->n_journal_names; idx++)
+		free (bk->journal_names[idx]);
+	free (bk->journal_names);
+	bk->journal_names = NULL;
+	bk->n_journal_names = 0;
+	hash_clear (&bk->journal_slots);
+}
+
+/*
+ * append the journal entries under backup_root to .bakim/journal, as
+ * slot and path, each NUL terminated, and drop them.  what a call
+ * stored then reaches the index even if the process is gone before
+ * the next index_update().
+ */
+int
+journal_save (void)
+{
+	char *fn;
+	long jdx, n_mine;
+	int lock, rl, r;
+	FILE *f;
+
+	if ((n_mine = journal_mine ()) == 0)
+		return (0);
+
+	rl = strlen (bk->backup_root);
+
+	fn = meta_path (".", NULL);
+	lock = lock_path (fn, LOCK_EX);
+	free (fn);
+
+	fn = meta_path ("journal", NULL);
+	r = 0;
+
+	if ((f = meta_fopen (fn, "a")) == NULL) {
+		report ("failed to write %s: %m\n", fn);
+		r = -1;
+	} else {
+		for (jdx = 0; jdx < n_mine; jdx++) {
+			fputs (bk->journal_names[bk->journal[jdx].slot]
+			       + rl + 1, f);
+			putc ('\0', f);
+			fputs (bk->journal[jdx].path, f);
+			putc ('\0', f);
+		}
+		if (fclose (f) != 0) {
+			report ("failed to write %s: %m\n", fn);
+			r = -1;
+		}
+	}
+
+	free (fn);
+	if (lock != -1)
+		close (lock);
+
+	/* kept for index_update() to try */
+	if (r == 0) {
+		bk->journal_saved += n_mine;
+		journal_drop (n_mine);
+	}
+
+	return (r);
+}
+
+/*
+ * rewrite .bakim/NAME merging it with the part of this run's journal
+ * under backup_root, leaving out the slots named in gone (if any).
+ * slot ids are renumbered: surviving old slots first, then new ones.
+ * journal entries for other targets are kept for their turn.
+ */
+static int
+index_merge (const char *name, struct hash_table *gone)
+{
+	struct index_reader ir;
+	struct index_iter it;
+	struct index_footer ft;
+	char **names, *fn, *tmp, *blk, prev[PATH_MAX], path[PATH_MAX];
+	int *old_map, *new_map, *slots, n_names, n_slots, alloc, have_old;
+	int more, idx, r, in_block, shared, rl;
+	uint64_t *offs, n_offs;
+	size_t blk_len;
+	long jdx, n_mine;
+	const char *slot;
+	char tmp_name[32];
+	FILE *f, *bf;
+
+	snprintf (tmp_name, sizeof tmp_name, "%s.tmp", name);
+	fn = meta_path (name, NULL);
+	tmp = meta_path (tmp_name, NULL);
+
+	if ((f = meta_fopen (tmp, "w")) == NULL) {
+		report ("failed to write %s: %m\n", tmp);
+		free (fn);
+		free (tmp);
+		return (-1);
+	}
+
+	have_old = index_open_file (&ir, name) == 0;
+
+	names = xcalloc (ir.n_slots + bk->n_journal_names + 1, sizeof *names);
+	n_names = 0;
+
+	old_map = xcalloc (ir.n_slots + 1, sizeof *old_map);
+	for (idx = 0; idx < ir.n_slots; idx++) {
+		if (gone && hash_lookup (gone, ir.slots[idx],
+					 strlen (ir.slots[idx]))) {
+			old_map[idx] = -1;
+			continue;
+		}
+		old_map[idx] = n_names;
+		names[n_names++] = ir.slots[idx];
+	}
+
+	rl = strlen (bk->backup_root);
+
+	new_map = xcalloc (bk->n_journal_names + 1, sizeof *new_map);
+	for (idx = 0; idx < bk->n_journal_names; idx++) {
+		if (strncmp (bk->journal_names[idx], bk->backup_root, rl) != 0
+		    || bk->journal_names[idx][rl] != '/') {
+			new_map[idx] = -1;
+			continue;
+		}
+		slot = bk->journal_names[idx] + rl + 1;
+
+		for (r = 0; r < n_names; r++) {
+			if (strcmp (names[r], slot) == 0)
+				break;
+		}
+		if (r == n_names)
+			names[n_names++] = (char *) slot;
+		new_map[idx] = r;
+	}
+
+	n_mine = journal_mine ();
+	qsort (bk->journal, n_mine, sizeof *bk->journal, cmp_journal);
+
+	blk = NULL;
+	if ((bf = open_memstream (&blk, &blk_len)) == NULL) {
+		report ("out of memory\n");
+		exit (1);
+	}
+
+	memset (&ft, 0, sizeof ft);
+	offs = NULL;
+	n_offs = 0;
+	slots = NULL;
+	alloc = 0;
+	in_block = 0;
+	prev[0] = 0;
+
+	index_iter_init (&it, &ir, 0);
+	more = have_old && index_iter_next (&it);
+	jdx = 0;
+
+	while (more || jdx < n_mine) {
+		if (!more)
+			r = 1;
+		else if (jdx == n_mine)
+			r = -1;
+		else
+			r = strcmp (it.path, bk->journal[jdx].path);
+
+		n_slots = 0;
+
+		if (r <= 0) {
+			strcpy (path, it.path);
+			for (idx = 0; idx < it.n_slots; idx++) {
+				if (it.slots[idx] < ir.n_slots
+				    && old_map[it.slots[idx]] != -1)
+					slots = add_slot (slots, &n_slots,
+						&alloc, old_map[it.slots[idx]]);
+			}
+			more = index_iter_next (&it);
+		} else {
+			strcpy (path, bk->journal[jdx].path);
+		}
+
+		if (r >= 0) {
+			while (jdx < n_mine
+			       && strcmp (bk->journal[jdx].path, path) == 0) {
+				slots = add_slot (slots, &n_slots, &alloc,
+					new_map[bk->journal[jdx].slot]);
+				jdx++;
+			}
+		}
+
+		if (n_slots == 0)
+			continue;
+
+		qsort (slots, n_slots, sizeof *slots, cmp_int);
+		for (idx = r = 0; idx < n_slots; idx++) {
+			if (r == 0 || slots[r - 1] != slots[idx])
+				slots[r++] = slots[idx];
+		}
+		n_slots = r;
+
+		if (in_block == INDEX_BLOCK) {
+			flush_block (f, bf, &blk, &blk_len, in_block);
+			in_block = 0;
+		}
+
+		if (in_block == 0) {
+			offs = realloc (offs, (n_offs + 1) * sizeof *offs);
+			if (!offs) {
+				report ("out of memory\n");
+				exit (1);
+			}
+			offs[n_offs++] = ftell (f);
+			prev[0] = 0;
+		}
+
+		for (shared = 0; prev[shared] && prev[shared] == path[shared];
+		     shared++)
+			;
+
+		put_varint (bf, shared);
+		put_varint (bf, strlen (path + shared));
+		fputs (path + shared, bf);
+		put_varint (bf, n_slots);
+		for (idx = 0; idx < n_slots; idx++)
+			put_varint (bf, slots[idx]);
+
+		strcpy (prev, path);
+		in_block++;
+		ft.n_paths++;
+	}
+
+	if (in_block)
+		flush_block (f, bf, &blk, &blk_len, in_block);
+
+	fclose (bf);
+	free (blk);
+
+	ft.slots_off = ftell (f);
+	fwrite (&n_names, 4, 1, f);
+	for (idx = 0; idx < n_names; idx++)
+		fwrite (names[idx], 1, strlen (names[idx]) + 1, f);
+
+	ft.blocks_off = ftell (f);
+	ft.n_blocks = n_offs;
+	fwrite (offs, sizeof *offs, n_offs, f);
+
+	memcpy (ft.magic, INDEX_MAGIC, 8);
+	fwrite (&ft, sizeof ft, 1, f);
+
+	r = 0;
+	if (fclose (f) != 0 || rename (tmp, fn) == -1) {
+		report ("failed to write %s: %m\n", fn);
+		unlink (tmp);
+		r = -1;
+	}
+
+	free (it.slots);
+	free (slots);
+	free (offs);
+	free (names);
+	free (old_map);
+	free (new_map);
+	free (fn);
+	free (tmp);
+
+	if (have_old)
+		index_close (&ir);
+
+	journal_drop (n_mine);
+
+	return (r);
+}
+
+/* move the delta's entries, less the slots in gone, into the journal */
+static void
+index_load_delta (struct hash_table *gone)
+{
+	struct index_reader ir;
+	struct index_iter it;
+	const char *slot;
+	char *bp;
+	int idx;
+
+	if (index_open_file (&ir, "index.delta") == -1)
+		return;
+
+	index_iter_init (&it, &ir, 0);
+	while (index_iter_next (&it)) {
+		for (idx = 0; idx < it.n_slots; idx++) {
+			if (it.slots[idx] >= ir.n_slots)
+				continue;
+			slot = ir.slots[it.slots[idx]];
+			if (gone && hash_lookup (gone, slot, strlen (slot)))
+				continue;
+			bp = xcalloc (1, strlen (bk->backup_root)
+				      + strlen (slot) + 2);
+			sprintf (bp, "%s/%s", bk->backup_root, slot);
+			index_note (bp, it.path);
+			free (bp);
+		}
+	}
+
+	free (it.slots);
+	index_close (&ir);
+}
+
+/*
+ * add .bakim/journal, less the slots in gone, to the journal.  a record
+ * cut short by a crash while it was appended is left out.
+ */
+static void
+index_load_journal (struct hash_table *gone)
+{
+	char *fn, *buf, *p, *path, *end, *bp;
+	struct stat sb;
+	FILE *f;
+
+	fn = meta_path ("journal", NULL);
+	f = fopen (fn, "r");
+	free (fn);
+
+	if (f == NULL)
+		return;
+
+	if (fstat (fileno (f), &sb) == -1 || sb.st_size == 0) {
+		fclose (f);
+		return;
+	}
+
+	buf = xcalloc (1, sb.st_size + 1);
+	end = buf + fread (buf, 1, sb.st_size, f);
+	fclose (f);
+
+	for (p = buf; p < end; p = path + strlen (path) + 1) {
+		if ((path = memchr (p, '\0', end - p)) == NULL)
+			break;
+		path++;
+		if (memchr (path, '\0', end - path) == NULL)
+			break;
+
+		if (!gone || !hash_lookup (gone, p, strlen (p))) {
+			bp = xcalloc (1, strlen (bk->backup_root)
+				      + strlen (p) + 2);
+			sprintf (bp, "%s/%s", bk->backup_root, p);
+			index_note (bp, path);
+			free (bp);
+		}
+	}
+
+	free (buf);
+}
+
+/*
+ * bring backup_root's path index up to date with the journal and
+ * .bakim/journal, dropping the slots in gone.  the journal goes into
+ * the delta unless that has grown too big or slots are going, when
+ * the delta is folded into the index.  runs on the same root take
+ * turns.
+ */
+int
+index_update (struct hash_table *gone)
+{
+	struct index_reader ir;
+	uint64_t n_index, n_delta;
+	char *fn;
+	int lock, r;
+
+	fn = meta_path (".", NULL);
+	lock = lock_path (fn, LOCK_EX);
+	free (fn);
+
+	index_load_journal (gone);
+
+	n_index = n_delta = 0;
+	if (index_open (&ir) == 0) {
+		n_index = ir.ft.n_paths;
+		index_close (&ir);
+	}
+	if (index_open_file (&ir, "index.delta") == 0) {
+		n_delta = ir.ft.n_paths;
+		index_close (&ir);
+	}
+
+	if (!gone && (n_delta + bk->n_journal) * INDEX_DELTA_SHARE < n_index) {
+		r = index_merge ("index.delta", NULL);
+	} else {
+		index_load_delta (gone);
+		if ((r = index_merge ("index", gone)) == 0) {
+			fn = meta_path ("index.delta", NULL);
+			unlink (fn);
+			free (fn);
+		}
+	}
+
+	/* on failure it stays for the next update */
+	if (r == 0) {
+		fn = meta_path ("journal", NULL);
+		unlink (fn);
+		free (fn);
+	}
+
+	if (lock != -1)
+		close (lock);
+
+	return (r);
+}
+
+
+/* bakim index -r: rebuild the path index from a walk of every branch */
+int
+cmd_index (int argc, char **argv)
+{
+	struct listing *lss, **lsp;
+	struct list_entry *le;
+	char **branches, *fn;
+	int c, idx, jdx, n, rebuild;
+
+	rebuild = 0;
+
+	while ((c = getopt (argc, argv, "r")) != EOF) {
+		switch (c) {
+		case 'r':
+			rebuild = 1;
+			break;
+		default:
+			usage ();
+		}
+	}
+
+	if (!rebuild || optind != argc)
+		usage ();
+
+	if ((n = list_all_branches (&branches)) == -1)
+		return (1);
+
+	lss = xcalloc (n + 1, sizeof *lss);
+	lsp = xcalloc (n + 1, sizeof *lsp);
+
+	for (idx = 0; idx < n; idx++) {
+		lss[idx].dirs = xcalloc (1, sizeof *lss[idx].dirs);
+		lss[idx].dirs[0] = xstrdup (branches[idx]);
+		lss[idx].n_dirs = 1;
+		lsp[idx] = &lss[idx];
+	}
+
+	list_branches (lsp, n);
+
+	fn = meta_path ("index", NULL);
+	unlink (fn);
+	free (fn);
+	fn = meta_path ("index.delta", NULL);
+	unlink (fn);
+	free (fn);
+	fn = meta_path ("journal", NULL);
+	unlink (fn);
+	free (fn);
+
+	for (idx = 0; idx < n; idx++) {
+		fn = xcalloc (1, strlen (bk->backup_root)
+			      + strlen (branches[idx]) + 2);
+		sprintf (fn, "%s/%s", bk->backup_root, branches[idx]);
+
+		for (jdx = 0; jdx < lss[idx].n; jdx++) {
+			le = &lss[idx].ents[jdx];
+			if (!S_ISDIR (le->sb.st_mode))
+				index_note (fn, le->path);
+		}
+
+		free (fn);
+		free_listing (&lss[idx]);
+		free (branches[idx]);
+	}
+
+	free (lss);
+	free (lsp);
+	free (branches);
+
+	return (index_update (NULL) == -1 ? 1 : 0);
+}
+
+/* every branch and slot holding PATH, from the path index */
+int
+cmd_versions (int argc, char **argv)
+{
+	struct index_reader ir[2];
+	struct index_iter it[2];
+	const char *path, *slot;
+	int idx, jdx, have[2], found[2];
+
+	if (argc != 2)
+		usage ();
+
+	path = argv[1];
+	while (*path == '/')
+		path++;
+
+	have[0] = index_open (&ir[0]) == 0;
+	have[1] = index_open_file (&ir[1], "index.delta") == 0;
+
+	if (!have[0] && !have[1]) {
+		report ("no path index, build one with"
+			" bakim index -r\n");
+		return (1);
+	}
+
+	memset (it, 0, sizeof it);
+	found[0] = have[0] && index_find (&ir[0], &it[0], path);
+	found[1] = have[1] && index_find (&ir[1], &it[1], path);
+
+	for (idx = 0; found[0] && idx < it[0].n_slots; idx++) {
+		if (it[0].slots[idx] < ir[0].n_slots)
+			printf ("%s/%s/%s\n", bk->backup_root,
+				ir[0].slots[it[0].slots[idx]], path);
+	}
+
+	/* today's slots may be in both */
+	for (idx = 0; found[1] && idx < it[1].n_slots; idx++) {
+		if (it[1].slots[idx] >= ir[1].n_slots)
+			continue;
+		slot = ir[1].slots[it[1].slots[idx]];
+		for (jdx = 0; found[0] && jdx < it[0].n_slots; jdx++) {
+			if (it[0].slots[jdx] < ir[0].n_slots
+			    && strcmp (ir[0].slots[it[0].slots[jdx]],
+				       slot) == 0)
+				break;
+		}
+		if (!found[0] || jdx == it[0].n_slots)
+			printf ("%s/%s/%s\n", bk->backup_root, slot, path);
+	}
+
+	for (idx = 0; idx < 2; idx++) {
+		free (it[idx].slots);
+		if (have[idx])
+			index_close (&ir[idx]);
+	}
+
+	return (found[0] || found[1] ? 0 : 1);
+}
+
+/*
+ * every indexed path matching PATTERN: a glob if it has any glob
+ * characters, a path and what is below it if it starts with /, and
+ * otherwise a plain substring.  a glob's literal start or the path is
+ * looked up, and the walk ends once past the paths starting with it.
+ */
+int
+cmd_find (int argc, char **argv)
+{
+	struct index_reader ir[2];
+	struct index_iter it[2];
+	const char *pat, *path;
+	char prefix[PATH_MAX];
+	int glob, below, found, idx, r, l, more[2];
+
+	if (argc != 2)
+		usage ();
+
+	pat = argv[1];
+	glob = strpbrk (pat, "*?[") != NULL;
+	below = !glob && *pat == '/';
+
+	if (below) {
+		while (*pat == '/')
+			pat++;
+		l = strlen (pat);
+		while (l && pat[l - 1] == '/')
+			l--;
+	} else {
+		l = glob ? strcspn (pat, "*?[\\") : 0;
+	}
+	snprintf (prefix, sizeof prefix, "%.*s", l, pat);
+	l = strlen (prefix);
+
+	more[0] = index_open (&ir[0]) == 0;
+	more[1] = index_open_file (&ir[1], "index.delta") == 0;
+
+	if (!more[0] && !more[1]) {
+		report ("no path index, build one with"
+			" bakim index -r\n");
+		return (1);
+	}
+
+	for (idx = 0; idx < 2; idx++) {
+		if (more[idx]) {
+			more[idx] = index_seek (&ir[idx], &it[idx], prefix);
+		} else {
+			memset (&it[idx], 0, sizeof it[idx]);
+		}
+	}
+	found = 0;
+
+	/* both are sorted; a path in both is printed once */
+	while (more[0] || more[1]) {
+		if (!more[1])
+			r = -1;
+		else if (!more[0])
+			r = 1;
+		else
+			r = strcmp (it[0].path, it[1].path);
+
+		path = r <= 0 ? it[0].path : it[1].path;
+		if (strncmp (path, prefix, l) != 0)
+			break;
+
+		if (glob ? fnmatch (pat, path, 0) == 0
+		    : below ? path[l] == 0 || path[l] == '/' || !l
+		    : strstr (path, pat) != NULL) {
+			printf ("%s\n", path);
+			found = 1;
+		}
+
+		if (r <= 0)
+			more[0] = index_iter_next (&it[0]);
+		if (r >= 0)
+			more[1] = index_iter_next (&it[1]);
+	}
+
+	for (idx = 0; idx < 2; idx++) {
+		free (it[idx].slots);
+		if (it[idx].ir)
+			index_close (&ir[idx]);
+	}
+
+	return (found ? 0 : 1);
+}
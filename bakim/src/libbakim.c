@@ -0,0 +1,7119 @@
+#include "libbakim.h"
+
+struct bakim bakim_cli = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.backup_root = BACKUP_ROOT,
+	.read_order = ORDER_AUTO,
+	.read_limit = { PTHREAD_MUTEX_INITIALIZER },
+	.write_limit = { PTHREAD_MUTEX_INITIALIZER },
+	.meta_limit = { PTHREAD_MUTEX_INITIALIZER },
+	.pack_lock = PTHREAD_MUTEX_INITIALIZER,
+	.content_check = CONTENT_STAT,
+	.defer_window = -1,
+	.busy_lock = PTHREAD_MUTEX_INITIALIZER,
+	.filter_min_size = -1,
+	.filter_max_size = -1,
+	.filter_min_age = -1,
+	.filter_max_age = -1,
+	.note_lock = PTHREAD_MUTEX_INITIALIZER,
+	.manifest_lock = PTHREAD_MUTEX_INITIALIZER,
+	.acct_lock = PTHREAD_MUTEX_INITIALIZER,
+	.journal_lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+/*
+ * the context the thread works for.  threads a run starts take their
+ * starter's, through start_thread().
+ */
+__thread struct bakim *bk = &bakim_cli;
+
+/* GF(2^8) over x^8+x^4+x^3+x^2+1, and c times each nibble for each c */
+pthread_once_t gf_once = PTHREAD_ONCE_INIT;
+unsigned char gf_exp[512], gf_log[256];
+unsigned char gf_nib[256][32];
+void (*gf_mul_add) (unsigned char *dst, const unsigned char *src, size_t n,
+		    int c);
+
+/* the kinds of pack a slot can have, by their directory under .bakim */
+const char *pack_kinds[] = { "pack", "recipe", NULL };
+
+/* adaptive mode: sleep this long per throttled op while disks are slow */
+volatile int backoff_us;
+struct watched_dev *first_watched;
+
+/* nftw callbacks take no user pointer, so the root is per thread */
+__thread struct root_ctx *cur;
+
+/* how deep below its root a listed directory being walked is */
+static __thread int list_level;
+
+/* set once a root is walked, when held back files are backed up */
+static __thread int walked;
+
+/*
+ * bakim watch: paths changed since the last batch, in the order they
+ * were first seen, and for inotify the directory each watch is on.
+ */
+struct hash_table watch_seen;
+char **watch_paths;
+int n_watch, watch_alloc;
+time_t watch_first, watch_last;
+int watch_overflow, watch_full;
+struct hash_table watch_wds;
+int *watch_fds, watch_ifd = -1;
+volatile sig_atomic_t watch_stop;
+
+static void *thread_main (void *arg);
+static void sha256_block (struct sha256_state *st, const unsigned char *p);
+static int mk_backup (const char *fpath, const struct stat *sb, int tflag,
+		      struct FTW *ftwbuf);
+static int cmp_pending (const void *a, const void *b);
+static int mk_backup_under (const char *fpath, const struct stat *sb,
+			    int tflag, struct FTW *ftwbuf);
+static int watch_add_cb (const char *fpath, const struct stat *sb,
+			 int tflag, struct FTW *ftwbuf);
+static int note_newest_ref (const char *fpath, const struct stat *sb,
+			    int tflag, struct FTW *ftwbuf);
+static int cmp_str (const void *a, const void *b);
+static int cmp_branch_date (const void *a, const void *b);
+static int list_cb (const char *fpath, const struct stat *sb, int tflag,
+		    struct FTW *ftwbuf);
+static int cmp_list_entry (const void *a, const void *b);
+
+void
+usage (void)
+{
+	printf ("usage: bakim [-o auto|none|inode|extent] [-c idle|be[:LEVEL]]\n"
+		"             [-R BYTES/S] [-W BYTES/S] [-M OPS/S] [-L MS]"
+		" [-P BYTES]\n"
+		"             [-C BYTES] [-Z LEVEL] [-E PARITY] [-V sample|full]"
+		" [-D SECONDS]\n"
+		"             [-x PATTERN]... [-X FILE] [-s MIN:MAX]"
+		" [-a MIN:MAX]\n"
+		"             [-b ROOT]... [-t COMMAND] [--from0 LIST] [--]"
+		" [FILE]...\n"
+		"       bakim prune [-n] [-j JOBS] [-d DAYS] [-w WEEKS]"
+		" [-m MONTHS]\n"
+		"       bakim verify [-r] [-j JOBS] [-R BYTES/S] [-S SRCDIR]"
+		" [-s STATEFILE] [BRANCH]...\n"
+		"       bakim diff BRANCH BRANCH\n"
+		"       bakim df [-r] [BRANCH]...\n"
+		"       bakim index -r\n"
+		"       bakim versions PATH\n"
+		"       bakim find PATTERN\n"
+		"       bakim recv\n"
+		"       bakim replicate [-n] [-j JOBS] SRC_ROOT DST_ROOT\n"
+		"       bakim export [-R BYTES/S] BRANCH|newest [PATH]\n"
+		"       bakim restore [-j JOBS] [-R BYTES/S] BRANCH|newest PATH"
+		" DEST\n"
+		"       bakim repair [-n] [-R BYTES/S] [BRANCH]...\n"
+		"       bakim watch [-i SETTLE] [-r RECONCILE] [BACKUP OPTION]..."
+		" FILE...\n");
+	exit (1);
+}
+
+void
+valgrind_cleanup (void)
+{
+	int idx;
+
+	free_roots ();
+	free_targets ();
+
+	free (bk->backup_branch);
+
+	for (idx = 0; idx < bk->n_busy; idx++)
+		free (bk->busy_paths[idx]);
+	free (bk->busy_paths);
+}
+
+/* the roots and lanes of a run, for the next run to start afresh */
+void
+free_roots (void)
+{
+	int idx;
+	struct root_ctx *rc, *nrc, *tc;
+	struct lane *lp, *nlp;
+
+	for (rc = bk->first_root; rc; rc = nrc) {
+		nrc = rc->next;
+		park_slots (rc);
+		while ((tc = rc->mirror) != NULL) {
+			rc->mirror = tc->mirror;
+			park_slots (tc);
+			free (tc);
+		}
+		for (idx = 0; idx < rc->n_list; idx++)
+			free (rc->list[idx]);
+		free (rc->list);
+		free (rc->path);
+		free (rc);
+	}
+
+	for (lp = bk->first_lane; lp; lp = nlp) {
+		nlp = lp->next;
+		free (lp);
+	}
+
+	bk->first_root = bk->last_root = NULL;
+	bk->first_lane = NULL;
+}
+
+void
+free_targets (void)
+{
+	struct target *t, *nt;
+
+	for (t = bk->first_target; t; t = nt) {
+		nt = t->next;
+		free (t->root);
+		free (t->directory);
+		free (t->newest);
+		if (t->lock != -1)
+			close (t->lock);
+		free_slot_list (t->warm_slots);
+		free (t);
+	}
+
+	bk->first_target = bk->last_target = NULL;
+	bk->n_targets = 0;
+}
+
+/*
+ * an engine message, one line.  the command prints it to stderr; a
+ * library call keeps the first as its error and hands each to the
+ * message callback.  errno is left as it was.
+ */
+void
+vreport (const char *fmt, va_list ap)
+{
+	char msg[1024];
+	int saved, l;
+
+	saved = errno;
+
+	if (bk == &bakim_cli) {
+		vfprintf (stderr, fmt, ap);
+		errno = saved;
+		return;
+	}
+
+	vsnprintf (msg, sizeof msg, fmt, ap);
+	l = strlen (msg);
+	if (l && msg[l - 1] == '\n')
+		msg[l - 1] = '\0';
+
+	pthread_mutex_lock (&bk->note_lock);
+	if (!bk->error[0])
+		snprintf (bk->error, sizeof bk->error, "%s", msg);
+	if (bk->callbacks && bk->callbacks->message)
+		bk->callbacks->message (bk->callbacks->arg, msg);
+	pthread_mutex_unlock (&bk->note_lock);
+
+	errno = saved;
+}
+
+void
+report (const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start (ap, fmt);
+	vreport (fmt, ap);
+	va_end (ap);
+}
+
+void *
+xcalloc (unsigned int a, unsigned int b)
+{
+	void *p;
+
+	if ((p = calloc (a, b)) == NULL) {
+		report ("memory error\n");
+		exit (1);
+	}
+
+	return (p);
+}
+
+char *
+xstrdup (const char *old)
+{
+	char *new;
+
+	if ((new = strdup (old)) == NULL) {
+		report ("out of memory\n");
+		exit (1);
+	}
+
+	return (new);
+}
+
+struct thread_start {
+	void *(*fn) (void *);
+	void *arg;
+	struct bakim *b;
+};
+
+static void *
+thread_main (void *arg)
+{
+	struct thread_start ts = *(struct thread_start *) arg;
+
+	free (arg);
+	bk = ts.b;
+
+	return (ts.fn (ts.arg));
+}
+
+/* pthread_create(), with the new thread working for the caller's context */
+int
+start_thread (pthread_t *thread, void *(*fn) (void *), void *arg)
+{
+	struct thread_start *ts;
+	int r;
+
+	ts = xcalloc (1, sizeof *ts);
+	ts->fn = fn;
+	ts->arg = arg;
+	ts->b = bk;
+
+	/* pthread_create() leaves errno alone; %m in a report wants it */
+	if ((r = pthread_create (thread, NULL, thread_main, ts)) != 0) {
+		free (ts);
+		errno = r;
+	}
+
+	return (r);
+}
+
+/* a count with an optional k, m or g suffix, in powers of 1024 */
+unsigned long long
+parse_size (const char *s)
+{
+	unsigned long long v;
+
+	if (size_arg (s, &v) == -1)
+		usage ();
+
+	return (v);
+}
+
+/* a size with an optional k, m or g suffix; -1 if it isn't one */
+int
+size_arg (const char *s, unsigned long long *vp)
+{
+	char *end;
+	unsigned long long v;
+
+	v = strtoull (s, &end, 10);
+
+	switch (tolower (*end)) {
+	case 'g':
+		v *= 1024;
+		/* fall through */
+	case 'm':
+		v *= 1024;
+		/* fall through */
+	case 'k':
+		v *= 1024;
+		end++;
+		break;
+	}
+
+	if (end == s || *end) {
+		report ("bad size %s\n", s);
+		return (-1);
+	}
+
+	*vp = v;
+
+	return (0);
+}
+
+/*
+ * charge n units against the bucket and sleep off any debt, and the
+ * latency backoff once for the op.
+ */
+void
+throttle_take (struct throttle *t, double n)
+{
+	throttle_sleep (throttle_debt (t, n));
+}
+
+/* a block both read and written: one op, limited by both buckets */
+void
+throttle_copy (double n)
+{
+	double r, w;
+
+	r = throttle_debt (&bk->read_limit, n);
+	w = throttle_debt (&bk->write_limit, n);
+
+	throttle_sleep (r > w ? r : w);
+}
+
+/*
+ * charge n units against the bucket, returning how many seconds it
+ * takes to pay off.  the bucket holds at most one second's worth, so
+ * an idle stretch doesn't turn into an unthrottled burst.
+ */
+double
+throttle_debt (struct throttle *t, double n)
+{
+	struct timespec now;
+	double wait;
+
+	wait = 0;
+
+	if (t->rate > 0) {
+		pthread_mutex_lock (&t->lock);
+
+		clock_gettime (CLOCK_MONOTONIC, &now);
+
+		if (t->last.tv_sec) {
+			t->tokens += t->rate * ((now.tv_sec - t->last.tv_sec)
+				     + (now.tv_nsec - t->last.tv_nsec) / 1e9);
+			if (t->tokens > t->rate)
+				t->tokens = t->rate;
+		} else {
+			t->tokens = t->rate;
+		}
+
+		t->last = now;
+		t->tokens -= n;
+
+		if (t->tokens < 0)
+			wait = -t->tokens / t->rate;
+
+		pthread_mutex_unlock (&t->lock);
+	}
+
+	return (wait);
+}
+
+void
+throttle_sleep (double wait)
+{
+	struct timespec ts;
+
+	wait += backoff_us / 1e6;
+
+	if (wait > 0) {
+		ts.tv_sec = (time_t) wait;
+		ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+		nanosleep (&ts, NULL);
+	}
+}
+
+/* the io priority belongs to the calling thread, so every lane sets it */
+void
+set_ioprio (void)
+{
+	if (!bk->io_class)
+		return;
+
+	if (syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+		     bk->io_class << IOPRIO_CLASS_SHIFT | bk->io_level) == -1)
+		report ("failed to set io priority: %m\n");
+}
+
+void
+watch_dev (dev_t dev)
+{
+	struct watched_dev *wd;
+
+	for (wd = first_watched; wd; wd = wd->next) {
+		if (wd->dev == dev)
+			return;
+	}
+
+	wd = xcalloc (1, sizeof *wd);
+	wd->dev = dev;
+	wd->next = first_watched;
+	first_watched = wd;
+
+	sample_latency (wd, NULL);
+}
+
+/*
+ * average ms per completed request on the device since the last call,
+ * from the read and write columns of /proc/diskstats.  returns -1 if
+ * the device isn't listed there (tmpfs, nfs and the like).
+ */
+int
+sample_latency (struct watched_dev *wd, double *ms)
+{
+	FILE *f;
+	char line[1000];
+	unsigned int maj, mnr;
+	unsigned long long rd, rd_ticks, wr, wr_ticks, ios, ticks;
+	int r;
+
+	if ((f = fopen ("/proc/diskstats", "r")) == NULL)
+		return (-1);
+
+	r = -1;
+
+	while (fgets (line, sizeof line, f)) {
+		if (sscanf (line, "%u %u %*s %llu %*u %*u %llu %llu %*u %*u"
+			    " %llu", &maj, &mnr, &rd, &rd_ticks, &wr,
+			    &wr_ticks) != 6)
+			continue;
+
+		if (maj != major (wd->dev) || mnr != minor (wd->dev))
+			continue;
+
+		ios = rd + wr;
+		ticks = rd_ticks + wr_ticks;
+
+		if (ms) {
+			if (ios > wd->ios)
+				*ms = (double) (ticks - wd->ticks)
+					/ (ios - wd->ios);
+			else
+				*ms = 0;
+		}
+
+		wd->ios = ios;
+		wd->ticks = ticks;
+		r = 0;
+		break;
+	}
+
+	fclose (f);
+
+	return (r);
+}
+
+/*
+ * once a second, double the per-op backoff while any watched device is
+ * slower than latency_limit_ms, and halve it again once they recover.
+ */
+void *
+latency_monitor (void *arg)
+{
+	struct watched_dev *wd;
+	double ms, worst;
+	int b;
+
+	while (1) {
+		sleep (1);
+
+		worst = 0;
+		for (wd = first_watched; wd; wd = wd->next) {
+			if (sample_latency (wd, &ms) == 0 && ms > worst)
+				worst = ms;
+		}
+
+		b = backoff_us;
+
+		if (worst > bk->latency_limit_ms) {
+			b = b ? b * 2 : BACKOFF_MIN_US;
+			if (b > BACKOFF_MAX_US)
+				b = BACKOFF_MAX_US;
+		} else {
+			b /= 2;
+			if (b < BACKOFF_MIN_US)
+				b = 0;
+		}
+
+		backoff_us = b;
+	}
+
+	return (NULL);
+}
+
+/* FNV-1a, over the first len bytes of s */
+unsigned long
+hash_str (const char *s, int len)
+{
+	unsigned long h;
+
+	h = 2166136261UL;
+	while (len-- > 0) {
+		h ^= (unsigned char) *s++;
+		h *= 16777619UL;
+	}
+
+	return (h);
+}
+
+struct hash_entry *
+hash_lookup (struct hash_table *ht, const char *key, int len)
+{
+	unsigned long h;
+	struct hash_entry *hp;
+
+	if (ht->size == 0)
+		return (NULL);
+
+	h = hash_str (key, len);
+
+	for (hp = ht->buckets[h & (ht->size - 1)]; hp; hp = hp->next) {
+		if (hp->hash == h && strncmp (hp->key, key, len) == 0
+		    && hp->key[len] == 0)
+			return (hp);
+	}
+
+	return (NULL);
+}
+
+struct hash_entry *
+hash_insert (struct hash_table *ht, const char *key, int len, void *val)
+{
+	unsigned long idx, nsize;
+	struct hash_entry *hp, *nhp, **nbuckets;
+
+	if (ht->count >= ht->size) {
+		nsize = ht->size ? ht->size * 2 : HASH_INITIAL_SIZE;
+		nbuckets = xcalloc (nsize, sizeof *nbuckets);
+
+		for (idx = 0; idx < ht->size; idx++) {
+			for (hp = ht->buckets[idx]; hp; hp = nhp) {
+				nhp = hp->next;
+				hp->next = nbuckets[hp->hash & (nsize - 1)];
+				nbuckets[hp->hash & (nsize - 1)] = hp;
+			}
+		}
+
+		free (ht->buckets);
+		ht->buckets = nbuckets;
+		ht->size = nsize;
+	}
+
+	hp = xcalloc (1, sizeof *hp);
+	hp->hash = hash_str (key, len);
+	hp->key = xcalloc (1, len + 1);
+	memcpy (hp->key, key, len);
+	hp->val = val;
+
+	hp->next = ht->buckets[hp->hash & (ht->size - 1)];
+	ht->buckets[hp->hash & (ht->size - 1)] = hp;
+	ht->count++;
+
+	return (hp);
+}
+
+void
+hash_clear (struct hash_table *ht)
+{
+	unsigned long idx;
+	struct hash_entry *hp, *nhp;
+
+	for (idx = 0; idx < ht->size; idx++) {
+		for (hp = ht->buckets[idx]; hp; hp = nhp) {
+			nhp = hp->next;
+			free (hp->key);
+			free (hp);
+		}
+	}
+
+	free (ht->buckets);
+	ht->buckets = NULL;
+	ht->size = 0;
+	ht->count = 0;
+}
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+#define XXH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static unsigned long long
+xxh64_round (unsigned long long acc, unsigned long long in)
+{
+	acc += in * XXH_P2;
+	acc = XXH_ROTL (acc, 31);
+	return (acc * XXH_P1);
+}
+
+static unsigned long long
+xxh64_merge (unsigned long long h, unsigned long long v)
+{
+	h ^= xxh64_round (0, v);
+	return (h * XXH_P1 + XXH_P4);
+}
+
+static unsigned long long
+xxh64_read64 (const unsigned char *p)
+{
+	unsigned long long v;
+
+	memcpy (&v, p, 8);
+	return (v);
+}
+
+/* xxHash64 with seed 0, the checksum kept in the manifests */
+void
+xxh64_init (struct xxh64_state *st)
+{
+	memset (st, 0, sizeof *st);
+	st->v[0] = XXH_P1 + XXH_P2;
+	st->v[1] = XXH_P2;
+	st->v[2] = 0;
+	st->v[3] = -XXH_P1;
+}
+
+void
+xxh64_update (struct xxh64_state *st, const void *data, size_t len)
+{
+	const unsigned char *p, *end;
+	int idx;
+
+	p = data;
+	end = p + len;
+	st->total += len;
+
+	if (st->memsize + len < 32) {
+		memcpy (st->mem + st->memsize, p, len);
+		st->memsize += len;
+		return;
+	}
+
+	if (st->memsize) {
+		memcpy (st->mem + st->memsize, p, 32 - st->memsize);
+		p += 32 - st->memsize;
+		for (idx = 0; idx < 4; idx++)
+			st->v[idx] = xxh64_round (st->v[idx],
+					xxh64_read64 (st->mem + idx * 8));
+		st->memsize = 0;
+	}
+
+	while (p + 32 <= end) {
+		st->v[0] = xxh64_round (st->v[0], xxh64_read64 (p));
+		st->v[1] = xxh64_round (st->v[1], xxh64_read64 (p + 8));
+		st->v[2] = xxh64_round (st->v[2], xxh64_read64 (p + 16));
+		st->v[3] = xxh64_round (st->v[3], xxh64_read64 (p + 24));
+		p += 32;
+	}
+
+	if (p < end) {
+		memcpy (st->mem, p, end - p);
+		st->memsize = end - p;
+	}
+}
+
+unsigned long long
+xxh64_final (struct xxh64_state *st)
+{
+	unsigned long long h, k;
+	unsigned int w;
+	const unsigned char *p, *end;
+
+	if (st->total >= 32) {
+		h = XXH_ROTL (st->v[0], 1) + XXH_ROTL (st->v[1], 7)
+			+ XXH_ROTL (st->v[2], 12) + XXH_ROTL (st->v[3], 18);
+		h = xxh64_merge (h, st->v[0]);
+		h = xxh64_merge (h, st->v[1]);
+		h = xxh64_merge (h, st->v[2]);
+		h = xxh64_merge (h, st->v[3]);
+	} else {
+		h = st->v[2] + XXH_P5;
+	}
+
+	h += st->total;
+
+	p = st->mem;
+	end = p + st->memsize;
+
+	while (p + 8 <= end) {
+		k = xxh64_round (0, xxh64_read64 (p));
+		h ^= k;
+		h = XXH_ROTL (h, 27) * XXH_P1 + XXH_P4;
+		p += 8;
+	}
+
+	if (p + 4 <= end) {
+		memcpy (&w, p, 4);
+		h ^= (unsigned long long) w * XXH_P1;
+		h = XXH_ROTL (h, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+	}
+
+	while (p < end) {
+		h ^= *p++ * XXH_P5;
+		h = XXH_ROTL (h, 11) * XXH_P1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+
+	return (h);
+}
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b,
+	0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01,
+	0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7,
+	0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152,
+	0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+	0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819,
+	0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116, 0x1e376c08,
+	0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f,
+	0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA_ROTR(x, r) (((x) >> (r)) | ((x) << (32 - (r))))
+
+static void
+sha256_block (struct sha256_state *st, const unsigned char *p)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int idx;
+
+	for (idx = 0; idx < 16; idx++, p += 4)
+		w[idx] = (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+
+	for (; idx < 64; idx++)
+		w[idx] = w[idx - 16] + w[idx - 7]
+			+ (SHA_ROTR (w[idx - 15], 7) ^ SHA_ROTR (w[idx - 15], 18)
+			   ^ (w[idx - 15] >> 3))
+			+ (SHA_ROTR (w[idx - 2], 17) ^ SHA_ROTR (w[idx - 2], 19)
+			   ^ (w[idx - 2] >> 10));
+
+	a = st->h[0]; b = st->h[1]; c = st->h[2]; d = st->h[3];
+	e = st->h[4]; f = st->h[5]; g = st->h[6]; h = st->h[7];
+
+	for (idx = 0; idx < 64; idx++) {
+		t1 = h + (SHA_ROTR (e, 6) ^ SHA_ROTR (e, 11) ^ SHA_ROTR (e, 25))
+			+ ((e & f) ^ (~e & g)) + sha256_k[idx] + w[idx];
+		t2 = (SHA_ROTR (a, 2) ^ SHA_ROTR (a, 13) ^ SHA_ROTR (a, 22))
+			+ ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	st->h[0] += a; st->h[1] += b; st->h[2] += c; st->h[3] += d;
+	st->h[4] += e; st->h[5] += f; st->h[6] += g; st->h[7] += h;
+}
+
+/* SHA-256, which names the chunks of chunked files */
+void
+sha256_init (struct sha256_state *st)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy (st->h, iv, sizeof iv);
+	st->total = 0;
+	st->memsize = 0;
+}
+
+void
+sha256_update (struct sha256_state *st, const void *data, size_t len)
+{
+	const unsigned char *p;
+	size_t n;
+
+	p = data;
+	st->total += len;
+
+	if (st->memsize) {
+		n = 64 - st->memsize < len ? 64 - st->memsize : len;
+		memcpy (st->mem + st->memsize, p, n);
+		st->memsize += n;
+		p += n;
+		len -= n;
+		if (st->memsize < 64)
+			return;
+		sha256_block (st, st->mem);
+		st->memsize = 0;
+	}
+
+	for (; len >= 64; p += 64, len -= 64)
+		sha256_block (st, p);
+
+	memcpy (st->mem, p, len);
+	st->memsize = len;
+}
+
+void
+sha256_final (struct sha256_state *st, unsigned char *out)
+{
+	uint64_t bits;
+	int idx;
+
+	bits = st->total * 8;
+
+	st->mem[st->memsize++] = 0x80;
+	if (st->memsize > 56) {
+		memset (st->mem + st->memsize, 0, 64 - st->memsize);
+		sha256_block (st, st->mem);
+		st->memsize = 0;
+	}
+	memset (st->mem + st->memsize, 0, 56 - st->memsize);
+	for (idx = 0; idx < 8; idx++)
+		st->mem[56 + idx] = bits >> (56 - 8 * idx);
+	sha256_block (st, st->mem);
+
+	for (idx = 0; idx < 8; idx++) {
+		out[4 * idx] = st->h[idx] >> 24;
+		out[4 * idx + 1] = st->h[idx] >> 16;
+		out[4 * idx + 2] = st->h[idx] >> 8;
+		out[4 * idx + 3] = st->h[idx];
+	}
+}
+
+/*
+ * the gear table of the chunker.  chunk boundaries, and so what dedups
+ * against what already stored, depend on it: never change the seed.
+ */
+pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+uint64_t gear[256];
+
+void
+gear_init (void)
+{
+	uint64_t x, z;
+	int idx;
+
+	for (x = 0x62616b696d000001ULL, idx = 0; idx < 256; idx++) {
+		z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[idx] = z ^ (z >> 31);
+	}
+}
+
+/*
+ * the length of the chunk starting at p, n bytes being available, of
+ * which there are at least CDC_MAX unless the file ends sooner.  this is
+ * FastCDC: no cut before CDC_MIN, a strict mask up to CDC_AVG and a loose
+ * one after, so chunk sizes bunch around the average.  the gear hash
+ * only looks back 64 bytes, so the masks take its high bits.
+ */
+size_t
+cdc_cut (const unsigned char *p, size_t n)
+{
+	uint64_t h;
+	size_t idx, normal;
+
+	if (n <= CDC_MIN)
+		return (n);
+
+	if (n > CDC_MAX)
+		n = CDC_MAX;
+
+	normal = n < CDC_AVG ? n : CDC_AVG;
+	h = 0;
+
+	/* the hash of the 64 bytes before CDC_MIN, where the search starts */
+	for (idx = CDC_MIN - 64; idx < CDC_MIN; idx++)
+		h = (h << 1) + gear[p[idx]];
+
+	for (; idx < normal; idx++) {
+		h = (h << 1) + gear[p[idx]];
+		if (!(h & CDC_MASK_S))
+			return (idx + 1);
+	}
+
+	for (; idx < n; idx++) {
+		h = (h << 1) + gear[p[idx]];
+		if (!(h & CDC_MASK_L))
+			return (idx + 1);
+	}
+
+	return (n);
+}
+
+unsigned char
+gf_mul (int a, int b)
+{
+	if (a == 0 || b == 0)
+		return (0);
+
+	return (gf_exp[gf_log[a] + gf_log[b]]);
+}
+
+unsigned char
+gf_inv (int a)
+{
+	return (gf_exp[255 - gf_log[a]]);
+}
+
+/* dst ^= c * src, a byte at a time through the nibble tables */
+static void
+gf_mul_add_scalar (unsigned char *dst, const unsigned char *src, size_t n,
+		   int c)
+{
+	const unsigned char *t;
+	size_t idx;
+
+	t = gf_nib[c];
+
+	for (idx = 0; idx < n; idx++)
+		dst[idx] ^= t[src[idx] & 15] ^ t[16 + (src[idx] >> 4)];
+}
+
+#if defined (__x86_64__) || defined (__i386__)
+/* the same, looking up 16 or 32 nibbles at once with pshufb */
+__attribute__ ((target ("ssse3")))
+static void
+gf_mul_add_ssse3 (unsigned char *dst, const unsigned char *src, size_t n,
+		  int c)
+{
+	__m128i lo, hi, mask, x, y;
+	size_t idx;
+
+	lo = _mm_loadu_si128 ((const __m128i *) gf_nib[c]);
+	hi = _mm_loadu_si128 ((const __m128i *) (gf_nib[c] + 16));
+	mask = _mm_set1_epi8 (15);
+
+	for (idx = 0; idx + 16 <= n; idx += 16) {
+		x = _mm_loadu_si128 ((const __m128i *) (src + idx));
+		y = _mm_xor_si128 (_mm_shuffle_epi8 (lo, _mm_and_si128 (x, mask)),
+				   _mm_shuffle_epi8 (hi, _mm_and_si128
+						     (_mm_srli_epi64 (x, 4),
+						      mask)));
+		x = _mm_loadu_si128 ((const __m128i *) (dst + idx));
+		_mm_storeu_si128 ((__m128i *) (dst + idx),
+				  _mm_xor_si128 (x, y));
+	}
+
+	gf_mul_add_scalar (dst + idx, src + idx, n - idx, c);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+gf_mul_add_avx2 (unsigned char *dst, const unsigned char *src, size_t n,
+		 int c)
+{
+	__m256i lo, hi, mask, x, y;
+	size_t idx;
+
+	lo = _mm256_broadcastsi128_si256 (_mm_loadu_si128
+					  ((const __m128i *) gf_nib[c]));
+	hi = _mm256_broadcastsi128_si256 (_mm_loadu_si128
+					  ((const __m128i *)
+					   (gf_nib[c] + 16)));
+	mask = _mm256_set1_epi8 (15);
+
+	for (idx = 0; idx + 32 <= n; idx += 32) {
+		x = _mm256_loadu_si256 ((const __m256i *) (src + idx));
+		y = _mm256_xor_si256 (_mm256_shuffle_epi8
+				      (lo, _mm256_and_si256 (x, mask)),
+				      _mm256_shuffle_epi8
+				      (hi, _mm256_and_si256
+				       (_mm256_srli_epi64 (x, 4), mask)));
+		x = _mm256_loadu_si256 ((const __m256i *) (dst + idx));
+		_mm256_storeu_si256 ((__m256i *) (dst + idx),
+				     _mm256_xor_si256 (x, y));
+	}
+
+	gf_mul_add_scalar (dst + idx, src + idx, n - idx, c);
+}
+#endif
+
+void
+gf_init (void)
+{
+	int idx, c, x;
+
+	for (x = 1, idx = 0; idx < 255; idx++) {
+		gf_exp[idx] = x;
+		gf_log[x] = idx;
+		if ((x <<= 1) & 0x100)
+			x ^= 0x11d;
+	}
+	for (; idx < 512; idx++)
+		gf_exp[idx] = gf_exp[idx - 255];
+
+	for (c = 0; c < 256; c++) {
+		for (x = 0; x < 16; x++) {
+			gf_nib[c][x] = gf_mul (c, x);
+			gf_nib[c][16 + x] = gf_mul (c, x << 4);
+		}
+	}
+
+	/* $BAKIM_SCALAR keeps to the tables, so tests can cover them too */
+	gf_mul_add = gf_mul_add_scalar;
+#if defined (__x86_64__) || defined (__i386__)
+	__builtin_cpu_init ();
+	if (getenv ("BAKIM_SCALAR") == NULL) {
+		if (__builtin_cpu_supports ("avx2"))
+			gf_mul_add = gf_mul_add_avx2;
+		else if (__builtin_cpu_supports ("ssse3"))
+			gf_mul_add = gf_mul_add_ssse3;
+	}
+#endif
+}
+
+/*
+ * the coefficient of data block i in parity block j: a Cauchy matrix,
+ * every square part of which is invertible, so any m lost blocks of a
+ * row can be had back from any m parity blocks that survive.
+ */
+unsigned char
+rs_coef (int j, int i)
+{
+	return (gf_inv ((RS_DATA + j) ^ i));
+}
+
+/* invert the n by n matrix a in place; -1 if it is singular */
+int
+gf_invert (unsigned char *a, int n)
+{
+	unsigned char b[RS_DATA * RS_DATA], t;
+	int row, col, k, piv;
+
+	memset (b, 0, sizeof b);
+	for (row = 0; row < n; row++)
+		b[row * n + row] = 1;
+
+	for (col = 0; col < n; col++) {
+		for (piv = col; piv < n && !a[piv * n + col]; piv++)
+			;
+		if (piv == n)
+			return (-1);
+
+		for (k = 0; k < n; k++) {
+			t = a[col * n + k];
+			a[col * n + k] = a[piv * n + k];
+			a[piv * n + k] = t;
+			t = b[col * n + k];
+			b[col * n + k] = b[piv * n + k];
+			b[piv * n + k] = t;
+		}
+
+		t = gf_inv (a[col * n + col]);
+		for (k = 0; k < n; k++) {
+			a[col * n + k] = gf_mul (a[col * n + k], t);
+			b[col * n + k] = gf_mul (b[col * n + k], t);
+		}
+
+		for (row = 0; row < n; row++) {
+			if (row == col || !(t = a[row * n + col]))
+				continue;
+			for (k = 0; k < n; k++) {
+				a[row * n + k] ^= gf_mul (a[col * n + k], t);
+				b[row * n + k] ^= gf_mul (b[col * n + k], t);
+			}
+		}
+	}
+
+	memcpy (a, b, n * n);
+
+	return (0);
+}
+
+int
+fsetflags (const char *name, unsigned long flags)
+{
+	int fd, r, f, save_errno;
+	struct stat buf;
+
+	save_errno = 0;
+
+	if (!lstat (name, &buf) && !S_ISREG (buf.st_mode)
+	    && !S_ISDIR (buf.st_mode)) {
+		return (-1);
+	}
+
+	fd = open (name, O_RDONLY);
+	if (fd == -1)
+		return (-1);
+
+	f = (int) flags;
+	r = ioctl (fd, _IOW('f', 2, long), &f);
+
+	if (r == -1)
+		save_errno = errno;
+
+	close (fd);
+
+	if (save_errno)
+		errno = save_errno;
+
+	return (r);
+}
+
+int
+fgetflags (const char *name, unsigned long *flags)
+{
+	struct stat buf;
+	int fd, r, f;
+
+	if (!lstat (name, &buf) && !S_ISREG (buf.st_mode)
+	    && !S_ISDIR (buf.st_mode)) {
+		return (-1);
+	}
+
+	fd = open (name, O_RDONLY);
+	if (fd == -1)
+		return (-1);
+
+	r = ioctl (fd, _IOR ('f', 1, long), &f);
+	*flags = f;
+	close (fd);
+
+	return (r);
+}
+
+int
+set_immutable (const char *fn)
+{
+	unsigned long flags;
+
+	if (fgetflags(fn, &flags) == -1) {
+		report ("failed to get flags for %s\n", fn);
+		return (-1);
+	}
+
+	flags |= EXT2_IMMUTABLE_FL;
+
+	if (fsetflags(fn, flags) == -1) {
+		report ("failed to set flags for %s\n", fn);
+		return (-1);
+	}
+
+	return (0);
+}
+
+void
+touched_dir (const char *rpath, const char *path, const struct stat *sb)
+{
+	struct dir_data *dp;
+
+	dp = xcalloc (1, sizeof *dp);
+
+	dp->path = xstrdup (path);
+	dp->rpath = xstrdup (rpath);
+	dp->atime = sb->st_atime;
+	dp->mtime = sb->st_mtime;
+	dp->mode = sb->st_mode;
+
+	if (!hash_lookup (&cur->dir_index, rpath, strlen (rpath)))
+		hash_insert (&cur->dir_index, rpath, strlen (rpath), dp);
+
+	if (!cur->first_dir) {
+		cur->first_dir = dp;
+	} else {
+		dp->next = cur->first_dir;
+		cur->first_dir = dp;
+	}
+}
+
+/* clear the immutable and append-only bits on an open file, if set */
+int
+clear_immutable_fd (int fd)
+{
+	int f;
+
+	if (ioctl (fd, _IOR ('f', 1, long), &f) == -1)
+		return (-1);
+
+	if ((f & (EXT2_IMMUTABLE_FL | EXT2_APPEND_FL)) == 0)
+		return (0);
+
+	f &= ~(EXT2_IMMUTABLE_FL | EXT2_APPEND_FL);
+
+	return (ioctl (fd, _IOW ('f', 2, long), &f));
+}
+
+/*
+ * unlink a non-directory, relative to dirfd.  archived files are all
+ * immutable, so EPERM means clear the flag and try once more.
+ */
+int
+unlink_entry_at (int dirfd, const char *name)
+{
+	int fd, r;
+
+	if (unlinkat (dirfd, name, 0) == 0 || errno == ENOENT)
+		return (0);
+
+	if (errno != EPERM)
+		return (-1);
+
+	if ((fd = openat (dirfd, name,
+			  O_RDONLY | O_NOFOLLOW | O_NONBLOCK)) == -1)
+		return (-1);
+
+	r = clear_immutable_fd (fd);
+	close (fd);
+
+	if (r == -1)
+		return (-1);
+
+	return (unlinkat (dirfd, name, 0));
+}
+
+void
+rm_push (struct remover *rm, struct rm_node *np)
+{
+	pthread_mutex_lock (&rm->lock);
+	np->qnext = rm->queue;
+	rm->queue = np;
+	pthread_cond_signal (&rm->cond);
+	pthread_mutex_unlock (&rm->lock);
+}
+
+/* drop one hold on np, removing it and walking up as parents empty */
+void
+rm_release (struct remover *rm, struct rm_node *np)
+{
+	struct rm_node *parent;
+	int last;
+
+	while (np) {
+		pthread_mutex_lock (&rm->lock);
+		last = --np->pending == 0;
+		pthread_mutex_unlock (&rm->lock);
+
+		if (!last)
+			return;
+
+		if (rmdir (np->path) == -1 && errno != ENOENT) {
+			report ("failed to remove %s: %m\n",
+				np->path);
+			pthread_mutex_lock (&rm->lock);
+			rm->errors++;
+			pthread_mutex_unlock (&rm->lock);
+		}
+
+		parent = np->parent;
+		free (np->path);
+		free (np);
+		np = parent;
+	}
+}
+
+/*
+ * unlink everything in np's directory and queue its subdirectories as
+ * separate work, so one huge tree still spreads over all the workers.
+ */
+void
+rm_empty_dir (struct remover *rm, struct rm_node *np)
+{
+	int fd, dfd, l;
+	DIR *dir;
+	struct dirent *de;
+	struct rm_node *child;
+
+	if ((fd = open (np->path,
+			O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) == -1) {
+		if (errno != ENOENT) {
+			report ("failed to open %s: %m\n", np->path);
+			pthread_mutex_lock (&rm->lock);
+			rm->errors++;
+			pthread_mutex_unlock (&rm->lock);
+		}
+		rm_release (rm, np);
+		return;
+	}
+
+	clear_immutable_fd (fd);
+
+	if ((dfd = dup (fd)) == -1 || (dir = fdopendir (dfd)) == NULL) {
+		report ("failed to read %s: %m\n", np->path);
+		close (fd);
+		rm_release (rm, np);
+		return;
+	}
+
+	while ((de = readdir (dir)) != NULL) {
+		if (strcmp (de->d_name, ".") == 0
+		    || strcmp (de->d_name, "..") == 0)
+			continue;
+
+		if (de->d_type != DT_DIR) {
+			if (unlink_entry_at (fd, de->d_name) == 0)
+				continue;
+
+			if (errno != EISDIR) {
+				report ("failed to remove %s/%s: %m\n",
+					np->path, de->d_name);
+				pthread_mutex_lock (&rm->lock);
+				rm->errors++;
+				pthread_mutex_unlock (&rm->lock);
+				continue;
+			}
+		}
+
+		l = strlen (np->path) + strlen (de->d_name) + 2;
+
+		child = xcalloc (1, sizeof *child);
+		child->path = xcalloc (1, l);
+		sprintf (child->path, "%s/%s", np->path, de->d_name);
+		child->parent = np;
+		child->pending = 1;
+
+		pthread_mutex_lock (&rm->lock);
+		np->pending++;
+		pthread_mutex_unlock (&rm->lock);
+
+		rm_push (rm, child);
+	}
+
+	closedir (dir);
+	close (fd);
+
+	rm_release (rm, np);
+}
+
+void *
+rm_worker (void *arg)
+{
+	struct remover *rm;
+	struct rm_node *np;
+
+	rm = arg;
+
+	pthread_mutex_lock (&rm->lock);
+
+	while (1) {
+		while (!rm->queue && rm->busy)
+			pthread_cond_wait (&rm->cond, &rm->lock);
+
+		if (!rm->queue)
+			break;
+
+		np = rm->queue;
+		rm->queue = np->qnext;
+		rm->busy++;
+		pthread_mutex_unlock (&rm->lock);
+
+		rm_empty_dir (rm, np);
+
+		pthread_mutex_lock (&rm->lock);
+		rm->busy--;
+		if (!rm->busy && !rm->queue)
+			pthread_cond_broadcast (&rm->cond);
+	}
+
+	pthread_mutex_unlock (&rm->lock);
+
+	return (NULL);
+}
+
+/*
+ * remove the directory trees in paths with jobs threads.  returns the
+ * number of entries that could not be removed.
+ */
+int
+remove_trees (char **paths, int n, int jobs)
+{
+	struct remover rm;
+	struct rm_node *np;
+	pthread_t threads[MAX_JOBS];
+	int idx, started;
+
+	memset (&rm, 0, sizeof rm);
+	pthread_mutex_init (&rm.lock, NULL);
+	pthread_cond_init (&rm.cond, NULL);
+
+	for (idx = 0; idx < n; idx++) {
+		np = xcalloc (1, sizeof *np);
+		np->path = xstrdup (paths[idx]);
+		np->pending = 1;
+		rm_push (&rm, np);
+	}
+
+	if (jobs > MAX_JOBS)
+		jobs = MAX_JOBS;
+
+	for (started = 0; started < jobs - 1; started++) {
+		if (start_thread (&threads[started], rm_worker, &rm) != 0)
+			break;
+	}
+
+	rm_worker (&rm);
+
+	for (idx = 0; idx < started; idx++)
+		pthread_join (threads[idx], NULL);
+
+	pthread_mutex_destroy (&rm.lock);
+	pthread_cond_destroy (&rm.cond);
+
+	return (rm.errors);
+}
+
+int
+delete_file_or_dir (char *path)
+{
+	struct stat sb;
+
+	if (lstat (path, &sb) == -1) {
+		if (errno == ENOENT)
+			return (0);
+		report ("error with lstat on %s: %m\n", path);
+		return (-1);
+	}
+
+	if (!S_ISDIR (sb.st_mode)) {
+		if (unlink_entry_at (AT_FDCWD, path) == -1) {
+			report ("failed to remove old entry %s: %m\n",
+				path);
+			return (-1);
+		}
+		return (0);
+	}
+
+	if (remove_trees (&path, 1, 1)) {
+		report ("failed to remove old entry %s\n", path);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/* -1 if the copy failed, leaving a partial dst_fn for the caller */
+int
+copy_file (const char *src_fn, char *dst_fn, unsigned long long *hash,
+	   struct parity *pe)
+{
+	int n_read, r;
+	FILE *src, *dst;
+	char buf[1024*1024];
+	struct xxh64_state st;
+
+	xxh64_init (&st);
+
+	if ((src = fopen (src_fn, "r")) == NULL) {
+		report ("cannot open src file %s: %m\n", src_fn);
+		return (-1);
+	}
+
+	if ((dst = fopen (dst_fn, "w")) == NULL) {
+		report ("cannot open dst file %s: %m\n", dst_fn);
+		fclose (src);
+		return (-1);
+	}
+
+	r = 0;
+
+	while ((n_read = fread (buf, 1, sizeof buf, src)) > 0) {
+		throttle_copy (n_read);
+
+		xxh64_update (&st, buf, n_read);
+
+		if (pe)
+			parity_update (pe, (unsigned char *) buf, n_read);
+
+		if (fwrite (buf, 1, n_read, dst) != n_read) {
+			report ("error copying file:"
+				" possibly out of space\n");
+			r = -1;
+			break;
+		}
+	}
+
+	if (ferror (src)) {
+		report ("error reading %s\n", src_fn);
+		r = -1;
+	}
+
+	if (fclose (src) != 0) {
+		report ("error closing file %s: %m\n", src_fn);
+		r = -1;
+	}
+	if (fclose (dst) != 0) {
+		report ("error closing file %s: %m\n", dst_fn);
+		r = -1;
+	}
+
+	*hash = xxh64_final (&st);
+
+	return (r);
+}
+
+/*
+ * the parity sidecar for path in slot_path, .bakim/parity/SLOT/path,
+ * open for writing.  NULL if it can't be had; the copy goes on without.
+ */
+struct parity *
+parity_open (const char *slot_path, const char *path)
+{
+	struct parity *pe;
+	char *dir, *fn, *p;
+	unsigned char hdr[RS_HEADER];
+	int fd;
+
+	dir = slot_meta_path (slot_path, "parity", NULL);
+	fn = xcalloc (1, strlen (dir) + strlen (path) + 2);
+	sprintf (fn, "%s/%s", dir, path);
+	free (dir);
+
+	for (p = strstr (fn, "/.bakim/") + 8; (p = strchr (p, '/')); p++) {
+		*p = 0;
+		make_dir (fn, 0755);
+		*p = '/';
+	}
+
+	unlink_entry_at (AT_FDCWD, fn);
+
+	if ((fd = open (fn, O_WRONLY | O_CREAT | O_TRUNC, 0444)) == -1) {
+		report ("failed to create parity %s: %m\n", fn);
+		free (fn);
+		return (NULL);
+	}
+	fchmod (fd, 0444);
+
+	/* the header is written again at the end, with the size */
+	memset (hdr, 0, sizeof hdr);
+	if (write_all (fd, hdr, sizeof hdr) == -1) {
+		report ("error writing parity %s: %m\n", fn);
+		close (fd);
+		unlink (fn);
+		free (fn);
+		return (NULL);
+	}
+
+	pe = xcalloc (1, sizeof *pe);
+	pe->fd = fd;
+	pe->fn = fn;
+	pe->m = bk->parity_blocks;
+	pe->par = xcalloc (pe->m, RS_BLOCK);
+
+	return (pe);
+}
+
+/* crc carried on over n zero bytes */
+uint32_t
+crc_zeros (uint32_t crc, size_t n)
+{
+	static const unsigned char zeros[4096];
+
+	for (; n > sizeof zeros; n -= sizeof zeros)
+		crc = crc32 (crc, zeros, sizeof zeros);
+
+	return (crc32 (crc, zeros, n));
+}
+
+void
+parity_update (struct parity *pe, const unsigned char *data, size_t n)
+{
+	size_t b, off, len;
+	int j;
+
+	while (n > 0) {
+		b = pe->fill / RS_BLOCK;
+		off = pe->fill % RS_BLOCK;
+		len = n < RS_BLOCK - off ? n : RS_BLOCK - off;
+
+		pe->crc[b] = crc32 (pe->crc[b], data, len);
+		for (j = 0; j < pe->m; j++)
+			gf_mul_add (pe->par + j * RS_BLOCK + off, data, len,
+				    rs_coef (j, b));
+
+		pe->fill += len;
+		pe->size += len;
+		data += len;
+		n -= len;
+
+		if (pe->fill == RS_DATA * RS_BLOCK)
+			parity_row (pe);
+	}
+}
+
+/*
+ * write out the row so far, short blocks taken as zero-padded.  a row
+ * shorter than one block, as a small file's is, has parity that short.
+ */
+void
+parity_row (struct parity *pe)
+{
+	unsigned char *rec;
+	size_t b, have, plen;
+	int j;
+
+	rec = xcalloc (RS_DATA + pe->m, 4);
+
+	for (b = 0; b < RS_DATA; b++) {
+		have = pe->fill > b * RS_BLOCK ? pe->fill - b * RS_BLOCK : 0;
+		if (have > RS_BLOCK)
+			have = RS_BLOCK;
+		put_le32 (rec + 4 * b, crc_zeros (pe->crc[b], RS_BLOCK - have));
+	}
+
+	for (j = 0; j < pe->m; j++)
+		put_le32 (rec + 4 * (RS_DATA + j),
+			  crc32 (0, pe->par + j * RS_BLOCK, RS_BLOCK));
+
+	plen = pe->fill < RS_BLOCK ? pe->fill : RS_BLOCK;
+	throttle_take (&bk->write_limit, (RS_DATA + pe->m) * 4 + pe->m * plen);
+
+	if (pe->fd != -1
+	    && write_all (pe->fd, rec, (RS_DATA + pe->m) * 4) == -1)
+		plen = 0;
+
+	for (j = 0; pe->fd != -1 && j < pe->m; j++) {
+		if (!plen || write_all (pe->fd, pe->par + j * RS_BLOCK,
+					plen) == -1) {
+			report ("error writing parity %s: %m\n",
+				pe->fn);
+			close (pe->fd);
+			pe->fd = -1;
+		}
+	}
+
+	free (rec);
+	memset (pe->crc, 0, sizeof pe->crc);
+	memset (pe->par, 0, pe->m * RS_BLOCK);
+	pe->fill = 0;
+}
+
+/* finish the sidecar, or drop it if the copy it goes with failed */
+void
+parity_close (struct parity *pe, int ok)
+{
+	unsigned char hdr[RS_HEADER];
+
+	if (!pe)
+		return;
+
+	if (ok && pe->fill)
+		parity_row (pe);
+
+	memset (hdr, 0, sizeof hdr);
+	memcpy (hdr, RS_MAGIC, 8);
+	put_le32 (hdr + 8, RS_DATA);
+	put_le32 (hdr + 12, pe->m);
+	put_le32 (hdr + 16, RS_BLOCK);
+	put_le32 (hdr + 24, pe->size);
+	put_le32 (hdr + 28, pe->size >> 32);
+
+	if (pe->fd != -1 && ok && pwrite (pe->fd, hdr, sizeof hdr, 0)
+	    != sizeof hdr) {
+		report ("error writing parity %s: %m\n", pe->fn);
+		ok = 0;
+	}
+
+	/* an empty file has nothing to protect */
+	if (pe->fd == -1 || close (pe->fd) != 0 || !ok || !pe->size)
+		unlink (pe->fn);
+	else
+		set_immutable (pe->fn);
+
+	free (pe->par);
+	free (pe->fn);
+	free (pe);
+}
+
+/* reflink src_fn into a new dst_fn, where the filesystem can */
+int
+clone_file (const char *src_fn, const char *dst_fn)
+{
+	int src, dst, r;
+
+	if ((src = open (src_fn, O_RDONLY)) == -1)
+		return (-1);
+
+	if ((dst = open (dst_fn, O_WRONLY | O_CREAT | O_EXCL, 0600)) == -1) {
+		close (src);
+		return (-1);
+	}
+
+	r = ioctl (dst, FICLONE, src);
+
+	close (src);
+	close (dst);
+
+	if (r == -1)
+		unlink (dst_fn);
+
+	return (r);
+}
+
+void
+set_file_meta (const char *dst_name, const struct stat *sb)
+{
+	struct utimbuf times;
+
+	if (chmod (dst_name, sb->st_mode) == -1)
+		report ("failed to set mode on %s: %m\n", dst_name);
+
+	times.actime = sb->st_atime;
+	times.modtime = sb->st_mtime;
+
+	if (utime (dst_name, &times) == -1) {
+		report ("failed to set timestamps on %s: %m\n",
+			dst_name);
+	}
+
+	if (lchown (dst_name, sb->st_uid, sb->st_gid) == -1)
+		report ("failed to chown %s: %m\n", dst_name);
+}
+
+struct link_data *
+find_link (const struct stat *sb)
+{
+	char key[50];
+	struct hash_entry *hp;
+
+	sprintf (key, "%d:%llx:%llx", cur->tgt->idx,
+		 (unsigned long long) sb->st_dev,
+		 (unsigned long long) sb->st_ino);
+
+	if ((hp = hash_lookup (&cur->lane->links, key, strlen (key))) == NULL)
+		return (NULL);
+
+	return (hp->val);
+}
+
+struct link_data *
+remember_link (const struct stat *sb, const char *dst_name,
+	       unsigned long long hash)
+{
+	char key[50];
+	struct link_data *lk;
+
+	sprintf (key, "%d:%llx:%llx", cur->tgt->idx,
+		 (unsigned long long) sb->st_dev,
+		 (unsigned long long) sb->st_ino);
+
+	lk = xcalloc (1, sizeof *lk);
+	lk->dst = xstrdup (dst_name);
+	lk->hash = hash;
+
+	hash_insert (&cur->lane->links, key, strlen (key), lk);
+
+	return (lk);
+}
+
+/*
+ * the copy of a multiply linked inode stored by an earlier run is only
+ * remembered at first.  once another name wants to join it, it is
+ * hashed for the manifest and made writable until the lane is sealed.
+ */
+int
+open_archived_link (struct link_data *lk)
+{
+	unsigned char *buf;
+	unsigned long flags;
+	long long size;
+	int r;
+
+	if (posix_memalign ((void **) &buf, DIRECT_ALIGN, VERIFY_BUFSIZE))
+		return (-1);
+	r = hash_file (lk->dst, 0, buf, &lk->hash, &size);
+	free (buf);
+
+	if (r == -1 || fgetflags (lk->dst, &flags) == -1)
+		return (-1);
+
+	if (flags & EXT2_IMMUTABLE_FL) {
+		flags &= ~EXT2_IMMUTABLE_FL;
+		if (fsetflags (lk->dst, flags) == -1)
+			return (-1);
+	}
+
+	lk->archived = 0;
+
+	return (0);
+}
+
+/* make the lane's hard linked copies immutable, now nothing can join them */
+void
+seal_links (struct lane *lp)
+{
+	unsigned long idx;
+	struct hash_entry *hp;
+	struct link_data *lk;
+
+	for (idx = 0; idx < lp->links.size; idx++) {
+		for (hp = lp->links.buckets[idx]; hp; hp = hp->next) {
+			lk = hp->val;
+			set_immutable (lk->dst);
+			free (lk->dst);
+			free (lk);
+		}
+	}
+
+	hash_clear (&lp->links);
+}
+
+/* a path under the .bakim bookkeeping directory of backup_root */
+char *
+meta_path (const char *a, const char *b)
+{
+	char *p;
+
+	p = xcalloc (1, strlen (bk->backup_root) + strlen (a)
+		     + (b ? strlen (b) : 0) + 20);
+
+	if (b)
+		sprintf (p, "%s/.bakim/%s/%s", bk->backup_root, a, b);
+	else
+		sprintf (p, "%s/.bakim/%s", bk->backup_root, a);
+
+	return (p);
+}
+
+/*
+ * the bookkeeping file a/BRANCH[.ext] for slot, a ROOT/BRANCH directory
+ * of whichever target it belongs to.
+ */
+char *
+slot_meta_path (const char *slot, const char *a, const char *ext)
+{
+	const char *branch;
+	char *p;
+
+	branch = strrchr (slot, '/') + 1;
+
+	p = xcalloc (1, strlen (slot) + strlen (a) + (ext ? strlen (ext) : 0)
+		     + 20);
+
+	sprintf (p, "%.*s/.bakim/%s/%s", (int) (branch - slot - 1), slot, a,
+		 branch);
+
+	if (ext)
+		sprintf (p + strlen (p), ".%s", ext);
+
+	return (p);
+}
+
+/*
+ * fopen for bookkeeping files, which come out 0644 whatever the umask
+ * is; backup runs leave it as they find it
+ */
+FILE *
+meta_fopen (const char *fn, const char *mode)
+{
+	int fd, flags;
+	FILE *f;
+
+	if (*mode == 'r')
+		return (fopen (fn, mode));
+
+	flags = O_WRONLY | O_CREAT | (*mode == 'a' ? O_APPEND : O_TRUNC);
+
+	if ((fd = open (fn, flags, 0644)) == -1)
+		return (NULL);
+	fchmod (fd, 0644);
+
+	if ((f = fdopen (fd, mode)) == NULL)
+		close (fd);
+
+	return (f);
+}
+
+/* mkdir, with mode exactly as given rather than less the umask */
+int
+make_dir (const char *path, mode_t mode)
+{
+	if (mkdir (path, mode) == -1)
+		return (-1);
+
+	if (chmod (path, mode & 07777) == -1)
+		report ("failed to chmod %s: %m\n", path);
+
+	return (0);
+}
+
+/*
+ * record the checksum of a freshly copied file in the manifest of the
+ * branch or slot it went to, backup_path being that directory.
+ */
+void
+manifest_add (const char *backup_path, const char *path, long long size,
+	      unsigned long long hash)
+{
+	struct hash_entry *hp;
+	struct manifest *mp;
+	char *fn;
+
+	pthread_mutex_lock (&bk->manifest_lock);
+
+	if ((hp = hash_lookup (&bk->manifests, backup_path,
+			       strlen (backup_path))) == NULL) {
+		mp = xcalloc (1, sizeof *mp);
+		fn = slot_meta_path (backup_path, "manifest", NULL);
+		if ((mp->f = meta_fopen (fn, "a")) == NULL)
+			report ("failed to open manifest %s: %m\n",
+				fn);
+		free (fn);
+		hp = hash_insert (&bk->manifests, backup_path,
+				  strlen (backup_path), mp);
+	}
+
+	mp = hp->val;
+
+	if (mp->f) {
+		fprintf (mp->f, "%016llx %lld ", hash, size);
+		escape_path (mp->f, path);
+		putc ('\n', mp->f);
+	}
+
+	pthread_mutex_unlock (&bk->manifest_lock);
+}
+
+void
+manifest_close_all (void)
+{
+	unsigned long idx;
+	struct hash_entry *hp;
+	struct manifest *mp;
+
+	for (idx = 0; idx < bk->manifests.size; idx++) {
+		for (hp = bk->manifests.buckets[idx]; hp; hp = hp->next) {
+			mp = hp->val;
+			if (mp->f && fclose (mp->f) != 0)
+				report ("error writing manifest"
+					" %s: %m\n", hp->key);
+			free (mp);
+		}
+	}
+
+	hash_clear (&bk->manifests);
+}
+
+void
+base26 (int c, char *s)
+{
+	s[0] = (int) ((c % (26 * 26)) / 26) + 'a';
+	s[1] = (c % 26) + 'a';
+	s[2] = 0;
+}
+
+/* the walked directory path, or NULL after a report if it was not seen */
+struct dir_data *
+find_dir (const char *path)
+{
+	struct hash_entry *hp;
+
+	if ((hp = hash_lookup (&cur->dir_index, path, strlen (path))) != NULL)
+		return (hp->val);
+
+	report ("touched directories path corrupted, unable to find %s\n",
+		path);
+
+	return (NULL);
+}
+
+/*
+ * make sure every parent directory of path exists under the slot dp,
+ * creating missing ones with the mode of the source directory.  the
+ * prefixes already known to exist are remembered in dp->paved, so
+ * siblings of a file we have seen before cost no syscalls at all.
+ * -1 if a file is in the way in this slot, -2 if it failed outright.
+ */
+int
+pave_path (const char *path, struct dir_data *dp)
+{
+	char *s, *p, *path2, dir_name[PATH_MAX];
+	const char *last;
+	struct stat sb;
+	struct dir_data *dir;
+
+	while (*path == '/')
+		path++;
+
+	if ((last = strrchr (path, '/')) == NULL)
+		return (0);
+
+	if (!dp->paved)
+		dp->paved = xcalloc (1, sizeof *dp->paved);
+
+	if (hash_lookup (dp->paved, path, last - path))
+		return (0);
+
+	path2 = xstrdup (path);
+	s = path2;
+	p = s;
+
+	while (1) {
+		while (*p && *p != '/')
+			p++;
+
+		if (*p == 0)
+			break;
+
+		*p = 0;
+
+		if (hash_lookup (dp->paved, s, p - s))
+			goto next;
+
+		if (strlen (dp->path) + strlen (s) + 100 >= PATH_MAX) {
+			report ("path exceeds PATH_MAX\n");
+			free (path2);
+			return (-2);
+		}
+
+		sprintf (dir_name, "%s/%s", dp->path, s);
+
+		if (lstat (dir_name, &sb) == -1) {
+			if (errno != ENOENT) {
+				report ("error with lstat on %s: %m\n",
+					dir_name);
+				free (path2);
+				return (-2);
+			}
+
+			if ((dir = find_dir (s)) == NULL) {
+				free (path2);
+				return (-2);
+			}
+
+			if (make_dir (dir_name, dir->mode) == -1
+			    && errno != EEXIST) {
+				report ("failed to create"
+					" directory %s: %m\n", dir_name);
+				free (path2);
+				return (-2);
+			}
+		} else {
+			if (!S_ISDIR (sb.st_mode)) {
+				free (path2);
+				return (-1);
+			}
+		}
+
+		hash_insert (dp->paved, s, p - s, NULL);
+
+	next:
+		*p = '/';
+
+		while (*p == '/')
+			p++;
+	}
+
+	free (path2);
+
+	return (0);
+}
+
+/*
+ * lstat of base/path without following anything below base: a link or
+ * file where a directory of path should be fails with ENOTDIR.
+ */
+int
+lstat_beneath (const char *base, const char *path, struct stat *sb)
+{
+	char comp[NAME_MAX + 1];
+	const char *p, *e;
+	int fd, nfd, err;
+
+	if ((fd = open (base, O_PATH | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return (-1);
+
+	for (p = path; (e = strchr (p, '/')) != NULL; p = e + 1) {
+		if (e == p)
+			continue;
+		if (e - p > NAME_MAX) {
+			close (fd);
+			errno = ENAMETOOLONG;
+			return (-1);
+		}
+		memcpy (comp, p, e - p);
+		comp[e - p] = 0;
+
+		nfd = openat (fd, comp, O_PATH | O_DIRECTORY | O_NOFOLLOW
+			      | O_CLOEXEC);
+		err = errno;
+		close (fd);
+
+		if (nfd == -1) {
+			errno = err == ELOOP ? ENOTDIR : err;
+			return (-1);
+		}
+		fd = nfd;
+	}
+
+	nfd = fstatat (fd, p, sb, AT_SYMLINK_NOFOLLOW);
+	err = errno;
+	close (fd);
+	errno = err;
+
+	return (nfd);
+}
+
+/*
+ * lstat dst_name, slot/path.  bakim recv takes its paths off the wire,
+ * and there a link stored earlier must not lead an entry out of the
+ * archive, so the directories on the way have to be directories.
+ */
+int
+slot_lstat (const char *slot, const char *path, const char *dst_name,
+	    struct stat *sb)
+{
+	if (!cur->untrusted)
+		return (lstat (dst_name, sb));
+
+	return (lstat_beneath (slot, path, sb));
+}
+
+/* whether bakim recv would be led out of newest/ on its way to path */
+int
+newest_unsafe (const char *path)
+{
+	struct stat sb;
+
+	if (!cur->untrusted || lstat_beneath (cur->tgt->newest, path, &sb) == 0
+	    || errno != ENOTDIR)
+		return (0);
+
+	report ("refusing %s: newest/ has no directory on its way\n",
+		path);
+
+	return (1);
+}
+
+struct dir_data *
+find_slot (const char *fpath, const struct stat *sb, int *flags)
+{
+	int count, r;
+	struct dir_data *dp;
+	char dst_name[PATH_MAX], suffix[3];
+	const char *path;
+	struct stat dst_sb;
+
+	path = fpath + cur->base_off;
+	count = 0;
+	*flags = 0;
+
+	for (dp = cur->first_collision_dir; dp; dp = dp->next) {
+		if (strlen (dp->path) + strlen (path) + 100 >= PATH_MAX) {
+			report ("path exceeds PATH_MAX\n");
+			return (NULL);
+		}
+		sprintf (dst_name, "%s/%s", dp->path, path);
+
+		if (slot_lstat (dp->path, path, dst_name, &dst_sb) == -1) {
+			if (errno == ENOENT) {
+				if ((r = pave_path (path, dp)) != -1)
+					return (r ? NULL : dp);
+			} else if (errno != ENOTDIR) {
+				report ("error with lstat on %s: %m\n",
+					dst_name);
+				return (NULL);
+			}
+		} else {
+			if (check_same (sb, &dst_sb, fpath, dst_name)) {
+				*flags |= FILE_FOUND;
+				return (dp);
+			}
+		}
+
+		count++;
+	}
+
+	for (; count <= 675; count++) {
+		dp = xcalloc (1, sizeof *dp);
+		dp->path = xcalloc (1, strlen (cur->tgt->directory) + 10);
+
+		base26 (count, suffix);
+		sprintf (dp->path, "%s-%s", cur->tgt->directory, suffix);
+
+		if (!cur->first_collision_dir)
+			cur->first_collision_dir = dp;
+
+		if (cur->last_collision_dir)
+			cur->last_collision_dir->next = dp;
+
+		cur->last_collision_dir = dp;
+
+		if (lstat (dp->path, &dst_sb) == -1) {
+			if (errno != ENOENT) {
+				report ("error with lstat on %s: %m\n",
+					dp->path);
+				return (NULL);
+			}
+
+			if (make_dir (dp->path, 0755) == -1
+			    && errno != EEXIST) {
+				report ("failed to create directory"
+					" %s: %m\n", dp->path);
+				return (NULL);
+			}
+
+			if (pave_path (path, dp) < 0) {
+				report ("new slot %s failed, odd."
+					" failing search\n", dp->path);
+				return (NULL);
+			} else {
+				return (dp);
+			}
+		}
+
+		if (strlen (dp->path) + strlen (path) + 100 >= PATH_MAX) {
+			report ("path exceeds PATH_MAX\n");
+			return (NULL);
+		}
+
+		sprintf (dst_name, "%s/%s", dp->path, path);
+		if (slot_lstat (dp->path, path, dst_name, &dst_sb) == -1) {
+			if (errno == ENOENT) {
+				if ((r = pave_path (path, dp)) != -1)
+					return (r ? NULL : dp);
+			} else if (errno == ENOTDIR) {
+				continue;
+			} else {
+				report ("error with lstat on %s: %m\n",
+					dst_name);
+				return (NULL);
+			}
+		} else {
+			if (check_same (sb, &dst_sb, fpath, dst_name)) {
+				*flags |= FILE_FOUND;
+				return (dp);
+			}
+		}
+	}
+
+	return (NULL);
+}
+
+/*
+ * the count-th collision slot of the run (0 is -aa), creating its
+ * directory and extending the list find_slot() also walks as needed.
+ */
+struct dir_data *
+collision_dir (int count)
+{
+	struct dir_data *dp;
+	char suffix[3];
+	int idx;
+
+	idx = 0;
+	for (dp = cur->first_collision_dir; dp; dp = dp->next) {
+		if (idx++ == count)
+			return (dp);
+	}
+
+	for (; idx <= count; idx++) {
+		dp = xcalloc (1, sizeof *dp);
+		dp->path = xcalloc (1, strlen (cur->tgt->directory) + 10);
+
+		base26 (idx, suffix);
+		sprintf (dp->path, "%s-%s", cur->tgt->directory, suffix);
+
+		if (make_dir (dp->path, 0755) == -1 && errno != EEXIST) {
+			report ("failed to create directory %s: %m\n",
+				dp->path);
+			free (dp->path);
+			free (dp);
+			return (NULL);
+		}
+
+		if (!cur->first_collision_dir)
+			cur->first_collision_dir = dp;
+
+		if (cur->last_collision_dir)
+			cur->last_collision_dir->next = dp;
+
+		cur->last_collision_dir = dp;
+	}
+
+	return (dp);
+}
+
+/*
+ * the target of newest/path for backup_path/path, or for a file in its
+ * pack or recipe pack (kind) for that, into out of PATH_MAX bytes.  it
+ * climbs to the root and goes down from there, so the archive may move
+ * or be named by a relative path or through a link.
+ */
+int
+newest_target (const char *backup_path, const char *path, int level,
+	       const char *kind, char *out)
+{
+	const char *branch;
+	int idx, l, r;
+
+	branch = strrchr (backup_path, '/') + 1;
+
+	for (idx = 0, l = 0; idx <= level && l < PATH_MAX - 3; idx++)
+		l += sprintf (out + l, "../");
+
+	if (kind)
+		r = snprintf (out + l, PATH_MAX - l, ".bakim/%s/%s.pack",
+			      kind, branch);
+	else
+		r = snprintf (out + l, PATH_MAX - l, "%s/%s", branch, path);
+
+	if (idx <= level || r >= PATH_MAX - l) {
+		report ("path exceeds PATH_MAX\n");
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * point newest/path at backup_path/path, or for a file in its pack or
+ * recipe pack (kind) at that, replacing whatever was there
+ */
+int
+update_newest (const char *backup_path, const char *path, int level,
+	       const char *kind)
+{
+	char newbr_name[PATH_MAX], newbr_tar[PATH_MAX];
+
+	if (strlen (cur->tgt->newest) + strlen (path) + 100 >= PATH_MAX) {
+		report ("path exceeds PATH_MAX\n");
+		return (-1);
+	}
+
+	sprintf (newbr_name, "%s/%s", cur->tgt->newest, path);
+
+	if (newest_unsafe (path))
+		return (-1);
+
+	if (newest_target (backup_path, path, level, kind, newbr_tar) == -1)
+		return (-1);
+
+	if (delete_file_or_dir (newbr_name) == -1)
+		return (-1);
+
+	if (symlink (newbr_tar, newbr_name) == -1) {
+		report ("failed to create symlink %s: %m\n",
+			newbr_name);
+		return (-1);
+	}
+
+	note_stored (backup_path, path);
+
+	return (0);
+}
+
+/*
+ * whether the pack or recipe pack of slot holds path, with the stat it
+ * had in sb.  neither is created.
+ */
+int
+slot_packed (const char *slot, const char *path, struct stat *sb)
+{
+	struct hash_entry *hp;
+	struct pack *pk;
+	int idx;
+
+	for (idx = 0; idx < 2; idx++) {
+		pk = pack_get (idx ? &bk->recipes : &bk->packs,
+			       idx ? "recipe" : "pack", slot);
+
+		pthread_mutex_lock (&pk->lock);
+		if ((hp = hash_lookup (&pk->recs, path,
+				       strlen (path))) != NULL)
+			pack_rec_stat (hp->val, sb);
+		pthread_mutex_unlock (&pk->lock);
+
+		if (hp)
+			return (1);
+	}
+
+	return (0);
+}
+
+/*
+ * the slot for the regular file fpath: backup_path, or the first
+ * collision slot holding no other version of it, as a file in its tree
+ * or in its pack or recipe pack, so turning -P or -C on or off doesn't
+ * store everything again.  nothing is created.  returns 1 with *count
+ * (-1 for backup_path) and dst_name, its name in that slot's tree, 0
+ * when an identical copy is archived, dst_name naming it if it is a
+ * file and empty if it is packed, or -1.
+ */
+int
+choose_slot (const char *fpath, const struct stat *sb,
+	     const char *backup_path, int *count, char *dst_name)
+{
+	const char *path;
+	char slot[PATH_MAX], suffix[3];
+	struct stat dst_sb;
+
+	path = fpath + cur->base_off;
+
+	for (*count = -1; *count <= 675; (*count)++) {
+		if (*count < 0) {
+			snprintf (slot, sizeof slot, "%s", backup_path);
+		} else {
+			base26 (*count, suffix);
+			snprintf (slot, sizeof slot, "%s-%s",
+				  cur->tgt->directory, suffix);
+		}
+
+		if (strlen (slot) + strlen (path) + 100 >= PATH_MAX) {
+			report ("path exceeds PATH_MAX\n");
+			return (-1);
+		}
+
+		sprintf (dst_name, "%s/%s", slot, path);
+
+		if (slot_lstat (slot, path, dst_name, &dst_sb) == 0) {
+			if (check_same (sb, &dst_sb, fpath, dst_name))
+				return (0);
+			continue;
+		} else if (errno == ENOTDIR) {
+			continue;
+		} else if (errno != ENOENT) {
+			report ("error with lstat on %s: %m\n",
+				dst_name);
+			return (-1);
+		}
+
+		if (slot_packed (slot, path, &dst_sb)) {
+			if (check_same (sb, &dst_sb, NULL, NULL)) {
+				*dst_name = 0;
+				return (0);
+			}
+			continue;
+		}
+
+		return (1);
+	}
+
+	report ("failed to find slot for %s\n", fpath);
+
+	return (-1);
+}
+
+/* backup_file() for files below pack_threshold, into the slot's pack */
+int
+backup_packed (const char *fpath, const struct stat *sb, struct FTW *ftwbuf)
+{
+	const char *path, *slot_path;
+	char dst_name[PATH_MAX];
+	struct pack *pk;
+	struct dir_data *dp;
+	int count, r;
+
+	path = fpath + cur->base_off;
+
+	if ((r = choose_slot (fpath, sb, cur->tgt->directory, &count,
+			      dst_name)) <= 0)
+		return (r);
+
+	if (count < 0) {
+		slot_path = cur->tgt->directory;
+	} else {
+		if ((dp = collision_dir (count)) == NULL)
+			return (-1);
+		slot_path = dp->path;
+	}
+
+	pk = pack_get (&bk->packs, "pack", slot_path);
+
+	pthread_mutex_lock (&pk->lock);
+	r = pack_store (pk, fpath, path, sb);
+	pthread_mutex_unlock (&pk->lock);
+
+	if (r == -1)
+		return (-1);
+
+	acct_add (slot_path, 1, sb->st_size, 0);
+	index_note (slot_path, path);
+
+	return (update_newest (slot_path, path, ftwbuf->level, "pack"));
+}
+
+
+/*
+ * the target of the source symlink fpath.  a receiver has no source
+ * tree; the sender's readlink comes with the entry instead.
+ */
+int
+source_link (const char *fpath, const struct stat *sb, char *buf)
+{
+	int r;
+
+	if (cur && cur->src_link) {
+		strcpy (buf, cur->src_link);
+		return (0);
+	}
+
+	r = readlink (fpath, buf, sb->st_size + 1);
+
+	if (r < 0) {
+		report ("failed to read link %s: %m\n", fpath);
+		return (-1);
+	}
+
+	if (r > sb->st_size) {
+		report ("symlink increased in size"
+			" between lstat and readlink\n");
+		return (-1);
+	}
+
+	buf[sb->st_size] = 0;
+
+	return (0);
+}
+
+int
+check_same (const struct stat *a, const struct stat *b,
+	    const char *a_path, const char *b_path)
+{
+	int mask, r;
+	char a_tar[PATH_MAX], b_tar[PATH_MAX];
+
+	mask = 0777;
+
+	if (S_ISREG (a->st_mode) && S_ISREG (b->st_mode)) {
+		if (a->st_mtime == b->st_mtime && a->st_size == b->st_size
+		    && (a->st_mode & mask) == (b->st_mode & mask)
+		    && a->st_uid == b->st_uid && a->st_gid == b->st_gid) {
+			if (bk->content_check == CONTENT_STAT || !a_path
+			    || !b_path)
+				return (1);
+			return (content_same (a_path, b_path, a->st_size));
+		}
+	} else if (S_ISDIR (a->st_mode) && S_ISDIR (b->st_mode)) {
+		if ((a->st_mode & mask) == (b->st_mode & mask)
+		    && a->st_uid == b->st_uid && a->st_gid == b->st_gid) {
+			return (1);
+		}
+	} else if (S_ISLNK (a->st_mode) && S_ISLNK (b->st_mode)) {
+		if (!a_path || !b_path) {
+			report ("bad call to check_same,"
+				" paths required for links\n");
+			exit (1);
+		}
+
+		if (a->st_uid != b->st_uid || a->st_gid != b->st_gid)
+			return (0);
+
+		/* one that can't be read is different, and fails later */
+		if (source_link (a_path, a, a_tar) == -1)
+			return (0);
+
+		r = readlink (b_path, b_tar, b->st_size + 1);
+
+		if (r < 0) {
+			report ("failed to read link %s: %m\n",
+				b_path);
+			return (0);
+		}
+
+		if (r > b->st_size) {
+			report ("symlink increased in size"
+				" between lstat and readlink\n");
+			return (0);
+		}
+
+		b_tar[b->st_size] = 0;
+
+		if (strcmp (a_tar, b_tar) == 0)
+			return (1);
+	}
+
+	return (0);
+}
+
+/* whether len bytes at off are the same in fa and fb */
+int
+range_same (int fa, int fb, off_t off, off_t len, char *abuf, char *bbuf,
+	    size_t bufsize)
+{
+	size_t n;
+
+	while (len > 0) {
+		n = len < bufsize ? len : bufsize;
+
+		if (pread (fa, abuf, n, off) != n || pread (fb, bbuf, n, off) != n)
+			return (-1);
+		throttle_take (&bk->read_limit, 2 * n);
+
+		if (memcmp (abuf, bbuf, n) != 0)
+			return (0);
+
+		off += n;
+		len -= n;
+	}
+
+	return (1);
+}
+
+/*
+ * the content stages of check_same(), once stat agrees: the head, the
+ * tail and SAMPLE_COUNT blocks between, all of a file no bigger than
+ * that, and then with CONTENT_FULL the whole of it.  a source that
+ * can't be opened is never the same, so storing it fails and says so
+ * rather than an old copy standing in for it.
+ */
+int
+content_same (const char *a_path, const char *b_path, off_t size)
+{
+	char abuf[SAMPLE_BLOCK], bbuf[SAMPLE_BLOCK], *fabuf, *fbbuf;
+	unsigned int seed;
+	off_t off, n_blocks;
+	int fa, fb, idx, r;
+
+	if ((fa = open (a_path, O_RDONLY | O_NOATIME)) == -1
+	    && (fa = open (a_path, O_RDONLY)) == -1)
+		return (0);
+
+	if ((fb = open (b_path, O_RDONLY | O_NOATIME)) == -1) {
+		close (fa);
+		return (0);
+	}
+
+	if (size <= (SAMPLE_COUNT + 2) * SAMPLE_BLOCK) {
+		r = range_same (fa, fb, 0, size, abuf, bbuf, sizeof abuf);
+	} else {
+		r = range_same (fa, fb, 0, SAMPLE_BLOCK, abuf, bbuf,
+				sizeof abuf);
+		if (r == 1)
+			r = range_same (fa, fb, size - SAMPLE_BLOCK,
+					SAMPLE_BLOCK, abuf, bbuf, sizeof abuf);
+
+		seed = bk->sample_seed ^ hash_str (a_path, strlen (a_path));
+		n_blocks = size / SAMPLE_BLOCK;
+
+		for (idx = 0; r == 1 && idx < SAMPLE_COUNT; idx++) {
+			off = (((off_t) rand_r (&seed) << 31) ^ rand_r (&seed))
+				% n_blocks * SAMPLE_BLOCK;
+			r = range_same (fa, fb, off, SAMPLE_BLOCK, abuf, bbuf,
+					sizeof abuf);
+		}
+
+		if (r == 1 && bk->content_check == CONTENT_FULL) {
+			fabuf = xcalloc (2, VERIFY_BUFSIZE);
+			fbbuf = fabuf + VERIFY_BUFSIZE;
+			r = range_same (fa, fb, 0, size, fabuf, fbbuf,
+					VERIFY_BUFSIZE);
+			free (fabuf);
+		}
+	}
+
+	posix_fadvise (fb, 0, 0, POSIX_FADV_DONTNEED);
+	close (fa);
+	close (fb);
+
+	/* the archived copy failing to read is no reason to trust it */
+	return (r == 1);
+}
+
+/*
+ * where fpath is to be stored: the branch itself or the first collision
+ * slot with room for it.  returns 1 with dst_name and *slot_path set
+ * when it must be stored, 0 when an identical copy is already there.
+ */
+int
+place_file (const char *fpath, const struct stat *sb, char *backup_path,
+	    char *dst_name, const char **slot_path)
+{
+	const char *path;
+	struct dir_data *dp;
+	int count, r;
+
+	path = fpath + cur->base_off;
+
+	if ((r = choose_slot (fpath, sb, backup_path, &count,
+			      dst_name)) == 0) {
+		/* names of the inode new since then can still link to it */
+		if (*dst_name && sb->st_nlink > 1 && !find_link (sb))
+			remember_link (sb, dst_name, 0)->archived = 1;
+		return (0);
+	}
+
+	if (r == -1)
+		return (-1);
+
+	if (count < 0) {
+		*slot_path = backup_path;
+		return (1);
+	}
+
+	if ((dp = collision_dir (count)) == NULL
+	    || pave_path (path, dp) != 0) {
+		report ("failed to find slot for %s\n", fpath);
+		return (-1);
+	}
+
+	*slot_path = dp->path;
+
+	return (1);
+}
+
+int
+backup_file (const char *fpath, const struct stat *sb, struct FTW *ftwbuf,
+	     char *backup_path)
+{
+	const char *path, *slot_path;
+	char dst_name[PATH_MAX];
+	int r, shared;
+	unsigned long long hash;
+	struct link_data *lk;
+	struct parity *pe;
+
+	if (bk->pack_threshold && sb->st_size < bk->pack_threshold)
+		return (backup_packed (fpath, sb, ftwbuf));
+
+	if (bk->chunk_threshold && sb->st_size >= bk->chunk_threshold)
+		return (backup_chunked (fpath, sb, ftwbuf));
+
+	path = fpath + cur->base_off;
+
+	if ((r = place_file (fpath, sb, backup_path, dst_name,
+			     &slot_path)) <= 0)
+		return (r);
+
+	/*
+	 * another name for an inode copied earlier in this run becomes a
+	 * hard link to that copy, or failing that (EMLINK, say) a reflink.
+	 */
+	lk = NULL;
+	shared = 0;
+
+	if (sb->st_nlink > 1 && (lk = find_link (sb)) != NULL)
+		shared = share_file (lk, dst_name);
+
+	if (shared) {
+		hash = lk->hash;
+	} else {
+		pe = bk->parity_blocks ? parity_open (slot_path, path) : NULL;
+		r = copy_file (fpath, dst_name, &hash, pe);
+		parity_close (pe, r == 0);
+		if (r == -1) {
+			unlink (dst_name);
+			return (-1);
+		}
+	}
+
+	if (sb->st_nlink > 1 && !lk)
+		remember_link (sb, dst_name, hash);
+
+	return (file_stored (dst_name, slot_path, path, sb, ftwbuf->level,
+			     hash, shared, sb->st_nlink > 1 && !lk));
+}
+
+/* 1 if dst_name is now a hard link to lk's copy, 2 a reflink, 0 neither */
+int
+share_file (struct link_data *lk, const char *dst_name)
+{
+	if (lk->archived && open_archived_link (lk) == -1)
+		return (0);
+
+	if (link (lk->dst, dst_name) == 0)
+		return (1);
+
+	if (clone_file (lk->dst, dst_name) == 0)
+		return (2);
+
+	return (0);
+}
+
+/*
+ * the bookkeeping for a file now at dst_name in slot_path, and its
+ * newest link.  shared is share_file()'s answer; a writable copy is one
+ * later links may still join, sealed with the rest of the lane.
+ */
+int
+file_stored (const char *dst_name, const char *slot_path, const char *path,
+	     const struct stat *sb, int level, unsigned long long hash,
+	     int shared, int writable)
+{
+	manifest_add (slot_path, path, sb->st_size, hash);
+
+	if (shared)
+		acct_add (slot_path, 1, 0, sb->st_size);
+	else
+		acct_add (slot_path, 1, sb->st_size, 0);
+
+	index_note (slot_path, path);
+
+	if (shared != 1) {
+		set_file_meta (dst_name, sb);
+
+		if (!writable)
+			set_immutable (dst_name);
+	}
+
+	return (update_newest (slot_path, path, level, NULL));
+}
+
+int
+backup_dir (const char *fpath, const struct stat *sb, struct FTW *ftwbuf,
+	    char *backup_path)
+{
+	const char *path;
+	char dst_name[PATH_MAX], newbr_name[PATH_MAX];
+	struct stat dst_sb;
+	int flags;
+	struct dir_data *dp;
+
+	path = fpath + cur->base_off;
+
+	if (strlen (path) + strlen (backup_path) + 100 >= PATH_MAX) {
+		report ("path exceeds PATH_MAX\n");
+		return (-1);
+	}
+
+	sprintf (dst_name, "%s/%s", backup_path, path);
+
+	if (slot_lstat (backup_path, path, dst_name, &dst_sb) == -1) {
+		if (errno == ENOTDIR) {
+			if ((dp = find_slot (fpath, sb, &flags)) == NULL) {
+				report ("failed to find slot for %s\n",
+					fpath);
+				return (-1);
+			}
+
+			if (flags & FILE_FOUND)
+				return (0);
+
+			if (backup_dir (fpath, sb, ftwbuf, dp->path) == -1) {
+				report ("backup failed for %s\n",
+					fpath);
+				return (-1);
+			} else {
+				return (0);
+			}
+		} else if (errno != ENOENT) {
+			report ("error with lstat on %s: %m\n",
+				dst_name);
+			return (-1);
+		}
+	} else {
+		if (check_same (sb, &dst_sb, NULL, NULL)) {
+			touched_dir (path, dst_name, sb);
+			return (0);
+		} else {
+			if ((dp = find_slot (fpath, sb, &flags)) == NULL) {
+				report ("failed to find slot for %s\n",
+					fpath);
+				return (-1);
+			}
+
+			if (flags & FILE_FOUND)
+				return (0);
+
+			if (backup_dir (fpath, sb, ftwbuf, dp->path) == -1) {
+				report ("backup failed for %s\n",
+					fpath);
+				return (-1);
+			} else {
+				return (0);
+			}
+		}
+	}
+
+	if (strlen (cur->tgt->newest) + strlen (path) + 100 >= PATH_MAX) {
+		report ("path exceeds PATH_MAX\n");
+		return (-1);
+	}
+	sprintf (newbr_name, "%s/%s", cur->tgt->newest, path);
+
+	if (newest_unsafe (path))
+		return (-1);
+
+	if (strlen (backup_path) + strlen (path)
+	    + strlen ("../") * ftwbuf->level + 100 >= PATH_MAX) {
+		report ("path exceeds PATH_MAX\n");
+		return (-1);
+	}
+
+	if (make_dir (dst_name, sb->st_mode) == -1) {
+		report ("failed to create directory %s: %m\n",
+			dst_name);
+		return (-1);
+	}
+
+	if (lchown (dst_name, sb->st_uid, sb->st_gid) == -1) {
+		report ("failed to chown %s: %m\n", dst_name);
+	}
+
+	if (lstat (dst_name, &dst_sb) == -1) {
+		report ("error with lstat on %s: %m\n", dst_name);
+		return (-1);
+	}
+
+	touched_dir (path, dst_name, sb);
+
+	if (delete_file_or_dir (newbr_name) == -1)
+		return (-1);
+
+	if (make_dir (newbr_name, sb->st_mode) == -1) {
+		report ("failed to create directory %s: %m\n",
+			newbr_name);
+		return (-1);
+	}
+
+	if (lchown (newbr_name, sb->st_uid, sb->st_gid) == -1) {
+		report ("failed to chown %s: %m\n", newbr_name);
+	}
+
+	if (lstat (newbr_name, &dst_sb) == -1) {
+		report ("error with lstat on %s: %m\n", newbr_name);
+		return (-1);
+	}
+
+	touched_dir (path, newbr_name, sb);
+
+	return (0);
+}
+
+int
+backup_link (const char *fpath, const struct stat *sb, struct FTW *ftwbuf,
+	     char *backup_path)
+{
+	const char *path;
+	char dst_name[PATH_MAX], newbr_name[PATH_MAX], newbr_tar[PATH_MAX], 
+		lnk_tar[PATH_MAX];
+	struct stat dst_sb;
+	int flags;
+	struct dir_data *dp;
+
+	path = fpath + cur->base_off;
+
+	if (strlen (path) + strlen (backup_path) + 100 >= PATH_MAX) {
+		report ("path exceeds PATH_MAX\n");
+		return (-1);
+	}
+
+	sprintf (dst_name, "%s/%s", backup_path, path);
+
+	if (slot_lstat (backup_path, path, dst_name, &dst_sb) == -1) {
+		if (errno == ENOTDIR) {
+			if ((dp = find_slot (fpath, sb, &flags)) == NULL) {
+				report ("failed to find slot for %s\n",
+					fpath);
+				return (-1);
+			}
+
+			if (flags & FILE_FOUND)
+				return (0);
+
+			if (backup_link (fpath, sb, ftwbuf, dp->path) == -1) {
+				report ("backup failed for %s\n",
+					fpath);
+				return (-1);
+			} else {
+				return (0);
+			}
+		} else if (errno != ENOENT) {
+			report ("error with lstat on %s: %m\n",
+				dst_name);
+			return (-1);
+		}
+	} else {
+ 		if (check_same (sb, &dst_sb, fpath, dst_name)) {
+			return (0);
+		} else {
+			if ((dp = find_slot (fpath, sb, &flags)) == NULL) {
+				report ("failed to find slot for %s\n",
+					fpath);
+				return (-1);
+			}
+
+			if (flags & FILE_FOUND)
+				return (0);
+
+			if (backup_link (fpath, sb, ftwbuf, dp->path) == -1) {
+				report ("backup failed for %s\n",
+					fpath);
+				return (-1);
+			} else {
+				return (0);
+			}
+		}
+	}
+
+	if (strlen (cur->tgt->newest) + strlen (path) + 100 >= PATH_MAX) {
+		report ("path exceeds PATH_MAX\n");
+		return (-1);
+	}
+	sprintf (newbr_name, "%s/%s", cur->tgt->newest, path);
+
+	if (newest_unsafe (path))
+		return (-1);
+
+	if (newest_target (backup_path, path, ftwbuf->level, NULL,
+			   newbr_tar) == -1)
+		return (-1);
+
+	if (source_link (fpath, sb, lnk_tar) == -1)
+		return (-1);
+
+	if (symlink (lnk_tar, dst_name) == -1) {
+		report ("failed to create symlink %s: %m\n", dst_name);
+		return (-1);
+	}
+
+	if (lchown (dst_name, sb->st_uid, sb->st_gid) == -1) {
+		report ("failed to chown %s: %m\n", dst_name);
+	}
+
+	acct_add (backup_path, 1, 0, 0);
+	index_note (backup_path, path);
+
+	if (delete_file_or_dir (newbr_name) == -1)
+		return (-1);
+
+	if (symlink (newbr_tar, newbr_name) == -1) {
+		report ("failed to create symlink %s: %m\n",
+			newbr_name);
+		return (-1);
+	}
+
+	note_stored (backup_path, path);
+
+	return (0);
+}
+
+/* back up one walked entry to every target of the root being walked */
+int
+backup_entry (const char *fpath, const struct stat *sb, int tflag,
+	      struct FTW *ftwbuf)
+{
+	struct root_ctx *head, *tc;
+	int r;
+
+	if (tflag == FTW_F && bk->defer_window >= 0 && file_busy (fpath, sb)) {
+		defer_file (fpath, sb, ftwbuf);
+		return (0);
+	}
+
+	if (tflag == FTW_F && sb->st_nlink > 1 && !walked
+	    && (r = link_later (fpath, sb)) != 0) {
+		if (r == 1)
+			pending_push (&cur->late, &cur->n_late,
+				      &cur->late_alloc, fpath, sb, ftwbuf);
+		return (0);
+	}
+
+	if (tflag == FTW_F && cur->mirror)
+		return (fan_file (fpath, sb, ftwbuf));
+
+	head = cur;
+	r = 0;
+
+	for (tc = head; tc; tc = tc->mirror) {
+		cur = tc;
+
+		switch (tflag) {
+		case FTW_F:
+			if (backup_file (fpath, sb, ftwbuf,
+					 tc->tgt->directory) == -1)
+				r = -1;
+			break;
+		case FTW_D:
+			if (backup_dir (fpath, sb, ftwbuf,
+					tc->tgt->directory) == -1)
+				r = -1;
+			break;
+		case FTW_SL:
+			if (backup_link (fpath, sb, ftwbuf,
+					 tc->tgt->directory) == -1)
+				r = -1;
+			break;
+		}
+	}
+
+	cur = head;
+
+	return (r);
+}
+
+void
+note_failure (const char *fpath)
+{
+	report ("failed to back up %s\n", fpath);
+
+	pthread_mutex_lock (&bk->note_lock);
+	bk->n_failed++;
+	if (bk->callbacks && bk->callbacks->failed)
+		bk->callbacks->failed (bk->callbacks->arg, fpath);
+	pthread_mutex_unlock (&bk->note_lock);
+}
+
+void
+note_stored (const char *slot_path, const char *path)
+{
+	if (!bk->callbacks || !bk->callbacks->stored)
+		return;
+
+	pthread_mutex_lock (&bk->note_lock);
+	bk->callbacks->stored (bk->callbacks->arg, path, slot_path);
+	pthread_mutex_unlock (&bk->note_lock);
+}
+
+/*
+ * whether fpath is still being written: changed within defer_window
+ * seconds, or open for writing somewhere, which a read lease cannot be
+ * taken over.  leases need the file's owner or CAP_LEASE and a local
+ * filesystem; without them only the time is looked at.
+ *
+ * a writer opening the file while the lease is held breaks it with a
+ * signal, by default a SIGIO that would kill the process.  SIGURG,
+ * ignored unless handled, is asked for instead and pointed at this
+ * thread, which blocks it meanwhile and takes it back before
+ * unblocking; no signal disposition of the process is touched.
+ */
+int
+file_busy (const char *fpath, const struct stat *sb)
+{
+	struct f_owner_ex owner;
+	struct timespec now;
+	sigset_t io, old;
+	int fd, busy;
+
+	if (time (NULL) - sb->st_mtime < bk->defer_window)
+		return (1);
+
+	if ((fd = open (fpath, O_RDONLY | O_NONBLOCK)) == -1)
+		return (0);
+
+	if (fcntl (fd, F_SETSIG, SIGURG) == -1) {
+		close (fd);
+		return (0);
+	}
+
+	sigemptyset (&io);
+	sigaddset (&io, SIGURG);
+	pthread_sigmask (SIG_BLOCK, &io, &old);
+
+	busy = 0;
+	if (fcntl (fd, F_SETLEASE, F_RDLCK) == -1) {
+		busy = errno == EAGAIN;
+	} else {
+		/* taking the lease made the whole process its owner */
+		owner.type = F_OWNER_TID;
+		owner.pid = syscall (SYS_gettid);
+		fcntl (fd, F_SETOWN_EX, &owner);
+		fcntl (fd, F_SETLEASE, F_UNLCK);
+	}
+
+	close (fd);
+
+	if (!sigismember (&old, SIGURG)) {
+		memset (&now, 0, sizeof now);
+		while (sigtimedwait (&io, NULL, &now) == SIGURG)
+			;
+	}
+	pthread_sigmask (SIG_SETMASK, &old, NULL);
+
+	return (busy);
+}
+
+void
+defer_file (const char *fpath, const struct stat *sb, struct FTW *ftwbuf)
+{
+	pending_push (&cur->deferred, &cur->n_deferred, &cur->deferred_alloc,
+		      fpath, sb, ftwbuf);
+}
+
+void
+pending_push (struct pending_file **list, int *n, int *alloc,
+	      const char *fpath, const struct stat *sb, struct FTW *ftwbuf)
+{
+	struct pending_file *pf;
+
+	if (*n == *alloc) {
+		*alloc = *alloc ? *alloc * 2 : 64;
+		if ((*list = realloc (*list, *alloc * sizeof **list)) == NULL) {
+			report ("out of memory\n");
+			exit (1);
+		}
+	}
+
+	pf = &(*list)[(*n)++];
+	pf->fpath = xstrdup (fpath);
+	pf->sb = *sb;
+	pf->base = ftwbuf->base;
+	pf->level = ftwbuf->level;
+}
+
+/*
+ * a name of a multiply linked inode that would be copied while no copy
+ * of the inode is known yet.  another name may be in the archive from
+ * an earlier run, and the walk may only get to it further on, so this
+ * one waits for the end of the root: 1.  choose_slot() only looks, so
+ * nothing is created for it now.  2 when this name is archived as it
+ * is, which is remembered for the others and, with no mirror to store
+ * it in as well, leaves nothing to do; 0 to store it now.
+ */
+int
+link_later (const char *fpath, const struct stat *sb)
+{
+	char dst_name[PATH_MAX];
+	int count, r;
+
+	if (find_link (sb))
+		return (0);
+
+	if ((r = choose_slot (fpath, sb, cur->tgt->directory, &count,
+			      dst_name)) != 0)
+		return (r == 1);
+
+	if (*dst_name)
+		remember_link (sb, dst_name, 0)->archived = 1;
+
+	return (cur->mirror ? 0 : 2);
+}
+
+/* the files link_later() held back, now every name has been seen */
+void
+backup_late (void)
+{
+	struct pending_file *list, *pf;
+	struct FTW ftwbuf;
+	int idx, n;
+
+	list = cur->late;
+	n = cur->n_late;
+
+	cur->late = NULL;
+	cur->n_late = cur->late_alloc = 0;
+
+	for (idx = 0; idx < n; idx++) {
+		pf = &list[idx];
+
+		ftwbuf.base = pf->base;
+		ftwbuf.level = pf->level;
+
+		if (backup_entry (pf->fpath, &pf->sb, FTW_F, &ftwbuf) == -1)
+			note_failure (pf->fpath);
+
+		free (pf->fpath);
+	}
+	free (list);
+}
+
+/*
+ * the root is walked; try the files that were busy once more, and
+ * leave the ones that still are for the next run.
+ */
+void
+retry_deferred (void)
+{
+	struct pending_file *list, *pf;
+	struct FTW ftwbuf;
+	struct stat sb;
+	int idx, n;
+
+	list = cur->deferred;
+	n = cur->n_deferred;
+
+	cur->deferred = NULL;
+	cur->n_deferred = cur->deferred_alloc = 0;
+
+	for (idx = 0; idx < n; idx++) {
+		pf = &list[idx];
+
+		ftwbuf.base = pf->base;
+		ftwbuf.level = pf->level;
+
+		if (lstat (pf->fpath, &sb) == 0 && S_ISREG (sb.st_mode)
+		    && backup_entry (pf->fpath, &sb, FTW_F, &ftwbuf) == -1)
+			note_failure (pf->fpath);
+
+		free (pf->fpath);
+	}
+	free (list);
+
+	if (!cur->n_deferred)
+		return;
+
+	pthread_mutex_lock (&bk->busy_lock);
+
+	bk->busy_paths = realloc (bk->busy_paths,
+				  (bk->n_busy + cur->n_deferred)
+				  * sizeof *bk->busy_paths);
+	if (!bk->busy_paths) {
+		report ("out of memory\n");
+		exit (1);
+	}
+
+	for (idx = 0; idx < cur->n_deferred; idx++) {
+		pf = &cur->deferred[idx];
+		report ("%s is still being written, left for the"
+			" next run\n", pf->fpath);
+		bk->busy_paths[bk->n_busy++] = pf->fpath;
+	}
+
+	pthread_mutex_unlock (&bk->busy_lock);
+
+	free (cur->deferred);
+	cur->deferred = NULL;
+	cur->n_deferred = cur->deferred_alloc = 0;
+}
+
+struct fan_op *
+fan_op_new (int kind, struct root_ctx *ctx)
+{
+	struct fan_op *op;
+
+	op = xcalloc (1, sizeof *op);
+	op->kind = kind;
+	op->ctx = ctx;
+
+	return (op);
+}
+
+void
+fan_op_free (struct fan_op *op)
+{
+	free (op->dst);
+	free (op->path);
+	free (op->fpath);
+	free (op);
+}
+
+/* queue op for a sink, waiting while it is a full buffer behind */
+void
+sink_push (struct sink *sk, struct fan_op *op)
+{
+	pthread_mutex_lock (&sk->lock);
+
+	while (op->chunk && sk->queued
+	       && sk->queued + op->chunk->len > FAN_BUFFER)
+		pthread_cond_wait (&sk->cond, &sk->lock);
+
+	if (sk->tail)
+		sk->tail->next = op;
+	else
+		sk->head = op;
+	sk->tail = op;
+
+	if (op->chunk)
+		sk->queued += op->chunk->len;
+
+	pthread_cond_broadcast (&sk->cond);
+	pthread_mutex_unlock (&sk->lock);
+}
+
+/* wait until a sink has done everything queued so far */
+void
+sink_sync (struct sink *sk)
+{
+	struct fan_op *op;
+
+	op = fan_op_new (FAN_SYNC, NULL);
+	sink_push (sk, op);
+
+	pthread_mutex_lock (&sk->lock);
+	while (!op->done)
+		pthread_cond_wait (&sk->cond, &sk->lock);
+	pthread_mutex_unlock (&sk->lock);
+
+	free (op);
+}
+
+void *
+sink_main (void *arg)
+{
+	struct sink *sk;
+	struct fan_op *op, *file;
+	struct xxh64_state st;
+	struct parity *pe;
+	unsigned long long hash;
+	int fd, shared, bad;
+
+	sk = arg;
+	file = NULL;
+	fd = -1;
+	bad = 0;
+
+	set_ioprio ();
+
+	for (;;) {
+		pthread_mutex_lock (&sk->lock);
+
+		while (!sk->head)
+			pthread_cond_wait (&sk->cond, &sk->lock);
+
+		op = sk->head;
+		if ((sk->head = op->next) == NULL)
+			sk->tail = NULL;
+
+		pthread_mutex_unlock (&sk->lock);
+
+		cur = op->ctx;
+
+		switch (op->kind) {
+		case FAN_COPY:
+			if ((fd = open (op->dst, O_WRONLY | O_CREAT | O_TRUNC,
+					0600)) == -1)
+				report ("cannot open dst file %s: %m\n",
+					op->dst);
+			bad = fd == -1;
+			xxh64_init (&st);
+			if (bk->parity_blocks)
+				op->pe = parity_open (op->slot, op->path);
+			file = op;
+			break;
+		case FAN_DATA:
+			throttle_take (&bk->write_limit, op->chunk->len);
+			xxh64_update (&st, op->chunk->data, op->chunk->len);
+			if (file->pe)
+				parity_update (file->pe, (unsigned char *)
+					       op->chunk->data, op->chunk->len);
+
+			if (!bad && write_all (fd, op->chunk->data,
+					       op->chunk->len) == -1) {
+				report ("error copying file:"
+					" possibly out of space\n");
+				bad = 1;
+			}
+
+			pthread_mutex_lock (&sk->lock);
+			sk->queued -= op->chunk->len;
+			pthread_cond_broadcast (&sk->cond);
+			pthread_mutex_unlock (&sk->lock);
+
+			if (__sync_sub_and_fetch (&op->chunk->refs, 1) == 0)
+				free (op->chunk);
+			free (op);
+			break;
+		case FAN_END:
+			if (fd != -1 && close (fd) != 0) {
+				report ("error closing file %s: %m\n",
+					file->dst);
+				bad = 1;
+			}
+
+			/* the reading side has already counted its failure */
+			if (bad && op->status == 0)
+				note_failure (file->fpath);
+			if (bad)
+				op->status = -1;
+
+			parity_close (file->pe, op->status == 0);
+
+			if (op->status == 0) {
+				hash = xxh64_final (&st);
+				if (file->lk)
+					file->lk->hash = hash;
+				file_stored (file->dst, file->slot, file->path,
+					     &file->sb, file->level, hash, 0,
+					     file->lk != NULL);
+			} else {
+				unlink (file->dst);
+			}
+
+			fan_op_free (file);
+			free (op);
+			break;
+		case FAN_LINK:
+			if ((shared = share_file (op->lk, op->dst)) != 0) {
+				hash = op->lk->hash;
+			} else {
+				pe = bk->parity_blocks
+					? parity_open (op->slot, op->path)
+					: NULL;
+				bad = copy_file (op->fpath, op->dst, &hash, pe);
+				parity_close (pe, !bad);
+				if (bad) {
+					unlink (op->dst);
+					note_failure (op->fpath);
+					fan_op_free (op);
+					break;
+				}
+			}
+
+			file_stored (op->dst, op->slot, op->path, &op->sb,
+				     op->level, hash, shared, 0);
+			fan_op_free (op);
+			break;
+		case FAN_SYNC:
+			pthread_mutex_lock (&sk->lock);
+			op->done = 1;
+			pthread_cond_broadcast (&sk->cond);
+			pthread_mutex_unlock (&sk->lock);
+			break;
+		case FAN_QUIT:
+			free (op);
+			cur = NULL;
+			return (NULL);
+		}
+
+		cur = NULL;
+	}
+}
+
+/*
+ * backup_file() for several targets: place the file in each, then read
+ * it once and hand the data to the sinks of the targets that need it.
+ */
+int
+fan_file (const char *fpath, const struct stat *sb, struct FTW *ftwbuf)
+{
+	struct root_ctx *head, *tc;
+	struct fan_op *op, *ops[MAX_TARGETS];
+	struct chunk *ch;
+	const char *slot;
+	char dst_name[PATH_MAX];
+	int idx, n, r, fd, n_read, want, status;
+	off_t left;
+	void *p;
+
+	head = cur;
+	n = 0;
+	r = 0;
+
+	for (tc = head; tc; tc = tc->mirror) {
+		cur = tc;
+
+		if (bk->pack_threshold && sb->st_size < bk->pack_threshold) {
+			if (backup_packed (fpath, sb, ftwbuf) == -1)
+				r = -1;
+			continue;
+		}
+
+		/* chunking reads the file whole, once per target */
+		if (bk->chunk_threshold
+		    && sb->st_size >= bk->chunk_threshold) {
+			if (backup_chunked (fpath, sb, ftwbuf) == -1)
+				r = -1;
+			continue;
+		}
+
+		if ((idx = place_file (fpath, sb, tc->tgt->directory,
+				       dst_name, &slot)) != 1) {
+			if (idx == -1)
+				r = -1;
+			continue;
+		}
+
+		op = fan_op_new (FAN_COPY, tc);
+		op->dst = xstrdup (dst_name);
+		op->slot = slot;
+		op->path = xstrdup (fpath + tc->base_off);
+		op->fpath = xstrdup (fpath);
+		op->sb = *sb;
+		op->level = ftwbuf->level;
+
+		if (sb->st_nlink > 1) {
+			if ((op->lk = find_link (sb)) != NULL) {
+				op->kind = FAN_LINK;
+				sink_push (tc->sink, op);
+				continue;
+			}
+			op->lk = remember_link (sb, dst_name, 0);
+		}
+
+		ops[n++] = op;
+	}
+
+	cur = head;
+
+	if (n == 0)
+		return (r);
+
+	for (idx = 0; idx < n; idx++)
+		sink_push (ops[idx]->ctx->sink, ops[idx]);
+
+	status = 0;
+
+	if ((fd = open (fpath, O_RDONLY)) == -1) {
+		report ("cannot open src file %s: %m\n", fpath);
+		status = -1;
+	} else {
+		/*
+		 * read straight into the chunk the sinks share, sized to
+		 * what the file should still hold, and only small past that
+		 * to see the end or what was written since
+		 */
+		ch = NULL;
+		left = sb->st_size;
+		for (;;) {
+			want = left <= 0 ? 4096 : left < FAN_CHUNK ? left
+				: FAN_CHUNK;
+			if (!ch && (ch = malloc (sizeof *ch + want)) == NULL) {
+				report ("out of memory\n");
+				exit (1);
+			}
+
+			if ((n_read = read (fd, ch->data, want)) == 0)
+				break;
+
+			if (n_read == -1) {
+				if (errno == EINTR)
+					continue;
+				report ("error reading %s: %m\n",
+					fpath);
+				status = -1;
+				break;
+			}
+
+			throttle_take (&bk->read_limit, n_read);
+			left -= n_read;
+
+			if (n_read < want
+			    && (p = realloc (ch, sizeof *ch + n_read)) != NULL)
+				ch = p;
+			ch->refs = n;
+			ch->len = n_read;
+
+			for (idx = 0; idx < n; idx++) {
+				op = fan_op_new (FAN_DATA, ops[idx]->ctx);
+				op->chunk = ch;
+				sink_push (op->ctx->sink, op);
+			}
+			ch = NULL;
+		}
+
+		free (ch);
+		close (fd);
+	}
+
+	for (idx = 0; idx < n; idx++) {
+		op = fan_op_new (FAN_END, ops[idx]->ctx);
+		op->status = status;
+		sink_push (op->ctx->sink, op);
+	}
+
+	return (status == -1 ? -1 : r);
+}
+
+/*
+ * compile one rule: a leading ! includes what earlier rules excluded, a
+ * trailing / only matches directories, and a pattern with a / in it is
+ * anchored at the root unless it starts with **.
+ */
+void
+filter_add (const char *rule)
+{
+	struct filter_rule *r;
+	struct hash_table *ht;
+	struct hash_entry *hp;
+	const char *key;
+	char *p;
+	int l;
+
+	bk->filter_rules = realloc (bk->filter_rules,
+				    (bk->n_filter_rules + 1)
+				    * sizeof *bk->filter_rules);
+	if (!bk->filter_rules) {
+		report ("out of memory\n");
+		exit (1);
+	}
+
+	r = &bk->filter_rules[bk->n_filter_rules];
+	memset (r, 0, sizeof *r);
+
+	if (*rule == '!') {
+		r->negate = 1;
+		rule++;
+	} else if (*rule == '\\') {
+		rule++;
+	}
+
+	p = xstrdup (rule);
+
+	for (l = strlen (p); l > 1 && p[l - 1] == '/'; l--) {
+		p[l - 1] = '\0';
+		r->dir_only = 1;
+	}
+
+	if (strncmp (p, "**/", 3) == 0) {
+		memmove (p, p + 3, strlen (p + 3) + 1);
+	} else if (strchr (p, '/')) {
+		r->anchored = 1;
+		if (*p == '/')
+			memmove (p, p + 1, strlen (p));
+	}
+
+	/* ** crosses directories, so the pattern goes without FNM_PATHNAME */
+	if (r->anchored && !strstr (p, "**"))
+		r->flags = FNM_PATHNAME;
+
+	r->pattern = p;
+
+	ht = NULL;
+	key = NULL;
+
+	if (!r->anchored && !r->dir_only && !strchr (p, '/')) {
+		if (p[0] == '*' && p[1] == '.' && p[2]
+		    && !strpbrk (p + 2, "*?[\\")) {
+			ht = &bk->filter_exts;
+			key = p + 2;
+		} else if (!strpbrk (p, "*?[\\")) {
+			ht = &bk->filter_names;
+			key = p;
+		}
+	}
+
+	if (ht) {
+		if ((hp = hash_lookup (ht, key, strlen (key))) != NULL)
+			hp->val = (void *) (long) (bk->n_filter_rules + 1);
+		else
+			hash_insert (ht, key, strlen (key),
+				     (void *) (long) (bk->n_filter_rules + 1));
+	} else {
+		bk->filter_globs = realloc (bk->filter_globs,
+					    (bk->n_filter_globs + 1)
+					    * sizeof *bk->filter_globs);
+		if (!bk->filter_globs) {
+			report ("out of memory\n");
+			exit (1);
+		}
+		bk->filter_globs[bk->n_filter_globs++] = bk->n_filter_rules;
+	}
+
+	bk->n_filter_rules++;
+}
+
+/* -X: rules from a file, one per line, with # comments */
+int
+filter_load (const char *fn)
+{
+	size_t alloc;
+	ssize_t n;
+	char *line;
+	FILE *f;
+
+	if ((f = fopen (fn, "r")) == NULL) {
+		report ("cannot open %s: %m\n", fn);
+		return (-1);
+	}
+
+	line = NULL;
+	alloc = 0;
+
+	while ((n = getline (&line, &alloc, f)) != -1) {
+		while (n && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+			line[--n] = '\0';
+		while (n && line[n - 1] == ' ' && (n < 2
+						   || line[n - 2] != '\\'))
+			line[--n] = '\0';
+		if (!n || *line == '#')
+			continue;
+		filter_add (line);
+	}
+
+	free (line);
+	fclose (f);
+
+	return (0);
+}
+
+/*
+ * one side of a range, in *vp: a size as size_arg() takes it, or a
+ * plain number of days, in seconds
+ */
+int
+range_arg (const char *s, int size, long long *vp)
+{
+	unsigned long long v;
+	char *end;
+	long days;
+
+	if (size) {
+		if (size_arg (s, &v) == -1)
+			return (-1);
+		*vp = v;
+		return (0);
+	}
+
+	errno = 0;
+	days = strtol (s, &end, 10);
+	if (end == s || *end || errno || days < 0
+	    || days > LLONG_MAX / 86400) {
+		report ("bad number of days %s\n", s);
+		return (-1);
+	}
+
+	*vp = (long long) days * 86400;
+
+	return (0);
+}
+
+/* MIN:MAX, either side left out for no bound, in bytes or days */
+int
+parse_range (const char *s, int size, long long *lo, long long *hi)
+{
+	char *copy, *p;
+	int r;
+
+	copy = xstrdup (s);
+	r = 0;
+
+	if ((p = strchr (copy, ':')) != NULL)
+		*p++ = '\0';
+
+	if (*copy)
+		r = range_arg (copy, size, lo);
+	if (r == 0 && p && *p)
+		r = range_arg (p, size, hi);
+
+	free (copy);
+
+	return (r);
+}
+
+/* whether the rules leave the entry at rel, named base, out */
+int
+filter_excluded (const char *rel, const char *base, int is_dir)
+{
+	struct filter_rule *r;
+	struct hash_entry *hp;
+	const char *p;
+	int best, k;
+
+	best = -1;
+
+	hp = hash_lookup (&bk->filter_names, base, strlen (base));
+	if (hp != NULL)
+		best = (long) hp->val - 1;
+
+	for (p = strchr (base, '.'); p && bk->filter_exts.count;
+	     p = strchr (p + 1, '.')) {
+		if ((hp = hash_lookup (&bk->filter_exts, p + 1,
+				       strlen (p + 1))) != NULL
+		    && (long) hp->val - 1 > best)
+			best = (long) hp->val - 1;
+	}
+
+	for (k = bk->n_filter_globs - 1;
+	     k >= 0 && bk->filter_globs[k] > best; k--) {
+		r = &bk->filter_rules[bk->filter_globs[k]];
+
+		if (r->dir_only && !is_dir)
+			continue;
+
+		if (fnmatch (r->pattern, r->anchored ? rel : base,
+			     r->flags) == 0) {
+			best = bk->filter_globs[k];
+			break;
+		}
+	}
+
+	return (best >= 0 && !bk->filter_rules[best].negate);
+}
+
+/* whether a walked entry is left out by the rules or the bounds */
+int
+filtered (const char *fpath, const struct stat *sb, int tflag,
+	  struct FTW *ftwbuf)
+{
+	const char *rel;
+	long long age;
+
+	if (ftwbuf->level == 0)
+		return (0);
+
+	/* a root given with a trailing / has its entries walked as root//x */
+	for (rel = fpath + cur->base_off + cur->name_len; *rel == '/'; rel++)
+		;
+
+	if (bk->n_filter_rules
+	    && filter_excluded (rel, fpath + ftwbuf->base, tflag == FTW_D))
+		return (1);
+
+	if (tflag != FTW_F)
+		return (0);
+
+	if ((bk->filter_min_size >= 0 && sb->st_size < bk->filter_min_size)
+	    || (bk->filter_max_size >= 0 && sb->st_size > bk->filter_max_size))
+		return (1);
+
+	if (bk->filter_min_age >= 0 || bk->filter_max_age >= 0) {
+		age = time (NULL) - sb->st_mtime;
+		if ((bk->filter_min_age >= 0 && age < bk->filter_min_age)
+		    || (bk->filter_max_age >= 0 && age > bk->filter_max_age))
+			return (1);
+	}
+
+	return (0);
+}
+
+static int
+mk_backup (const char *fpath, const struct stat *sb,
+		int tflag, struct FTW *ftwbuf)
+{
+	struct target *t;
+
+	for (t = bk->first_target; t; t = t->next) {
+		if (strncmp (fpath, t->root, strlen (t->root)) == 0)
+			return (tflag == FTW_D ? FTW_SKIP_SUBTREE : FTW_CONTINUE);
+	}
+
+	if (strcmp (fpath + cur->base_off, ".") == 0)
+		return (0);
+
+	/* a directory left out is never read */
+	if (filtered (fpath, sb, tflag, ftwbuf))
+		return (tflag == FTW_D ? FTW_SKIP_SUBTREE : FTW_CONTINUE);
+
+	throttle_take (&bk->meta_limit, 1);
+
+	if (tflag == FTW_F && cur->order != ORDER_NONE) {
+		queue_file (fpath, sb, ftwbuf);
+		return (0);
+	}
+
+	if (backup_entry (fpath, sb, tflag, ftwbuf) == -1)
+		note_failure (fpath);
+
+	return (0);
+}
+
+void
+fix_dirs (void)
+{
+	struct dir_data *dp, *ndp;
+	struct utimbuf times;
+
+	for (dp = cur->first_dir; dp; dp = ndp) {
+		ndp = dp->next;
+
+		times.actime = dp->atime;
+		times.modtime = dp->mtime;
+
+		if (utime (dp->path, &times) == -1) {
+			report ("failed to set timestamp on %s: %m\n",
+				dp->path);
+		}
+
+		free (dp->path);
+		free (dp->rpath);
+		free (dp);
+	}
+
+	cur->first_dir = 0;
+	hash_clear (&cur->dir_index);
+}
+
+void
+free_slot_list (struct dir_data *dp)
+{
+	struct dir_data *ndp;
+
+	for (; dp; dp = ndp) {
+		ndp = dp->next;
+
+		if (dp->paved) {
+			hash_clear (dp->paved);
+			free (dp->paved);
+		}
+
+		free (dp->path);
+		free (dp->rpath);
+		free (dp);
+	}
+}
+
+void
+free_collision_dirs (void)
+{
+	free_slot_list (cur->first_collision_dir);
+
+	cur->first_collision_dir = 0;
+	cur->last_collision_dir = 0;
+}
+
+/*
+ * the collision slots of a root and what is known to be paved in them
+ * outlive the run: the first root of the next run on the target takes
+ * them over, unless a slot directory has gone meanwhile.
+ */
+void
+adopt_slots (struct root_ctx *rc)
+{
+	struct dir_data *dp;
+	struct stat sb;
+
+	for (dp = rc->tgt->warm_slots; dp; dp = dp->next) {
+		if (lstat (dp->path, &sb) == -1 || !S_ISDIR (sb.st_mode)) {
+			free_slot_list (rc->tgt->warm_slots);
+			rc->tgt->warm_slots = NULL;
+			rc->last_collision_dir = NULL;
+			return;
+		}
+		rc->last_collision_dir = dp;
+	}
+
+	rc->first_collision_dir = rc->tgt->warm_slots;
+	rc->tgt->warm_slots = NULL;
+}
+
+void
+park_slots (struct root_ctx *rc)
+{
+	if (!rc->tgt->warm_slots)
+		rc->tgt->warm_slots = rc->first_collision_dir;
+	else
+		free_slot_list (rc->first_collision_dir);
+
+	rc->first_collision_dir = rc->last_collision_dir = NULL;
+}
+
+/* the branch changed: no slot of the old one is of any use */
+void
+drop_slots (void)
+{
+	struct root_ctx *rc, *tc;
+	struct target *t;
+
+	for (t = bk->first_target; t; t = t->next) {
+		free_slot_list (t->warm_slots);
+		t->warm_slots = NULL;
+	}
+
+	for (rc = bk->first_root; rc; rc = rc->next) {
+		for (tc = rc; tc; tc = tc->mirror) {
+			free_slot_list (tc->first_collision_dir);
+			tc->first_collision_dir = NULL;
+			tc->last_collision_dir = NULL;
+		}
+	}
+}
+
+/*
+ * sysfs knows whether a block device seeks.  partitions have no queue
+ * of their own, so fall back to the parent disk's.
+ */
+int
+is_rotational (dev_t dev)
+{
+	char name[100];
+	FILE *f;
+	int c;
+
+	if (major (dev) == 0)
+		return (0);
+
+	sprintf (name, "/sys/dev/block/%u:%u/queue/rotational",
+		 major (dev), minor (dev));
+
+	if ((f = fopen (name, "r")) == NULL) {
+		sprintf (name, "/sys/dev/block/%u:%u/../queue/rotational",
+			 major (dev), minor (dev));
+		if ((f = fopen (name, "r")) == NULL)
+			return (0);
+	}
+
+	c = getc (f);
+	fclose (f);
+
+	return (c == '1');
+}
+
+/*
+ * physical offset of the first extent of name, relative to the
+ * directory dir, or 0 if the fs won't say
+ */
+unsigned long long
+extent_key (int dir, const char *name, const struct stat *sb)
+{
+	int fd;
+	struct {
+		struct fiemap fm;
+		struct fiemap_extent fe;
+	} req;
+
+	if (sb->st_size == 0)
+		return (0);
+
+	if ((fd = openat (dir, name, O_RDONLY | O_NOATIME | O_NOFOLLOW)) == -1
+	    && (fd = openat (dir, name, O_RDONLY | O_NOFOLLOW)) == -1)
+		return (0);
+
+	memset (&req, 0, sizeof req);
+	req.fm.fm_length = FIEMAP_MAX_OFFSET;
+	req.fm.fm_extent_count = 1;
+
+	if (ioctl (fd, FS_IOC_FIEMAP, &req.fm) == -1
+	    || req.fm.fm_mapped_extents == 0) {
+		close (fd);
+		return (0);
+	}
+
+	close (fd);
+
+	return (req.fe.fe_physical);
+}
+
+void
+queue_file (const char *fpath, const struct stat *sb, struct FTW *ftwbuf)
+{
+	struct pending_file *pf;
+
+	if (!cur->pending)
+		cur->pending = xcalloc (ORDER_BATCH, sizeof *cur->pending);
+
+	pf = &cur->pending[cur->n_pending++];
+	pf->fpath = xstrdup (fpath);
+	pf->sb = *sb;
+	pf->base = ftwbuf->base;
+	pf->level = ftwbuf->level;
+
+	/* extents are looked up in pending_keys(), off the walk */
+	pf->key = sb->st_ino;
+
+	if (cur->n_pending == ORDER_BATCH)
+		flush_pending ();
+}
+
+static int
+cmp_pending (const void *a, const void *b)
+{
+	const struct pending_file *pa, *pb;
+
+	pa = a;
+	pb = b;
+
+	if (pa->key != pb->key)
+		return (pa->key < pb->key ? -1 : 1);
+
+	if (pa->sb.st_ino != pb->sb.st_ino)
+		return (pa->sb.st_ino < pb->sb.st_ino ? -1 : 1);
+
+	return (0);
+}
+
+/*
+ * the extent keys of the held back files.  they come in walk order, so
+ * each directory is opened once for all of its files.
+ */
+void
+pending_keys (void)
+{
+	struct pending_file *pf;
+	char *dir;
+	int idx, fd;
+
+	dir = NULL;
+	fd = -1;
+
+	for (idx = 0; idx < cur->n_pending; idx++) {
+		pf = &cur->pending[idx];
+
+		if (!dir || strlen (dir) != pf->base
+		    || strncmp (dir, pf->fpath, pf->base) != 0) {
+			if (fd != -1)
+				close (fd);
+			free (dir);
+			dir = xcalloc (1, pf->base + 2);
+			memcpy (dir, pf->fpath, pf->base);
+			fd = open (pf->base ? dir : ".",
+				   O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		}
+
+		pf->key = fd == -1 ? 0
+			: extent_key (fd, pf->fpath + pf->base, &pf->sb);
+	}
+
+	if (fd != -1)
+		close (fd);
+	free (dir);
+}
+
+/*
+ * copy the held back files in on-disk order.  their directories were
+ * all handled when nftw reported them, so nothing depends on the order
+ * the files themselves go in.
+ */
+void
+flush_pending (void)
+{
+	int idx;
+	struct pending_file *pf;
+	struct FTW ftwbuf;
+
+	if (cur->order == ORDER_EXTENT)
+		pending_keys ();
+
+	qsort (cur->pending, cur->n_pending, sizeof *cur->pending,
+	       cmp_pending);
+
+	for (idx = 0; idx < cur->n_pending; idx++) {
+		pf = &cur->pending[idx];
+
+		ftwbuf.base = pf->base;
+		ftwbuf.level = pf->level;
+
+		if (backup_entry (pf->fpath, &pf->sb, FTW_F, &ftwbuf) == -1)
+			note_failure (pf->fpath);
+
+		free (pf->fpath);
+	}
+
+	cur->n_pending = 0;
+}
+
+/*
+ * queue a root for backup, on the lane of the device it lives on.  a
+ * root whose basename is already queued joins that root's lane, since
+ * both land in the same part of the backup tree.
+ */
+struct root_ctx *
+add_root (const char *arg)
+{
+	int l;
+	char *p;
+	struct stat sb;
+	struct root_ctx *rc, *orc, *tc;
+	struct lane *lp;
+	struct target *t;
+
+	if (lstat (arg, &sb) == -1) {
+		report ("error with lstat on %s: %m\n", arg);
+		return (NULL);
+	}
+
+	rc = xcalloc (1, sizeof *rc);
+	rc->path = xstrdup (arg);
+	rc->dev = sb.st_dev;
+
+	rc->order = bk->read_order;
+	if (rc->order == ORDER_AUTO)
+		rc->order = is_rotational (rc->dev) ? ORDER_EXTENT : ORDER_NONE;
+	else if (rc->order == ORDER_EXTENT && !is_rotational (rc->dev))
+		rc->order = ORDER_INODE;
+
+	l = strlen (rc->path) - 1;
+
+	while (l > 1 && rc->path[l] == '/')
+		l--;
+
+	for (p = rc->path + l; p > rc->path && p[-1] != '/'; p--)
+		;
+
+	if (p > rc->path && p <= rc->path + l)
+		rc->base_off = p - rc->path;
+	else
+		rc->base_off = 0;
+
+	rc->name_len = l + 1 - rc->base_off;
+
+	lp = NULL;
+	for (orc = bk->first_root; orc; orc = orc->next) {
+		if (orc->name_len == rc->name_len
+		    && strncmp (orc->path + orc->base_off,
+				rc->path + rc->base_off, rc->name_len) == 0) {
+			for (lp = bk->first_lane; lp; lp = lp->next) {
+				if (lp->dev == orc->dev)
+					break;
+			}
+			break;
+		}
+	}
+
+	if (!lp) {
+		for (lp = bk->first_lane; lp; lp = lp->next) {
+			if (lp->dev == rc->dev)
+				break;
+		}
+	}
+
+	if (!lp) {
+		lp = xcalloc (1, sizeof *lp);
+		lp->dev = rc->dev;
+		lp->next = bk->first_lane;
+		bk->first_lane = lp;
+	}
+
+	rc->lane = lp;
+	rc->tgt = bk->first_target;
+
+	/* the same walk, with its own slot and directory state per target */
+	for (t = bk->first_target ? bk->first_target->next : NULL, tc = rc; t;
+	     t = t->next, tc = tc->mirror) {
+		tc->mirror = xcalloc (1, sizeof *rc);
+		tc->mirror->lane = lp;
+		tc->mirror->tgt = t;
+		tc->mirror->path = rc->path;
+		tc->mirror->base_off = rc->base_off;
+		tc->mirror->name_len = rc->name_len;
+		tc->mirror->dev = rc->dev;
+		tc->mirror->order = rc->order;
+	}
+
+	if (lp->last_root)
+		lp->last_root->lane_next = rc;
+	else
+		lp->first_root = rc;
+	lp->last_root = rc;
+
+	if (bk->last_root)
+		bk->last_root->next = rc;
+	else
+		bk->first_root = rc;
+	bk->last_root = rc;
+
+	for (tc = rc; tc; tc = tc->mirror)
+		adopt_slots (tc);
+
+	return (rc);
+}
+
+/* the root path is below, or NULL */
+struct root_ctx *
+root_of (const char *path)
+{
+	struct root_ctx *rc;
+	int len;
+
+	for (rc = bk->first_root; rc; rc = rc->next) {
+		len = rc->base_off + rc->name_len;
+		if (strncmp (path, rc->path, len) == 0
+		    && (path[len] == '/' || !path[len]))
+			return (rc);
+	}
+
+	return (NULL);
+}
+
+/*
+ * path made absolute through its parent, so that a symlink keeps its
+ * own name, as the walk would see it
+ */
+char *
+abs_path (const char *path)
+{
+	char *copy, *base, *real, *p;
+	int l;
+
+	copy = xstrdup (path);
+
+	for (l = strlen (copy); l > 1 && copy[l - 1] == '/'; l--)
+		copy[l - 1] = '\0';
+
+	if ((base = strrchr (copy, '/')) != NULL)
+		*base++ = '\0';
+	else
+		base = copy;
+
+	if (!*base || strcmp (base, ".") == 0 || strcmp (base, "..") == 0) {
+		free (copy);
+		return (realpath (path, NULL));
+	}
+
+	real = realpath (base == copy ? "." : *copy ? copy : "/", NULL);
+	if (!real) {
+		free (copy);
+		return (NULL);
+	}
+
+	p = xcalloc (1, strlen (real) + strlen (base) + 2);
+	sprintf (p, "%s/%s", strcmp (real, "/") ? real : "", base);
+
+	free (real);
+	free (copy);
+
+	return (p);
+}
+
+void
+list_add (struct root_ctx *rc, char *path)
+{
+	if (rc->n_list == rc->list_alloc) {
+		rc->list_alloc = rc->list_alloc ? rc->list_alloc * 2 : 64;
+		rc->list = realloc (rc->list, rc->list_alloc
+				    * sizeof *rc->list);
+		if (!rc->list) {
+			report ("out of memory\n");
+			exit (1);
+		}
+	}
+
+	rc->list[rc->n_list++] = path;
+}
+
+/*
+ * --from0: back up only the NUL separated paths read from fn ("-" for
+ * stdin), each of which must be below one of the roots
+ */
+int
+load_list (const char *fn)
+{
+	struct root_ctx *rc;
+	size_t alloc;
+	ssize_t n;
+	char *line, *p;
+	FILE *f;
+	int r;
+
+	if (strcmp (fn, "-") == 0) {
+		f = stdin;
+	} else if ((f = fopen (fn, "r")) == NULL) {
+		report ("cannot open %s: %m\n", fn);
+		return (-1);
+	}
+
+	/* a root with nothing listed is not walked */
+	for (rc = bk->first_root; rc; rc = rc->next)
+		rc->list_only = 1;
+
+	line = NULL;
+	alloc = 0;
+	r = 0;
+
+	while ((n = getdelim (&line, &alloc, '\0', f)) != -1) {
+		if (n && line[n - 1] == '\0')
+			n--;
+		if (!n)
+			continue;
+
+		if ((p = abs_path (line)) == NULL) {
+			if (errno != ENOENT) {
+				report ("cannot resolve %s: %m\n",
+					line);
+				r = -1;
+			}
+			continue;
+		}
+
+		if ((rc = root_of (p)) == NULL) {
+			report ("%s is not below any root\n", line);
+			free (p);
+			r = -1;
+			continue;
+		}
+
+		list_add (rc, p);
+	}
+
+	free (line);
+	if (f != stdin)
+		fclose (f);
+
+	return (r);
+}
+
+static int
+mk_backup_under (const char *fpath, const struct stat *sb,
+		 int tflag, struct FTW *ftwbuf)
+{
+	struct FTW ftw;
+
+	ftw.base = ftwbuf->base;
+	ftw.level = ftwbuf->level + list_level;
+
+	return (mk_backup (fpath, sb, tflag, &ftw));
+}
+
+/*
+ * back up the listed paths of a root instead of walking it.  each gets
+ * the directories above it first, once, and a listed directory gets
+ * all of its subtree.  paths that have gone since are skipped.
+ */
+int
+backup_listed (struct root_ctx *rc)
+{
+	struct hash_table done;
+	struct hash_entry *hp;
+	struct stat sb;
+	struct FTW ftw;
+	char *p, c;
+	int idx, len, level, i, r;
+
+	if (rc->n_list)
+		qsort (rc->list, rc->n_list, sizeof *rc->list, cmp_str);
+	memset (&done, 0, sizeof done);
+
+	len = rc->base_off + rc->name_len;
+	r = 0;
+
+	for (idx = 0; idx < rc->n_list; idx++) {
+		p = rc->list[idx];
+		ftw.base = rc->base_off;
+		level = 0;
+
+		for (i = len; ; i++) {
+			if (p[i] != '/' && p[i] != '\0')
+				continue;
+
+			if ((hp = hash_lookup (&done, p, i)) != NULL) {
+				/* already covered by a subtree walk */
+				if (hp->val == (void *) 2L || !p[i])
+					break;
+			} else {
+				c = p[i];
+				p[i] = '\0';
+
+				if (lstat (p, &sb) == -1) {
+					p[i] = c;
+					break;
+				}
+
+				ftw.level = level;
+
+				if (S_ISDIR (sb.st_mode) && !c) {
+					list_level = level;
+					if (nftw (p, mk_backup_under,
+						  MAX_DIRS_OPEN, FTW_PHYS
+						  | FTW_ACTIONRETVAL) == -1) {
+						report ("nftw failed\n");
+						r = -1;
+					}
+					hash_insert (&done, p, i, (void *) 2L);
+				} else if (S_ISDIR (sb.st_mode)) {
+					/* a left out directory covers its tree */
+					if (mk_backup (p, &sb, FTW_D, &ftw)
+					    == FTW_SKIP_SUBTREE) {
+						hash_insert (&done, p, i,
+							     (void *) 2L);
+						p[i] = c;
+						break;
+					}
+					hash_insert (&done, p, i, (void *) 1L);
+				} else if (!c) {
+					mk_backup (p, &sb, S_ISLNK (sb.st_mode)
+						   ? FTW_SL : FTW_F, &ftw);
+					hash_insert (&done, p, i, (void *) 1L);
+				}
+
+				p[i] = c;
+				if (!S_ISDIR (sb.st_mode))
+					break;
+			}
+
+			if (!p[i])
+				break;
+
+			ftw.base = i + 1;
+			level++;
+		}
+	}
+
+	hash_clear (&done);
+
+	return (r);
+}
+
+int
+backup_root_ctx (struct root_ctx *rc)
+{
+	struct root_ctx *tc;
+	int r;
+
+	for (tc = rc; tc; tc = tc->mirror) {
+		if (rc->lane->sinks)
+			tc->sink = &rc->lane->sinks[tc->tgt->idx];
+	}
+
+	cur = rc;
+	r = 0;
+
+	if (rc->list_only) {
+		r = backup_listed (rc);
+	} else if (nftw (rc->path, mk_backup, MAX_DIRS_OPEN,
+			 FTW_PHYS | FTW_ACTIONRETVAL) == -1) {
+		report ("nftw failed\n");
+		r = -1;
+	}
+
+	flush_pending ();
+	free (cur->pending);
+	cur->pending = NULL;
+
+	walked = 1;
+
+	if (cur->n_late)
+		backup_late ();
+
+	if (cur->n_deferred)
+		retry_deferred ();
+
+	walked = 0;
+
+	/* directory times are only final once the sinks are done here */
+	for (tc = rc; tc; tc = tc->mirror) {
+		if (tc->sink)
+			sink_sync (tc->sink);
+	}
+
+	/* the collision slots are kept for the next run by park_slots() */
+	for (tc = rc; tc; tc = tc->mirror) {
+		cur = tc;
+		fix_dirs ();
+	}
+
+	cur = NULL;
+
+	return (r);
+}
+
+void *
+lane_main (void *arg)
+{
+	struct lane *lp;
+	struct root_ctx *rc;
+	struct fan_op *op;
+	int idx, n_sinks;
+
+	lp = arg;
+
+	set_ioprio ();
+
+	n_sinks = 0;
+	if (bk->n_targets > 1) {
+		lp->sinks = xcalloc (bk->n_targets, sizeof *lp->sinks);
+
+		for (; n_sinks < bk->n_targets; n_sinks++) {
+			pthread_mutex_init (&lp->sinks[n_sinks].lock, NULL);
+			pthread_cond_init (&lp->sinks[n_sinks].cond, NULL);
+
+			if (start_thread (&lp->sinks[n_sinks].thread,
+					  sink_main, &lp->sinks[n_sinks]) != 0) {
+				report ("failed to start sink: %m\n");
+				pthread_mutex_destroy (&lp->sinks[n_sinks].lock);
+				pthread_cond_destroy (&lp->sinks[n_sinks].cond);
+				lp->status = -1;
+				break;
+			}
+		}
+	}
+
+	for (rc = lp->first_root; rc && !lp->status; rc = rc->lane_next) {
+		if (backup_root_ctx (rc) == -1)
+			lp->status = -1;
+	}
+
+	for (idx = 0; idx < n_sinks; idx++) {
+		op = fan_op_new (FAN_QUIT, NULL);
+		sink_push (&lp->sinks[idx], op);
+		pthread_join (lp->sinks[idx].thread, NULL);
+		pthread_mutex_destroy (&lp->sinks[idx].lock);
+		pthread_cond_destroy (&lp->sinks[idx].cond);
+	}
+	free (lp->sinks);
+	lp->sinks = NULL;
+
+	seal_links (lp);
+
+	return (NULL);
+}
+
+/* YYYY-MM-DD, optionally followed by a -xx collision suffix */
+int
+is_branch_name (const char *name)
+{
+	static const char pat[] = "dddd-dd-dd";
+	int idx;
+
+	for (idx = 0; pat[idx]; idx++) {
+		if (pat[idx] == 'd' ? !isdigit ((unsigned char) name[idx])
+		    : name[idx] != pat[idx])
+			return (0);
+	}
+
+	if (name[idx] == 0)
+		return (1);
+
+	return (name[idx] == '-' && islower ((unsigned char) name[idx + 1])
+		&& islower ((unsigned char) name[idx + 2])
+		&& name[idx + 3] == 0);
+}
+
+/*
+ * where the newest/ link fpath with target tar leads, as a path below
+ * the backup root into rel of PATH_MAX bytes; -1 if it leads elsewhere.
+ * both ends are taken with links and dots resolved, as the root may be
+ * named either way, but not the target's last component, which may be
+ * a stored link, nor what no longer exists, like a since packed file.
+ */
+int
+newest_rel (const char *fpath, const char *tar, char *rel)
+{
+	static __thread char root[PATH_MAX], real[PATH_MAX];
+	char buf[PATH_MAX], dir[PATH_MAX], *tail, *p;
+	int l;
+
+	if (strcmp (root, bk->backup_root) != 0) {
+		if (realpath (bk->backup_root, real) == NULL)
+			return (-1);
+		snprintf (root, sizeof root, "%s", bk->backup_root);
+	}
+
+	if (tar[0] == '/')
+		l = snprintf (buf, sizeof buf, "%s", tar);
+	else
+		l = snprintf (buf, sizeof buf, "%.*s/%s",
+			      (int) (strrchr (fpath, '/') - fpath), fpath, tar);
+	if (l >= sizeof buf)
+		return (-1);
+
+	/* the longest leading directory there is, and the rest as named */
+	for (tail = strrchr (buf, '/'); ; tail = p) {
+		*tail = 0;
+		if (realpath (buf[0] ? buf : "/", dir) != NULL)
+			break;
+		if (errno != ENOENT || (p = strrchr (buf, '/')) == NULL)
+			return (-1);
+		*tail = '/';
+	}
+
+	l = strlen (real);
+	if (strncmp (dir, real, l) != 0 || (dir[l] != '/' && dir[l] != 0))
+		return (-1);
+
+	if (snprintf (rel, PATH_MAX, "%s%s%s", dir[l] ? dir + l + 1 : "",
+		      dir[l] ? "/" : "", tail + 1) >= PATH_MAX)
+		return (-1);
+
+	return (0);
+}
+
+/* branches some newest/ link points into; filled by note_newest_ref */
+struct hash_table newest_refs;
+
+static int
+note_newest_ref (const char *fpath, const struct stat *sb,
+		 int tflag, struct FTW *ftwbuf)
+{
+	char tar[PATH_MAX], rel[PATH_MAX], *p, *e;
+	int r;
+
+	if (tflag != FTW_SL)
+		return (0);
+
+	if ((r = readlink (fpath, tar, sizeof tar - 1)) < 0) {
+		report ("failed to read link %s: %m\n", fpath);
+		return (0);
+	}
+	tar[r] = 0;
+
+	if (newest_rel (fpath, tar, rel) == -1)
+		return (0);
+
+	p = rel;
+
+	/* a packed file's link names .bakim/KIND/SLOT.pack */
+	if (strncmp (p, ".bakim/", 7) == 0) {
+		if ((p = strrchr (p, '/')) == NULL
+		    || (e = strrchr (p, '.')) == NULL)
+			return (0);
+		p++;
+	} else if ((e = strchr (p, '/')) == NULL) {
+		e = p + strlen (p);
+	}
+
+	if (!hash_lookup (&newest_refs, p, e - p))
+		hash_insert (&newest_refs, p, e - p, NULL);
+
+	return (0);
+}
+
+/* strftime of fmt for the noon of date, to bucket dates by period */
+void
+date_key (const char *date, const char *fmt, char *key, int size)
+{
+	struct tm tm;
+
+	memset (&tm, 0, sizeof tm);
+	sscanf (date, "%d-%d-%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday);
+	tm.tm_year -= 1900;
+	tm.tm_mon--;
+	tm.tm_hour = 12;
+	tm.tm_isdst = -1;
+
+	mktime (&tm);
+	strftime (key, size, fmt, &tm);
+}
+
+/*
+ * bds is sorted newest first.  keep the newest date in each of the
+ * count most recent periods, as named by fmt.
+ */
+int
+keep_by_period (struct branch_date *bds, int n, const char *fmt, int count)
+{
+	char key[32], last[32];
+	int idx;
+
+	last[0] = 0;
+
+	for (idx = 0; idx < n && count > 0; idx++) {
+		date_key (bds[idx].date, fmt, key, sizeof key);
+
+		if (strcmp (key, last) == 0)
+			continue;
+
+		strcpy (last, key);
+		bds[idx].keep = 1;
+		count--;
+	}
+
+	return (0);
+}
+
+static int
+cmp_str (const void *a, const void *b)
+{
+	return (strcmp (*(char * const *) a, *(char * const *) b));
+}
+
+static int
+cmp_branch_date (const void *a, const void *b)
+{
+	return (strcmp (((const struct branch_date *) b)->date,
+			((const struct branch_date *) a)->date));
+}
+
+int
+cmd_prune (int argc, char **argv)
+{
+	int c, idx, jdx, n_daily, n_weekly, n_monthly, dry_run, jobs;
+	int n_bds, n_doomed, l, scan_failed;
+	DIR *dir;
+	struct dirent *de;
+	struct branch_date *bds, *bd;
+	char **doomed, *name;
+	struct hash_table gone;
+
+	n_daily = n_weekly = n_monthly = -1;
+	dry_run = 0;
+	jobs = sysconf (_SC_NPROCESSORS_ONLN);
+
+	while ((c = getopt (argc, argv, "d:w:m:nj:")) != EOF) {
+		switch (c) {
+		case 'd':
+			n_daily = atoi (optarg);
+			break;
+		case 'w':
+			n_weekly = atoi (optarg);
+			break;
+		case 'm':
+			n_monthly = atoi (optarg);
+			break;
+		case 'n':
+			dry_run = 1;
+			break;
+		case 'j':
+			jobs = atoi (optarg);
+			break;
+		default:
+			usage ();
+		}
+	}
+
+	if (optind != argc || (n_daily < 0 && n_weekly < 0 && n_monthly < 0))
+		usage ();
+
+	if (jobs < 1)
+		jobs = 1;
+
+	if ((dir = opendir (bk->backup_root)) == NULL) {
+		report ("failed to open %s: %m\n", bk->backup_root);
+		return (1);
+	}
+
+	bds = NULL;
+	n_bds = 0;
+
+	while ((de = readdir (dir)) != NULL) {
+		if (!is_branch_name (de->d_name))
+			continue;
+
+		for (idx = 0; idx < n_bds; idx++) {
+			if (strncmp (bds[idx].date, de->d_name, 10) == 0)
+				break;
+		}
+
+		if (idx == n_bds) {
+			bds = realloc (bds, (n_bds + 1) * sizeof *bds);
+			if (!bds) {
+				report ("out of memory\n");
+				exit (1);
+			}
+			memset (&bds[idx], 0, sizeof *bds);
+			memcpy (bds[idx].date, de->d_name, 10);
+			n_bds++;
+		}
+
+		bd = &bds[idx];
+		bd->dirs = realloc (bd->dirs, (bd->n_dirs + 1)
+				    * sizeof *bd->dirs);
+		if (!bd->dirs) {
+			report ("out of memory\n");
+			exit (1);
+		}
+		bd->dirs[bd->n_dirs++] = xstrdup (de->d_name);
+	}
+
+	closedir (dir);
+
+	qsort (bds, n_bds, sizeof *bds, cmp_branch_date);
+
+	if (n_daily > 0)
+		keep_by_period (bds, n_bds, "%F", n_daily);
+	if (n_weekly > 0)
+		keep_by_period (bds, n_bds, "%G-%V", n_weekly);
+	if (n_monthly > 0)
+		keep_by_period (bds, n_bds, "%Y-%m", n_monthly);
+
+	l = strlen (bk->backup_root) + strlen ("newest") + 10;
+	name = xcalloc (1, l);
+	sprintf (name, "%s/newest", bk->backup_root);
+
+	/* without knowing what newest/ still uses, nothing may go */
+	scan_failed = 0;
+	if (nftw (name, note_newest_ref, MAX_DIRS_OPEN, FTW_PHYS) == -1
+	    && errno != ENOENT) {
+		report ("failed to scan %s: %m\n", name);
+		scan_failed = 1;
+		for (idx = 0; idx < n_bds; idx++)
+			bds[idx].keep = 1;
+	}
+
+	free (name);
+
+	doomed = NULL;
+	n_doomed = 0;
+
+	for (idx = 0; idx < n_bds; idx++) {
+		bd = &bds[idx];
+
+		for (jdx = 0; jdx < bd->n_dirs; jdx++) {
+			if (bd->keep || hash_lookup (&newest_refs, bd->dirs[jdx],
+						     strlen (bd->dirs[jdx]))) {
+				free (bd->dirs[jdx]);
+				continue;
+			}
+
+			l = strlen (bk->backup_root)
+			    + strlen (bd->dirs[jdx]) + 2;
+			name = xcalloc (1, l);
+			sprintf (name, "%s/%s", bk->backup_root,
+				 bd->dirs[jdx]);
+			free (bd->dirs[jdx]);
+
+			printf ("%s %s\n", dry_run ? "would remove" : "removing",
+				name);
+
+			doomed = realloc (doomed, (n_doomed + 1)
+					  * sizeof *doomed);
+			if (!doomed) {
+				report ("out of memory\n");
+				exit (1);
+			}
+			doomed[n_doomed++] = name;
+		}
+
+		free (bd->dirs);
+	}
+
+	free (bds);
+	hash_clear (&newest_refs);
+
+	c = 0;
+
+	if (!dry_run && n_doomed)
+		c = remove_trees (doomed, n_doomed, jobs);
+
+	memset (&gone, 0, sizeof gone);
+
+	for (idx = 0; idx < n_doomed; idx++) {
+		if (!dry_run) {
+			name = doomed[idx] + strlen (bk->backup_root) + 1;
+			forget_branch (name);
+			hash_insert (&gone, name, strlen (name), NULL);
+		}
+		free (doomed[idx]);
+	}
+	free (doomed);
+
+	if (gone.count) {
+		index_update (&gone);
+		hash_clear (&gone);
+		if (chunk_gc () == -1)
+			scan_failed = 1;
+	}
+
+	if (c) {
+		report ("%d entries could not be removed\n", c);
+		return (1);
+	}
+
+	return (scan_failed);
+}
+
+/* charge a new entry in backup_path to that branch's accounting */
+void
+acct_add (const char *backup_path, long long files, long long bytes,
+	  long long shared)
+{
+	struct hash_entry *hp;
+	struct acct *ap;
+
+	pthread_mutex_lock (&bk->acct_lock);
+
+	if ((hp = hash_lookup (&bk->accts, backup_path,
+			       strlen (backup_path))) == NULL)
+		hp = hash_insert (&bk->accts, backup_path,
+				  strlen (backup_path),
+				  xcalloc (1, sizeof (struct acct)));
+
+	ap = hp->val;
+	ap->files += files;
+	ap->bytes += bytes;
+	ap->shared += shared;
+
+	pthread_mutex_unlock (&bk->acct_lock);
+}
+
+/* returns -1 if the accounting file fn does not exist yet */
+int
+acct_load (const char *fn, struct acct *ap)
+{
+	FILE *f;
+	int r;
+
+	memset (ap, 0, sizeof *ap);
+
+	if ((f = fopen (fn, "r")) == NULL)
+		return (-1);
+
+	r = fscanf (f, "files %lld bytes %lld shared %lld", &ap->files,
+		    &ap->bytes, &ap->shared);
+	fclose (f);
+
+	return (r == 3 ? 0 : -1);
+}
+
+/* replace the accounting file fn, atomically */
+int
+acct_store (const char *fn, const struct acct *ap)
+{
+	FILE *f;
+	char *tmp;
+	int r;
+
+	tmp = xcalloc (1, strlen (fn) + 10);
+	sprintf (tmp, "%s.tmp", fn);
+
+	r = -1;
+
+	if ((f = meta_fopen (tmp, "w")) != NULL) {
+		fprintf (f, "files %lld\nbytes %lld\nshared %lld\n",
+			 ap->files, ap->bytes, ap->shared);
+		if (fclose (f) == 0 && rename (tmp, fn) == 0)
+			r = 0;
+	}
+
+	if (r == -1)
+		report ("failed to write %s: %m\n", fn);
+
+	free (tmp);
+
+	return (r);
+}
+
+/*
+ * flock path, a directory or file, for as long as the returned fd is
+ * open; -1 if it can't be opened or locked
+ */
+int
+lock_path (const char *path, int op)
+{
+	int fd;
+
+	if ((fd = open (path, O_RDONLY | O_CLOEXEC)) == -1)
+		return (-1);
+
+	while (flock (fd, op) == -1) {
+		if (errno != EINTR) {
+			close (fd);
+			return (-1);
+		}
+	}
+
+	return (fd);
+}
+
+/*
+ * accounting files are read, added to and replaced, so every writer
+ * holds their directory exclusively meanwhile
+ */
+int
+lock_dir_of (const char *fn)
+{
+	char *dir;
+	int fd;
+
+	dir = xstrdup (fn);
+	*strrchr (dir, '/') = '\0';
+	fd = lock_path (dir, LOCK_EX);
+	free (dir);
+
+	return (fd);
+}
+
+/* returns -1 if the branch has never been accounted */
+int
+acct_read (const char *branch, struct acct *ap)
+{
+	char *fn;
+	int r;
+
+	fn = meta_path ("acct", branch);
+	r = acct_load (fn, ap);
+	free (fn);
+
+	return (r);
+}
+
+/* replace a branch's accounting file, atomically */
+int
+acct_write (const char *branch, const struct acct *ap)
+{
+	char *fn;
+	int r, lock;
+
+	fn = meta_path ("acct", branch);
+	lock = lock_dir_of (fn);
+	r = acct_store (fn, ap);
+	if (lock != -1)
+		close (lock);
+	free (fn);
+
+	return (r);
+}
+
+/* fold this run's additions into the accounting files */
+void
+acct_flush_all (void)
+{
+	unsigned long idx;
+	struct hash_entry *hp;
+	struct acct *ap, old;
+	char *fn;
+	int lock;
+
+	for (idx = 0; idx < bk->accts.size; idx++) {
+		for (hp = bk->accts.buckets[idx]; hp; hp = hp->next) {
+			ap = hp->val;
+			fn = slot_meta_path (hp->key, "acct", NULL);
+			if ((lock = lock_dir_of (fn)) == -1)
+				report ("failed to lock the accounting"
+					" of %s: %m\n", hp->key);
+			acct_load (fn, &old);
+			ap->files += old.files;
+			ap->bytes += old.bytes;
+			ap->shared += old.shared;
+			acct_store (fn, ap);
+			if (lock != -1)
+				close (lock);
+			free (fn);
+			free (ap);
+		}
+	}
+
+	hash_clear (&bk->accts);
+}
+
+/* drop the bookkeeping kept for a branch that no longer exists */
+void
+forget_branch (const char *branch)
+{
+	char *fn;
+
+	fn = meta_path ("manifest", branch);
+	unlink (fn);
+	free (fn);
+
+	fn = meta_path ("acct", branch);
+	unlink (fn);
+	free (fn);
+
+	fn = pack_path ("pack", branch, "pack");
+	unlink_entry_at (AT_FDCWD, fn);
+	free (fn);
+
+	fn = pack_path ("pack", branch, "idx");
+	unlink_entry_at (AT_FDCWD, fn);
+	free (fn);
+
+	fn = pack_path ("recipe", branch, "pack");
+	unlink_entry_at (AT_FDCWD, fn);
+	free (fn);
+
+	fn = pack_path ("recipe", branch, "idx");
+	unlink_entry_at (AT_FDCWD, fn);
+	free (fn);
+
+	fn = meta_path ("parity", branch);
+	delete_file_or_dir (fn);
+	free (fn);
+}
+
+/*
+ * the directories making up a branch: just name if it carries a slot
+ * suffix, otherwise the date and all its -xx slots, in slot order.
+ */
+int
+branch_slots (const char *name, char ***slots)
+{
+	DIR *dir;
+	struct dirent *de;
+	int n;
+
+	if (!is_branch_name (name))
+		return (-1);
+
+	*slots = xcalloc (1, sizeof **slots);
+	(*slots)[0] = xstrdup (name);
+	n = 1;
+
+	if (strlen (name) > 10)
+		return (n);
+
+	if ((dir = opendir (bk->backup_root)) == NULL)
+		return (n);
+
+	while ((de = readdir (dir)) != NULL) {
+		if (strlen (de->d_name) != 13 || !is_branch_name (de->d_name)
+		    || strncmp (de->d_name, name, 10) != 0)
+			continue;
+
+		*slots = realloc (*slots, (n + 1) * sizeof **slots);
+		if (!*slots) {
+			report ("out of memory\n");
+			exit (1);
+		}
+		(*slots)[n++] = xstrdup (de->d_name);
+	}
+
+	closedir (dir);
+
+	qsort (*slots + 1, n - 1, sizeof **slots, cmp_str);
+
+	return (n);
+}
+
+/* what was taken from a newer slot while slot_merge is set */
+struct hash_table slot_seen;
+int slot_merge;
+
+/*
+ * when a date's slots are walked newest first, 1 if path already came
+ * from a newer one, else 0 and it is noted as taken.
+ */
+int
+slot_taken (const char *path)
+{
+	int l;
+
+	if (!slot_merge)
+		return (0);
+
+	l = strlen (path);
+	if (hash_lookup (&slot_seen, path, l) != NULL)
+		return (1);
+	hash_insert (&slot_seen, path, l, NULL);
+
+	return (0);
+}
+
+/* the slots of branch, or just newest; -1 after a report if neither */
+int
+walk_slots (const char *branch, char ***slots)
+{
+	int n;
+
+	if (strcmp (branch, "newest") == 0) {
+		*slots = xcalloc (1, sizeof **slots);
+		(*slots)[0] = xstrdup (branch);
+		n = 1;
+	} else if ((n = branch_slots (branch, slots)) == -1) {
+		report ("%s is not a branch\n", branch);
+		return (-1);
+	}
+
+	slot_merge = n > 1;
+
+	return (n);
+}
+
+void
+free_slots (char **slots, int n)
+{
+	int idx;
+
+	for (idx = 0; idx < n; idx++)
+		free (slots[idx]);
+	free (slots);
+
+	hash_clear (&slot_seen);
+	slot_merge = 0;
+}
+
+void
+listing_add (struct listing *ls, const char *path, const struct stat *sb,
+	     int slot)
+{
+	struct list_entry *le;
+
+	if (ls->n == ls->alloc) {
+		ls->alloc = ls->alloc ? ls->alloc * 2 : 1024;
+		ls->ents = realloc (ls->ents, ls->alloc * sizeof *ls->ents);
+		if (!ls->ents) {
+			report ("out of memory\n");
+			exit (1);
+		}
+	}
+
+	le = &ls->ents[ls->n++];
+	le->path = xstrdup (path);
+	le->sb = *sb;
+	le->slot = slot;
+}
+
+/* a slot directory being listed by one worker */
+struct list_job {
+	struct list_job *next;
+	struct listing *ls, part;
+	int slot, skip;
+};
+
+static __thread struct list_job *cur_job;
+
+static int
+list_cb (const char *fpath, const struct stat *sb, int tflag,
+	 struct FTW *ftwbuf)
+{
+	if (ftwbuf->level == 0)
+		return (0);
+
+	listing_add (&cur_job->part, fpath + cur_job->skip, sb,
+		     cur_job->slot);
+
+	return (0);
+}
+
+pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+struct list_job *list_queue;
+
+void *
+list_worker (void *arg)
+{
+	struct list_job *jp;
+	char *dir;
+	const char **kind;
+	struct hash_table recs;
+	struct hash_entry *hp;
+	struct stat sb;
+	unsigned long idx;
+
+	while (1) {
+		pthread_mutex_lock (&list_lock);
+		if ((jp = list_queue) != NULL)
+			list_queue = jp->next;
+		pthread_mutex_unlock (&list_lock);
+
+		if (!jp)
+			break;
+
+		dir = xcalloc (1, strlen (bk->backup_root)
+			       + strlen (jp->ls->dirs[jp->slot]) + 2);
+		sprintf (dir, "%s/%s", bk->backup_root,
+			 jp->ls->dirs[jp->slot]);
+		jp->skip = strlen (dir) + 1;
+
+		cur_job = jp;
+		if (nftw (dir, list_cb, MAX_DIRS_OPEN, FTW_PHYS) == -1)
+			report ("failed to walk %s: %m\n", dir);
+		cur_job = NULL;
+
+		/* packed and chunked files, which have no entry in the tree */
+		for (kind = pack_kinds; *kind; kind++) {
+			memset (&recs, 0, sizeof recs);
+			if (pack_load (*kind, jp->ls->dirs[jp->slot],
+				       &recs) == -1)
+				continue;
+			for (idx = 0; idx < recs.size; idx++) {
+				for (hp = recs.buckets[idx]; hp;
+				     hp = hp->next) {
+					pack_rec_stat (hp->val, &sb);
+					listing_add (&jp->part, hp->key, &sb,
+						     jp->slot);
+					free (hp->val);
+				}
+			}
+			hash_clear (&recs);
+		}
+
+		free (dir);
+	}
+
+	return (NULL);
+}
+
+/*
+ * walk every slot directory of the given listings, one thread per
+ * directory up to the number of cpus, then sort each listing by path
+ * keeping only the entry from the newest slot.
+ */
+void
+list_branches (struct listing **lss, int n)
+{
+	struct list_job *jobs, *jp;
+	pthread_t threads[MAX_JOBS];
+	int idx, jdx, k, n_jobs, started, out;
+	struct listing *ls;
+
+	n_jobs = 0;
+	for (idx = 0; idx < n; idx++)
+		n_jobs += lss[idx]->n_dirs;
+
+	jobs = xcalloc (n_jobs, sizeof *jobs);
+
+	k = 0;
+	for (idx = 0; idx < n; idx++) {
+		for (jdx = 0; jdx < lss[idx]->n_dirs; jdx++) {
+			jp = &jobs[k++];
+			jp->ls = lss[idx];
+			jp->slot = jdx;
+			jp->next = list_queue;
+			list_queue = jp;
+		}
+	}
+
+	k = sysconf (_SC_NPROCESSORS_ONLN);
+	if (k > n_jobs)
+		k = n_jobs;
+	if (k > MAX_JOBS)
+		k = MAX_JOBS;
+
+	for (started = 0; started < k - 1; started++) {
+		if (start_thread (&threads[started], list_worker, NULL) != 0)
+			break;
+	}
+
+	list_worker (NULL);
+
+	for (idx = 0; idx < started; idx++)
+		pthread_join (threads[idx], NULL);
+
+	for (idx = 0; idx < n_jobs; idx++) {
+		jp = &jobs[idx];
+		for (jdx = 0; jdx < jp->part.n; jdx++) {
+			listing_add (jp->ls, jp->part.ents[jdx].path,
+				     &jp->part.ents[jdx].sb, jp->slot);
+			free (jp->part.ents[jdx].path);
+		}
+		free (jp->part.ents);
+	}
+
+	free (jobs);
+
+	for (idx = 0; idx < n; idx++) {
+		ls = lss[idx];
+
+		qsort (ls->ents, ls->n, sizeof *ls->ents, cmp_list_entry);
+
+		out = 0;
+		for (jdx = 0; jdx < ls->n; jdx++) {
+			if (jdx + 1 < ls->n && strcmp (ls->ents[jdx].path,
+					ls->ents[jdx + 1].path) == 0) {
+				free (ls->ents[jdx].path);
+				continue;
+			}
+			ls->ents[out++] = ls->ents[jdx];
+		}
+		ls->n = out;
+	}
+}
+
+static int
+cmp_list_entry (const void *a, const void *b)
+{
+	const struct list_entry *la, *lb;
+	int r;
+
+	la = a;
+	lb = b;
+
+	if ((r = strcmp (la->path, lb->path)) != 0)
+		return (r);
+
+	return (la->slot - lb->slot);
+}
+
+/* index the manifest checksums of every slot, keyed "slot path" */
+void
+load_listing_hashes (struct listing *ls)
+{
+	struct verify_file *files;
+	unsigned long long *hash;
+	char key[PATH_MAX + 20];
+	int idx, jdx, n;
+
+	for (idx = 0; idx < ls->n_dirs; idx++) {
+		if ((n = load_manifest (ls->dirs[idx], &files)) == -1)
+			continue;
+
+		ls->has_manifest = 1;
+
+		for (jdx = 0; jdx < n; jdx++) {
+			snprintf (key, sizeof key, "%d %s", idx,
+				  files[jdx].path);
+			hash = xcalloc (1, sizeof *hash);
+			*hash = files[jdx].hash;
+			hash_insert (&ls->hashes, key, strlen (key), hash);
+			free (files[jdx].path);
+		}
+
+		free (files);
+	}
+}
+
+/*
+ * check_same() on the two entries, plus the manifest checksums when
+ * both sides have one, which catches content changes stat can't see.
+ */
+int
+entry_changed (struct listing *a, struct list_entry *ea,
+	       struct listing *b, struct list_entry *eb)
+{
+	char a_path[PATH_MAX], b_path[PATH_MAX], key[PATH_MAX + 20];
+	struct hash_entry *ha, *hb;
+
+	if (strlen (bk->backup_root) + strlen (ea->path) + 100 >= PATH_MAX) {
+		report ("path exceeds PATH_MAX\n");
+		exit (1);
+	}
+
+	sprintf (a_path, "%s/%s/%s", bk->backup_root, a->dirs[ea->slot],
+		 ea->path);
+	sprintf (b_path, "%s/%s/%s", bk->backup_root, b->dirs[eb->slot],
+		 eb->path);
+
+	if (!check_same (&ea->sb, &eb->sb, a_path, b_path))
+		return (1);
+
+	if (!S_ISREG (ea->sb.st_mode) || !a->has_manifest || !b->has_manifest)
+		return (0);
+
+	snprintf (key, sizeof key, "%d %s", ea->slot, ea->path);
+	ha = hash_lookup (&a->hashes, key, strlen (key));
+	snprintf (key, sizeof key, "%d %s", eb->slot, eb->path);
+	hb = hash_lookup (&b->hashes, key, strlen (key));
+
+	if (ha && hb && *(unsigned long long *) ha->val
+	    != *(unsigned long long *) hb->val)
+		return (1);
+
+	return (0);
+}
+
+void
+free_listing (struct listing *ls)
+{
+	unsigned long idx;
+	struct hash_entry *hp;
+	int jdx;
+
+	for (jdx = 0; jdx < ls->n; jdx++)
+		free (ls->ents[jdx].path);
+	free (ls->ents);
+
+	for (jdx = 0; jdx < ls->n_dirs; jdx++)
+		free (ls->dirs[jdx]);
+	free (ls->dirs);
+
+	for (idx = 0; idx < ls->hashes.size; idx++) {
+		for (hp = ls->hashes.buckets[idx]; hp; hp = hp->next)
+			free (hp->val);
+	}
+	hash_clear (&ls->hashes);
+}
+
+/*
+ * list what changed going from branch A to branch B, as a merge join
+ * of the two sorted listings: "A path" for entries only in B, "D path"
+ * for entries only in A and "M path" where check_same() disagrees.
+ */
+int
+cmd_diff (int argc, char **argv)
+{
+	struct listing a, b, *lss[2];
+	int c, ia, ib, r, changes;
+
+	while ((c = getopt (argc, argv, "")) != EOF) {
+		switch (c) {
+		default:
+			usage ();
+		}
+	}
+
+	if (argc - optind != 2)
+		usage ();
+
+	memset (&a, 0, sizeof a);
+	memset (&b, 0, sizeof b);
+
+	if ((a.n_dirs = branch_slots (argv[optind], &a.dirs)) == -1
+	    || (b.n_dirs = branch_slots (argv[optind + 1], &b.dirs)) == -1) {
+		report ("branches are named YYYY-MM-DD[-xx]\n");
+		return (1);
+	}
+
+	lss[0] = &a;
+	lss[1] = &b;
+	list_branches (lss, 2);
+
+	load_listing_hashes (&a);
+	load_listing_hashes (&b);
+
+	ia = ib = changes = 0;
+
+	while (ia < a.n || ib < b.n) {
+		if (ia == a.n)
+			r = 1;
+		else if (ib == b.n)
+			r = -1;
+		else
+			r = strcmp (a.ents[ia].path, b.ents[ib].path);
+
+		if (r < 0) {
+			printf ("D %s\n", a.ents[ia++].path);
+			changes++;
+		} else if (r > 0) {
+			printf ("A %s\n", b.ents[ib++].path);
+			changes++;
+		} else {
+			if (entry_changed (&a, &a.ents[ia], &b, &b.ents[ib])) {
+				printf ("M %s\n", a.ents[ia].path);
+				changes++;
+			}
+			ia++;
+			ib++;
+		}
+	}
+
+	free_listing (&a);
+	free_listing (&b);
+
+	return (changes ? 1 : 0);
+}
+
+/*
+ * recompute the accounting of the given branch directories from
+ * scratch.  an inode seen under more than one name, in any of them,
+ * is charged once and shared after that.
+ */
+void
+acct_rebuild (char **branches, int n)
+{
+	struct listing *lss, **lsp;
+	struct list_entry *le;
+	struct hash_table inodes;
+	struct acct a;
+	char key[50];
+	int idx, jdx;
+
+	lss = xcalloc (n, sizeof *lss);
+	lsp = xcalloc (n, sizeof *lsp);
+
+	for (idx = 0; idx < n; idx++) {
+		lss[idx].dirs = xcalloc (1, sizeof *lss[idx].dirs);
+		lss[idx].dirs[0] = xstrdup (branches[idx]);
+		lss[idx].n_dirs = 1;
+		lsp[idx] = &lss[idx];
+	}
+
+	list_branches (lsp, n);
+
+	memset (&inodes, 0, sizeof inodes);
+
+	for (idx = 0; idx < n; idx++) {
+		memset (&a, 0, sizeof a);
+
+		for (jdx = 0; jdx < lss[idx].n; jdx++) {
+			le = &lss[idx].ents[jdx];
+
+			if (S_ISLNK (le->sb.st_mode)) {
+				a.files++;
+				continue;
+			}
+
+			if (!S_ISREG (le->sb.st_mode))
+				continue;
+
+			a.files++;
+
+			if (le->sb.st_nlink > 1) {
+				sprintf (key, "%llx",
+					 (unsigned long long) le->sb.st_ino);
+				if (hash_lookup (&inodes, key, strlen (key))) {
+					a.shared += le->sb.st_size;
+					continue;
+				}
+				hash_insert (&inodes, key, strlen (key), NULL);
+			}
+
+			a.bytes += le->sb.st_size;
+		}
+
+		acct_write (branches[idx], &a);
+		free_listing (&lss[idx]);
+	}
+
+	hash_clear (&inodes);
+	free (lss);
+	free (lsp);
+}
+
+/*
+ * report the files and bytes stored in each branch and collision slot
+ * from the accounting kept as bakim copies, or rebuild that accounting
+ * (-r) with a parallel walk of the branches.
+ */
+int
+cmd_df (int argc, char **argv)
+{
+	int c, idx, n, rebuild;
+	char **branches;
+	struct acct a, total;
+	DIR *dir;
+	struct dirent *de;
+
+	rebuild = 0;
+
+	while ((c = getopt (argc, argv, "r")) != EOF) {
+		switch (c) {
+		case 'r':
+			rebuild = 1;
+			break;
+		default:
+			usage ();
+		}
+	}
+
+	branches = NULL;
+	n = 0;
+
+	if (optind < argc) {
+		for (idx = optind; idx < argc; idx++) {
+			if (!is_branch_name (argv[idx])) {
+				report ("branches are named"
+					" YYYY-MM-DD[-xx]\n");
+				return (1);
+			}
+		}
+		branches = argv + optind;
+		n = argc - optind;
+	} else {
+		if ((dir = opendir (bk->backup_root)) == NULL) {
+			report ("failed to open %s: %m\n",
+				bk->backup_root);
+			return (1);
+		}
+
+		while ((de = readdir (dir)) != NULL) {
+			if (!is_branch_name (de->d_name))
+				continue;
+			branches = realloc (branches, (n + 1)
+					    * sizeof *branches);
+			if (!branches) {
+				report ("out of memory\n");
+				exit (1);
+			}
+			branches[n++] = xstrdup (de->d_name);
+		}
+
+		closedir (dir);
+	}
+
+	qsort (branches, n, sizeof *branches, cmp_str);
+
+	if (rebuild)
+		acct_rebuild (branches, n);
+
+	memset (&total, 0, sizeof total);
+
+	printf ("%-16s %12s %16s %16s\n", "branch", "files", "bytes",
+		"shared");
+
+	for (idx = 0; idx < n; idx++) {
+		if (acct_read (branches[idx], &a) == -1) {
+			printf ("%-16s %12s %16s %16s\n", branches[idx], "-",
+				"-", "-");
+			continue;
+		}
+
+		printf ("%-16s %12lld %16lld %16lld\n", branches[idx],
+			a.files, a.bytes, a.shared);
+
+		total.files += a.files;
+		total.bytes += a.bytes;
+		total.shared += a.shared;
+	}
+
+	printf ("%-16s %12lld %16lld %16lld\n", "total", total.files,
+		total.bytes, total.shared);
+
+	return (0);
+}
+
+/* every branch and collision slot directory, sorted */
+int
+list_all_branches (char ***branches)
+{
+	DIR *dir;
+	struct dirent *de;
+	int n;
+
+	*branches = NULL;
+	n = 0;
+
+	if ((dir = opendir (bk->backup_root)) == NULL) {
+		report ("failed to open %s: %m\n", bk->backup_root);
+		return (-1);
+	}
+
+	while ((de = readdir (dir)) != NULL) {
+		if (!is_branch_name (de->d_name))
+			continue;
+		*branches = realloc (*branches, (n + 1) * sizeof **branches);
+		if (!*branches) {
+			report ("out of memory\n");
+			exit (1);
+		}
+		(*branches)[n++] = xstrdup (de->d_name);
+	}
+
+	closedir (dir);
+
+	qsort (*branches, n, sizeof **branches, cmp_str);
+
+	return (n);
+}
+
+/* add root to the targets a backup run writes to */
+struct target *
+add_target (const char *root)
+{
+	struct target *t;
+
+	if (bk->n_targets == MAX_TARGETS) {
+		report ("too many backup roots, at most %d\n",
+			MAX_TARGETS);
+		exit (1);
+	}
+
+	t = xcalloc (1, sizeof *t);
+	t->root = xstrdup (root);
+	t->idx = bk->n_targets++;
+	t->lock = -1;
+
+	if (bk->last_target)
+		bk->last_target->next = t;
+	else
+		bk->first_target = t;
+	bk->last_target = t;
+
+	return (t);
+}
+
+/*
+ * a run holds each target's root shared while it lasts, and chunk_gc
+ * holds it exclusively, so no chunk is swept between being found in
+ * the store and being named by the recipe that needs it
+ */
+int
+lock_targets (void)
+{
+	struct target *t;
+
+	for (t = bk->first_target; t; t = t->next) {
+		if (t->lock != -1)
+			continue;
+		if ((t->lock = lock_path (t->root, LOCK_SH)) == -1) {
+			report ("failed to lock %s: %m\n", t->root);
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
+void
+unlock_targets (void)
+{
+	struct target *t;
+
+	for (t = bk->first_target; t; t = t->next) {
+		if (t->lock != -1)
+			close (t->lock);
+		t->lock = -1;
+	}
+}
+
+/*
+ * set up newest, today's branch and the .bakim bookkeeping under each
+ * target, for a run that writes to them.
+ */
+int
+open_branch (void)
+{
+	int l;
+	char *p;
+	time_t rawtime;
+	struct tm *timeinfo;
+	struct target *t;
+
+	if (lock_targets () == -1)
+		return (-1);
+
+	time (&rawtime);
+	timeinfo = localtime (&rawtime);
+
+	l = strlen ("1970-01-01") + 100;
+	if ((bk->backup_branch = calloc (1, l)) == NULL) {
+		report ("failed to allocate backup_branch\n");
+		return (-1);
+	}
+	sprintf (bk->backup_branch, "%04d-%02d-%02d", timeinfo->tm_year + 1900,
+		 timeinfo->tm_mon + 1, timeinfo->tm_mday);
+
+	for (t = bk->first_target; t; t = t->next) {
+		l = strlen (t->root) + strlen ("newest") + 10;
+		if ((t->newest = calloc (1, l)) == NULL) {
+			report ("failed to allocate newest\n");
+			return (-1);
+		}
+
+		sprintf (t->newest, "%s/%s", t->root, "newest");
+
+		if (make_dir (t->newest, 0755) == -1) {
+			if (errno != EEXIST) {
+				report ("failed to create directory"
+					" %s: %m\n", t->newest);
+				return (-1);
+			}
+		}
+
+		l = strlen (t->root) + strlen (bk->backup_branch) + 100;
+		if ((t->directory = calloc (1, l)) == NULL) {
+			report ("failed to allocate backup_directory\n");
+			return (-1);
+		}
+		sprintf (t->directory, "%s/%s", t->root, bk->backup_branch);
+
+		if (make_dir (t->directory, 0755) == -1) {
+			if (errno != EEXIST) {
+				report ("failed to create directory"
+					" %s: %m\n", t->directory);
+				return (-1);
+			}
+		}
+
+		if (lchown (t->directory, 0, 0) == -1) {
+			report ("failed to chown %s: %m\n",
+				t->directory);
+		}
+
+		p = xcalloc (1, strlen (t->root) + 30);
+
+		sprintf (p, "%s/.bakim", t->root);
+		make_dir (p, 0755);
+
+		sprintf (p, "%s/.bakim/manifest", t->root);
+		make_dir (p, 0755);
+
+		sprintf (p, "%s/.bakim/acct", t->root);
+		make_dir (p, 0755);
+
+		if (bk->chunk_threshold) {
+			sprintf (p, "%s/.bakim/chunks", t->root);
+			make_dir (p, 0755);
+		}
+
+		free (p);
+	}
+
+	return (0);
+}
+
+/*
+ * open today's branch, or a new one when the day has changed since it
+ * was opened, as it does under bakim watch and the library
+ */
+int
+check_branch (void)
+{
+	char today[32];
+	struct target *t;
+	struct tm tm;
+	time_t now;
+
+	time (&now);
+	localtime_r (&now, &tm);
+	sprintf (today, "%04d-%02d-%02d", tm.tm_year + 1900, tm.tm_mon + 1,
+		 tm.tm_mday);
+
+	if (bk->backup_branch && strcmp (today, bk->backup_branch) == 0)
+		return (lock_targets ());
+
+	drop_slots ();
+
+	for (t = bk->first_target; t; t = t->next) {
+		free (t->newest);
+		free (t->directory);
+		t->newest = t->directory = NULL;
+	}
+	free (bk->backup_branch);
+	bk->backup_branch = NULL;
+
+	if (open_branch () == -1) {
+		free (bk->backup_branch);
+		bk->backup_branch = NULL;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * the options a backup run takes, shared by bakim watch and the
+ * library.  -1 for an unknown option or a bad value.
+ */
+int
+backup_option (int c, char *arg)
+{
+	unsigned long long v;
+
+	switch (c) {
+	case 'o':
+		if (strcmp (arg, "auto") == 0)
+			bk->read_order = ORDER_AUTO;
+		else if (strcmp (arg, "none") == 0)
+			bk->read_order = ORDER_NONE;
+		else if (strcmp (arg, "inode") == 0)
+			bk->read_order = ORDER_INODE;
+		else if (strcmp (arg, "extent") == 0)
+			bk->read_order = ORDER_EXTENT;
+		else
+			return (-1);
+		break;
+	case 'c':
+		if (strcmp (arg, "idle") == 0) {
+			bk->io_class = IOPRIO_CLASS_IDLE;
+		} else if (strncmp (arg, "be", 2) == 0) {
+			bk->io_class = IOPRIO_CLASS_BE;
+			bk->io_level = 4;
+			if (arg[2] == ':')
+				bk->io_level = atoi (arg + 3);
+			if (bk->io_level < 0 || bk->io_level > 7)
+				return (-1);
+		} else {
+			return (-1);
+		}
+		break;
+	case 'R':
+		if (size_arg (arg, &v) == -1)
+			return (-1);
+		bk->read_limit.rate = v;
+		break;
+	case 'W':
+		if (size_arg (arg, &v) == -1)
+			return (-1);
+		bk->write_limit.rate = v;
+		break;
+	case 'M':
+		bk->meta_limit.rate = atoi (arg);
+		break;
+	case 'L':
+		bk->latency_limit_ms = atoi (arg);
+		break;
+	case 'P':
+		if (size_arg (arg, &v) == -1)
+			return (-1);
+		bk->pack_threshold = v;
+		break;
+	case 'C':
+		if (size_arg (arg, &v) == -1)
+			return (-1);
+		bk->chunk_threshold = v;
+		break;
+	case 'Z':
+		bk->chunk_level = atoi (arg);
+		if (bk->chunk_level < 1 || bk->chunk_level > 9)
+			return (-1);
+		break;
+	case 'V':
+		if (strcmp (arg, "sample") == 0)
+			bk->content_check = CONTENT_SAMPLE;
+		else if (strcmp (arg, "full") == 0)
+			bk->content_check = CONTENT_FULL;
+		else
+			return (-1);
+		break;
+	case 'D':
+		bk->defer_window = atoi (arg);
+		if (bk->defer_window < 0)
+			return (-1);
+		break;
+	case 'x':
+		filter_add (arg);
+		break;
+	case 'X':
+		return (filter_load (arg));
+	case 's':
+		return (parse_range (arg, 1, &bk->filter_min_size,
+				     &bk->filter_max_size));
+	case 'a':
+		return (parse_range (arg, 0, &bk->filter_min_age,
+				     &bk->filter_max_age));
+	case 'E':
+		bk->parity_blocks = atoi (arg);
+		if (bk->parity_blocks < 1 || bk->parity_blocks > RS_DATA)
+			return (-1);
+		break;
+	case 't':
+		bk->remote_cmd = arg;
+		break;
+	case 'b':
+		add_target (arg);
+		break;
+	default:
+		return (-1);
+	}
+
+	return (0);
+}
+
+/* every backup option back to its default */
+void
+options_reset (void)
+{
+	int idx;
+
+	bk->read_order = ORDER_AUTO;
+	bk->io_class = bk->io_level = 0;
+	bk->read_limit.rate = bk->write_limit.rate = bk->meta_limit.rate = 0;
+	bk->latency_limit_ms = 0;
+	bk->pack_threshold = bk->chunk_threshold = 0;
+	bk->chunk_level = 0;
+	bk->content_check = CONTENT_STAT;
+	bk->defer_window = -1;
+	bk->parity_blocks = 0;
+	bk->remote_cmd = NULL;
+
+	for (idx = 0; idx < bk->n_filter_rules; idx++)
+		free (bk->filter_rules[idx].pattern);
+	free (bk->filter_rules);
+	bk->filter_rules = NULL;
+	bk->n_filter_rules = 0;
+	hash_clear (&bk->filter_names);
+	hash_clear (&bk->filter_exts);
+	free (bk->filter_globs);
+	bk->filter_globs = NULL;
+	bk->n_filter_globs = 0;
+	bk->filter_min_size = bk->filter_max_size = -1;
+	bk->filter_min_age = bk->filter_max_age = -1;
+}
+
+/* check the options against each other and ready what they need */
+int
+backup_setup (void)
+{
+	if (bk->parity_blocks) {
+		if (bk->remote_cmd) {
+			report ("-E cannot be used with -t\n");
+			return (-1);
+		}
+		pthread_once (&gf_once, gf_init);
+	}
+
+	if (bk->defer_window >= 0 && bk->remote_cmd) {
+		report ("-D cannot be used with -t\n");
+		return (-1);
+	}
+
+	if (bk->content_check != CONTENT_STAT) {
+		if (bk->remote_cmd) {
+			report ("-V cannot be used with -t\n");
+			return (-1);
+		}
+		bk->sample_seed = time (NULL) ^ getpid ();
+	}
+
+	/* compressed files go through the chunk store */
+	if (bk->chunk_level && !bk->chunk_threshold)
+		bk->chunk_threshold = 1024 * 1024;
+
+	if (bk->chunk_threshold) {
+		if (bk->remote_cmd) {
+			report ("-C and -Z cannot be used with -t\n");
+			return (-1);
+		}
+		pthread_once (&gear_once, gear_init);
+	}
+
+	return (0);
+}
+
+int
+start_monitor (void)
+{
+	struct lane *lp;
+	struct stat sb;
+	pthread_t monitor;
+	struct target *t;
+
+	if (bk->latency_limit_ms <= 0)
+		return (0);
+
+	for (t = bk->first_target; t; t = t->next) {
+		if (lstat (t->root, &sb) == 0)
+			watch_dev (sb.st_dev);
+	}
+
+	for (lp = bk->first_lane; lp; lp = lp->next)
+		watch_dev (lp->dev);
+
+	if (start_thread (&monitor, latency_monitor, NULL) != 0) {
+		report ("failed to start latency monitor: %m\n");
+		return (-1);
+	}
+	pthread_detach (monitor);
+
+	return (0);
+}
+
+/* back up every root, one lane per source device */
+int
+run_lanes (void)
+{
+	struct lane *lp, *stop;
+	int status;
+
+	status = 0;
+
+	for (lp = bk->first_lane; lp; lp = lp->next)
+		lp->status = 0;
+
+	if (bk->first_lane && !bk->first_lane->next) {
+		lane_main (bk->first_lane);
+		status = bk->first_lane->status;
+	} else {
+		/* the lanes already going finish; the rest never start */
+		for (lp = bk->first_lane; lp; lp = lp->next) {
+			if (start_thread (&lp->thread, lane_main, lp) != 0) {
+				report ("failed to start lane: %m\n");
+				status = -1;
+				break;
+			}
+		}
+
+		for (stop = lp, lp = bk->first_lane; lp != stop;
+		     lp = lp->next) {
+			pthread_join (lp->thread, NULL);
+			if (lp->status)
+				status = lp->status;
+		}
+	}
+
+	return (status);
+}
+
+/*
+ * seal what the run wrote and fold it into the bookkeeping.  the path
+ * index is only rewritten when update_index is set; until then what it
+ * is missing waits in .bakim/journal.
+ */
+void
+finish_run (int update_index)
+{
+	struct target *t;
+
+	pack_seal_all ();
+	manifest_close_all ();
+	acct_flush_all ();
+
+	for (t = bk->first_target; t; t = t->next) {
+		bk->backup_root = t->root;
+		if (!update_index)
+			journal_save ();
+		else if (bk->n_journal || bk->journal_saved)
+			index_update (NULL);
+	}
+	bk->backup_root = bk->first_target->root;
+
+	if (update_index)
+		bk->journal_saved = 0;
+
+	/* between calls and watch batches chunk_gc may run */
+	unlock_targets ();
+}
+
+/* queue a changed path for the next batch, if it is under a root */
+void
+watch_note (const char *path)
+{
+	struct target *t;
+
+	for (t = bk->first_target; t; t = t->next) {
+		if (strncmp (path, t->root, strlen (t->root)) == 0)
+			return;
+	}
+
+	if (!root_of (path) || hash_lookup (&watch_seen, path, strlen (path)))
+		return;
+
+	hash_insert (&watch_seen, path, strlen (path), NULL);
+
+	if (n_watch == watch_alloc) {
+		watch_alloc = watch_alloc ? watch_alloc * 2 : 256;
+		watch_paths = realloc (watch_paths,
+				       watch_alloc * sizeof *watch_paths);
+		if (!watch_paths) {
+			report ("out of memory\n");
+			exit (1);
+		}
+	}
+
+	watch_paths[n_watch++] = xstrdup (path);
+
+	watch_last = time (NULL);
+	if (n_watch == 1)
+		watch_first = watch_last;
+}
+
+/*
+ * one fanotify mark per source filesystem, reporting the directory and
+ * name of each event.  that needs CAP_SYS_ADMIN and linux 5.9; without
+ * them this fails and the caller falls back to inotify.
+ */
+int
+watch_fanotify (void)
+{
+	struct root_ctx *rc;
+	int fd, n, idx;
+
+	fd = fanotify_init (FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME
+			    | FAN_CLOEXEC | FAN_NONBLOCK,
+			    O_RDONLY | O_LARGEFILE);
+	if (fd == -1)
+		return (-1);
+
+	for (n = 0, rc = bk->first_root; rc; rc = rc->next)
+		n++;
+
+	watch_fds = xcalloc (n + 1, sizeof *watch_fds);
+
+	for (idx = 0, rc = bk->first_root; rc; rc = rc->next, idx++) {
+		if (fanotify_mark (fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+				   FAN_CLOSE_WRITE | FAN_MOVED_TO | FAN_CREATE
+				   | FAN_ONDIR, AT_FDCWD, rc->path) == -1
+		    || (watch_fds[idx] = open (rc->path, O_RDONLY
+					       | O_DIRECTORY | O_CLOEXEC))
+		    == -1) {
+			while (idx--)
+				close (watch_fds[idx]);
+			free (watch_fds);
+			watch_fds = NULL;
+			close (fd);
+			return (-1);
+		}
+	}
+	watch_fds[idx] = -1;
+
+	return (fd);
+}
+
+void
+watch_fanotify_read (int fd)
+{
+	char buf[WATCH_BUFSIZE] __attribute__ ((aligned (8)));
+	char path[PATH_MAX], proc[64];
+	struct fanotify_event_metadata *md;
+	struct fanotify_event_info_fid *fid;
+	struct file_handle *fh;
+	struct stat sb;
+	const char *name;
+	ssize_t n, l;
+	int idx, dfd;
+
+	while ((n = read (fd, buf, sizeof buf)) > 0) {
+		for (md = (struct fanotify_event_metadata *) buf;
+		     FAN_EVENT_OK (md, n); md = FAN_EVENT_NEXT (md, n)) {
+			if (md->mask & FAN_Q_OVERFLOW) {
+				watch_overflow = 1;
+				continue;
+			}
+
+			fid = (struct fanotify_event_info_fid *) (md + 1);
+			if (md->event_len < sizeof *md + sizeof *fid
+			    || fid->hdr.info_type
+			    != FAN_EVENT_INFO_TYPE_DFID_NAME)
+				continue;
+
+			fh = (struct file_handle *) fid->handle;
+			name = (const char *) fh->f_handle + fh->handle_bytes;
+
+			dfd = -1;
+			for (idx = 0; dfd == -1 && watch_fds[idx] != -1; idx++)
+				dfd = open_by_handle_at (watch_fds[idx], fh,
+							 O_PATH);
+			if (dfd == -1)
+				continue;
+
+			snprintf (proc, sizeof proc, "/proc/self/fd/%d", dfd);
+			l = readlink (proc, path, sizeof path - 1);
+			close (dfd);
+
+			if (l <= 0 || l + strlen (name) + 2 > sizeof path)
+				continue;
+			path[l] = '\0';
+
+			if (strcmp (name, ".") != 0)
+				sprintf (path + l, "/%s", name);
+
+			/*
+			 * a new file is noted once written, a symlink now.
+			 * events on one file merge, so look for a bare create.
+			 */
+			if ((md->mask & (FAN_CREATE | FAN_CLOSE_WRITE
+					 | FAN_MOVED_TO | FAN_ONDIR))
+			    == FAN_CREATE
+			    && (lstat (path, &sb) == -1
+				|| !S_ISLNK (sb.st_mode)))
+				continue;
+
+			watch_note (path);
+		}
+	}
+}
+
+static int
+watch_add_cb (const char *fpath, const struct stat *sb,
+	      int tflag, struct FTW *ftwbuf)
+{
+	struct hash_entry *hp;
+	struct target *t;
+	char key[16];
+	int wd;
+
+	if (tflag != FTW_D)
+		return (FTW_CONTINUE);
+
+	for (t = bk->first_target; t; t = t->next) {
+		if (strncmp (fpath, t->root, strlen (t->root)) == 0)
+			return (FTW_SKIP_SUBTREE);
+	}
+
+	if (filtered (fpath, sb, tflag, ftwbuf))
+		return (FTW_SKIP_SUBTREE);
+
+	wd = inotify_add_watch (watch_ifd, fpath, IN_CLOSE_WRITE | IN_MOVED_TO
+				| IN_CREATE | IN_ONLYDIR | IN_DONT_FOLLOW);
+	if (wd == -1) {
+		if (errno == ENOSPC && !watch_full) {
+			report ("out of inotify watches, changes below"
+				" %s are left to reconciliation\n", fpath);
+			watch_full = 1;
+		}
+		return (0);
+	}
+
+	/* a moved directory keeps its watch, under its new name */
+	sprintf (key, "%d", wd);
+	if ((hp = hash_lookup (&watch_wds, key, strlen (key))) != NULL) {
+		free (hp->val);
+		hp->val = xstrdup (fpath);
+	} else {
+		hash_insert (&watch_wds, key, strlen (key), xstrdup (fpath));
+	}
+
+	return (0);
+}
+
+/* a watch on every directory of every root */
+int
+watch_inotify (void)
+{
+	struct root_ctx *rc;
+
+	if ((watch_ifd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC)) == -1)
+		return (-1);
+
+	for (rc = bk->first_root; rc; rc = rc->next) {
+		cur = rc;
+		nftw (rc->path, watch_add_cb, MAX_DIRS_OPEN,
+		      FTW_PHYS | FTW_ACTIONRETVAL);
+	}
+	cur = NULL;
+
+	return (watch_ifd);
+}
+
+void
+watch_inotify_read (int fd)
+{
+	char buf[WATCH_BUFSIZE]
+		__attribute__ ((aligned (__alignof__ (struct inotify_event))));
+	char path[PATH_MAX], key[16];
+	struct inotify_event *ev;
+	struct hash_entry *hp;
+	struct stat sb;
+	ssize_t n;
+	char *p;
+
+	while ((n = read (fd, buf, sizeof buf)) > 0) {
+		for (p = buf; p < buf + n; p += sizeof *ev + ev->len) {
+			ev = (struct inotify_event *) p;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				watch_overflow = 1;
+				continue;
+			}
+
+			sprintf (key, "%d", ev->wd);
+			if (!ev->len || (hp = hash_lookup (&watch_wds, key,
+							   strlen (key)))
+			    == NULL)
+				continue;
+
+			if (snprintf (path, sizeof path, "%s/%s",
+				      (char *) hp->val, ev->name)
+			    >= (int) sizeof path)
+				continue;
+
+			if (ev->mask & IN_ISDIR) {
+				if ((cur = root_of (path)) != NULL)
+					nftw (path, watch_add_cb, MAX_DIRS_OPEN,
+					      FTW_PHYS | FTW_ACTIONRETVAL);
+				cur = NULL;
+			} else if ((ev->mask & IN_CREATE)
+				   && (lstat (path, &sb) == -1
+				       || !S_ISLNK (sb.st_mode))) {
+				continue;
+			}
+
+			watch_note (path);
+		}
+	}
+}
+
+void
+watch_stop_handler (int sig)
+{
+	watch_stop = 1;
+}
+
+/*
+ * back up what changed since the last batch, or everything when full.
+ * a batch that starts on a new day starts a new branch.
+ */
+int
+watch_batch (int full)
+{
+	struct root_ctx *rc;
+	int idx, status;
+
+	if (check_branch () == -1)
+		exit (1);
+
+	for (rc = bk->first_root; !full && rc; rc = rc->next)
+		rc->list_only = 1;
+
+	for (idx = 0; !full && idx < n_watch; idx++)
+		list_add (root_of (watch_paths[idx]), watch_paths[idx]);
+
+	status = run_lanes ();
+	finish_run (1);
+
+	if (bk->n_failed)
+		status = -1;
+	bk->n_failed = 0;
+
+	if (full)
+		printf ("%s: backed up all roots\n", bk->backup_branch);
+	else
+		printf ("%s: backed up %d changed paths\n", bk->backup_branch,
+			n_watch);
+	fflush (stdout);
+
+	for (rc = bk->first_root; rc; rc = rc->next) {
+		free (rc->list);
+		rc->list = NULL;
+		rc->n_list = rc->list_alloc = 0;
+		rc->list_only = 0;
+	}
+
+	for (idx = 0; idx < n_watch; idx++)
+		free (watch_paths[idx]);
+	n_watch = 0;
+	hash_clear (&watch_seen);
+	watch_overflow = 0;
+
+	/* nothing may tell us when a busy file is done, so ask again */
+	for (idx = 0; idx < bk->n_busy; idx++) {
+		watch_note (bk->busy_paths[idx]);
+		free (bk->busy_paths[idx]);
+	}
+	bk->n_busy = 0;
+
+	return (status);
+}
+
+/*
+ * bakim watch: back up the roots once, then keep backing up whatever is
+ * written, moved in or created below them.  changes are batched until
+ * the roots have been quiet for SETTLE seconds, or for at most
+ * WATCH_MAX_WAIT, and everything is walked again every RECONCILE
+ * seconds and whenever events were lost.
+ */
+int
+cmd_watch (int argc, char **argv)
+{
+	int c, idx, fd, status, settle, reconcile, inotify;
+	time_t now, due, next_full;
+	struct sigaction sa;
+	struct pollfd pfd;
+	struct root_ctx *rc;
+	struct target *t;
+	struct stat sb;
+	char *p;
+
+	settle = WATCH_SETTLE;
+	reconcile = WATCH_RECONCILE;
+
+	while ((c = getopt (argc, argv, "i:r:" BACKUP_OPTS)) != EOF) {
+		switch (c) {
+		case 'i':
+			settle = atoi (optarg);
+			break;
+		case 'r':
+			reconcile = atoi (optarg);
+			break;
+		default:
+			if (backup_option (c, optarg) == -1)
+				usage ();
+		}
+	}
+
+	if (optind >= argc)
+		usage ();
+
+	if (bk->remote_cmd) {
+		report ("-t cannot be used with watch\n");
+		return (1);
+	}
+
+	if (!bk->first_target)
+		add_target (bk->backup_root);
+	bk->backup_root = bk->first_target->root;
+
+	/* events name absolute paths, so the roots must be too */
+	for (idx = optind; idx < argc; idx++) {
+		if ((p = realpath (argv[idx], NULL)) == NULL) {
+			report ("cannot resolve %s: %m\n", argv[idx]);
+			return (1);
+		}
+		rc = add_root (p);
+		free (p);
+		if (rc == NULL)
+			return (1);
+	}
+
+	if (backup_setup () == -1 || open_branch () == -1
+	    || start_monitor () == -1)
+		return (1);
+
+	memset (&sa, 0, sizeof sa);
+	sa.sa_handler = watch_stop_handler;
+	sigaction (SIGINT, &sa, NULL);
+	sigaction (SIGTERM, &sa, NULL);
+
+	/*
+	 * a filesystem mark would also see everything written to a target
+	 * on the same filesystem, so those are watched with inotify.
+	 */
+	inotify = 0;
+	for (t = bk->first_target; t; t = t->next) {
+		for (rc = bk->first_root; rc; rc = rc->next) {
+			if (lstat (t->root, &sb) == 0 && sb.st_dev == rc->dev)
+				inotify = 1;
+		}
+	}
+
+	if (inotify || (fd = watch_fanotify ()) == -1) {
+		inotify = 1;
+		if ((fd = watch_inotify ()) == -1) {
+			report ("cannot watch for changes: %m\n");
+			return (1);
+		}
+	}
+
+	printf ("watching with %s\n", inotify ? "inotify" : "fanotify");
+
+	status = watch_batch (1);
+
+	next_full = reconcile > 0 ? time (NULL) + reconcile : 0;
+
+	while (!watch_stop) {
+		now = time (NULL);
+
+		due = next_full;
+		if (n_watch) {
+			if (!due || watch_last + settle < due)
+				due = watch_last + settle;
+			if (watch_first + WATCH_MAX_WAIT < due)
+				due = watch_first + WATCH_MAX_WAIT;
+		}
+		if (watch_overflow)
+			due = now;
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+
+		if (poll (&pfd, 1, !due ? -1 : due > now ? (due - now) * 1000
+			  : 0) == -1) {
+			if (errno == EINTR)
+				continue;
+			report ("poll failed: %m\n");
+			status = -1;
+			break;
+		}
+
+		if (pfd.revents & POLLIN) {
+			if (inotify)
+				watch_inotify_read (fd);
+			else
+				watch_fanotify_read (fd);
+		}
+
+		now = time (NULL);
+
+		if (watch_overflow || (next_full && now >= next_full)) {
+			if (watch_batch (1))
+				status = -1;
+			if (next_full)
+				next_full = time (NULL) + reconcile;
+		} else if (n_watch && (now - watch_last >= settle
+				       || now - watch_first >= WATCH_MAX_WAIT)) {
+			if (watch_batch (0))
+				status = -1;
+		}
+	}
+
+	if (n_watch && watch_batch (0))
+		status = -1;
+
+	close (fd);
+	valgrind_cleanup ();
+
+	return (status ? 1 : 0);
+}
+
+/*
+ * libbakim.  a context is a struct bakim of its own, which a call makes
+ * the calling thread's between bakim_enter() and bakim_leave().  calls
+ * on one context take turns; other contexts run alongside.
+ */
+void
+bakim_enter (struct bakim *b)
+{
+	pthread_mutex_lock (&b->lock);
+
+	bk = b;
+	bk->backup_root = bk->first_target->root;
+	bk->error[0] = '\0';
+}
+
+void
+bakim_leave (struct bakim *b)
+{
+	b->callbacks = NULL;
+	bk = &bakim_cli;
+
+	pthread_mutex_unlock (&b->lock);
+}
+
+/* report why the call is failing, from inside it; -1 */
+int
+bakim_fail (struct bakim *b, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start (ap, fmt);
+	vreport (fmt, ap);
+	va_end (ap);
+
+	return (-1);
+}
+
+struct bakim *
+bakim_open (const char *const *targets)
+{
+	struct bakim *b;
+	struct stat sb;
+	int idx;
+
+	/* there is no context to report to yet, so only errno says why */
+	for (idx = 0; targets && targets[idx]; idx++) {
+		if (stat (targets[idx], &sb) == -1)
+			return (NULL);
+		if (!S_ISDIR (sb.st_mode)) {
+			errno = ENOTDIR;
+			return (NULL);
+		}
+	}
+
+	if (idx > MAX_TARGETS) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	if ((b = calloc (1, sizeof *b)) == NULL)
+		return (NULL);
+
+	pthread_mutex_init (&b->lock, NULL);
+	pthread_mutex_init (&b->read_limit.lock, NULL);
+	pthread_mutex_init (&b->write_limit.lock, NULL);
+	pthread_mutex_init (&b->meta_limit.lock, NULL);
+	pthread_mutex_init (&b->pack_lock, NULL);
+	pthread_mutex_init (&b->busy_lock, NULL);
+	pthread_mutex_init (&b->note_lock, NULL);
+	pthread_mutex_init (&b->manifest_lock, NULL);
+	pthread_mutex_init (&b->acct_lock, NULL);
+	pthread_mutex_init (&b->journal_lock, NULL);
+
+	/* add_target() and options_reset() work on the thread's context */
+	pthread_mutex_lock (&b->lock);
+	bk = b;
+
+	if (!idx)
+		add_target (BACKUP_ROOT);
+	for (idx = 0; targets && targets[idx]; idx++)
+		add_target (targets[idx]);
+	options_reset ();
+
+	bakim_leave (b);
+
+	return (b);
+}
+
+/* options stay set on the context for every later call */
+int
+bakim_option (struct bakim *b, int opt, const char *value)
+{
+	int r;
+
+	bakim_enter (b);
+
+	/* targets are the context's, and nothing may outlive a call */
+	if (!opt || strchr ("bcLt", opt) || !value)
+		r = bakim_fail (b, "-%c is not a library option", opt);
+	else if ((r = backup_option (opt, (char *) value)) == -1)
+		bakim_fail (b, "bad value for -%c: %s", opt, value);
+
+	bakim_leave (b);
+
+	return (r);
+}
+
+/*
+ * one run over the paths.  what it stored goes to .bakim/journal, and
+ * the path index catches up with that every LIBRARY_INDEX_BATCH entries
+ * and at bakim_close(), so a small call doesn't rewrite all of it.
+ */
+int
+bakim_backup_paths (struct bakim *b, const char *const *paths,
+		    const struct bakim_opts *opts,
+		    const struct bakim_callbacks *cb)
+{
+	struct root_ctx *rc;
+	char *p;
+	int idx, len, r;
+
+	bakim_enter (b);
+
+	bk->callbacks = cb;
+	bk->n_failed = 0;
+	r = 0;
+
+	if (backup_setup () == -1 || check_branch () == -1) {
+		r = bakim_fail (b, "cannot start a backup run");
+		goto out;
+	}
+
+	if (opts && opts->root) {
+		/* as with --from0, the paths and the root made absolute */
+		if ((p = abs_path (opts->root)) == NULL) {
+			r = bakim_fail (b, "cannot resolve %s: %m", opts->root);
+			goto out;
+		}
+		rc = add_root (p);
+		free (p);
+		if (rc == NULL) {
+			r = bakim_fail (b, "cannot back up %s", opts->root);
+			goto out;
+		}
+
+		rc->list_only = 1;
+		len = rc->base_off + rc->name_len;
+
+		for (idx = 0; paths[idx]; idx++) {
+			if ((p = abs_path (paths[idx])) == NULL) {
+				if (errno != ENOENT)
+					r = bakim_fail (b, "cannot resolve %s:"
+							" %m", paths[idx]);
+				continue;
+			}
+
+			if (strncmp (p, rc->path, len) != 0
+			    || (p[len] != '/' && p[len])) {
+				r = bakim_fail (b, "%s is not below %s",
+						paths[idx], opts->root);
+				free (p);
+				continue;
+			}
+
+			list_add (rc, p);
+		}
+	} else {
+		for (idx = 0; paths[idx]; idx++) {
+			if (add_root (paths[idx]) == NULL)
+				r = bakim_fail (b, "cannot back up %s",
+						paths[idx]);
+		}
+	}
+
+	if (bk->first_root) {
+		if (run_lanes ())
+			r = bakim_fail (b, "backup run failed");
+		finish_run (bk->n_journal + bk->journal_saved
+			    >= LIBRARY_INDEX_BATCH);
+	}
+
+	if (bk->n_failed)
+		r = bakim_fail (b, "failed to back up %ld entries",
+				bk->n_failed);
+
+	for (idx = 0; idx < bk->n_busy; idx++) {
+		if (cb && cb->deferred)
+			cb->deferred (cb->arg, bk->busy_paths[idx]);
+		free (bk->busy_paths[idx]);
+	}
+	bk->n_busy = 0;
+
+out:
+	unlock_targets ();
+	free_roots ();
+
+	bakim_leave (b);
+
+	return (r);
+}
+
+const char *
+bakim_error (struct bakim *b)
+{
+	return (b->error);
+}
+
+void
+bakim_close (struct bakim *b)
+{
+	struct target *t;
+
+	if (!b)
+		return;
+
+	bakim_enter (b);
+
+	for (t = bk->first_target; t && (bk->n_journal || bk->journal_saved);
+	     t = t->next) {
+		bk->backup_root = t->root;
+		index_update (NULL);
+	}
+
+	free_targets ();
+	free (bk->backup_branch);
+	free (bk->busy_paths);
+	options_reset ();
+
+	bakim_leave (b);
+
+	pthread_mutex_destroy (&b->lock);
+	pthread_mutex_destroy (&b->read_limit.lock);
+	pthread_mutex_destroy (&b->write_limit.lock);
+	pthread_mutex_destroy (&b->meta_limit.lock);
+	pthread_mutex_destroy (&b->pack_lock);
+	pthread_mutex_destroy (&b->busy_lock);
+	pthread_mutex_destroy (&b->note_lock);
+	pthread_mutex_destroy (&b->manifest_lock);
+	pthread_mutex_destroy (&b->acct_lock);
+	pthread_mutex_destroy (&b->journal_lock);
+	free (b);
+}
+
+/* the backup root the command line works on, from $BAKIM_ROOT */
+void
+set_backup_root (char *root)
+{
+	bakim_cli.backup_root = root;
+}
+
+/*
+ * bakim [OPTION]... FILE...: back up the files to today's branch of
+ * every target
+ */
+int
+backup_main (int argc, char **argv)
+{
+	int c, idx, status;
+	char *p, *from0;
+	struct root_ctx *rc;
+	static struct option longopts[] = {
+		{ "from0", required_argument, NULL, '0' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	from0 = NULL;
+	status = 0;
+
+	while ((c = getopt_long (argc, argv, "0:" BACKUP_OPTS, longopts,
+				 NULL)) != EOF) {
+		if (c == '0')
+			from0 = optarg;
+		else if (backup_option (c, optarg) == -1)
+			usage ();
+	}
+
+	if (optind >= argc) {
+		usage ();
+	}
+
+	if (!bk->first_target)
+		add_target (bk->backup_root);
+	bk->backup_root = bk->first_target->root;
+
+	/* listed paths are matched against the roots, both made absolute */
+	for (idx = optind; idx < argc; idx++) {
+		p = from0 ? abs_path (argv[idx]) : xstrdup (argv[idx]);
+		if (!p) {
+			report ("cannot resolve %s: %m\n", argv[idx]);
+			return (1);
+		}
+		rc = add_root (p);
+		free (p);
+		if (rc == NULL)
+			return (1);
+	}
+
+	if (backup_setup () == -1)
+		return (1);
+
+	if (from0) {
+		if (bk->remote_cmd) {
+			report ("--from0 cannot be used with -t\n");
+			return (1);
+		}
+		if (load_list (from0) == -1)
+			status = 1;
+	}
+
+	if (bk->remote_cmd) {
+		status = remote_backup ();
+		valgrind_cleanup ();
+		return (status ? 1 : 0);
+	}
+
+	if (open_branch () == -1 || start_monitor () == -1)
+		return (1);
+
+	if (run_lanes () || bk->n_failed)
+		status = 1;
+	finish_run (1);
+
+	valgrind_cleanup ();
+
+	return (status);
+}
@@ -0,0 +1,1018 @@
+/*
+ * what the files of libbakim share: the engine's structures and the
+ * state and functions one of them uses from another.
+ */
+#ifndef LIBBAKIM_H
+#define LIBBAKIM_H
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <ftw.h>
+#include <utime.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <zlib.h>
+#include "bakim.h"
+#if defined (__x86_64__) || defined (__i386__)
+#include <immintrin.h>
+#endif
+
+#define EXT2_IMMUTABLE_FL 0x00000010
+#define EXT2_APPEND_FL 0x00000020
+#define BACKUP_ROOT "/big"
+
+#define MAX_DIRS_OPEN 100
+
+#define FILE_FOUND 0x00000001
+
+#define HASH_INITIAL_SIZE 1024
+
+#define ORDER_AUTO 0
+#define ORDER_NONE 1
+#define ORDER_INODE 2
+#define ORDER_EXTENT 3
+
+#define ORDER_BATCH 8192
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+#define MAX_JOBS 64
+
+#define VERIFY_CHUNK 256
+#define VERIFY_BUFSIZE (1024*1024)
+#define VERIFY_MAGIC "BAKIMVS1"
+#define DIRECT_ALIGN 4096
+
+#define INDEX_BLOCK 64
+#define INDEX_MAGIC "BAKIMIX1"
+#define INDEX_DELTA_SHARE 8
+
+#define REMOTE_VERSION "bakim 1"
+#define REMOTE_BATCH 1024
+#define REMOTE_BATCH_BYTES (256*1024)
+#define REMOTE_CHUNK (1024*1024)
+#define REMOTE_MAX_FRAME (REMOTE_CHUNK + 64*1024)
+
+#define MAX_TARGETS 16
+#define FAN_BUFFER (64*1024*1024)
+#define FAN_CHUNK (1024*1024)
+
+#define BACKOFF_MIN_US 1000
+#define BACKOFF_MAX_US 1000000
+
+#define CDC_MIN (16*1024)
+#define CDC_AVG (64*1024)
+#define CDC_MAX (256*1024)
+#define CDC_MASK_S 0xffffc00000000000ULL
+#define CDC_MASK_L 0xfffc000000000000ULL
+#define CDC_BUFSIZE (4*1024*1024)
+#define SHA256_LEN 32
+#define SAMPLE_LEN (256*1024)
+
+#define CONTENT_STAT 0
+#define CONTENT_SAMPLE 1
+#define CONTENT_FULL 2
+
+#define SAMPLE_BLOCK 4096
+#define SAMPLE_COUNT 8
+
+#define RS_DATA 16
+#define RS_BLOCK (64*1024)
+#define RS_MAGIC "BAKIMRS1"
+#define RS_HEADER 32
+
+#define BACKUP_OPTS "o:c:R:W:M:L:P:C:Z:E:V:D:x:X:s:a:t:b:"
+
+#define WATCH_SETTLE 5
+#define WATCH_MAX_WAIT 60
+#define WATCH_RECONCILE 3600
+#define WATCH_BUFSIZE (64*1024)
+
+#define LIBRARY_INDEX_BATCH 100000
+
+struct hash_entry {
+	struct hash_entry *next;
+	unsigned long hash;
+	char *key;
+	void *val;
+};
+
+struct hash_table {
+	struct hash_entry **buckets;
+	unsigned long size, count;
+};
+
+/* token bucket; rate is in units per second, 0 for no limit */
+struct throttle {
+	pthread_mutex_t lock;
+	double rate, tokens;
+	struct timespec last;
+};
+
+/* a device whose latency the adaptive throttle watches */
+struct watched_dev {
+	struct watched_dev *next;
+	dev_t dev;
+	unsigned long long ios, ticks;
+};
+
+/*
+ * a directory being torn down.  pending counts the subdirectories still
+ * queued or in progress, plus one while the directory itself is being
+ * emptied; whoever drops it to zero removes the directory.
+ */
+struct rm_node {
+	struct rm_node *parent, *qnext;
+	char *path;
+	int pending;
+};
+
+struct remover {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct rm_node *queue;
+	int busy, errors;
+};
+
+struct xxh64_state {
+	unsigned long long total, v[4];
+	unsigned char mem[32];
+	int memsize;
+};
+
+struct sha256_state {
+	uint32_t h[8];
+	uint64_t total;
+	unsigned char mem[64];
+	int memsize;
+};
+
+/* space used by one branch or collision slot */
+struct acct {
+	long long files, bytes, shared;
+};
+
+/*
+ * small files can be stored in a pack per branch or slot instead of as
+ * files of their own: SLOT.pack holds their data back to back and
+ * SLOT.idx one pack_rec, followed by the relative path, for each.
+ * both only ever grow and are append-only (EXT2_APPEND_FL) between
+ * runs, and a run appending to one holds an flock on SLOT.pack.  the
+ * newest/ link of a packed file points at SLOT.pack itself; readers
+ * look its path under newest/ up in that pack.
+ */
+struct pack_rec {
+	uint64_t offset, size, hash;
+	int64_t mtime, atime;
+	uint32_t mode, uid, gid, path_len;
+};
+
+struct pack {
+	pthread_mutex_t lock;
+	char *slot;
+	const char *kind;
+	int data_fd, idx_fd;
+	uint64_t end;
+	struct hash_table recs;
+};
+
+/* a slot's pack and recipe pack opened for reading, with their indexes */
+struct pack_view {
+	struct hash_table recs, crecs;
+	int fd, cfd;
+};
+
+/* a file for bakim restore to copy, from the tree or from a pack */
+struct restore_file {
+	char *src, *dst;
+	struct stat sb;
+	struct pack_view *pv;
+	uint64_t offset;
+	unsigned long long key;
+	int recipe;
+};
+
+/* a directory created at DEST, whose owner and times wait for the end */
+struct restore_dir {
+	char *dst;
+	struct stat sb;
+};
+
+/* a second name of a multiply linked file, made once the first exists */
+struct restore_link {
+	char *dst, *first;
+};
+
+/* an open checksum manifest of one branch or collision slot */
+struct manifest {
+	FILE *f;
+};
+
+/* a file to scrub, with its checksum if a manifest recorded one */
+struct verify_file {
+	char *path;
+	long long size;
+	unsigned long long hash;
+	int has_hash;
+};
+
+/* VERIFY_CHUNK files of one branch, the unit of work and of resuming */
+struct verify_chunk {
+	struct verify_chunk *next;
+	char *branch;
+	int is_pack, resumable;
+	struct verify_file *files;
+	int n_files;
+};
+
+/*
+ * the runs of a branch's files a scrub has finished, by first and last
+ * path, which stay put when a manifest grows.  sorted and merged once
+ * loaded, so a path is looked up with a binary search.
+ */
+struct verify_range {
+	char *first, *last;
+};
+
+struct verify_done {
+	struct verify_range *r;
+	int n, alloc, pack;
+};
+
+/* one entry of a branch listing; slot says which directory it is in */
+struct list_entry {
+	char *path;
+	struct stat sb;
+	int slot;
+};
+
+/* the sorted listing of a branch, newest slot winning for each path */
+struct listing {
+	char **dirs;
+	int n_dirs;
+	struct list_entry *ents;
+	int n, alloc;
+	struct hash_table hashes;
+	int has_manifest;
+};
+
+/* a path stored this run, and the branch or slot it went into */
+struct journal_ent {
+	char *path;
+	int slot;
+};
+
+/*
+ * the path index is a sorted table of every non-directory path stored
+ * under any branch or slot, each with the list of slots holding it.
+ * paths are front coded against their predecessor in blocks of
+ * INDEX_BLOCK; the first path of a block is stored whole, so blocks
+ * can be binary searched through the offset table.  the layout is
+ *
+ *	blocks, slot names (u32 count, NUL terminated names),
+ *	block offsets (u64 each), struct index_footer
+ *
+ * and a block is a varint entry count, then per entry varints for the
+ * shared prefix, suffix length, suffix bytes, slot count and slot ids.
+ *
+ * runs merge what they stored into index.delta, a second index of the
+ * same layout, and only fold it into the index once it has grown past
+ * 1/INDEX_DELTA_SHARE of it, so a run costs what it stored rather than
+ * what the whole index holds.  readers look in both.  library calls
+ * that leave the index for later append what they stored to
+ * .bakim/journal instead, for the next update to take in.
+ */
+struct index_footer {
+	uint64_t slots_off, blocks_off, n_blocks, n_paths;
+	char magic[8];
+};
+
+struct index_reader {
+	unsigned char *map;
+	size_t size;
+	struct index_footer ft;
+	char **slots;
+	int n_slots;
+	const uint64_t *offs;
+};
+
+struct index_iter {
+	struct index_reader *ir;
+	uint64_t block;
+	const unsigned char *p;
+	int left;
+	char path[PATH_MAX];
+	int *slots, n_slots, alloc;
+};
+
+/* a date branch and its collision slots, for retention */
+struct branch_date {
+	char date[11];
+	char **dirs;
+	int n_dirs, keep;
+};
+
+/* the first copy made of a multiply linked source inode */
+struct link_data {
+	char *dst;
+	unsigned long long hash;
+	int archived;
+};
+
+/*
+ * a file whose copy is held back so the batch can be read in disk
+ * order, or until it is no longer being written
+ */
+struct pending_file {
+	char *fpath;
+	struct stat sb;
+	int base, level;
+	unsigned long long key;
+};
+
+/*
+ * an include or exclude rule, gitignore style.  an anchored pattern is
+ * matched against the path below the root, the rest against the name.
+ */
+struct filter_rule {
+	char *pattern;
+	int negate, dir_only, anchored, flags;
+};
+
+/* one backup root a run writes to, with today's branch and newest/ */
+struct target {
+	struct target *next;
+	int idx;
+	char *root, *directory, *newest;
+	int lock;
+	/* collision slots a finished run left, until the branch changes */
+	struct dir_data *warm_slots;
+};
+
+/* a buffer of file data read once and written to several targets */
+struct chunk {
+	int refs;
+	size_t len;
+	char data[];
+};
+
+#define FAN_COPY 0
+#define FAN_DATA 1
+#define FAN_END 2
+#define FAN_LINK 3
+#define FAN_SYNC 4
+#define FAN_QUIT 5
+
+/*
+ * work for a sink.  a FAN_COPY names the file the FAN_DATA chunks that
+ * follow go into, up to a FAN_END carrying the read status.
+ */
+struct fan_op {
+	struct fan_op *next;
+	int kind, status, level, done;
+	struct root_ctx *ctx;
+	char *dst, *path, *fpath;
+	const char *slot;
+	struct stat sb;
+	struct link_data *lk;
+	struct chunk *chunk;
+	struct parity *pe;
+};
+
+/*
+ * the parity sidecar of a file being copied, written a row at a time:
+ * every RS_DATA blocks of RS_BLOCK bytes get m parity blocks, and the
+ * CRC-32 of each data and parity block.
+ */
+struct parity {
+	int fd, m;
+	char *fn;
+	size_t fill;
+	uint64_t size;
+	uint32_t crc[RS_DATA];
+	unsigned char *par;
+};
+
+/*
+ * the writer for one target of one lane, when there are several
+ * targets.  it stores files the lane has placed and read, falling at
+ * most FAN_BUFFER bytes behind before the lane waits for it.
+ */
+struct sink {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct fan_op *head, *tail;
+	size_t queued;
+};
+
+struct dir_data {
+	struct dir_data *next;
+	char *path, *rpath;
+	time_t atime, mtime;
+	int mode;
+	struct hash_table *paved;
+};
+
+/*
+ * everything that used to be global to a single nftw run.  roots on
+ * different devices are backed up concurrently, so the walk state
+ * hangs off the root being walked by the calling thread.  a root gets
+ * one of these per target, chained through mirror; the walk is shared
+ * and the slot and directory state is the target's own.  when list is
+ * set only those paths under the root and their parents are backed up,
+ * instead of walking all of it.
+ */
+struct root_ctx {
+	struct root_ctx *next, *lane_next, *mirror;
+	struct lane *lane;
+	struct target *tgt;
+	struct sink *sink;
+	char *path;
+	int base_off, name_len;
+	dev_t dev;
+	struct dir_data *first_dir, *first_collision_dir, *last_collision_dir;
+	struct hash_table dir_index;
+	int order;
+	struct pending_file *pending;
+	int n_pending;
+	const char *src_link;
+	char **list;
+	int n_list, list_alloc;
+	/* only the listed paths are backed up, none if there are none */
+	int list_only;
+	struct pending_file *deferred;
+	int n_deferred, deferred_alloc;
+	struct pending_file *late;
+	int n_late, late_alloc;
+	int untrusted;
+};
+
+/*
+ * one lane per source device, walking its roots one after another.
+ * hard links never cross devices, so the lane also owns the map of
+ * (target, st_dev, st_ino) to where that inode was first copied.  those copies
+ * stay writable until the lane is done so later links can join them.
+ */
+struct lane {
+	struct lane *next;
+	dev_t dev;
+	struct root_ctx *first_root, *last_root;
+	pthread_t thread;
+	int status;
+	struct hash_table links;
+	struct sink *sinks;
+};
+
+/* a growable byte buffer, for building and receiving frames */
+struct buf {
+	unsigned char *data;
+	size_t len, alloc;
+};
+
+/* reads a received frame, noting rather than overrunning a short one */
+struct rd {
+	const unsigned char *p, *end;
+	int bad;
+};
+
+/* a file the receiver asked for, in the order it asked */
+struct need {
+	uint32_t id;
+	char *path;
+};
+
+/*
+ * the sending side of a remote run (-t).  the walk streams entries
+ * while a reader thread collects which files the receiver wants and a
+ * data thread sends them, so nothing waits on a round trip.
+ */
+struct remote {
+	int fd;
+	FILE *in;
+	pid_t pid;
+	pthread_mutex_t send_lock, lock;
+	pthread_cond_t cond;
+	char **paths;
+	uint32_t n_ids, ids_alloc, acked;
+	struct need *needs;
+	int need_head, n_needs, needs_alloc;
+	int no_more, status;
+	struct buf batch;
+	int n_batch;
+};
+
+/* a file the receiver has placed and is waiting for the data of */
+struct recv_file {
+	uint32_t id;
+	char *dst, *slot, *path, *tmp;
+	int level;
+	struct stat sb;
+};
+
+/*
+ * the engine's state: the targets a run writes to and today's branch
+ * under them, the options and filters it runs with, and what it builds
+ * up on the way.  the command line has one, bakim_cli; each library
+ * context is another, kept between calls, so contexts on different
+ * targets run side by side.
+ */
+struct bakim {
+	/* calls on one library context take turns */
+	pthread_mutex_t lock;
+
+	/* the root meta_path() and the commands work on */
+	char *backup_root;
+	char *backup_branch;
+	int read_order;
+
+	struct root_ctx *first_root, *last_root;
+	struct lane *first_lane;
+	struct target *first_target, *last_target;
+	int n_targets;
+
+	/* command that starts a receiver on the far side, for -t */
+	char *remote_cmd;
+
+	int io_class, io_level;
+	struct throttle read_limit, write_limit, meta_limit;
+
+	/* adaptive mode: how slow a disk may get before runs back off */
+	int latency_limit_ms;
+
+	/* files below this size go to packs; 0 turns packing off */
+	long long pack_threshold;
+	pthread_mutex_t pack_lock;
+	struct hash_table packs;
+
+	/* files from this size up are stored as chunk lists; 0 for never */
+	long long chunk_threshold;
+	struct hash_table recipes;
+
+	/* zlib level chunks are compressed at, 0 for none */
+	int chunk_level;
+
+	/*
+	 * how far check_same() looks past stat into regular files, and
+	 * the seed that moves its samples from run to run
+	 */
+	int content_check;
+	unsigned int sample_seed;
+
+	/*
+	 * files written to within this many seconds, or open for writing,
+	 * are put off to the end of the root and then to the next run; -1
+	 * for off.  busy_paths collects the ones still busy at the end.
+	 */
+	int defer_window;
+	pthread_mutex_t busy_lock;
+	char **busy_paths;
+	int n_busy;
+
+	/*
+	 * -x and -X rules, in order; the last one to match decides.  plain
+	 * names and *.ext patterns are looked up by hash, giving the number
+	 * of the last such rule, and only later glob rules need fnmatch.
+	 */
+	struct filter_rule *filter_rules;
+	int n_filter_rules;
+	struct hash_table filter_names, filter_exts;
+	int *filter_globs, n_filter_globs;
+
+	/* -s and -a bounds on regular files, -1 for none */
+	long long filter_min_size, filter_max_size;
+	long long filter_min_age, filter_max_age;
+
+	/*
+	 * entries this run failed to back up, and who to tell about those
+	 * and the ones stored, one thread at a time
+	 */
+	pthread_mutex_t note_lock;
+	long n_failed;
+	const struct bakim_callbacks *callbacks;
+
+	/* parity blocks per RS_DATA data blocks of a copied file, or 0 */
+	int parity_blocks;
+
+	/* checksum manifests, by slot directory, under .bakim/manifest */
+	pthread_mutex_t manifest_lock;
+	struct hash_table manifests;
+
+	/* this run's additions to the space accounting, by branch name */
+	pthread_mutex_t acct_lock;
+	struct hash_table accts;
+
+	/*
+	 * paths stored this run, merged into the path index at the end.
+	 * slots are named by full path, as a run may write to several
+	 * targets.  journal_saved counts those already in .bakim/journal.
+	 */
+	pthread_mutex_t journal_lock;
+	struct journal_ent *journal;
+	int n_journal, journal_alloc;
+	long journal_saved;
+	struct hash_table journal_slots;
+	char **journal_names;
+	int n_journal_names;
+
+	/* why the last library call failed */
+	char error[256];
+};
+
+extern struct bakim bakim_cli;
+extern __thread struct bakim *bk;
+extern __thread struct root_ctx *cur;
+extern int slot_merge;
+extern pthread_once_t gf_once;
+extern void (*gf_mul_add) (unsigned char *dst, const unsigned char *src,
+			   size_t n, int c);
+
+void usage (void);
+void valgrind_cleanup (void);
+void free_roots (void);
+void free_targets (void);
+void vreport (const char *fmt, va_list ap);
+void report (const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
+void *xcalloc (unsigned int a, unsigned int b);
+char *xstrdup (const char *old);
+int start_thread (pthread_t *thread, void *(*fn) (void *), void *arg);
+unsigned long long parse_size (const char *s);
+int size_arg (const char *s, unsigned long long *vp);
+void throttle_take (struct throttle *t, double n);
+double throttle_debt (struct throttle *t, double n);
+void throttle_copy (double n);
+void throttle_sleep (double wait);
+void set_ioprio (void);
+void watch_dev (dev_t dev);
+int sample_latency (struct watched_dev *wd, double *ms);
+void *latency_monitor (void *arg);
+unsigned long hash_str (const char *s, int len);
+struct hash_entry *hash_lookup (struct hash_table *ht, const char *key,
+				int len);
+struct hash_entry *hash_insert (struct hash_table *ht, const char *key,
+				int len, void *val);
+void hash_clear (struct hash_table *ht);
+void xxh64_init (struct xxh64_state *st);
+void xxh64_update (struct xxh64_state *st, const void *data, size_t len);
+unsigned long long xxh64_final (struct xxh64_state *st);
+void sha256_init (struct sha256_state *st);
+void sha256_update (struct sha256_state *st, const void *data, size_t len);
+void sha256_final (struct sha256_state *st, unsigned char *out);
+void gear_init (void);
+size_t cdc_cut (const unsigned char *p, size_t n);
+int fsetflags (const char *name, unsigned long flags);
+int fgetflags (const char *name, unsigned long *flags);
+int set_immutable (const char *fn);
+void touched_dir (const char *rpath, const char *path, const struct stat *sb);
+int clear_immutable_fd (int fd);
+int unlink_entry_at (int dirfd, const char *name);
+void rm_push (struct remover *rm, struct rm_node *np);
+void rm_release (struct remover *rm, struct rm_node *np);
+void rm_empty_dir (struct remover *rm, struct rm_node *np);
+void *rm_worker (void *arg);
+int remove_trees (char **paths, int n, int jobs);
+int delete_file_or_dir (char *path);
+int copy_file (const char *src_fn, char *dst_fn, unsigned long long *hash,
+	       struct parity *pe);
+void gf_init (void);
+unsigned char gf_mul (int a, int b);
+unsigned char gf_inv (int a);
+unsigned char rs_coef (int j, int i);
+int gf_invert (unsigned char *a, int n);
+struct parity *parity_open (const char *slot_path, const char *path);
+void parity_update (struct parity *pe, const unsigned char *data, size_t n);
+void parity_row (struct parity *pe);
+void parity_close (struct parity *pe, int ok);
+uint32_t crc_zeros (uint32_t crc, size_t n);
+int repair_open (const char *fn, const struct stat *sb);
+void repair_done (const char *fn, int fd, const struct stat *sb);
+int repair_row (unsigned char *data, unsigned char *rec, int m, int n_blocks);
+int repair_rec (int fd, unsigned char *rec, int m, size_t plen, uint64_t off,
+		int write);
+int repair_file (const char *fn, const char *sidecar);
+int cmd_repair (int argc, char **argv);
+int clone_file (const char *src_fn, const char *dst_fn);
+void set_file_meta (const char *dst_name, const struct stat *sb);
+struct link_data *find_link (const struct stat *sb);
+struct link_data *remember_link (const struct stat *sb, const char *dst_name,
+		    unsigned long long hash);
+void seal_links (struct lane *lp);
+int open_archived_link (struct link_data *lk);
+char *meta_path (const char *a, const char *b);
+char *slot_meta_path (const char *slot, const char *a, const char *ext);
+FILE *meta_fopen (const char *fn, const char *mode);
+int make_dir (const char *path, mode_t mode);
+void manifest_add (const char *backup_path, const char *path, long long size,
+		   unsigned long long hash);
+void manifest_close_all (void);
+void acct_add (const char *backup_path, long long files, long long bytes,
+	       long long shared);
+int acct_load (const char *fn, struct acct *ap);
+int lock_path (const char *path, int op);
+int lock_dir_of (const char *fn);
+int acct_store (const char *fn, const struct acct *ap);
+int acct_read (const char *branch, struct acct *ap);
+int acct_write (const char *branch, const struct acct *ap);
+void acct_flush_all (void);
+void forget_branch (const char *branch);
+void chunk_mark (const unsigned char *sha);
+int chunk_gc (void);
+char *pack_path (const char *kind, const char *branch,
+			const char *ext);
+int pack_load (const char *kind, const char *branch,
+	       struct hash_table *recs);
+int pack_load_idx (const char *fn, struct hash_table *recs);
+void pack_rec_stat (const struct pack_rec *pr, struct stat *sb);
+int pack_begin (struct pack *pk);
+void pack_end (struct pack *pk);
+struct pack *pack_get (struct hash_table *ht, const char *kind,
+		       const char *slot);
+int pack_store (struct pack *pk, const char *fpath, const char *path,
+		const struct stat *sb);
+void pack_seal_all (void);
+void pack_seal (struct hash_table *ht);
+int pack_read (const char *branch, const char *path, struct pack_rec *pr,
+	       int *fd);
+void free_pack_recs (struct hash_table *recs);
+struct pack_view *pack_view (const char *slot);
+void free_pack_views (void);
+struct hash_entry **branch_packed (const char *branch, const char *prefix,
+				   int recipe, unsigned long *n);
+int newest_rel (const char *fpath, const char *tar, char *rel);
+int resolve_newest (const char *fpath, int base, char *fn, struct stat *sb,
+		    struct pack_view **pv, struct pack_rec **pr);
+void chunk_path (const char *root, const unsigned char *sha, char *fn);
+int chunk_commit (const char *tmp, const char *fn);
+int chunk_put (const char *root, const unsigned char *sha,
+	       const unsigned char *data, size_t len, unsigned char *zbuf);
+int compressible (const char *fpath, const unsigned char *data, size_t len);
+int chunk_compressed (int fd, uint32_t len);
+int chunk_inflate (int fd, unsigned char *buf, uint32_t len);
+int recipe_store (struct pack *pk, const char *fpath, const char *path,
+		  const struct stat *sb, uint64_t *fresh);
+int backup_chunked (const char *fpath, const struct stat *sb,
+		    struct FTW *ftwbuf);
+unsigned char *recipe_chunks (int fd, uint64_t offset, uint32_t *n);
+int chunk_open (const char *root, const unsigned char *sha);
+struct dir_data *collision_dir (int count);
+int newest_target (const char *backup_path, const char *path, int level,
+		   const char *kind, char *out);
+int update_newest (const char *backup_path, const char *path, int level,
+		   const char *kind);
+int slot_packed (const char *slot, const char *path, struct stat *sb);
+int choose_slot (const char *fpath, const struct stat *sb,
+		 const char *backup_path, int *count, char *dst_name);
+int backup_packed (const char *fpath, const struct stat *sb,
+		   struct FTW *ftwbuf);
+void index_note (const char *backup_path, const char *path);
+void put_varint (FILE *f, uint64_t v);
+uint64_t get_varint (const unsigned char **p, const unsigned char *end);
+int index_open (struct index_reader *ir);
+int index_open_file (struct index_reader *ir, const char *name);
+int index_seek (struct index_reader *ir, struct index_iter *it,
+		const char *path);
+int index_find (struct index_reader *ir, struct index_iter *it,
+		const char *path);
+void index_close (struct index_reader *ir);
+void index_iter_init (struct index_iter *it, struct index_reader *ir,
+		      uint64_t block);
+int index_iter_next (struct index_iter *it);
+int journal_save (void);
+int index_update (struct hash_table *gone);
+void base26 (int c, char *s);
+struct dir_data *find_dir (const char *path);
+int pave_path (const char *path, struct dir_data *dp);
+int lstat_beneath (const char *base, const char *path, struct stat *sb);
+int slot_lstat (const char *slot, const char *path, const char *dst_name,
+		struct stat *sb);
+int newest_unsafe (const char *path);
+struct dir_data *find_slot (const char *fpath, const struct stat *sb,
+			    int *flags);
+int source_link (const char *fpath, const struct stat *sb, char *buf);
+int range_same (int fa, int fb, off_t off, off_t len, char *abuf, char *bbuf,
+		size_t bufsize);
+int content_same (const char *a_path, const char *b_path, off_t size);
+int check_same (const struct stat *a, const struct stat *b, const char *a_path,
+		const char *b_path);
+int place_file (const char *fpath, const struct stat *sb, char *backup_path,
+		char *dst_name, const char **slot_path);
+int backup_file (const char *fpath, const struct stat *sb, struct FTW *ftwbuf,
+		 char *backup_path);
+int share_file (struct link_data *lk, const char *dst_name);
+int file_stored (const char *dst_name, const char *slot_path, const char *path,
+		 const struct stat *sb, int level, unsigned long long hash,
+		 int shared, int writable);
+int backup_dir (const char *fpath, const struct stat *sb, struct FTW *ftwbuf,
+		char *backup_path);
+int backup_link (const char *fpath, const struct stat *sb, struct FTW *ftwbuf,
+		 char *backup_path);
+int backup_entry (const char *fpath, const struct stat *sb, int tflag,
+		  struct FTW *ftwbuf);
+void note_failure (const char *fpath);
+void note_stored (const char *slot_path, const char *path);
+int file_busy (const char *fpath, const struct stat *sb);
+void defer_file (const char *fpath, const struct stat *sb,
+		 struct FTW *ftwbuf);
+void pending_push (struct pending_file **list, int *n, int *alloc,
+		   const char *fpath, const struct stat *sb,
+		   struct FTW *ftwbuf);
+int link_later (const char *fpath, const struct stat *sb);
+void backup_late (void);
+void retry_deferred (void);
+struct fan_op *fan_op_new (int kind, struct root_ctx *ctx);
+void fan_op_free (struct fan_op *op);
+void sink_push (struct sink *sk, struct fan_op *op);
+void sink_sync (struct sink *sk);
+void *sink_main (void *arg);
+int fan_file (const char *fpath, const struct stat *sb, struct FTW *ftwbuf);
+void filter_add (const char *rule);
+int filter_load (const char *fn);
+int range_arg (const char *s, int size, long long *vp);
+int parse_range (const char *s, int size, long long *lo, long long *hi);
+int filter_excluded (const char *rel, const char *base, int is_dir);
+int filtered (const char *fpath, const struct stat *sb, int tflag,
+	      struct FTW *ftwbuf);
+void fix_dirs (void);
+void free_slot_list (struct dir_data *dp);
+void free_collision_dirs (void);
+void adopt_slots (struct root_ctx *rc);
+void park_slots (struct root_ctx *rc);
+void drop_slots (void);
+int is_rotational (dev_t dev);
+unsigned long long extent_key (int dir, const char *name,
+			       const struct stat *sb);
+void pending_keys (void);
+void queue_file (const char *fpath, const struct stat *sb,
+		 struct FTW *ftwbuf);
+void flush_pending (void);
+struct root_ctx *add_root (const char *arg);
+struct root_ctx *root_of (const char *path);
+char *abs_path (const char *path);
+void list_add (struct root_ctx *rc, char *path);
+int load_list (const char *fn);
+int backup_listed (struct root_ctx *rc);
+int backup_root_ctx (struct root_ctx *rc);
+void *lane_main (void *arg);
+void buf_put (struct buf *b, const void *p, size_t n);
+void buf_uint (struct buf *b, uint64_t v, int n);
+void put_le32 (unsigned char *p, uint32_t v);
+uint32_t get_le32 (const unsigned char *p);
+const unsigned char *rd_bytes (struct rd *r, size_t n);
+uint64_t rd_uint (struct rd *r, int n);
+int write_all (int fd, const void *p, size_t n);
+void send_frame (int fd, int type, const void *a, size_t alen, const void *b,
+		 size_t blen);
+int recv_frame (FILE *f, int *type, struct buf *b);
+void remote_start (void);
+void remote_flush (void);
+void *remote_reader (void *arg);
+void send_file (uint32_t id, const char *fpath, unsigned char *buf);
+void *remote_data (void *arg);
+int remote_backup (void);
+int safe_path (const char *path);
+int recv_entries (struct buf *b, int out, struct recv_file **files,
+		  int *n_files, int *alloc);
+int recv_finish (struct recv_file *rf, int fd, long long size,
+		 unsigned long long hash, int ok);
+int cmd_recv (int argc, char **argv);
+struct target *add_target (const char *root);
+int lock_targets (void);
+void unlock_targets (void);
+int open_branch (void);
+int check_branch (void);
+int backup_option (int c, char *arg);
+void options_reset (void);
+int backup_setup (void);
+int start_monitor (void);
+int run_lanes (void);
+void finish_run (int update_index);
+void watch_note (const char *path);
+int watch_fanotify (void);
+void watch_fanotify_read (int fd);
+int watch_inotify (void);
+void watch_inotify_read (int fd);
+void watch_stop_handler (int sig);
+int watch_batch (int full);
+int cmd_watch (int argc, char **argv);
+int is_branch_name (const char *name);
+void date_key (const char *date, const char *fmt, char *key, int size);
+int keep_by_period (struct branch_date *bds, int n, const char *fmt,
+		    int count);
+int cmd_prune (int argc, char **argv);
+void escape_path (FILE *f, const char *path);
+int unescape_path (char *s);
+int load_manifest (const char *branch, struct verify_file **files);
+int walk_branch (const char *branch, struct verify_file **files);
+int hash_file (const char *fn, int direct, unsigned char *buf,
+	       unsigned long long *hash, long long *size);
+void verify_one (const char *branch, struct verify_file *vf,
+		 unsigned char *buf);
+int verify_chunks (int fd, uint64_t offset, struct xxh64_state *st,
+		   uint64_t *left, unsigned char *buf);
+void verify_pack (const char *branch, const char *kind, unsigned char *buf);
+void *verify_worker (void *arg);
+void put_state_str (FILE *f, const char *s);
+void verify_note_done (struct verify_chunk *vc);
+char *state_str (FILE *f);
+int load_verify_state (const char *fn, struct hash_table *done);
+int cmp_verify_range (const void *a, const void *b);
+int verify_covered (struct verify_done *vd, const char *path);
+int cmd_verify (int argc, char **argv);
+int branch_slots (const char *name, char ***slots);
+int slot_taken (const char *path);
+int walk_slots (const char *branch, char ***slots);
+void free_slots (char **slots, int n);
+void listing_add (struct listing *ls, const char *path,
+		  const struct stat *sb, int slot);
+void *list_worker (void *arg);
+void list_branches (struct listing **lss, int n);
+void load_listing_hashes (struct listing *ls);
+int entry_changed (struct listing *a, struct list_entry *ea,
+		   struct listing *b, struct list_entry *eb);
+void free_listing (struct listing *ls);
+int cmd_diff (int argc, char **argv);
+void acct_rebuild (char **branches, int n);
+int list_all_branches (char ***branches);
+int cmd_index (int argc, char **argv);
+int cmd_versions (int argc, char **argv);
+int cmd_find (int argc, char **argv);
+int cmd_df (int argc, char **argv);
+int copy_range (int src, uint64_t offset, int dst, uint64_t size);
+int replicate_file (const char *src_fn, const char *dst_fn);
+int repl_meta_copy (const char *src_fn, const char *dst_fn);
+struct repl_link *repl_note_link (const struct stat *sb, const char *dst,
+				  int immutable);
+int repl_link_to (struct repl_link *rl, const char *dst);
+int repl_relink (struct repl_link *rl, const char *dst);
+void repl_old_link (const struct stat *sb, const char *dst, int immutable);
+void *repl_worker (void *arg);
+void repl_retarget (const char *tar, const char *dst, char *out);
+int cmd_replicate (int argc, char **argv);
+void export_write (const void *p, size_t n);
+int tar_octal (char *field, int len, uint64_t v);
+void pax_record (struct buf *b, const char *key, const char *val);
+void tar_pad (uint64_t size);
+void tar_seal (unsigned char *h);
+void tar_header (const char *name, const struct stat *sb, int type,
+		 const char *link);
+uint64_t tar_send (int fd, uint64_t offset, uint64_t size);
+void tar_zero (uint64_t left);
+void tar_end (uint64_t size);
+int tar_data (int fd, uint64_t offset, uint64_t size);
+int export_entry (const char *name, const char *fn, const struct stat *sb);
+int export_packed (const char *name, struct pack_view *pv,
+		   const struct pack_rec *pr);
+int export_chunked (const char *name, struct pack_view *pv,
+		    const struct pack_rec *pr);
+int cmd_export (int argc, char **argv);
+void *restore_grow (void *list, int n, size_t size);
+void restore_have_link (const char *key, const char *dst);
+void restore_add_dir (const char *dst, const struct stat *sb);
+int restore_parents (char *dst);
+void restore_meta (const char *dst, const struct stat *sb);
+void restore_add_file (const char *src, const char *dst,
+		       const struct stat *sb, struct pack_view *pv,
+		       uint64_t offset, int recipe);
+void restore_entry (const char *src, const char *dst, const struct stat *sb);
+int restore_chunked (struct restore_file *rf);
+int restore_file (struct restore_file *rf);
+void *restore_worker (void *arg);
+int cmd_restore (int argc, char **argv);
+int backup_main (int argc, char **argv);
+void bakim_enter (struct bakim *b);
+void bakim_leave (struct bakim *b);
+int bakim_fail (struct bakim *b, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+#endif
@@ -0,0 +1,567 @@
+#include "libbakim.h"
+
+/* packs, which keep a slot's small files in one file and an index */
+
+static int cmp_pack_rec (const void *a, const void *b);
+
+/*
+ * the name of a pack file of branch, ext being "pack" or "idx".  kind
+ * is "pack", or "recipe" for the chunk lists of chunked files.
+ */
+char *
+pack_path (const char *kind, const char *branch, const char *ext)
+{
+	char *name, *fn;
+
+	name = xcalloc (1, strlen (branch) + strlen (ext) + 2);
+	sprintf (name, "%s.%s", branch, ext);
+	fn = meta_path (kind, name);
+	free (name);
+
+	return (fn);
+}
+
+/*
+ * read a branch's pack index into recs, path to struct pack_rec.
+ * returns -1 if the branch has no pack.
+ */
+int
+pack_load (const char *kind, const char *branch, struct hash_table *recs)
+{
+	char *fn;
+	int r;
+
+	fn = pack_path (kind, branch, "idx");
+	r = pack_load_idx (fn, recs);
+	free (fn);
+
+	return (r);
+}
+
+/* pack_load() by the name of the pack index */
+int
+pack_load_idx (const char *fn, struct hash_table *recs)
+{
+	char path[PATH_MAX];
+	struct pack_rec rec, *pr;
+	FILE *f;
+
+	if ((f = fopen (fn, "r")) == NULL)
+		return (-1);
+
+	while (fread (&rec, sizeof rec, 1, f) == 1) {
+		if (rec.path_len >= PATH_MAX
+		    || fread (path, 1, rec.path_len, f) != rec.path_len)
+			break;
+		path[rec.path_len] = 0;
+
+		pr = xcalloc (1, sizeof *pr);
+		*pr = rec;
+		hash_insert (recs, path, rec.path_len, pr);
+	}
+
+	fclose (f);
+
+	return (0);
+}
+
+/* the stat a packed file would have had as a file of its own */
+void
+pack_rec_stat (const struct pack_rec *pr, struct stat *sb)
+{
+	memset (sb, 0, sizeof *sb);
+	sb->st_mode = S_IFREG | (pr->mode & 07777);
+	sb->st_uid = pr->uid;
+	sb->st_gid = pr->gid;
+	sb->st_size = pr->size;
+	sb->st_mtime = pr->mtime;
+	sb->st_atime = pr->atime;
+	sb->st_nlink = 1;
+}
+
+/*
+ * the pack of a slot directory in ht, its index loaded on first use.
+ * nothing is created until pack_begin().
+ */
+struct pack *
+pack_get (struct hash_table *ht, const char *kind, const char *slot)
+{
+	struct hash_entry *hp;
+	struct pack *pk;
+	char *fn;
+
+	pthread_mutex_lock (&bk->pack_lock);
+
+	if ((hp = hash_lookup (ht, slot, strlen (slot))) != NULL) {
+		pthread_mutex_unlock (&bk->pack_lock);
+		return (hp->val);
+	}
+
+	pk = xcalloc (1, sizeof *pk);
+	pthread_mutex_init (&pk->lock, NULL);
+	pk->slot = xstrdup (slot);
+	pk->kind = kind;
+	pk->data_fd = -1;
+	pk->idx_fd = -1;
+
+	fn = slot_meta_path (slot, kind, "idx");
+	pack_load_idx (fn, &pk->recs);
+	free (fn);
+
+	hash_insert (ht, slot, strlen (slot), pk);
+
+	pthread_mutex_unlock (&bk->pack_lock);
+
+	return (pk);
+}
+
+/*
+ * ready pk for an append: open it on first use and take its flock, as
+ * another run may be appending to the same slot, then learn where the
+ * data goes.  caller holds pk->lock, and calls pack_end() when done.
+ */
+int
+pack_begin (struct pack *pk)
+{
+	struct stat sb;
+	char *fn;
+	off_t end;
+
+	if (pk->data_fd == -1) {
+		fn = slot_meta_path (pk->slot, pk->kind, "idx");
+		*strrchr (fn, '/') = 0;
+		make_dir (fn, 0755);
+		free (fn);
+
+		fn = slot_meta_path (pk->slot, pk->kind, "pack");
+		if ((pk->data_fd = open (fn, O_WRONLY | O_CREAT | O_APPEND
+					 | O_CLOEXEC, 0644)) == -1) {
+			report ("failed to open pack %s: %m\n", fn);
+			free (fn);
+			return (-1);
+		}
+		free (fn);
+
+		fn = slot_meta_path (pk->slot, pk->kind, "idx");
+		if ((pk->idx_fd = open (fn, O_WRONLY | O_CREAT | O_APPEND
+					| O_CLOEXEC, 0644)) == -1) {
+			report ("failed to open pack index %s: %m\n",
+				fn);
+			free (fn);
+			close (pk->data_fd);
+			pk->data_fd = -1;
+			return (-1);
+		}
+		free (fn);
+
+		/* new ones are 0644 whatever the umask */
+		if (fstat (pk->data_fd, &sb) == 0 && sb.st_size == 0)
+			fchmod (pk->data_fd, 0644);
+		if (fstat (pk->idx_fd, &sb) == 0 && sb.st_size == 0)
+			fchmod (pk->idx_fd, 0644);
+	}
+
+	while (flock (pk->data_fd, LOCK_EX) == -1) {
+		if (errno != EINTR) {
+			report ("failed to lock pack of %s: %m\n",
+				pk->slot);
+			return (-1);
+		}
+	}
+
+	if ((end = lseek (pk->data_fd, 0, SEEK_END)) == -1) {
+		report ("error seeking pack of %s: %m\n", pk->slot);
+		flock (pk->data_fd, LOCK_UN);
+		return (-1);
+	}
+	pk->end = end;
+
+	return (0);
+}
+
+void
+pack_end (struct pack *pk)
+{
+	flock (pk->data_fd, LOCK_UN);
+}
+
+/*
+ * append a file's data to the pack, then its index record, so the
+ * index never names data that isn't there.  caller holds pk->lock.
+ */
+int
+pack_store (struct pack *pk, const char *fpath, const char *path,
+	    const struct stat *sb)
+{
+	int fd, n, w;
+	char buf[64 * 1024], rec_buf[sizeof (struct pack_rec) + PATH_MAX];
+	struct pack_rec *pr;
+	struct xxh64_state st;
+	uint64_t size;
+
+	if ((fd = open (fpath, O_RDONLY | O_NOFOLLOW)) == -1) {
+		report ("cannot open src file %s: %m\n", fpath);
+		return (-1);
+	}
+
+	if (pack_begin (pk) == -1) {
+		close (fd);
+		return (-1);
+	}
+
+	xxh64_init (&st);
+	size = 0;
+
+	while ((n = read (fd, buf, sizeof buf)) > 0) {
+		throttle_copy (n);
+
+		xxh64_update (&st, buf, n);
+
+		if ((w = write (pk->data_fd, buf, n)) != n) {
+			report ("error writing pack of %s:"
+				" possibly out of space\n", pk->slot);
+			/* what did go in stays, unreferenced */
+			close (fd);
+			pack_end (pk);
+			return (-1);
+		}
+		size += n;
+	}
+
+	close (fd);
+
+	if (n < 0) {
+		report ("error reading %s: %m\n", fpath);
+		/* the partial data stays in the pack, unreferenced */
+		pack_end (pk);
+		return (-1);
+	}
+
+	pr = xcalloc (1, sizeof *pr);
+	pr->offset = pk->end;
+	pr->size = size;
+	pr->hash = xxh64_final (&st);
+	pr->mtime = sb->st_mtime;
+	pr->atime = sb->st_atime;
+	pr->mode = sb->st_mode;
+	pr->uid = sb->st_uid;
+	pr->gid = sb->st_gid;
+	pr->path_len = strlen (path);
+
+	pk->end += size;
+
+	memcpy (rec_buf, pr, sizeof *pr);
+	memcpy (rec_buf + sizeof *pr, path, pr->path_len);
+
+	if ((w = write (pk->idx_fd, rec_buf, sizeof *pr + pr->path_len))
+	    != (int) (sizeof *pr + pr->path_len)) {
+		report ("error writing pack index of %s: %m\n",
+			pk->slot);
+		/* a torn record would hide the ones after it */
+		if (w > 0)
+			ftruncate (pk->idx_fd,
+				   lseek (pk->idx_fd, 0, SEEK_END) - w);
+		free (pr);
+		pack_end (pk);
+		return (-1);
+	}
+
+	pack_end (pk);
+	hash_insert (&pk->recs, path, pr->path_len, pr);
+
+	return (0);
+}
+
+/* close this run's packs and make them append-only again */
+void
+pack_seal_all (void)
+{
+	pack_seal (&bk->packs);
+	pack_seal (&bk->recipes);
+}
+
+void
+pack_seal (struct hash_table *ht)
+{
+	unsigned long idx;
+	struct hash_entry *hp;
+	struct pack *pk;
+	int f;
+
+	for (idx = 0; idx < ht->size; idx++) {
+		for (hp = ht->buckets[idx]; hp; hp = hp->next) {
+			pk = hp->val;
+
+			if (pk->data_fd == -1)
+				goto done;
+
+			if (ioctl (pk->data_fd, _IOR ('f', 1, long), &f) == 0) {
+				f |= EXT2_APPEND_FL;
+				ioctl (pk->data_fd, _IOW ('f', 2, long), &f);
+			}
+			if (ioctl (pk->idx_fd, _IOR ('f', 1, long), &f) == 0) {
+				f |= EXT2_APPEND_FL;
+				ioctl (pk->idx_fd, _IOW ('f', 2, long), &f);
+			}
+
+			if (close (pk->data_fd) == -1 || close (pk->idx_fd) == -1)
+				report ("error closing pack of %s:"
+					" %m\n", pk->slot);
+
+		done:
+			free_pack_recs (&pk->recs);
+			pthread_mutex_destroy (&pk->lock);
+			free (pk->slot);
+			free (pk);
+		}
+	}
+
+	hash_clear (ht);
+}
+
+/*
+ * find path in a branch's pack.  on success pr is filled in and fd is
+ * the pack data, open for reading at pr->offset.
+ */
+int
+pack_read (const char *branch, const char *path, struct pack_rec *pr,
+	   int *fd)
+{
+	struct hash_table recs;
+	struct hash_entry *hp;
+	char *fn;
+	int r;
+
+	memset (&recs, 0, sizeof recs);
+
+	if (pack_load ("pack", branch, &recs) == -1)
+		return (-1);
+
+	r = -1;
+
+	if ((hp = hash_lookup (&recs, path, strlen (path))) != NULL) {
+		*pr = *(struct pack_rec *) hp->val;
+
+		fn = pack_path ("pack", branch, "pack");
+		if ((*fd = open (fn, O_RDONLY)) != -1) {
+			if (lseek (*fd, pr->offset, SEEK_SET) == -1)
+				close (*fd);
+			else
+				r = 0;
+		}
+		free (fn);
+	}
+
+	free_pack_recs (&recs);
+
+	return (r);
+}
+
+/* free a table filled by pack_load() */
+void
+free_pack_recs (struct hash_table *recs)
+{
+	struct hash_entry *hp;
+	unsigned long idx;
+
+	for (idx = 0; idx < recs->size; idx++) {
+		for (hp = recs->buckets[idx]; hp; hp = hp->next)
+			free (hp->val);
+	}
+	hash_clear (recs);
+}
+
+/* packs opened for reading, by slot name */
+struct hash_table pack_views;
+
+/*
+ * the packs of slot for reading, loaded once.  fd, or cfd for recipes,
+ * is -1 if it has none.
+ */
+struct pack_view *
+pack_view (const char *slot)
+{
+	struct hash_entry *hp;
+	struct pack_view *pv;
+	char *fn;
+
+	if ((hp = hash_lookup (&pack_views, slot, strlen (slot))) != NULL)
+		return (hp->val);
+
+	pv = xcalloc (1, sizeof *pv);
+	pv->fd = -1;
+	pv->cfd = -1;
+
+	if (pack_load ("pack", slot, &pv->recs) == 0) {
+		fn = pack_path ("pack", slot, "pack");
+		if ((pv->fd = open (fn, O_RDONLY | O_NOATIME)) == -1)
+			pv->fd = open (fn, O_RDONLY);
+		free (fn);
+	}
+
+	if (pack_load ("recipe", slot, &pv->crecs) == 0) {
+		fn = pack_path ("recipe", slot, "pack");
+		if ((pv->cfd = open (fn, O_RDONLY | O_NOATIME)) == -1)
+			pv->cfd = open (fn, O_RDONLY);
+		free (fn);
+	}
+
+	hash_insert (&pack_views, slot, strlen (slot), pv);
+
+	return (pv);
+}
+
+void
+free_pack_views (void)
+{
+	struct hash_entry *hp;
+	struct pack_view *pv;
+	unsigned long idx;
+
+	for (idx = 0; idx < pack_views.size; idx++) {
+		for (hp = pack_views.buckets[idx]; hp; hp = hp->next) {
+			pv = hp->val;
+			free_pack_recs (&pv->recs);
+			free_pack_recs (&pv->crecs);
+			if (pv->fd != -1)
+				close (pv->fd);
+			if (pv->cfd != -1)
+				close (pv->cfd);
+			free (pv);
+		}
+	}
+	hash_clear (&pack_views);
+}
+
+static int
+cmp_pack_rec (const void *a, const void *b)
+{
+	const struct pack_rec *x = ((struct hash_entry **) a)[0]->val;
+	const struct pack_rec *y = ((struct hash_entry **) b)[0]->val;
+
+	return (x->offset < y->offset ? -1 : x->offset > y->offset);
+}
+
+/*
+ * the pack_view() records of branch at or under prefix, in pack order,
+ * from the recipes if recipe is set.  a path that crossed a threshold
+ * on a later run is also a file in the tree, and that one wins.
+ */
+struct hash_entry **
+branch_packed (const char *branch, const char *prefix, int recipe,
+	       unsigned long *n)
+{
+	struct pack_view *pv;
+	struct hash_table *recs;
+	struct hash_entry *hp, **ents;
+	struct stat sb;
+	unsigned long idx;
+	char fn[PATH_MAX];
+	int l;
+
+	pv = pack_view (branch);
+	recs = recipe ? &pv->crecs : &pv->recs;
+
+	ents = xcalloc (recs->count + 1, sizeof *ents);
+	l = strlen (prefix);
+	*n = 0;
+
+	for (idx = 0; (recipe ? pv->cfd : pv->fd) != -1 && idx < recs->size;
+	     idx++) {
+		for (hp = recs->buckets[idx]; hp; hp = hp->next) {
+			if (l && (strncmp (hp->key, prefix, l) != 0
+				  || (hp->key[l] != '/' && hp->key[l])))
+				continue;
+			snprintf (fn, sizeof fn, "%s/%s/%s", bk->backup_root,
+				  branch, hp->key);
+			if (lstat (fn, &sb) == 0)
+				continue;
+			ents[(*n)++] = hp;
+		}
+	}
+
+	qsort (ents, *n, sizeof *ents, cmp_pack_rec);
+
+	return (ents);
+}
+
+/*
+ * what the newest/ link fpath stands for: 0 with the archived entry in
+ * fn and sb, or 1 with its record in a pack, 2 in a recipe pack, as
+ * such a file has no entry of its own and its link names the pack (or
+ * from before that, leads nowhere).  -1 if none of them exists.
+ */
+int
+resolve_newest (const char *fpath, int base, char *fn, struct stat *sb,
+		struct pack_view **pv, struct pack_rec **pr)
+{
+	char tar[PATH_MAX], rel[PATH_MAX], slot[PATH_MAX], *p, *e;
+	struct hash_entry *hp;
+	struct hash_table *recs;
+	int r, l, have;
+
+	if ((r = readlink (fpath, tar, sizeof tar - 1)) == -1) {
+		report ("failed to read link %s: %m\n", fpath);
+		return (-1);
+	}
+	tar[r] = 0;
+
+	if (snprintf (fn, PATH_MAX, "%.*s/%s", base, fpath, tar)
+	    >= PATH_MAX) {
+		report ("path exceeds PATH_MAX\n");
+		return (-1);
+	}
+
+	have = newest_rel (fpath, tar, rel) == 0;
+	l = strlen (bk->backup_root);
+
+	/* ROOT/.bakim/KIND/SLOT.pack, holding newest/PATH */
+	if (have && strncmp (rel, ".bakim/", 7) == 0
+	    && strncmp (fpath, bk->backup_root, l) == 0
+	    && strncmp (fpath + l, "/newest/", 8) == 0
+	    && (p = strchr (rel + 7, '/')) != NULL
+	    && (e = strrchr (p, '.')) != NULL && strcmp (e, ".pack") == 0) {
+		r = strncmp (rel + 7, "recipe/", 7) == 0 ? 2 : 1;
+		p++;
+		snprintf (slot, sizeof slot, "%.*s", (int) (e - p), p);
+
+		*pv = pack_view (slot);
+		recs = r == 1 ? &(*pv)->recs : &(*pv)->crecs;
+		if ((r == 1 ? (*pv)->fd : (*pv)->cfd) != -1
+		    && (hp = hash_lookup (recs, fpath + l + 8,
+					  strlen (fpath + l + 8)))) {
+			*pr = hp->val;
+			return (r);
+		}
+
+		report ("%s: not in pack %s\n", fpath, tar);
+		return (-1);
+	}
+
+	if (lstat (fn, sb) == 0)
+		return (0);
+
+	if (have) {
+		strcpy (slot, rel);
+		if ((p = strchr (slot, '/')) != NULL) {
+			*p++ = 0;
+			*pv = pack_view (slot);
+			if ((*pv)->fd != -1 && (hp = hash_lookup (&(*pv)->recs,
+								  p,
+								  strlen (p)))) {
+				*pr = hp->val;
+				return (1);
+			}
+			if ((*pv)->cfd != -1
+			    && (hp = hash_lookup (&(*pv)->crecs, p,
+						  strlen (p)))) {
+				*pr = hp->val;
+				return (2);
+			}
+		}
+	}
+
+	report ("%s: target %s is missing\n", fpath, tar);
+
+	return (-1);
+}
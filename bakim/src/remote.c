@@ -0,0 +1,947 @@
+#include "libbakim.h"
+
+/* backing up to another host: bakim -t and bakim recv */
+
+struct remote remote = {
+	-1, NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER
+};
+
+static int mk_remote (const char *fpath, const struct stat *sb, int tflag,
+		      struct FTW *ftwbuf);
+
+/*
+ * the remote protocol.  every frame is a type byte and a little endian
+ * 32 bit payload length.  the sender opens with H (version), then sends
+ * E (a batch of entries), R (end of a root), F (end of the walk) and,
+ * for each file the receiver asks for, D (id, up to REMOTE_CHUNK bytes
+ * of data) frames closed by Z (id, status).  the receiver answers each
+ * E batch with one N (last id of the batch, ids it needs the data of),
+ * preceded by X (message) if it could read only part of the batch,
+ * echoes F once it has placed everything, and answers the sender's
+ * closing Q with Q (status).  an entry is:
+ *
+ *	u32 id, u8 type (f, d or l), u16 level, u32 mode, u32 uid,
+ *	u32 gid, u64 size, u64 mtime, u64 atime, u16 length, path,
+ *	and for links u16 length, target
+ */
+void
+buf_put (struct buf *b, const void *p, size_t n)
+{
+	if (b->len + n > b->alloc) {
+		b->alloc = b->alloc ? b->alloc * 2 : 4096;
+		if (b->alloc < b->len + n)
+			b->alloc = b->len + n;
+		if ((b->data = realloc (b->data, b->alloc)) == NULL) {
+			report ("out of memory\n");
+			exit (1);
+		}
+	}
+
+	memcpy (b->data + b->len, p, n);
+	b->len += n;
+}
+
+void
+buf_uint (struct buf *b, uint64_t v, int n)
+{
+	unsigned char tmp[8];
+	int idx;
+
+	for (idx = 0; idx < n; idx++)
+		tmp[idx] = v >> (8 * idx);
+
+	buf_put (b, tmp, n);
+}
+
+void
+put_le32 (unsigned char *p, uint32_t v)
+{
+	int idx;
+
+	for (idx = 0; idx < 4; idx++)
+		p[idx] = v >> (8 * idx);
+}
+
+uint32_t
+get_le32 (const unsigned char *p)
+{
+	return (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24);
+}
+
+const unsigned char *
+rd_bytes (struct rd *r, size_t n)
+{
+	const unsigned char *p;
+
+	if (r->bad || r->end - r->p < n) {
+		r->bad = 1;
+		return (NULL);
+	}
+
+	p = r->p;
+	r->p += n;
+
+	return (p);
+}
+
+uint64_t
+rd_uint (struct rd *r, int n)
+{
+	const unsigned char *p;
+	uint64_t v;
+	int idx;
+
+	if ((p = rd_bytes (r, n)) == NULL)
+		return (0);
+
+	v = 0;
+	for (idx = 0; idx < n; idx++)
+		v |= (uint64_t) p[idx] << (8 * idx);
+
+	return (v);
+}
+
+int
+write_all (int fd, const void *p, size_t n)
+{
+	ssize_t r;
+
+	while (n > 0) {
+		if ((r = write (fd, p, n)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		p = (const char *) p + r;
+		n -= r;
+	}
+
+	return (0);
+}
+
+/* one frame, with its payload in two parts to spare copying data */
+void
+send_frame (int fd, int type, const void *a, size_t alen, const void *b,
+	    size_t blen)
+{
+	unsigned char hdr[5];
+
+	hdr[0] = type;
+	put_le32 (hdr + 1, alen + blen);
+
+	pthread_mutex_lock (&remote.send_lock);
+
+	if (write_all (fd, hdr, sizeof hdr) == -1
+	    || (alen && write_all (fd, a, alen) == -1)
+	    || (blen && write_all (fd, b, blen) == -1)) {
+		report ("lost the remote connection: %m\n");
+		exit (1);
+	}
+
+	pthread_mutex_unlock (&remote.send_lock);
+}
+
+int
+recv_frame (FILE *f, int *type, struct buf *b)
+{
+	unsigned char hdr[5];
+	uint32_t len;
+	int idx;
+
+	if (fread (hdr, 1, sizeof hdr, f) != sizeof hdr)
+		return (-1);
+
+	*type = hdr[0];
+	len = 0;
+	for (idx = 0; idx < 4; idx++)
+		len |= (uint32_t) hdr[idx + 1] << (8 * idx);
+
+	if (len > REMOTE_MAX_FRAME) {
+		report ("oversized frame from the remote side\n");
+		return (-1);
+	}
+
+	b->len = 0;
+	if (len > b->alloc) {
+		free (b->data);
+		b->alloc = len;
+		b->data = xcalloc (1, len);
+	}
+
+	if (len && fread (b->data, 1, len, f) != len)
+		return (-1);
+
+	b->len = len;
+
+	return (0);
+}
+
+/* start remote_cmd with its stdin and stdout on one end of a socketpair */
+void
+remote_start (void)
+{
+	int sv[2];
+
+	if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		report ("socketpair failed: %m\n");
+		exit (1);
+	}
+
+	if ((remote.pid = fork ()) == -1) {
+		report ("fork failed: %m\n");
+		exit (1);
+	}
+
+	if (remote.pid == 0) {
+		close (sv[0]);
+		dup2 (sv[1], 0);
+		dup2 (sv[1], 1);
+		close (sv[1]);
+		execl ("/bin/sh", "sh", "-c", bk->remote_cmd, (char *) NULL);
+		report ("failed to run %s: %m\n", bk->remote_cmd);
+		_exit (127);
+	}
+
+	close (sv[1]);
+	remote.fd = sv[0];
+
+	if ((remote.in = fdopen (dup (sv[0]), "r")) == NULL) {
+		report ("fdopen failed: %m\n");
+		exit (1);
+	}
+
+	signal (SIGPIPE, SIG_IGN);
+}
+
+void
+remote_flush (void)
+{
+	if (remote.n_batch == 0)
+		return;
+
+	send_frame (remote.fd, 'E', remote.batch.data, remote.batch.len,
+		    NULL, 0);
+
+	remote.batch.len = 0;
+	remote.n_batch = 0;
+}
+
+static int
+mk_remote (const char *fpath, const struct stat *sb,
+	   int tflag, struct FTW *ftwbuf)
+{
+	const char *path;
+	char tar[PATH_MAX];
+	struct buf *b;
+	uint32_t id;
+	int type, r;
+
+	path = fpath + cur->base_off;
+
+	if (strcmp (path, ".") == 0)
+		return (0);
+
+	if (filtered (fpath, sb, tflag, ftwbuf))
+		return (tflag == FTW_D ? FTW_SKIP_SUBTREE : FTW_CONTINUE);
+
+	throttle_take (&bk->meta_limit, 1);
+
+	switch (tflag) {
+	case FTW_F:
+		type = 'f';
+		break;
+	case FTW_D:
+		type = 'd';
+		break;
+	case FTW_SL:
+		type = 'l';
+		if ((r = readlink (fpath, tar, sizeof tar - 1)) == -1) {
+			report ("failed to read link %s: %m\n", fpath);
+			return (0);
+		}
+		tar[r] = 0;
+		break;
+	default:
+		return (0);
+	}
+
+	pthread_mutex_lock (&remote.lock);
+
+	if (remote.n_ids == remote.ids_alloc) {
+		remote.ids_alloc = remote.ids_alloc ? remote.ids_alloc * 2
+			: 4096;
+		remote.paths = realloc (remote.paths,
+					remote.ids_alloc * sizeof (char *));
+		if (remote.paths == NULL) {
+			report ("out of memory\n");
+			exit (1);
+		}
+	}
+
+	id = remote.n_ids++;
+	remote.paths[id] = type == 'f' ? xstrdup (fpath) : NULL;
+
+	pthread_mutex_unlock (&remote.lock);
+
+	b = &remote.batch;
+	buf_uint (b, id, 4);
+	buf_uint (b, type, 1);
+	buf_uint (b, ftwbuf->level, 2);
+	buf_uint (b, sb->st_mode, 4);
+	buf_uint (b, sb->st_uid, 4);
+	buf_uint (b, sb->st_gid, 4);
+	buf_uint (b, sb->st_size, 8);
+	buf_uint (b, sb->st_mtime, 8);
+	buf_uint (b, sb->st_atime, 8);
+	buf_uint (b, strlen (path), 2);
+	buf_put (b, path, strlen (path));
+
+	if (type == 'l') {
+		buf_uint (b, strlen (tar), 2);
+		buf_put (b, tar, strlen (tar));
+	}
+
+	if (++remote.n_batch >= REMOTE_BATCH || b->len >= REMOTE_BATCH_BYTES)
+		remote_flush ();
+
+	return (0);
+}
+
+/* collect the receiver's answers; ids it passed over are forgotten */
+void *
+remote_reader (void *arg)
+{
+	struct buf b;
+	struct rd r;
+	uint32_t upto, id;
+	int type, quit;
+
+	memset (&b, 0, sizeof b);
+	quit = 0;
+
+	while (!quit && recv_frame (remote.in, &type, &b) == 0) {
+		r.p = b.data;
+		r.end = b.data + b.len;
+		r.bad = 0;
+
+		pthread_mutex_lock (&remote.lock);
+
+		switch (type) {
+		case 'N':
+			upto = rd_uint (&r, 4);
+
+			while (r.p < r.end) {
+				id = rd_uint (&r, 4);
+
+				if (r.bad || id >= remote.n_ids
+				    || !remote.paths[id])
+					continue;
+
+				if (remote.n_needs == remote.needs_alloc) {
+					remote.needs_alloc = remote.needs_alloc
+						? remote.needs_alloc * 2 : 1024;
+					remote.needs = realloc (remote.needs,
+						remote.needs_alloc
+						* sizeof *remote.needs);
+					if (remote.needs == NULL) {
+						report ("out of memory\n");
+						exit (1);
+					}
+				}
+
+				remote.needs[remote.n_needs].id = id;
+				remote.needs[remote.n_needs].path =
+					remote.paths[id];
+				remote.n_needs++;
+				remote.paths[id] = NULL;
+			}
+
+			for (id = remote.acked; id <= upto
+				     && id < remote.n_ids; id++) {
+				free (remote.paths[id]);
+				remote.paths[id] = NULL;
+			}
+			remote.acked = id;
+			break;
+		case 'X':
+			report ("the receiver refused a batch: %.*s\n",
+				(int) b.len, b.data);
+			break;
+		case 'F':
+			remote.no_more = 1;
+			break;
+		case 'Q':
+			remote.status = (int32_t) rd_uint (&r, 4);
+			quit = 1;
+			break;
+		}
+
+		pthread_cond_broadcast (&remote.cond);
+		pthread_mutex_unlock (&remote.lock);
+	}
+
+	if (!quit) {
+		report ("the receiver closed the connection\n");
+		pthread_mutex_lock (&remote.lock);
+		remote.status = -1;
+		remote.no_more = 1;
+		pthread_cond_broadcast (&remote.cond);
+		pthread_mutex_unlock (&remote.lock);
+	}
+
+	free (b.data);
+
+	return (NULL);
+}
+
+void
+send_file (uint32_t id, const char *fpath, unsigned char *buf)
+{
+	int fd, n;
+	unsigned char status;
+
+	put_le32 (buf, id);
+	status = 0;
+
+	if ((fd = open (fpath, O_RDONLY)) == -1) {
+		report ("cannot open src file %s: %m\n", fpath);
+		status = 1;
+	} else {
+		while ((n = read (fd, buf + 4, REMOTE_CHUNK)) != 0) {
+			if (n == -1) {
+				if (errno == EINTR)
+					continue;
+				report ("error reading %s: %m\n",
+					fpath);
+				status = 1;
+				break;
+			}
+
+			throttle_take (&bk->read_limit, n);
+			send_frame (remote.fd, 'D', buf, 4 + n, NULL, 0);
+		}
+
+		close (fd);
+	}
+
+	send_frame (remote.fd, 'Z', buf, 4, &status, 1);
+}
+
+/* send the data of each file the receiver asks for, in the order asked */
+void *
+remote_data (void *arg)
+{
+	unsigned char *buf;
+	struct need nd;
+
+	buf = xcalloc (1, 4 + REMOTE_CHUNK);
+
+	for (;;) {
+		pthread_mutex_lock (&remote.lock);
+
+		while (remote.need_head == remote.n_needs && !remote.no_more)
+			pthread_cond_wait (&remote.cond, &remote.lock);
+
+		if (remote.need_head == remote.n_needs) {
+			pthread_mutex_unlock (&remote.lock);
+			break;
+		}
+
+		nd = remote.needs[remote.need_head++];
+		if (remote.need_head == remote.n_needs)
+			remote.need_head = remote.n_needs = 0;
+
+		pthread_mutex_unlock (&remote.lock);
+
+		send_file (nd.id, nd.path, buf);
+		free (nd.path);
+	}
+
+	send_frame (remote.fd, 'Q', NULL, 0, NULL, 0);
+
+	free (buf);
+
+	return (NULL);
+}
+
+/* back up every root through the receiver started by remote_cmd */
+int
+remote_backup (void)
+{
+	pthread_t reader, data;
+	struct root_ctx *rc;
+	int status, wstatus;
+
+	remote_start ();
+
+	send_frame (remote.fd, 'H', REMOTE_VERSION, strlen (REMOTE_VERSION),
+		    NULL, 0);
+
+	if (start_thread (&reader, remote_reader, NULL) != 0
+	    || start_thread (&data, remote_data, NULL) != 0) {
+		report ("failed to start remote threads: %m\n");
+		exit (1);
+	}
+
+	set_ioprio ();
+
+	status = 0;
+
+	for (rc = bk->first_root; rc; rc = rc->next) {
+		cur = rc;
+
+		if (nftw (rc->path, mk_remote, MAX_DIRS_OPEN,
+			  FTW_PHYS | FTW_ACTIONRETVAL) == -1) {
+			report ("nftw failed\n");
+			status = -1;
+		}
+
+		remote_flush ();
+		send_frame (remote.fd, 'R', NULL, 0, NULL, 0);
+
+		cur = NULL;
+	}
+
+	send_frame (remote.fd, 'F', NULL, 0, NULL, 0);
+
+	pthread_join (data, NULL);
+	pthread_join (reader, NULL);
+
+	if (remote.status)
+		status = remote.status;
+
+	close (remote.fd);
+	fclose (remote.in);
+
+	if (waitpid (remote.pid, &wstatus, 0) == -1
+	    || !WIFEXITED (wstatus) || WEXITSTATUS (wstatus) != 0)
+		status = -1;
+
+	free (remote.paths);
+	free (remote.needs);
+	free (remote.batch.data);
+
+	return (status);
+}
+
+/* a relative path with no way out of the tree it is applied under */
+int
+safe_path (const char *path)
+{
+	const char *p;
+
+	if (*path == 0 || *path == '/')
+		return (0);
+
+	for (p = path; p; p = strchr (p, '/')) {
+		if (*p == '/')
+			p++;
+		if (strncmp (p, "..", 2) == 0 && (p[2] == '/' || p[2] == 0))
+			return (0);
+	}
+
+	return (1);
+}
+
+/*
+ * apply one E batch the way mk_backup() would, and answer with the ids
+ * of the files that need storing.  those only have their slot chosen
+ * here; recv_open() and recv_finish() write the data under a temporary
+ * name and give it its own, and newest/ its link, once all is there.
+ * the rest of a batch that can't be read is refused with an X frame,
+ * and the N answers for the entries before it.
+ */
+int
+recv_entries (struct buf *b, int out, struct recv_file **files, int *n_files,
+	      int *alloc)
+{
+	struct rd r;
+	struct buf reply;
+	struct stat sb;
+	struct FTW ftw;
+	struct recv_file *rf;
+	const char *slot;
+	char path[PATH_MAX], tar[PATH_MAX], dst[PATH_MAX];
+	static const char bad_batch[] = "malformed entry batch";
+	const unsigned char *p;
+	uint32_t id, last;
+	int type, len, status;
+
+	r.p = b->data;
+	r.end = b->data + b->len;
+	r.bad = 0;
+
+	memset (&reply, 0, sizeof reply);
+	buf_uint (&reply, 0, 4);
+	last = 0;
+	status = 0;
+
+	while (r.p < r.end && !r.bad) {
+		memset (&sb, 0, sizeof sb);
+		memset (&ftw, 0, sizeof ftw);
+
+		id = rd_uint (&r, 4);
+		type = rd_uint (&r, 1);
+		ftw.level = rd_uint (&r, 2);
+		sb.st_mode = rd_uint (&r, 4);
+		sb.st_uid = rd_uint (&r, 4);
+		sb.st_gid = rd_uint (&r, 4);
+		sb.st_size = rd_uint (&r, 8);
+		sb.st_mtime = rd_uint (&r, 8);
+		sb.st_atime = rd_uint (&r, 8);
+		sb.st_nlink = 1;
+
+		len = rd_uint (&r, 2);
+		if (len >= PATH_MAX || (p = rd_bytes (&r, len)) == NULL) {
+			r.bad = 1;
+			break;
+		}
+		memcpy (path, p, len);
+		path[len] = 0;
+
+		if (type == 'l') {
+			len = rd_uint (&r, 2);
+			if (len >= PATH_MAX
+			    || (p = rd_bytes (&r, len)) == NULL) {
+				r.bad = 1;
+				break;
+			}
+			memcpy (tar, p, len);
+			tar[len] = 0;
+			sb.st_size = len;
+		}
+
+		if (r.bad || !strchr ("dlf", type)) {
+			r.bad = 1;
+			break;
+		}
+		last = id;
+
+		if (!safe_path (path)) {
+			report ("refusing path %s\n", path);
+			status = -1;
+			continue;
+		}
+
+		throttle_take (&bk->meta_limit, 1);
+
+		switch (type) {
+		case 'd':
+			if (backup_dir (path, &sb, &ftw,
+					cur->tgt->directory) == -1) {
+				report ("failed to back up %s\n",
+					path);
+				status = -1;
+			}
+			break;
+		case 'l':
+			cur->src_link = tar;
+			if (backup_link (path, &sb, &ftw,
+					 cur->tgt->directory) == -1) {
+				report ("failed to back up %s\n",
+					path);
+				status = -1;
+			}
+			cur->src_link = NULL;
+			break;
+		case 'f':
+			if ((len = place_file (path, &sb, cur->tgt->directory,
+					       dst, &slot)) != 1) {
+				if (len == -1)
+					status = -1;
+				break;
+			}
+
+			if (newest_unsafe (path)) {
+				status = -1;
+				break;
+			}
+
+			if (*n_files == *alloc) {
+				*alloc = *alloc ? *alloc * 2 : 1024;
+				*files = realloc (*files,
+						  *alloc * sizeof **files);
+				if (*files == NULL) {
+					report ("out of memory\n");
+					exit (1);
+				}
+			}
+
+			rf = &(*files)[(*n_files)++];
+			rf->id = id;
+			rf->dst = xstrdup (dst);
+			rf->slot = xstrdup (slot);
+			rf->path = xstrdup (path);
+			rf->tmp = NULL;
+			rf->level = ftw.level;
+			rf->sb = sb;
+
+			buf_uint (&reply, id, 4);
+			break;
+		}
+	}
+
+	if (r.bad) {
+		report ("%s\n", bad_batch);
+		send_frame (out, 'X', bad_batch, strlen (bad_batch), NULL, 0);
+		status = -1;
+	}
+
+	put_le32 (reply.data, last);
+
+	send_frame (out, 'N', reply.data, reply.len, NULL, 0);
+	free (reply.data);
+
+	return (status);
+}
+
+/* a temporary file beside rf->dst for its data to arrive in */
+int
+recv_open (struct recv_file *rf)
+{
+	int fd;
+
+	rf->tmp = xcalloc (1, strlen (rf->dst) + 20);
+	sprintf (rf->tmp, "%.*s/.bakim-recv.XXXXXX",
+		 (int) (strrchr (rf->dst, '/') - rf->dst), rf->dst);
+
+	if ((fd = mkostemp (rf->tmp, O_CLOEXEC)) == -1) {
+		report ("cannot open dst file %s: %m\n", rf->tmp);
+		free (rf->tmp);
+		rf->tmp = NULL;
+	}
+
+	return (fd);
+}
+
+/*
+ * the data of the oldest placed file has arrived; make it a backup
+ * under its own name.  a file of another root by the same path, placed
+ * before either had arrived, may have taken that name meanwhile; the
+ * slot is then chosen again, and an identical copy leaves nothing to do.
+ */
+int
+recv_finish (struct recv_file *rf, int fd, long long size,
+	     unsigned long long hash, int ok)
+{
+	char dst[PATH_MAX];
+	const char *slot;
+	int r, placed;
+
+	if (close (fd) != 0) {
+		report ("error closing file %s: %m\n", rf->tmp);
+		ok = 0;
+	}
+
+	placed = 1;
+	if (ok) {
+		rf->sb.st_size = size;
+		set_file_meta (rf->tmp, &rf->sb);
+
+		if ((r = link (rf->tmp, rf->dst)) == -1 && errno == EEXIST) {
+			placed = place_file (rf->path, &rf->sb,
+					     cur->tgt->directory, dst, &slot);
+			if (placed == 1) {
+				free (rf->dst);
+				free (rf->slot);
+				rf->dst = xstrdup (dst);
+				rf->slot = xstrdup (slot);
+				r = link (rf->tmp, rf->dst);
+			} else if (placed == 0) {
+				r = 0;
+			}
+		}
+
+		if (r == -1) {
+			report ("failed to link %s to %s: %m\n",
+				rf->dst, rf->tmp);
+			ok = 0;
+		}
+	}
+
+	unlink (rf->tmp);
+
+	if (ok && placed == 1) {
+		set_immutable (rf->dst);
+
+		manifest_add (rf->slot, rf->path, size, hash);
+		acct_add (rf->slot, 1, size, 0);
+		index_note (rf->slot, rf->path);
+
+		if (update_newest (rf->slot, rf->path, rf->level, NULL) == -1)
+			ok = 0;
+	}
+
+	if (!ok)
+		report ("failed to back up %s\n", rf->path);
+
+	free (rf->dst);
+	free (rf->slot);
+	free (rf->path);
+	free (rf->tmp);
+
+	return (ok ? 0 : -1);
+}
+
+/*
+ * bakim recv (or bakim-recv): the storing end of -t.  the protocol
+ * runs over stdin and stdout; anything else printing to stdout goes to
+ * stderr instead so it cannot corrupt the stream.
+ */
+int
+cmd_recv (int argc, char **argv)
+{
+	struct buf b;
+	struct rd r;
+	struct root_ctx *rc;
+	struct recv_file *files, *rf;
+	struct xxh64_state st;
+	uint32_t id, status_le;
+	long long size;
+	int out, type, n_files, alloc, head, fd, status, fix_later;
+
+	if (argc != 1)
+		usage ();
+
+	if ((out = dup (1)) == -1 || dup2 (2, 1) == -1) {
+		report ("failed to set up stdout: %m\n");
+		return (1);
+	}
+
+	memset (&b, 0, sizeof b);
+
+	if (recv_frame (stdin, &type, &b) == -1 || type != 'H'
+	    || b.len != strlen (REMOTE_VERSION)
+	    || memcmp (b.data, REMOTE_VERSION, b.len) != 0) {
+		report ("bad greeting from the sender\n");
+		return (1);
+	}
+
+	add_target (bk->backup_root);
+
+	if (open_branch () == -1)
+		return (1);
+
+	rc = xcalloc (1, sizeof *rc);
+	rc->lane = xcalloc (1, sizeof *rc->lane);
+	rc->tgt = bk->first_target;
+	rc->untrusted = 1;
+	cur = rc;
+
+	files = NULL;
+	n_files = alloc = head = 0;
+	fd = -1;
+	size = 0;
+	status = 0;
+	fix_later = 0;
+
+	for (;;) {
+		if (recv_frame (stdin, &type, &b) == -1) {
+			report ("the sender closed the connection\n");
+			if (fd != -1)
+				unlink (files[head].tmp);
+			exit (1);
+		}
+
+		r.p = b.data;
+		r.end = b.data + b.len;
+		r.bad = 0;
+
+		if (type == 'Q')
+			break;
+
+		switch (type) {
+		case 'E':
+			if (recv_entries (&b, out, &files, &n_files,
+					  &alloc) == -1)
+				status = -1;
+			break;
+		case 'R':
+			/* files still to come would touch the directories */
+			free_collision_dirs ();
+			if (head == n_files)
+				fix_dirs ();
+			else
+				fix_later = 1;
+			break;
+		case 'F':
+			send_frame (out, 'F', NULL, 0, NULL, 0);
+			break;
+		case 'D':
+		case 'Z':
+			id = rd_uint (&r, 4);
+			if (r.bad || head == n_files || files[head].id != id) {
+				report ("data for unexpected file\n");
+				if (fd != -1)
+					unlink (files[head].tmp);
+				exit (1);
+			}
+
+			rf = &files[head];
+
+			if (fd == -1) {
+				if ((fd = recv_open (rf)) == -1)
+					exit (1);
+				xxh64_init (&st);
+				size = 0;
+			}
+
+			if (type == 'D') {
+				throttle_take (&bk->write_limit, r.end - r.p);
+				xxh64_update (&st, r.p, r.end - r.p);
+
+				if (write_all (fd, r.p, r.end - r.p) == -1) {
+					report ("error writing %s: %m\n",
+						rf->tmp);
+					unlink (rf->tmp);
+					exit (1);
+				}
+				size += r.end - r.p;
+				break;
+			}
+
+			if (recv_finish (rf, fd, size, xxh64_final (&st),
+					 rd_uint (&r, 1) == 0 && !r.bad) == -1)
+				status = -1;
+
+			fd = -1;
+			if (++head == n_files) {
+				head = n_files = 0;
+				if (fix_later) {
+					fix_dirs ();
+					fix_later = 0;
+				}
+			}
+			break;
+		default:
+			report ("unknown frame type %d\n", type);
+			exit (1);
+		}
+	}
+
+	if (head != n_files) {
+		report ("%d files never arrived\n", n_files - head);
+		status = -1;
+	}
+
+	free_collision_dirs ();
+	fix_dirs ();
+	cur = NULL;
+
+	manifest_close_all ();
+	acct_flush_all ();
+
+	if (bk->n_journal)
+		index_update (NULL);
+
+	put_le32 ((unsigned char *) &status_le, status);
+	send_frame (out, 'Q', &status_le, 4, NULL, 0);
+
+	free (files);
+	free (b.data);
+	free (rc->lane);
+	free (rc);
+
+	return (status ? 1 : 0);
+}
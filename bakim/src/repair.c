@@ -0,0 +1,391 @@
+#include "libbakim.h"
+
+/* bakim repair, from the parity -E keeps beside archived files */
+
+/* what bakim repair found */
+char *repair_dir;
+int repair_skip, repair_dry_run;
+long long repair_files, repair_fixed, repair_lost;
+
+static int repair_cb (const char *fpath, const struct stat *sb, int tflag,
+		      struct FTW *ftwbuf);
+
+/* fn opened for writing, its immutable flag cleared for the while */
+int
+repair_open (const char *fn, const struct stat *sb)
+{
+	int fd;
+
+	if ((fd = open (fn, O_RDONLY | O_NOFOLLOW)) != -1) {
+		clear_immutable_fd (fd);
+		close (fd);
+	}
+
+	if ((fd = open (fn, O_WRONLY | O_NOFOLLOW)) == -1)
+		report ("cannot open %s for repair: %m\n", fn);
+
+	return (fd);
+}
+
+/* put back the times writing moved, and seal fn again */
+void
+repair_done (const char *fn, int fd, const struct stat *sb)
+{
+	struct timespec ts[2];
+
+	ts[0] = sb->st_atim;
+	ts[1] = sb->st_mtim;
+
+	if (futimens (fd, ts) == -1)
+		report ("failed to set timestamps on %s: %m\n", fn);
+
+	if (close (fd) != 0)
+		report ("error closing file %s: %m\n", fn);
+
+	set_immutable (fn);
+}
+
+/*
+ * check one row, the RS_DATA blocks of data against the CRCs of rec,
+ * and rebuild the blocks that fail from the parity blocks that don't.
+ * returns how many data blocks were rebuilt, -1 if there were more
+ * than the parity could cover, and -2 if only parity blocks were bad,
+ * which are then made again in rec.
+ */
+int
+repair_row (unsigned char *data, unsigned char *rec, int m, int n_blocks)
+{
+	unsigned char a[RS_DATA * RS_DATA], good[RS_DATA], *par, *syn;
+	int lost[RS_DATA], use[RS_DATA], n_lost, n_use, b, j, k, bad_par;
+
+	par = rec + (RS_DATA + m) * 4;
+	n_lost = n_use = bad_par = 0;
+
+	for (b = 0; b < n_blocks; b++) {
+		good[b] = crc32 (0, data + b * RS_BLOCK, RS_BLOCK)
+			== get_le32 (rec + 4 * b);
+		if (!good[b])
+			lost[n_lost++] = b;
+	}
+
+	for (j = 0; j < m; j++) {
+		if (crc32 (0, par + j * RS_BLOCK, RS_BLOCK)
+		    == get_le32 (rec + 4 * (RS_DATA + j)))
+			use[n_use++] = j;
+		else
+			bad_par = 1;
+	}
+
+	if (n_lost == 0) {
+		if (!bad_par)
+			return (0);
+
+		for (j = 0; j < m; j++) {
+			memset (par + j * RS_BLOCK, 0, RS_BLOCK);
+			for (b = 0; b < n_blocks; b++)
+				gf_mul_add (par + j * RS_BLOCK,
+					    data + b * RS_BLOCK, RS_BLOCK,
+					    rs_coef (j, b));
+		}
+		return (-2);
+	}
+
+	if (n_lost > n_use)
+		return (-1);
+
+	/* what the chosen parity blocks lack for the blocks lost */
+	syn = xcalloc (n_lost, RS_BLOCK);
+
+	for (k = 0; k < n_lost; k++) {
+		j = use[k];
+		memcpy (syn + k * RS_BLOCK, par + j * RS_BLOCK, RS_BLOCK);
+		for (b = 0; b < n_blocks; b++) {
+			if (good[b])
+				gf_mul_add (syn + k * RS_BLOCK,
+					    data + b * RS_BLOCK, RS_BLOCK,
+					    rs_coef (j, b));
+		}
+		for (b = 0; b < n_lost; b++)
+			a[k * n_lost + b] = rs_coef (j, lost[b]);
+	}
+
+	if (gf_invert (a, n_lost) == -1) {
+		free (syn);
+		return (-1);
+	}
+
+	for (b = 0; b < n_lost; b++) {
+		memset (data + lost[b] * RS_BLOCK, 0, RS_BLOCK);
+		for (k = 0; k < n_lost; k++)
+			gf_mul_add (data + lost[b] * RS_BLOCK,
+				    syn + k * RS_BLOCK, RS_BLOCK,
+				    a[b * n_lost + k]);
+	}
+
+	free (syn);
+
+	/* the CRCs themselves may be what rotted */
+	for (b = 0; b < n_lost; b++) {
+		if (crc32 (0, data + lost[b] * RS_BLOCK, RS_BLOCK)
+		    != get_le32 (rec + 4 * lost[b]))
+			return (-1);
+	}
+
+	return (n_lost);
+}
+
+/*
+ * read or write the sidecar's record of a row at off, its parity blocks
+ * plen long there and RS_BLOCK apart in rec.  0 if it came up short.
+ */
+int
+repair_rec (int fd, unsigned char *rec, int m, size_t plen, uint64_t off,
+	    int write)
+{
+	size_t len;
+	int j;
+
+	len = (RS_DATA + m) * 4;
+	if ((write ? pwrite (fd, rec, len, off) : pread (fd, rec, len, off))
+	    != len)
+		return (0);
+	off += len;
+
+	for (j = 0; j < m; j++, off += plen) {
+		if ((write ? pwrite (fd, rec + len + j * RS_BLOCK, plen, off)
+		     : pread (fd, rec + len + j * RS_BLOCK, plen, off))
+		    != plen)
+			return (0);
+	}
+
+	return (1);
+}
+
+/* check the archived file fn against its sidecar, repairing what rotted */
+int
+repair_file (const char *fn, const char *sidecar)
+{
+	unsigned char hdr[RS_HEADER], *data, *rec;
+	struct stat sb;
+	uint64_t size, row, n_rows, off;
+	size_t rec_len, len, blen, plen;
+	int fd, sfd, wfd, swfd, m, b, r, lost;
+
+	if ((sfd = open (sidecar, O_RDONLY | O_NOATIME)) == -1
+	    && (sfd = open (sidecar, O_RDONLY)) == -1) {
+		report ("cannot open %s: %m\n", sidecar);
+		return (-1);
+	}
+
+	if (pread (sfd, hdr, sizeof hdr, 0) != sizeof hdr
+	    || memcmp (hdr, RS_MAGIC, 8) != 0
+	    || get_le32 (hdr + 8) != RS_DATA
+	    || get_le32 (hdr + 16) != RS_BLOCK
+	    || (m = get_le32 (hdr + 12)) < 1 || m > RS_DATA) {
+		printf ("ERROR %s: not a parity file\n", sidecar);
+		close (sfd);
+		return (-1);
+	}
+	size = get_le32 (hdr + 24) | (uint64_t) get_le32 (hdr + 28) << 32;
+
+	if ((fd = open (fn, O_RDONLY | O_NOATIME)) == -1
+	    && (fd = open (fn, O_RDONLY)) == -1) {
+		printf ("ERROR %s: %s\n", fn, strerror (errno));
+		close (sfd);
+		return (-1);
+	}
+
+	if (fstat (fd, &sb) == -1 || sb.st_size != size) {
+		printf ("ERROR %s: size differs from its parity\n", fn);
+		close (fd);
+		close (sfd);
+		return (-1);
+	}
+
+	rec_len = (RS_DATA + m) * 4 + m * RS_BLOCK;
+	n_rows = (size + RS_DATA * RS_BLOCK - 1) / (RS_DATA * RS_BLOCK);
+	data = xcalloc (RS_DATA, RS_BLOCK);
+	rec = xcalloc (1, rec_len);
+	wfd = swfd = -1;
+	lost = 0;
+
+	for (row = 0; row < n_rows; row++) {
+		off = row * RS_DATA * RS_BLOCK;
+		len = size - off < RS_DATA * RS_BLOCK ? size - off
+			: RS_DATA * RS_BLOCK;
+
+		/* an unreadable block counts as lost, like a rotten one */
+		memset (data, 0, RS_DATA * RS_BLOCK);
+		for (b = 0; b * RS_BLOCK < len; b++) {
+			blen = len - b * RS_BLOCK < RS_BLOCK
+				? len - b * RS_BLOCK : RS_BLOCK;
+			if (pread (fd, data + b * RS_BLOCK, blen,
+				   off + b * RS_BLOCK) != blen)
+				memset (data + b * RS_BLOCK, 0, RS_BLOCK);
+		}
+		throttle_take (&bk->read_limit, len);
+
+		plen = len < RS_BLOCK ? len : RS_BLOCK;
+		memset (rec, 0, rec_len);
+
+		if (!repair_rec (sfd, rec, m, plen, RS_HEADER + row * rec_len,
+				 0)) {
+			printf ("ERROR %s: parity is short\n", sidecar);
+			lost = 1;
+			break;
+		}
+
+		r = repair_row (data, rec, m, (len + RS_BLOCK - 1) / RS_BLOCK);
+
+		if (r == -1) {
+			printf ("UNRECOVERABLE %s: %llu+%zu\n", fn,
+				(unsigned long long) off, len);
+			lost = 1;
+			continue;
+		}
+
+		if (r == -2) {
+			printf ("%s %s: parity at row %llu\n",
+				repair_dry_run ? "would repair" : "repaired",
+				sidecar, (unsigned long long) row);
+			if (repair_dry_run)
+				continue;
+			if (swfd == -1 && (swfd = repair_open (sidecar, &sb))
+			    == -1) {
+				lost = 1;
+				continue;
+			}
+			if (!repair_rec (swfd, rec, m, plen, RS_HEADER + row
+					 * rec_len, 1)) {
+				report ("error writing %s: %m\n",
+					sidecar);
+				lost = 1;
+			}
+			continue;
+		}
+
+		if (r == 0)
+			continue;
+
+		printf ("%s %s: %d blocks at %llu+%zu\n",
+			repair_dry_run ? "would repair" : "repaired", fn, r,
+			(unsigned long long) off, len);
+
+		repair_fixed += r;
+
+		if (repair_dry_run)
+			continue;
+
+		if (wfd == -1 && (wfd = repair_open (fn, &sb)) == -1) {
+			lost = 1;
+			continue;
+		}
+
+		/* the whole row is written back, it being good now */
+		if (pwrite (wfd, data, len, off) != len) {
+			report ("error writing %s: %m\n", fn);
+			lost = 1;
+		}
+	}
+
+	if (wfd != -1)
+		repair_done (fn, wfd, &sb);
+
+	if (swfd != -1) {
+		if (fstat (sfd, &sb) == 0)
+			repair_done (sidecar, swfd, &sb);
+	}
+
+	posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+	close (fd);
+	close (sfd);
+	free (data);
+	free (rec);
+
+	if (lost)
+		repair_lost++;
+	repair_files++;
+
+	return (lost ? -1 : 0);
+}
+
+static int
+repair_cb (const char *fpath, const struct stat *sb, int tflag,
+	   struct FTW *ftwbuf)
+{
+	char fn[PATH_MAX];
+
+	if (tflag != FTW_F)
+		return (0);
+
+	if (snprintf (fn, sizeof fn, "%s%s", repair_dir, fpath + repair_skip)
+	    >= sizeof fn)
+		return (0);
+
+	repair_file (fn, fpath);
+
+	return (0);
+}
+
+int
+cmd_repair (int argc, char **argv)
+{
+	int c, idx, n;
+	char **branches, *dir;
+
+	while ((c = getopt (argc, argv, "nR:")) != EOF) {
+		switch (c) {
+		case 'n':
+			repair_dry_run = 1;
+			break;
+		case 'R':
+			bk->read_limit.rate = parse_size (optarg);
+			break;
+		default:
+			usage ();
+		}
+	}
+
+	if (optind < argc) {
+		for (idx = optind; idx < argc; idx++) {
+			if (!is_branch_name (argv[idx])) {
+				report ("branches are named"
+					" YYYY-MM-DD[-xx]\n");
+				return (1);
+			}
+		}
+		n = argc - optind;
+		branches = xcalloc (n, sizeof *branches);
+		for (idx = 0; idx < n; idx++)
+			branches[idx] = xstrdup (argv[optind + idx]);
+	} else if ((n = list_all_branches (&branches)) == -1) {
+		return (1);
+	}
+
+	pthread_once (&gf_once, gf_init);
+
+	for (idx = 0; idx < n; idx++) {
+		dir = meta_path ("parity", branches[idx]);
+		repair_dir = xcalloc (1, strlen (bk->backup_root)
+				      + strlen (branches[idx]) + 2);
+		sprintf (repair_dir, "%s/%s", bk->backup_root, branches[idx]);
+		repair_skip = strlen (dir);
+
+		if (nftw (dir, repair_cb, MAX_DIRS_OPEN, FTW_PHYS) == -1
+		    && errno != ENOENT) {
+			report ("failed to walk %s: %m\n", dir);
+			repair_lost++;
+		}
+
+		free (repair_dir);
+		free (dir);
+		free (branches[idx]);
+	}
+	free (branches);
+
+	printf ("%lld files checked, %lld blocks %s, %lld files"
+		" unrecoverable\n", repair_files, repair_fixed,
+		repair_dry_run ? "to repair" : "repaired", repair_lost);
+
+	return (repair_lost ? 1 : 0);
+}
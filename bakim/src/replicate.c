@@ -0,0 +1,840 @@
+#include "libbakim.h"
+
+static int repl_cb (const char *fpath, const struct stat *sb, int tflag,
+		    struct FTW *ftwbuf);
+static int repl_fix_dir (const char *fpath, const struct stat *sb, int tflag,
+			 struct FTW *ftwbuf);
+static int repl_newest_cb (const char *fpath, const struct stat *sb,
+			   int tflag, struct FTW *ftwbuf);
+static int repl_newest_prune (const char *fpath, const struct stat *sb,
+			      int tflag, struct FTW *ftwbuf);
+static int repl_chunk_cb (const char *fpath, const struct stat *sb,
+			  int tflag, struct FTW *ftwbuf);
+
+/*
+ * bakim replicate: bring a second store up to date with backup_root's
+ * layout.  a branch dated before today never changes again, so once it
+ * has been copied whole a marker under .bakim/replica says so and later
+ * runs pass it by.  today's branches are re-walked and topped up.
+ */
+struct repl_job {
+	struct repl_job *next;
+	char *branch, *src, *dst;
+	int skip, final, errors;
+	long long files, bytes;
+	struct hash_table links;	/* the repl_links it added, to seal */
+};
+
+/*
+ * a hard linked file, whether its source was immutable and whether it
+ * was copied by this run
+ */
+struct repl_link {
+	char *dst;
+	int immutable, fresh;
+};
+
+static __thread struct repl_job *cur_repl;
+
+/*
+ * repl_lock guards the queue and repl_links, the copy of each multiply
+ * linked source inode by dev:ino.  the table is shared by every branch,
+ * as later branches link to files of earlier ones.
+ */
+pthread_mutex_t repl_lock = PTHREAD_MUTEX_INITIALIZER;
+struct repl_job *repl_queue;
+struct hash_table repl_links;
+char *repl_src, *repl_dst;
+long long repl_chunk_bytes;
+int repl_chunk_errors;
+
+/*
+ * size bytes of src from offset to dst at its current position: with
+ * copy_file_range, so the data need not pass through us, else with pread
+ * and write for filesystems that can't.
+ */
+int
+copy_range (int src, uint64_t offset, int dst, uint64_t size)
+{
+	char buf[64 * 1024];
+	loff_t off;
+	ssize_t n;
+
+	off = offset;
+	n = 0;
+
+	while (size > 0 && (n = copy_file_range (src, &off, dst, NULL,
+						 size < 1 << 30 ? size
+						 : 1 << 30, 0)) > 0) {
+		throttle_take (&bk->read_limit, n);
+		size -= n;
+	}
+
+	if (n == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS
+			|| errno == EOPNOTSUPP)) {
+		while (size > 0 && (n = pread (src, buf, size < sizeof buf
+					       ? size : sizeof buf, off)) > 0) {
+			throttle_take (&bk->read_limit, n);
+			if (write_all (dst, buf, n) == -1)
+				return (-1);
+			off += n;
+			size -= n;
+		}
+	}
+
+	if (size > 0 && n == 0)
+		errno = EIO;
+
+	return (size > 0 ? -1 : 0);
+}
+
+/* copy src_fn to a new dst_fn, reflinked where the filesystem can */
+int
+replicate_file (const char *src_fn, const char *dst_fn)
+{
+	struct stat sb;
+	int src, dst, r;
+
+	if (clone_file (src_fn, dst_fn) == 0)
+		return (0);
+
+	if ((src = open (src_fn, O_RDONLY)) == -1 || fstat (src, &sb) == -1) {
+		report ("cannot open src file %s: %m\n", src_fn);
+		if (src != -1)
+			close (src);
+		return (-1);
+	}
+
+	if ((dst = open (dst_fn, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+		report ("cannot open dst file %s: %m\n", dst_fn);
+		close (src);
+		return (-1);
+	}
+
+	if ((r = copy_range (src, 0, dst, sb.st_size)) == -1)
+		report ("error copying %s: %m\n", src_fn);
+
+	close (src);
+
+	if (close (dst) != 0) {
+		report ("error closing file %s: %m\n", dst_fn);
+		r = -1;
+	}
+
+	return (r);
+}
+
+/* replace a bookkeeping file, keeping the source's append-only flag */
+int
+repl_meta_copy (const char *src_fn, const char *dst_fn)
+{
+	struct stat sb;
+	unsigned long flags;
+	char *tmp;
+	int r;
+
+	if (lstat (src_fn, &sb) == -1)
+		return (0);
+
+	tmp = xcalloc (1, strlen (dst_fn) + 10);
+	sprintf (tmp, "%s.tmp", dst_fn);
+	unlink (tmp);
+
+	r = replicate_file (src_fn, tmp);
+
+	if (r == 0 && chmod (tmp, sb.st_mode & 07777) == -1)
+		report ("failed to set mode on %s: %m\n", tmp);
+
+	if (r == 0 && rename (tmp, dst_fn) == -1) {
+		if (errno == EPERM && fsetflags (dst_fn, 0) == 0
+		    && rename (tmp, dst_fn) == 0) {
+			r = 0;
+		} else {
+			report ("failed to replace %s: %m\n", dst_fn);
+			unlink (tmp);
+			r = -1;
+		}
+	}
+
+	if (r == 0 && fgetflags (src_fn, &flags) == 0
+	    && (flags & EXT2_APPEND_FL))
+		fsetflags (dst_fn, EXT2_APPEND_FL);
+
+	free (tmp);
+
+	return (r);
+}
+
+/*
+ * the first copy of a multiply linked source inode in any branch.  with
+ * dst, record it if it is the first.  called with repl_lock held.
+ */
+struct repl_link *
+repl_note_link (const struct stat *sb, const char *dst, int immutable)
+{
+	struct repl_link *rl;
+	struct hash_entry *hp;
+	char key[50];
+
+	sprintf (key, "%llx:%llx", (unsigned long long) sb->st_dev,
+		 (unsigned long long) sb->st_ino);
+
+	if ((hp = hash_lookup (&repl_links, key, strlen (key))) != NULL)
+		return (hp->val);
+
+	if (!dst)
+		return (NULL);
+
+	rl = xcalloc (1, sizeof *rl);
+	rl->dst = xstrdup (dst);
+	rl->immutable = immutable;
+	hash_insert (&repl_links, key, strlen (key), rl);
+	hash_insert (&cur_repl->links, key, strlen (key), rl);
+
+	return (rl);
+}
+
+/* make the copies jp recorded immutable again, as their sources are */
+void
+repl_seal (struct repl_job *jp)
+{
+	struct repl_link *rl;
+	struct hash_entry *hp;
+	unsigned long idx;
+
+	pthread_mutex_lock (&repl_lock);
+
+	for (idx = 0; idx < jp->links.size; idx++) {
+		for (hp = jp->links.buckets[idx]; hp; hp = hp->next) {
+			rl = hp->val;
+			if (rl->immutable)
+				set_immutable (rl->dst);
+		}
+	}
+
+	pthread_mutex_unlock (&repl_lock);
+
+	hash_clear (&jp->links);
+}
+
+/*
+ * make dst another name of rl's copy.  one left by an earlier run is
+ * immutable already and takes no more links until that is cleared;
+ * the end of the branch seals it again.
+ */
+int
+repl_link_to (struct repl_link *rl, const char *dst)
+{
+	unsigned long flags;
+
+	if (link (rl->dst, dst) == 0)
+		return (0);
+
+	if (errno != EPERM || !rl->immutable
+	    || fgetflags (rl->dst, &flags) == -1
+	    || fsetflags (rl->dst, flags & ~EXT2_IMMUTABLE_FL) == -1)
+		return (-1);
+
+	return (link (rl->dst, dst));
+}
+
+/* repl_link_to() for a dst that exists, replacing it */
+int
+repl_relink (struct repl_link *rl, const char *dst)
+{
+	char *tmp;
+	int r;
+
+	tmp = xcalloc (1, strlen (dst) + 20);
+	sprintf (tmp, "%s.bakim-link", dst);
+
+	if ((r = repl_link_to (rl, tmp)) == 0 && (r = rename (tmp, dst)) == -1)
+		unlink (tmp);
+
+	free (tmp);
+
+	return (r);
+}
+
+/*
+ * dst, left by an earlier run, is a copy of the multiply linked sb.  a
+ * name of the inode the walk met first and copied afresh is made a
+ * link to dst instead, so the order names come in doesn't matter.
+ * called with repl_lock held.
+ */
+void
+repl_old_link (const struct stat *sb, const char *dst, int immutable)
+{
+	struct repl_link *rl, old;
+
+	if ((rl = repl_note_link (sb, NULL, 0)) == NULL) {
+		repl_note_link (sb, dst, immutable);
+		return;
+	}
+
+	if (!rl->fresh)
+		return;
+
+	old.dst = (char *) dst;
+	old.immutable = immutable;
+
+	if (repl_relink (&old, rl->dst) == 0) {
+		free (rl->dst);
+		rl->dst = xstrdup (dst);
+		rl->immutable = immutable;
+		rl->fresh = 0;
+	}
+}
+
+static int
+repl_cb (const char *fpath, const struct stat *sb, int tflag,
+	 struct FTW *ftwbuf)
+{
+	struct repl_job *jp;
+	struct repl_link *rl;
+	struct stat dst_sb;
+	char dst[PATH_MAX], tar[PATH_MAX];
+	unsigned long flags;
+	int r;
+
+	jp = cur_repl;
+	flags = 0;
+
+	if (strlen (jp->dst) + strlen (fpath + jp->skip) + 10 >= PATH_MAX) {
+		report ("path exceeds PATH_MAX\n");
+		jp->errors++;
+		return (0);
+	}
+	sprintf (dst, "%s%s", jp->dst, fpath + jp->skip);
+
+	/* left over from an earlier run; a partial file is copied again */
+	if (lstat (dst, &dst_sb) == 0) {
+		if (tflag == FTW_D ? S_ISDIR (dst_sb.st_mode)
+		    : check_same (sb, &dst_sb, fpath, dst)) {
+			if (tflag == FTW_F && sb->st_nlink > 1) {
+				fgetflags (dst, &flags);
+				pthread_mutex_lock (&repl_lock);
+				repl_old_link (sb, dst,
+					       flags & EXT2_IMMUTABLE_FL);
+				pthread_mutex_unlock (&repl_lock);
+			}
+			return (0);
+		}
+		delete_file_or_dir (dst);
+	}
+
+	switch (tflag) {
+	case FTW_D:
+		if (mkdir (dst, sb->st_mode & 07777) == -1) {
+			report ("failed to create directory %s: %m\n",
+				dst);
+			jp->errors++;
+			return (0);
+		}
+		break;
+	case FTW_SL:
+		if ((r = readlink (fpath, tar, sizeof tar - 1)) == -1
+		    || (tar[r] = 0, symlink (tar, dst)) == -1) {
+			report ("failed to copy link %s: %m\n", fpath);
+			jp->errors++;
+			return (0);
+		}
+		break;
+	case FTW_F:
+		fgetflags (fpath, &flags);
+
+		/* a link to the copy in whichever branch has one, or a copy */
+		if (sb->st_nlink > 1) {
+			pthread_mutex_lock (&repl_lock);
+			r = (rl = repl_note_link (sb, NULL, 0)) != NULL
+			    && repl_link_to (rl, dst) == 0;
+			pthread_mutex_unlock (&repl_lock);
+			if (r) {
+				jp->files++;
+				return (0);
+			}
+		}
+
+		if (replicate_file (fpath, dst) == -1) {
+			unlink (dst);
+			jp->errors++;
+			return (0);
+		}
+
+		set_file_meta (dst, sb);
+		jp->files++;
+		jp->bytes += sb->st_size;
+
+		/*
+		 * immutable files can't take more links; seal those later.
+		 * another branch's worker may have copied the inode too
+		 * meanwhile, and its copy is linked to then.
+		 */
+		if (sb->st_nlink > 1) {
+			pthread_mutex_lock (&repl_lock);
+			rl = repl_note_link (sb, dst, flags & EXT2_IMMUTABLE_FL);
+			if (strcmp (rl->dst, dst) == 0)
+				rl->fresh = 1;
+			else
+				repl_relink (rl, dst);
+			pthread_mutex_unlock (&repl_lock);
+		} else if (flags & EXT2_IMMUTABLE_FL)
+			set_immutable (dst);
+		return (0);
+	default:
+		return (0);
+	}
+
+	if (lchown (dst, sb->st_uid, sb->st_gid) == -1)
+		report ("failed to chown %s: %m\n", dst);
+
+	return (0);
+}
+
+/* directory times, once nothing more is created inside them */
+static int
+repl_fix_dir (const char *fpath, const struct stat *sb, int tflag,
+	      struct FTW *ftwbuf)
+{
+	char dst[PATH_MAX];
+	struct utimbuf times;
+
+	if (tflag != FTW_DP)
+		return (0);
+
+	snprintf (dst, sizeof dst, "%s%s", cur_repl->dst,
+		  fpath + cur_repl->skip);
+
+	times.actime = sb->st_atime;
+	times.modtime = sb->st_mtime;
+
+	if (utime (dst, &times) == -1)
+		report ("failed to set timestamp on %s: %m\n", dst);
+
+	return (0);
+}
+
+void *
+repl_worker (void *arg)
+{
+	struct repl_job *jp, pj;
+	unsigned long idx;
+	char *src_fn, *dst_fn, *tmp;
+	static const char *metas[][2] = {
+		{ "manifest", NULL }, { "acct", NULL },
+		{ "pack", "pack" }, { "pack", "idx" },
+		{ "recipe", "pack" }, { "recipe", "idx" }
+	};
+	FILE *f;
+
+	while (1) {
+		pthread_mutex_lock (&repl_lock);
+		if ((jp = repl_queue) != NULL)
+			repl_queue = jp->next;
+		pthread_mutex_unlock (&repl_lock);
+
+		if (!jp)
+			break;
+
+		cur_repl = jp;
+
+		if (nftw (jp->src, repl_cb, MAX_DIRS_OPEN, FTW_PHYS) == -1
+		    || nftw (jp->src, repl_fix_dir, MAX_DIRS_OPEN,
+			     FTW_PHYS | FTW_DEPTH) == -1) {
+			report ("failed to walk %s: %m\n", jp->src);
+			jp->errors++;
+		}
+
+		cur_repl = NULL;
+		repl_seal (jp);
+
+		/* the parity sidecars, a tree of their own */
+		memset (&pj, 0, sizeof pj);
+		pj.src = slot_meta_path (jp->src, "parity", NULL);
+		pj.dst = slot_meta_path (jp->dst, "parity", NULL);
+		pj.skip = strlen (pj.src);
+		cur_repl = &pj;
+
+		if (nftw (pj.src, repl_cb, MAX_DIRS_OPEN, FTW_PHYS) == -1
+		    && errno != ENOENT) {
+			report ("failed to walk %s: %m\n", pj.src);
+			jp->errors++;
+		}
+
+		cur_repl = NULL;
+		repl_seal (&pj);
+		jp->errors += pj.errors;
+		free (pj.src);
+		free (pj.dst);
+
+		for (idx = 0; idx < sizeof metas / sizeof metas[0]; idx++) {
+			src_fn = slot_meta_path (jp->src, metas[idx][0],
+						 metas[idx][1]);
+			dst_fn = slot_meta_path (jp->dst, metas[idx][0],
+						 metas[idx][1]);
+			if (repl_meta_copy (src_fn, dst_fn) == -1)
+				jp->errors++;
+			free (src_fn);
+			free (dst_fn);
+		}
+
+		if (jp->final && !jp->errors) {
+			tmp = slot_meta_path (jp->dst, "replica", NULL);
+			if ((f = meta_fopen (tmp, "w")) == NULL
+			    || fclose (f) != 0) {
+				report ("failed to write %s: %m\n",
+					tmp);
+				jp->errors++;
+			}
+			free (tmp);
+		}
+	}
+
+	return (NULL);
+}
+
+/*
+ * tar, a newest/ link target into repl_src, as the link at dst into
+ * repl_dst: enough ../ to climb from dst to /, then the absolute path.
+ * links made since they climb only to the root are taken as they are.
+ */
+void
+repl_retarget (const char *tar, const char *dst, char *out)
+{
+	const char *p;
+	int l;
+
+	for (p = tar; strncmp (p, "../", 3) == 0; p += 3)
+		;
+
+	l = strlen (repl_src);
+
+	if (p == tar || strncmp (p - 1, repl_src, l) != 0 || p[l - 1] != '/') {
+		strcpy (out, tar);
+		return;
+	}
+
+	*out = 0;
+	for (dst = strchr (dst + 1, '/'); dst; dst = strchr (dst + 1, '/'))
+		strcat (out, "../");
+
+	sprintf (out + strlen (out) - 1, "%s%s", repl_dst, p + l - 1);
+}
+
+static int
+repl_newest_cb (const char *fpath, const struct stat *sb, int tflag,
+		struct FTW *ftwbuf)
+{
+	char dst[PATH_MAX], tar[PATH_MAX], new_tar[PATH_MAX],
+		old_tar[PATH_MAX];
+	struct stat dst_sb;
+	int r, have;
+
+	if (snprintf (dst, sizeof dst, "%s%s", repl_dst,
+		      fpath + strlen (repl_src)) >= sizeof dst)
+		return (0);
+
+	have = lstat (dst, &dst_sb) == 0;
+
+	if (tflag == FTW_D) {
+		if (have && S_ISDIR (dst_sb.st_mode))
+			return (0);
+		if (have)
+			delete_file_or_dir (dst);
+		if (mkdir (dst, sb->st_mode & 07777) == -1)
+			report ("failed to create directory %s: %m\n",
+				dst);
+		else if (lchown (dst, sb->st_uid, sb->st_gid) == -1)
+			report ("failed to chown %s: %m\n", dst);
+		return (0);
+	}
+
+	if (tflag != FTW_SL)
+		return (0);
+
+	if ((r = readlink (fpath, tar, sizeof tar - 1)) == -1)
+		return (0);
+	tar[r] = 0;
+
+	repl_retarget (tar, dst, new_tar);
+
+	if (have) {
+		if (S_ISLNK (dst_sb.st_mode)
+		    && (r = readlink (dst, old_tar, sizeof old_tar - 1)) != -1
+		    && (old_tar[r] = 0, strcmp (old_tar, new_tar) == 0))
+			return (0);
+		delete_file_or_dir (dst);
+	}
+
+	if (symlink (new_tar, dst) == -1)
+		report ("failed to create symlink %s: %m\n", dst);
+	else if (lchown (dst, sb->st_uid, sb->st_gid) == -1)
+		report ("failed to chown %s: %m\n", dst);
+
+	return (0);
+}
+
+/* drop what newest/ no longer has, and settle directory times */
+static int
+repl_newest_prune (const char *fpath, const struct stat *sb, int tflag,
+		   struct FTW *ftwbuf)
+{
+	char src[PATH_MAX];
+	struct stat src_sb;
+	struct utimbuf times;
+
+	if (snprintf (src, sizeof src, "%s%s", repl_src,
+		      fpath + strlen (repl_dst)) >= sizeof src)
+		return (0);
+
+	if (lstat (src, &src_sb) == -1
+	    || (S_ISDIR (src_sb.st_mode) != S_ISDIR (sb->st_mode))) {
+		delete_file_or_dir ((char *) fpath);
+		return (0);
+	}
+
+	if (tflag == FTW_DP) {
+		times.actime = src_sb.st_atime;
+		times.modtime = src_sb.st_mtime;
+		utime (fpath, &times);
+	}
+
+	return (0);
+}
+
+/* chunks the copy lacks; they are named by content, so never change */
+static int
+repl_chunk_cb (const char *fpath, const struct stat *sb, int tflag,
+	       struct FTW *ftwbuf)
+{
+	char dst[PATH_MAX], tmp[PATH_MAX];
+	struct stat dst_sb;
+
+	if (snprintf (dst, sizeof dst, "%s%s", repl_dst,
+		      fpath + strlen (repl_src)) >= sizeof dst)
+		return (0);
+
+	if (tflag == FTW_D) {
+		if (mkdir (dst, 0755) == -1 && errno != EEXIST)
+			report ("failed to create directory %s: %m\n",
+				dst);
+		return (0);
+	}
+
+	if (tflag != FTW_F || ftwbuf->level != 2
+	    || strncmp (fpath + ftwbuf->base, ".tmp.", 5) == 0
+	    || lstat (dst, &dst_sb) == 0)
+		return (0);
+
+	snprintf (tmp, sizeof tmp, "%.*s.tmp.%ld",
+		  (int) (strlen (dst) - strlen (fpath + ftwbuf->base)), dst,
+		  (long) getpid ());
+
+	if (replicate_file (fpath, tmp) == -1) {
+		unlink (tmp);
+		repl_chunk_errors++;
+		return (0);
+	}
+
+	if (chunk_commit (tmp, dst) == -1)
+		repl_chunk_errors++;
+	else
+		repl_chunk_bytes += sb->st_size;
+
+	return (0);
+}
+
+int
+cmd_replicate (int argc, char **argv)
+{
+	int c, idx, n, jobs, dry_run, started, errors;
+	struct repl_job *jobs_list, *jp;
+	struct repl_link *rl;
+	struct hash_entry *hp;
+	struct stat sb;
+	pthread_t threads[MAX_JOBS];
+	char today[20], **branches, *p, *q;
+	time_t now;
+	static const char *dirs[] = {
+		"", "/.bakim", "/.bakim/manifest", "/.bakim/acct",
+		"/.bakim/pack", "/.bakim/replica", "/.bakim/recipe",
+		"/.bakim/chunks", "/.bakim/parity"
+	};
+
+	dry_run = 0;
+	jobs = sysconf (_SC_NPROCESSORS_ONLN);
+
+	while ((c = getopt (argc, argv, "nj:")) != EOF) {
+		switch (c) {
+		case 'n':
+			dry_run = 1;
+			break;
+		case 'j':
+			jobs = atoi (optarg);
+			break;
+		default:
+			usage ();
+		}
+	}
+
+	if (optind + 2 != argc)
+		usage ();
+
+	repl_src = argv[optind];
+	for (p = repl_src + strlen (repl_src); p > repl_src + 1
+		     && p[-1] == '/';)
+		*--p = 0;
+
+	if (jobs < 1)
+		jobs = 1;
+	if (jobs > MAX_JOBS)
+		jobs = MAX_JOBS;
+
+	umask (0);
+
+	for (idx = 0; !dry_run && idx < sizeof dirs / sizeof dirs[0]; idx++) {
+		p = xcalloc (1, strlen (argv[optind + 1]) + 30);
+		sprintf (p, "%s%s", argv[optind + 1], dirs[idx]);
+		if (mkdir (p, 0755) == -1 && errno != EEXIST) {
+			report ("failed to create directory %s: %m\n",
+				p);
+			return (1);
+		}
+		free (p);
+	}
+
+	/* newest/ links are absolute, so the copies need the real path */
+	if ((repl_dst = realpath (argv[optind + 1], NULL)) == NULL) {
+		if (!dry_run) {
+			report ("failed to resolve %s: %m\n",
+				argv[optind + 1]);
+			return (1);
+		}
+		repl_dst = xstrdup (argv[optind + 1]);
+	}
+
+	time (&now);
+	strftime (today, sizeof today, "%Y-%m-%d", localtime (&now));
+
+	bk->backup_root = repl_src;
+	if ((n = list_all_branches (&branches)) == -1)
+		return (1);
+
+	jobs_list = NULL;
+
+	for (idx = n - 1; idx >= 0; idx--) {
+		p = xcalloc (1, strlen (repl_dst) + strlen (branches[idx]) + 2);
+		sprintf (p, "%s/%s", repl_dst, branches[idx]);
+		q = slot_meta_path (p, "replica", NULL);
+
+		if (lstat (q, &sb) == 0) {
+			free (p);
+			free (q);
+			free (branches[idx]);
+			continue;
+		}
+		free (q);
+
+		jp = xcalloc (1, sizeof *jp);
+		jp->branch = branches[idx];
+		jp->dst = p;
+		jp->src = xcalloc (1, strlen (repl_src)
+				   + strlen (branches[idx]) + 2);
+		sprintf (jp->src, "%s/%s", repl_src, branches[idx]);
+		jp->skip = strlen (jp->src);
+		jp->final = strncmp (branches[idx], today, 10) < 0;
+
+		jp->next = jobs_list;
+		jobs_list = jp;
+	}
+
+	free (branches);
+
+	/* chunks go first, so no copied recipe names one that is missing */
+	p = xcalloc (1, strlen (repl_src) + 20);
+	sprintf (p, "%s/.bakim/chunks", repl_src);
+
+	if (!dry_run && nftw (p, repl_chunk_cb, MAX_DIRS_OPEN, FTW_PHYS) == -1
+	    && errno != ENOENT) {
+		report ("failed to walk %s: %m\n", p);
+		repl_chunk_errors++;
+	}
+	free (p);
+
+	if (repl_chunk_bytes || repl_chunk_errors)
+		printf ("chunks: %lld bytes%s\n", repl_chunk_bytes,
+			repl_chunk_errors ? ", with errors" : "");
+
+	if (!dry_run) {
+		repl_queue = jobs_list;
+
+		for (started = 0; started < jobs - 1 && started < n; started++) {
+			if (start_thread (&threads[started],
+					  repl_worker, NULL) != 0)
+				break;
+		}
+
+		repl_worker (NULL);
+
+		for (idx = 0; idx < started; idx++)
+			pthread_join (threads[idx], NULL);
+
+		/* linking to a copy may have had to clear its flag */
+		for (idx = 0; idx < repl_links.size; idx++) {
+			for (hp = repl_links.buckets[idx]; hp; hp = hp->next) {
+				rl = hp->val;
+				if (rl->immutable)
+					set_immutable (rl->dst);
+				free (rl->dst);
+				free (rl);
+			}
+		}
+		hash_clear (&repl_links);
+	}
+
+	errors = repl_chunk_errors;
+
+	while ((jp = jobs_list) != NULL) {
+		jobs_list = jp->next;
+		if (dry_run)
+			printf ("%s\n", jp->branch);
+		else
+			printf ("%s: %lld files, %lld bytes%s\n", jp->branch,
+				jp->files, jp->bytes,
+				jp->errors ? ", with errors" : "");
+		errors += jp->errors;
+		free (jp->branch);
+		free (jp->src);
+		free (jp->dst);
+		free (jp);
+	}
+
+	if (dry_run) {
+		free (repl_dst);
+		return (0);
+	}
+
+	p = xcalloc (1, strlen (repl_src) + 20);
+	q = xcalloc (1, strlen (repl_dst) + 20);
+	sprintf (p, "%s/newest", repl_src);
+	sprintf (q, "%s/newest", repl_dst);
+
+	if (nftw (p, repl_newest_cb, MAX_DIRS_OPEN, FTW_PHYS) == -1
+	    || nftw (q, repl_newest_prune, MAX_DIRS_OPEN,
+		     FTW_PHYS | FTW_DEPTH) == -1) {
+		report ("failed to replicate %s: %m\n", p);
+		errors++;
+	}
+
+	sprintf (p, "%s/.bakim/index", repl_src);
+	sprintf (q, "%s/.bakim/index", repl_dst);
+
+	if (repl_meta_copy (p, q) == -1)
+		errors++;
+
+	free (p);
+	free (q);
+	free (repl_dst);
+
+	return (errors ? 1 : 0);
+}
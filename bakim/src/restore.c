@@ -0,0 +1,639 @@
+#include "libbakim.h"
+
+static int restore_cb (const char *fpath, const struct stat *sb, int tflag,
+		       struct FTW *ftwbuf);
+static int cmp_restore_file (const void *a, const void *b);
+
+/*
+ * bakim restore: copy PATH of a branch, or of newest/, back out to DEST.
+ * the walk only creates directories and symlinks and lists the files;
+ * those are then sorted by where they sit on the archive disk and
+ * copied by a pool of workers, reflinked where the filesystem allows.
+ * an entry already at DEST that check_same() accepts is left alone, so
+ * an interrupted restore can simply be run again.  as with export, a bare
+ * date means all its slots, the newest one holding a path winning.
+ */
+struct restore_file *restore_files;
+int n_restore_files, restore_next;
+struct restore_dir *restore_dirs;
+int n_restore_dirs;
+struct restore_link *restore_links;
+int n_restore_links;
+
+/* first restored name of each multiply linked archive inode */
+struct hash_table restore_inodes;
+
+pthread_mutex_t restore_lock = PTHREAD_MUTEX_INITIALIZER;
+int restore_skip, restore_newest, restore_extent, restore_errors;
+char *restore_dest;
+uint64_t restore_count, restore_bytes;
+
+/* room for one more element in a list grown 1024 at a time */
+void *
+restore_grow (void *list, int n, size_t size)
+{
+	if (n % 1024 == 0 && (list = realloc (list, (n + 1024) * size))
+	    == NULL) {
+		report ("out of memory\n");
+		exit (1);
+	}
+
+	return (list);
+}
+
+void
+restore_add_dir (const char *dst, const struct stat *sb)
+{
+	restore_dirs = restore_grow (restore_dirs, n_restore_dirs,
+				     sizeof *restore_dirs);
+	restore_dirs[n_restore_dirs].dst = xstrdup (dst);
+	restore_dirs[n_restore_dirs++].sb = *sb;
+}
+
+/*
+ * directories leading to dst below restore_dest, for a packed file
+ * whose own directory never made it into the archive tree.
+ */
+int
+restore_parents (char *dst)
+{
+	char *p;
+
+	for (p = dst + strlen (restore_dest) + 1; (p = strchr (p, '/'));
+	     p++) {
+		*p = 0;
+		if (mkdir (dst, 0755) == -1 && errno != EEXIST) {
+			report ("failed to create directory %s: %m\n",
+				dst);
+			*p = '/';
+			return (-1);
+		}
+		*p = '/';
+	}
+
+	return (0);
+}
+
+/* owner, then mode, as chown clears set-id bits; then times */
+void
+restore_meta (const char *dst, const struct stat *sb)
+{
+	struct timespec ts[2];
+
+	if (lchown (dst, sb->st_uid, sb->st_gid) == -1)
+		report ("failed to chown %s: %m\n", dst);
+
+	if (!S_ISLNK (sb->st_mode) && chmod (dst, sb->st_mode & 07777) == -1)
+		report ("failed to set mode on %s: %m\n", dst);
+
+	ts[0].tv_sec = sb->st_atime;
+	ts[0].tv_nsec = 0;
+	ts[1].tv_sec = sb->st_mtime;
+	ts[1].tv_nsec = 0;
+
+	if (utimensat (AT_FDCWD, dst, ts, AT_SYMLINK_NOFOLLOW) == -1)
+		report ("failed to set timestamps on %s: %m\n", dst);
+}
+
+/*
+ * queue a file; src is NULL for one read from pv at offset, or for
+ * the chunks of the recipe there when recipe is set
+ */
+void
+restore_add_file (const char *src, const char *dst, const struct stat *sb,
+		  struct pack_view *pv, uint64_t offset, int recipe)
+{
+	struct restore_file *rf;
+	struct restore_link *rl;
+	struct hash_entry *hp;
+	struct stat dst_sb;
+	char key[50];
+
+	if (src && sb->st_nlink > 1)
+		sprintf (key, "%llx:%llx", (unsigned long long) sb->st_dev,
+			 (unsigned long long) sb->st_ino);
+
+	if (lstat (dst, &dst_sb) == 0) {
+		if (check_same (sb, &dst_sb, NULL, NULL)) {
+			/* restored before; the other names link to it */
+			if (src && sb->st_nlink > 1)
+				restore_have_link (key, dst);
+			return;
+		}
+		delete_file_or_dir ((char *) dst);
+	}
+
+	if (src && sb->st_nlink > 1) {
+		if ((hp = hash_lookup (&restore_inodes, key,
+				       strlen (key))) != NULL) {
+			restore_links = restore_grow (restore_links,
+						      n_restore_links,
+						      sizeof *restore_links);
+			rl = &restore_links[n_restore_links++];
+			rl->dst = xstrdup (dst);
+			rl->first = xstrdup (hp->val);
+			return;
+		}
+
+		hash_insert (&restore_inodes, key, strlen (key),
+			     xstrdup (dst));
+	}
+
+	restore_files = restore_grow (restore_files, n_restore_files,
+				      sizeof *restore_files);
+	rf = &restore_files[n_restore_files++];
+	rf->src = src ? xstrdup (src) : NULL;
+	rf->dst = xstrdup (dst);
+	rf->sb = *sb;
+	rf->pv = pv;
+	rf->offset = offset;
+	rf->recipe = recipe;
+
+	if (!src)
+		rf->key = offset;
+	else if (restore_extent)
+		rf->key = extent_key (AT_FDCWD, src, sb);
+	else
+		rf->key = sb->st_ino;
+}
+
+/*
+ * dst, a name of the multiply linked inode key, was restored by an
+ * earlier run.  names met before it were queued to be copied and have
+ * the first of them linked to; they link to dst instead.
+ */
+void
+restore_have_link (const char *key, const char *dst)
+{
+	struct hash_entry *hp;
+	struct restore_link *rl;
+	char *first;
+	int idx;
+
+	if ((hp = hash_lookup (&restore_inodes, key, strlen (key))) == NULL) {
+		hash_insert (&restore_inodes, key, strlen (key),
+			     xstrdup (dst));
+		return;
+	}
+
+	first = hp->val;
+
+	for (idx = n_restore_files - 1; idx >= 0; idx--) {
+		if (strcmp (restore_files[idx].dst, first) == 0)
+			break;
+	}
+
+	/* already restored by this run */
+	if (idx < 0)
+		return;
+
+	free (restore_files[idx].src);
+	free (restore_files[idx].dst);
+	restore_files[idx] = restore_files[--n_restore_files];
+
+	for (idx = 0; idx < n_restore_links; idx++) {
+		rl = &restore_links[idx];
+		if (strcmp (rl->first, first) == 0) {
+			free (rl->first);
+			rl->first = xstrdup (dst);
+		}
+	}
+
+	restore_links = restore_grow (restore_links, n_restore_links,
+				      sizeof *restore_links);
+	rl = &restore_links[n_restore_links++];
+	rl->dst = first;
+	rl->first = xstrdup (dst);
+	hp->val = xstrdup (dst);
+}
+
+/* the archived entry src, with stat sb, as dst */
+void
+restore_entry (const char *src, const char *dst, const struct stat *sb)
+{
+	char tar[PATH_MAX];
+	struct stat dst_sb;
+	int r;
+
+	if (S_ISREG (sb->st_mode)) {
+		restore_add_file (src, dst, sb, NULL, 0, 0);
+		return;
+	}
+
+	if (lstat (dst, &dst_sb) == 0) {
+		if (S_ISDIR (sb->st_mode) && S_ISDIR (dst_sb.st_mode)) {
+			restore_add_dir (dst, sb);
+			return;
+		}
+		if (check_same (sb, &dst_sb, src, dst))
+			return;
+		delete_file_or_dir ((char *) dst);
+	}
+
+	if (S_ISDIR (sb->st_mode)) {
+		/* ours alone until the end, whatever mode it will get */
+		if (mkdir (dst, 0700) == -1) {
+			report ("failed to create directory %s: %m\n",
+				dst);
+			restore_errors++;
+			return;
+		}
+		restore_add_dir (dst, sb);
+	} else if (S_ISLNK (sb->st_mode)) {
+		if ((r = readlink (src, tar, sizeof tar - 1)) == -1
+		    || (tar[r] = 0, symlink (tar, dst)) == -1) {
+			report ("failed to restore link %s: %m\n",
+				dst);
+			restore_errors++;
+			return;
+		}
+		restore_meta (dst, sb);
+	}
+}
+
+static int
+restore_cb (const char *fpath, const struct stat *sb, int tflag,
+	    struct FTW *ftwbuf)
+{
+	char dst[PATH_MAX], fn[PATH_MAX];
+	struct stat tar_sb;
+	struct pack_view *pv;
+	struct pack_rec *pr;
+
+	if (snprintf (dst, sizeof dst, "%s%s", restore_dest,
+		      fpath + restore_skip) >= sizeof dst) {
+		report ("path exceeds PATH_MAX\n");
+		restore_errors++;
+		return (0);
+	}
+
+	if (slot_taken (dst))
+		return (0);
+
+	if (tflag == FTW_DNR || tflag == FTW_NS) {
+		report ("failed to read %s\n", fpath);
+		restore_errors++;
+		return (0);
+	}
+
+	if (tflag != FTW_SL || !restore_newest) {
+		restore_entry (fpath, dst, sb);
+		return (0);
+	}
+
+	switch (resolve_newest (fpath, ftwbuf->base, fn, &tar_sb, &pv, &pr)) {
+	case 0:
+		restore_entry (fn, dst, &tar_sb);
+		break;
+	case 1:
+		pack_rec_stat (pr, &tar_sb);
+		restore_add_file (NULL, dst, &tar_sb, pv, pr->offset, 0);
+		break;
+	case 2:
+		pack_rec_stat (pr, &tar_sb);
+		restore_add_file (NULL, dst, &tar_sb, pv, pr->offset, 1);
+		break;
+	default:
+		restore_errors++;
+	}
+
+	return (0);
+}
+
+static int
+cmp_restore_file (const void *a, const void *b)
+{
+	const struct restore_file *x = a, *y = b;
+
+	if (!x->src != !y->src)
+		return (!x->src ? 1 : -1);
+
+	if (x->pv != y->pv)
+		return (x->pv < y->pv ? -1 : 1);
+
+	if (x->recipe != y->recipe)
+		return (x->recipe - y->recipe);
+
+	if (x->key != y->key)
+		return (x->key < y->key ? -1 : 1);
+
+	if (x->sb.st_ino != y->sb.st_ino)
+		return (x->sb.st_ino < y->sb.st_ino ? -1 : 1);
+
+	return (0);
+}
+
+/* gather a chunked file's data from the chunk store into a new dst */
+int
+restore_chunked (struct restore_file *rf)
+{
+	unsigned char *ents, *ent, *buf;
+	uint64_t done, len;
+	uint32_t idx, n;
+	int fd, dst, r;
+
+	if ((ents = recipe_chunks (rf->pv->cfd, rf->offset, &n)) == NULL) {
+		report ("cannot read recipe for %s\n", rf->dst);
+		return (-1);
+	}
+
+	if ((dst = open (rf->dst, O_WRONLY | O_CREAT | O_EXCL, 0600)) == -1) {
+		report ("cannot open dst file %s: %m\n", rf->dst);
+		free (ents);
+		return (-1);
+	}
+
+	buf = NULL;
+	done = 0;
+	r = 0;
+
+	for (idx = 0; idx < n && done < rf->sb.st_size && r == 0; idx++) {
+		ent = ents + idx * (4 + SHA256_LEN);
+		len = get_le32 (ent + SHA256_LEN);
+
+		if ((fd = chunk_open (bk->backup_root, ent)) == -1) {
+			report ("chunk of %s is missing: %m\n",
+				rf->dst);
+			r = -1;
+			break;
+		}
+
+		if (chunk_compressed (fd, len)) {
+			if (!buf)
+				buf = xcalloc (1, CDC_MAX);
+			if (len > CDC_MAX || chunk_inflate (fd, buf, len) == -1
+			    || write_all (dst, buf, len) == -1)
+				r = -1;
+		} else {
+			r = copy_range (fd, 0, dst, len);
+		}
+		if (r == -1)
+			report ("error restoring %s: %m\n", rf->dst);
+		close (fd);
+		done += len;
+	}
+
+	free (ents);
+	free (buf);
+
+	if (r == 0 && done != rf->sb.st_size) {
+		report ("chunk data for %s is short\n", rf->dst);
+		r = -1;
+	}
+
+	if (close (dst) != 0) {
+		report ("error closing file %s: %m\n", rf->dst);
+		r = -1;
+	}
+
+	return (r);
+}
+
+/* copy one file's data into a new dst, cloning when it is a whole file */
+int
+restore_file (struct restore_file *rf)
+{
+	int src, dst, r;
+
+	if (rf->src && clone_file (rf->src, rf->dst) == 0)
+		return (0);
+
+	if (rf->recipe)
+		return (restore_chunked (rf));
+
+	src = rf->pv ? rf->pv->fd : -1;
+
+	if (rf->src && (src = open (rf->src, O_RDONLY | O_NOATIME)) == -1
+	    && (src = open (rf->src, O_RDONLY)) == -1) {
+		report ("cannot open src file %s: %m\n", rf->src);
+		return (-1);
+	}
+
+	if ((dst = open (rf->dst, O_WRONLY | O_CREAT | O_EXCL, 0600)) == -1) {
+		report ("cannot open dst file %s: %m\n", rf->dst);
+		if (rf->src)
+			close (src);
+		return (-1);
+	}
+
+	if ((r = copy_range (src, rf->offset, dst, rf->sb.st_size)) == -1)
+		report ("error restoring %s: %m\n", rf->dst);
+
+	if (rf->src) {
+		posix_fadvise (src, 0, 0, POSIX_FADV_DONTNEED);
+		close (src);
+	}
+
+	if (close (dst) != 0) {
+		report ("error closing file %s: %m\n", rf->dst);
+		r = -1;
+	}
+
+	return (r);
+}
+
+void *
+restore_worker (void *arg)
+{
+	struct restore_file *rf;
+	int r;
+
+	while (1) {
+		pthread_mutex_lock (&restore_lock);
+		rf = restore_next < n_restore_files
+			? &restore_files[restore_next++] : NULL;
+		pthread_mutex_unlock (&restore_lock);
+
+		if (!rf)
+			break;
+
+		if ((r = restore_file (rf)) == -1)
+			unlink (rf->dst);
+		else
+			restore_meta (rf->dst, &rf->sb);
+
+		pthread_mutex_lock (&restore_lock);
+		if (r == -1) {
+			restore_errors++;
+		} else {
+			restore_count++;
+			restore_bytes += rf->sb.st_size;
+		}
+		pthread_mutex_unlock (&restore_lock);
+	}
+
+	return (NULL);
+}
+
+int
+cmd_restore (int argc, char **argv)
+{
+	int c, idx, jobs, started, recipe, k, n_slots, have;
+	char *top, *prefix, *p, *dst, **slots;
+	unsigned long jdx, n;
+	struct hash_entry *hp, **ents;
+	struct pack_view *pv;
+	struct stat sb, st;
+	pthread_t threads[MAX_JOBS];
+
+	jobs = sysconf (_SC_NPROCESSORS_ONLN);
+
+	while ((c = getopt (argc, argv, "j:R:")) != EOF) {
+		switch (c) {
+		case 'j':
+			jobs = atoi (optarg);
+			break;
+		case 'R':
+			bk->read_limit.rate = parse_size (optarg);
+			break;
+		default:
+			usage ();
+		}
+	}
+
+	if (optind + 3 != argc)
+		usage ();
+
+	if (jobs < 1)
+		jobs = 1;
+	if (jobs > MAX_JOBS)
+		jobs = MAX_JOBS;
+
+	restore_newest = strcmp (argv[optind], "newest") == 0;
+
+	if ((n_slots = walk_slots (argv[optind], &slots)) == -1)
+		return (1);
+
+	prefix = argv[optind + 1];
+	while (*prefix == '/')
+		prefix++;
+	for (p = prefix + strlen (prefix); p > prefix && p[-1] == '/';)
+		*--p = 0;
+	if (strcmp (prefix, ".") == 0)
+		*prefix = 0;
+
+	restore_dest = argv[optind + 2];
+	for (p = restore_dest + strlen (restore_dest); p > restore_dest + 1
+		     && p[-1] == '/';)
+		*--p = 0;
+
+	umask (0);
+
+	top = xcalloc (1, strlen (bk->backup_root) + strlen (argv[optind])
+		       + strlen (prefix) + 6);
+
+	/* what PATH is, by the newest slot that has it */
+	have = 0;
+	for (k = n_slots - 1; k >= 0 && !have; k--) {
+		sprintf (top, "%s/%s%s%s", bk->backup_root, slots[k],
+			 *prefix ? "/" : "", prefix);
+		have = lstat (top, &sb) == 0;
+	}
+
+	/* like cp, a single file restored onto a directory goes inside it */
+	if ((!have || !S_ISDIR (sb.st_mode))
+	    && stat (restore_dest, &st) == 0 && S_ISDIR (st.st_mode)) {
+		p = strrchr (top, '/') + 1;
+		dst = xcalloc (1, strlen (restore_dest) + strlen (p) + 2);
+		sprintf (dst, "%s/%s", restore_dest, p);
+		restore_dest = dst;
+	}
+
+	if (have)
+		restore_extent = is_rotational (sb.st_dev);
+
+	for (k = n_slots - 1; k >= 0; k--) {
+		sprintf (top, "%s/%s%s%s", bk->backup_root, slots[k],
+			 *prefix ? "/" : "", prefix);
+		restore_skip = strlen (top);
+
+		if (nftw (top, restore_cb, MAX_DIRS_OPEN, FTW_PHYS) == -1
+		    && (errno != ENOENT || restore_newest)) {
+			report ("failed to walk %s: %m\n", top);
+			restore_errors++;
+		}
+
+		/* packed and chunked files have no entry in the tree */
+		for (recipe = 0; !restore_newest && recipe < 2; recipe++) {
+			pv = pack_view (slots[k]);
+			ents = branch_packed (slots[k], prefix, recipe, &n);
+
+			for (jdx = 0; jdx < n; jdx++) {
+				dst = xcalloc (1, strlen (restore_dest)
+					       + strlen (ents[jdx]->key) + 2);
+				sprintf (dst, "%s%s%s", restore_dest,
+					 *prefix ? "" : "/",
+					 ents[jdx]->key + strlen (prefix));
+				if (!slot_taken (dst)
+				    && restore_parents (dst) == 0) {
+					pack_rec_stat (ents[jdx]->val, &sb);
+					restore_add_file (NULL, dst, &sb, pv,
+							  ((struct pack_rec *)
+							   ents[jdx]->val)
+							  ->offset, recipe);
+				}
+				free (dst);
+			}
+
+			free (ents);
+		}
+	}
+
+	qsort (restore_files, n_restore_files, sizeof *restore_files,
+	       cmp_restore_file);
+
+	for (started = 0; started < jobs - 1 && started < n_restore_files;
+	     started++) {
+		if (start_thread (&threads[started], restore_worker,
+				  NULL) != 0)
+			break;
+	}
+
+	restore_worker (NULL);
+
+	for (idx = 0; idx < started; idx++)
+		pthread_join (threads[idx], NULL);
+
+	for (idx = 0; idx < n_restore_links; idx++) {
+		if (link (restore_links[idx].first,
+			  restore_links[idx].dst) == -1) {
+			report ("failed to link %s: %m\n",
+				restore_links[idx].dst);
+			restore_errors++;
+		}
+		free (restore_links[idx].dst);
+		free (restore_links[idx].first);
+	}
+
+	/* children before parents, so a parent's mtime sticks */
+	for (idx = n_restore_dirs - 1; idx >= 0; idx--) {
+		restore_meta (restore_dirs[idx].dst, &restore_dirs[idx].sb);
+		free (restore_dirs[idx].dst);
+	}
+
+	printf ("%llu files, %llu bytes restored\n",
+		(unsigned long long) restore_count,
+		(unsigned long long) restore_bytes);
+
+	for (idx = 0; idx < n_restore_files; idx++) {
+		free (restore_files[idx].src);
+		free (restore_files[idx].dst);
+	}
+
+	for (jdx = 0; jdx < restore_inodes.size; jdx++) {
+		for (hp = restore_inodes.buckets[jdx]; hp; hp = hp->next)
+			free (hp->val);
+	}
+	hash_clear (&restore_inodes);
+
+	free (restore_files);
+	free (restore_dirs);
+	free (restore_links);
+	free_pack_views ();
+	free_slots (slots, n_slots);
+	if (restore_dest != argv[optind + 2])
+		free (restore_dest);
+	free (top);
+
+	return (restore_errors ? 1 : 0);
+}
@@ -0,0 +1,803 @@
+#include "libbakim.h"
+
+/* checksum manifests, and bakim verify against them */
+
+static int collect_file (const char *fpath, const struct stat *sb, int tflag,
+			 struct FTW *ftwbuf);
+static int cmp_verify_file (const void *a, const void *b);
+
+/* one path per manifest line, so backslash and newline are escaped */
+void
+escape_path (FILE *f, const char *path)
+{
+	for (; *path; path++) {
+		if (*path == '\\')
+			fputs ("\\\\", f);
+		else if (*path == '\n')
+			fputs ("\\n", f);
+		else
+			putc (*path, f);
+	}
+}
+
+int
+unescape_path (char *s)
+{
+	char *d;
+
+	for (d = s; *s; s++) {
+		if (*s == '\\' && s[1]) {
+			s++;
+			*d++ = *s == 'n' ? '\n' : *s;
+		} else if (*s != '\n') {
+			*d++ = *s;
+		}
+	}
+	*d = 0;
+
+	return (0);
+}
+
+/*
+ * read a branch's manifest into files.  returns the number of files,
+ * or -1 if the branch has no manifest.
+ */
+int
+load_manifest (const char *branch, struct verify_file **files)
+{
+	FILE *f;
+	char *fn, line[PATH_MAX + 100];
+	unsigned long long hash;
+	long long size;
+	int n, off, alloc;
+	struct verify_file *vf;
+
+	fn = meta_path ("manifest", branch);
+	f = fopen (fn, "r");
+	free (fn);
+
+	if (!f)
+		return (-1);
+
+	n = alloc = 0;
+	*files = NULL;
+
+	while (fgets (line, sizeof line, f)) {
+		if (sscanf (line, "%llx %lld %n", &hash, &size, &off) != 2)
+			continue;
+
+		if (n == alloc) {
+			alloc = alloc ? alloc * 2 : 1024;
+			*files = realloc (*files, alloc * sizeof **files);
+			if (!*files) {
+				report ("out of memory\n");
+				exit (1);
+			}
+		}
+
+		unescape_path (line + off);
+
+		vf = &(*files)[n++];
+		vf->path = xstrdup (line + off);
+		vf->size = size;
+		vf->hash = hash;
+		vf->has_hash = 1;
+	}
+
+	fclose (f);
+
+	return (n);
+}
+
+/* nftw has no user pointer; walk_branch collects through these */
+static struct verify_file *walk_files;
+static int walk_n, walk_alloc, walk_off;
+
+static int
+collect_file (const char *fpath, const struct stat *sb, int tflag,
+	      struct FTW *ftwbuf)
+{
+	struct verify_file *vf;
+
+	if (tflag != FTW_F)
+		return (0);
+
+	if (walk_n == walk_alloc) {
+		walk_alloc = walk_alloc ? walk_alloc * 2 : 1024;
+		walk_files = realloc (walk_files,
+				      walk_alloc * sizeof *walk_files);
+		if (!walk_files) {
+			report ("out of memory\n");
+			exit (1);
+		}
+	}
+
+	vf = &walk_files[walk_n++];
+	vf->path = xstrdup (fpath + walk_off);
+	vf->size = sb->st_size;
+	vf->has_hash = 0;
+
+	return (0);
+}
+
+/* list the regular files of a branch that has no manifest */
+int
+walk_branch (const char *branch, struct verify_file **files)
+{
+	char *dir;
+
+	dir = xcalloc (1, strlen (bk->backup_root) + strlen (branch) + 2);
+	sprintf (dir, "%s/%s", bk->backup_root, branch);
+
+	walk_files = NULL;
+	walk_n = walk_alloc = 0;
+	walk_off = strlen (dir) + 1;
+
+	if (nftw (dir, collect_file, MAX_DIRS_OPEN, FTW_PHYS) == -1)
+		report ("failed to walk %s: %m\n", dir);
+
+	free (dir);
+
+	*files = walk_files;
+
+	return (walk_n);
+}
+
+static int
+cmp_verify_file (const void *a, const void *b)
+{
+	return (strcmp (((const struct verify_file *) a)->path,
+			((const struct verify_file *) b)->path));
+}
+
+/*
+ * checksum a whole file, reading around the page cache with O_DIRECT
+ * when the filesystem allows it.  buf must be DIRECT_ALIGN aligned and
+ * VERIFY_BUFSIZE long.
+ */
+int
+hash_file (const char *fn, int direct, unsigned char *buf,
+	   unsigned long long *hash, long long *size)
+{
+	int fd, n, save_errno;
+	struct xxh64_state st;
+
+	fd = -1;
+	if (direct)
+		fd = open (fn, O_RDONLY | O_DIRECT | O_NOATIME | O_NOFOLLOW);
+	if (fd == -1 && (fd = open (fn, O_RDONLY | O_NOFOLLOW)) == -1)
+		return (-1);
+
+	xxh64_init (&st);
+	*size = 0;
+
+	while ((n = read (fd, buf, VERIFY_BUFSIZE)) > 0) {
+		throttle_take (&bk->read_limit, n);
+		xxh64_update (&st, buf, n);
+		*size += n;
+	}
+
+	save_errno = errno;
+
+	if (n < 0 && direct && errno == EINVAL) {
+		close (fd);
+		return (hash_file (fn, 0, buf, hash, size));
+	}
+
+	if (!direct)
+		posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+
+	close (fd);
+
+	if (n < 0) {
+		errno = save_errno;
+		return (-1);
+	}
+
+	*hash = xxh64_final (&st);
+
+	return (0);
+}
+
+/* verify settings and totals, shared by the workers */
+pthread_mutex_t verify_lock = PTHREAD_MUTEX_INITIALIZER;
+struct verify_chunk *verify_queue;
+FILE *verify_state;
+char *verify_source;
+long long verify_files, verify_bytes, verify_bad, verify_errors,
+	verify_skipped;
+
+void
+verify_one (const char *branch, struct verify_file *vf, unsigned char *buf)
+{
+	char fn[PATH_MAX], src_fn[PATH_MAX];
+	unsigned long long hash, src_hash;
+	long long size, src_size;
+	struct stat sb;
+	const char *what;
+
+	if (strlen (bk->backup_root) + strlen (branch) + strlen (vf->path)
+	    + 100 >= PATH_MAX) {
+		report ("path exceeds PATH_MAX\n");
+		return;
+	}
+
+	sprintf (fn, "%s/%s/%s", bk->backup_root, branch, vf->path);
+
+	what = NULL;
+
+	if (hash_file (fn, 1, buf, &hash, &size) == -1) {
+		pthread_mutex_lock (&verify_lock);
+		printf ("ERROR %s: %s\n", fn, strerror (errno));
+		verify_errors++;
+		pthread_mutex_unlock (&verify_lock);
+		return;
+	}
+
+	if (vf->has_hash) {
+		if (size != vf->size || hash != vf->hash)
+			what = "MISMATCH";
+	} else if (verify_source) {
+		sprintf (src_fn, "%s/%s", verify_source, vf->path);
+
+		if (lstat (src_fn, &sb) == -1 || !S_ISREG (sb.st_mode)
+		    || sb.st_size != size) {
+			what = "SKIPPED";
+		} else if (hash_file (src_fn, 0, buf, &src_hash,
+				      &src_size) == -1) {
+			what = "SKIPPED";
+		} else if (src_hash != hash) {
+			what = "MISMATCH";
+		}
+	}
+
+	pthread_mutex_lock (&verify_lock);
+
+	verify_files++;
+	verify_bytes += size;
+
+	if (what) {
+		printf ("%s %s\n", what, fn);
+		if (*what == 'M')
+			verify_bad++;
+		else
+			verify_skipped++;
+	}
+
+	pthread_mutex_unlock (&verify_lock);
+}
+
+/*
+ * hash the chunks of the recipe at offset into st, checking each
+ * against its name on the way; left is what they fell short by
+ */
+int
+verify_chunks (int fd, uint64_t offset, struct xxh64_state *st,
+	       uint64_t *left, unsigned char *buf)
+{
+	struct sha256_state sha;
+	unsigned char *ents, *ent, digest[SHA256_LEN];
+	uint64_t len;
+	uint32_t idx, n;
+	int cfd, bad, r;
+
+	if ((ents = recipe_chunks (fd, offset, &n)) == NULL)
+		return (-1);
+
+	bad = 0;
+	r = 0;
+
+	for (idx = 0; idx < n && r >= 0; idx++) {
+		ent = ents + idx * (4 + SHA256_LEN);
+		len = get_le32 (ent + SHA256_LEN);
+
+		if ((cfd = chunk_open (bk->backup_root, ent)) == -1) {
+			r = -1;
+			break;
+		}
+
+		sha256_init (&sha);
+		if (chunk_compressed (cfd, len)) {
+			if (len <= VERIFY_BUFSIZE
+			    && chunk_inflate (cfd, buf, len) == 0) {
+				sha256_update (&sha, buf, len);
+				xxh64_update (st, buf, len);
+				*left -= *left < len ? *left : len;
+				len = 0;
+			}
+		}
+		while (len > 0 && (r = read (cfd, buf, len < VERIFY_BUFSIZE
+					     ? len : VERIFY_BUFSIZE)) > 0) {
+			throttle_take (&bk->read_limit, r);
+			sha256_update (&sha, buf, r);
+			xxh64_update (st, buf, r);
+			len -= r;
+			*left -= *left < r ? *left : r;
+		}
+		sha256_final (&sha, digest);
+
+		/* a deflated chunk that won't inflate is as good as rotten */
+		if (len || memcmp (digest, ent, SHA256_LEN) != 0)
+			bad = 1;
+
+		posix_fadvise (cfd, 0, 0, POSIX_FADV_DONTNEED);
+		close (cfd);
+	}
+
+	free (ents);
+
+	return (r < 0 ? -1 : bad);
+}
+
+/*
+ * check every record of a branch's pack, reading the pack front to
+ * back; for the recipe pack, the chunks each record names
+ */
+void
+verify_pack (const char *branch, const char *kind, unsigned char *buf)
+{
+	char *fn, path[PATH_MAX];
+	struct pack_rec rec;
+	struct xxh64_state st;
+	uint64_t left;
+	FILE *idx;
+	int fd, n;
+
+	fn = pack_path (kind, branch, "idx");
+	idx = fopen (fn, "r");
+	free (fn);
+
+	if (!idx)
+		return;
+
+	fn = pack_path (kind, branch, "pack");
+	fd = open (fn, O_RDONLY | O_NOATIME);
+
+	while (fd != -1 && fread (&rec, sizeof rec, 1, idx) == 1) {
+		if (rec.path_len >= PATH_MAX
+		    || fread (path, 1, rec.path_len, idx) != rec.path_len)
+			break;
+		path[rec.path_len] = 0;
+
+		xxh64_init (&st);
+		left = rec.size;
+		n = 0;
+
+		if (*kind == 'r') {
+			if ((n = verify_chunks (fd, rec.offset, &st, &left,
+						buf)) > 0)
+				left = 1;
+		} else if (lseek (fd, rec.offset, SEEK_SET) != -1) {
+			while (left > 0 && (n = read (fd, buf, left
+					< VERIFY_BUFSIZE ? left
+					: VERIFY_BUFSIZE)) > 0) {
+				throttle_take (&bk->read_limit, n);
+				xxh64_update (&st, buf, n);
+				left -= n;
+			}
+		}
+
+		pthread_mutex_lock (&verify_lock);
+		verify_files++;
+		verify_bytes += rec.size - left;
+		if (n < 0) {
+			printf ("ERROR %s[%s]: %s\n", fn, path,
+				strerror (errno));
+			verify_errors++;
+		} else if (left || xxh64_final (&st) != rec.hash) {
+			printf ("MISMATCH %s[%s]\n", fn, path);
+			verify_bad++;
+		}
+		pthread_mutex_unlock (&verify_lock);
+	}
+
+	if (fd == -1) {
+		pthread_mutex_lock (&verify_lock);
+		printf ("ERROR %s: %s\n", fn, strerror (errno));
+		verify_errors++;
+		pthread_mutex_unlock (&verify_lock);
+	} else {
+		posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+		close (fd);
+	}
+
+	fclose (idx);
+	free (fn);
+}
+
+void *
+verify_worker (void *arg)
+{
+	struct verify_chunk *vc;
+	unsigned char *buf;
+	int idx;
+
+	if (posix_memalign ((void **) &buf, DIRECT_ALIGN, VERIFY_BUFSIZE)) {
+		report ("out of memory\n");
+		exit (1);
+	}
+
+	while (1) {
+		pthread_mutex_lock (&verify_lock);
+		if ((vc = verify_queue) != NULL)
+			verify_queue = vc->next;
+		pthread_mutex_unlock (&verify_lock);
+
+		if (!vc)
+			break;
+
+		if (vc->is_pack) {
+			verify_pack (vc->branch, "pack", buf);
+			verify_pack (vc->branch, "recipe", buf);
+		}
+
+		for (idx = 0; idx < vc->n_files; idx++)
+			verify_one (vc->branch, &vc->files[idx], buf);
+
+		pthread_mutex_lock (&verify_lock);
+		if (verify_state && vc->resumable)
+			verify_note_done (vc);
+		pthread_mutex_unlock (&verify_lock);
+
+		free (vc);
+	}
+
+	free (buf);
+
+	return (NULL);
+}
+
+void
+put_state_str (FILE *f, const char *s)
+{
+	uint16_t len;
+
+	len = strlen (s);
+	fwrite (&len, sizeof len, 1, f);
+	fwrite (s, 1, len, f);
+}
+
+/*
+ * log a finished chunk as its branch and first and last path, each a
+ * u16 length and the bytes; a branch's packs have empty paths.  caller
+ * holds verify_lock.
+ */
+void
+verify_note_done (struct verify_chunk *vc)
+{
+	put_state_str (verify_state, vc->branch);
+	put_state_str (verify_state, vc->is_pack ? "" : vc->files[0].path);
+	put_state_str (verify_state, vc->is_pack ? ""
+		       : vc->files[vc->n_files - 1].path);
+	fflush (verify_state);
+}
+
+/* the next string of a state file, or NULL at its end */
+char *
+state_str (FILE *f)
+{
+	uint16_t len;
+	char *s;
+
+	if (fread (&len, sizeof len, 1, f) != 1)
+		return (NULL);
+
+	s = xcalloc (1, len + 1);
+	if (fread (s, 1, len, f) != len) {
+		free (s);
+		return (NULL);
+	}
+
+	return (s);
+}
+
+int
+cmp_verify_range (const void *a, const void *b)
+{
+	return (strcmp (((const struct verify_range *) a)->first,
+			((const struct verify_range *) b)->first));
+}
+
+/*
+ * the finished chunks of an earlier scrub into done, keyed by branch.
+ * -1 if fn is not a state file, which then starts over.
+ */
+int
+load_verify_state (const char *fn, struct hash_table *done)
+{
+	char magic[sizeof VERIFY_MAGIC - 1], *branch, *first, *last;
+	struct verify_done *vd;
+	struct verify_range *r;
+	struct hash_entry *hp;
+	unsigned long idx;
+	FILE *f;
+	int n;
+
+	if ((f = fopen (fn, "r")) == NULL)
+		return (-1);
+
+	if (fread (magic, 1, sizeof magic, f) != sizeof magic
+	    || memcmp (magic, VERIFY_MAGIC, sizeof magic) != 0) {
+		fclose (f);
+		return (-1);
+	}
+
+	while ((branch = state_str (f)) != NULL) {
+		first = state_str (f);
+		last = first ? state_str (f) : NULL;
+		if (!last) {
+			free (branch);
+			free (first);
+			break;
+		}
+
+		if ((hp = hash_lookup (done, branch, strlen (branch))) == NULL) {
+			vd = xcalloc (1, sizeof *vd);
+			hash_insert (done, branch, strlen (branch), vd);
+		} else {
+			vd = hp->val;
+		}
+		free (branch);
+
+		if (!*first) {
+			vd->pack = 1;
+			free (first);
+			free (last);
+			continue;
+		}
+
+		if (vd->n == vd->alloc) {
+			vd->alloc = vd->alloc ? vd->alloc * 2 : 64;
+			vd->r = realloc (vd->r, vd->alloc * sizeof *vd->r);
+			if (!vd->r) {
+				report ("out of memory\n");
+				exit (1);
+			}
+		}
+		vd->r[vd->n].first = first;
+		vd->r[vd->n++].last = last;
+	}
+
+	fclose (f);
+
+	/* a resumed scrub's chunks can span earlier ones, so merge them */
+	for (idx = 0; idx < done->size; idx++) {
+		for (hp = done->buckets[idx]; hp; hp = hp->next) {
+			vd = hp->val;
+			qsort (vd->r, vd->n, sizeof *vd->r, cmp_verify_range);
+
+			for (n = 0, r = vd->r; r < vd->r + vd->n; r++) {
+				if (n && strcmp (r->first, vd->r[n - 1].last)
+				    <= 0) {
+					if (strcmp (r->last, vd->r[n - 1].last)
+					    > 0) {
+						free (vd->r[n - 1].last);
+						vd->r[n - 1].last = r->last;
+					} else {
+						free (r->last);
+					}
+					free (r->first);
+					continue;
+				}
+				vd->r[n++] = *r;
+			}
+			vd->n = n;
+		}
+	}
+
+	return (0);
+}
+
+/* whether path is in a finished range of vd */
+int
+verify_covered (struct verify_done *vd, const char *path)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = vd->n;
+
+	/* the last range starting at or before path */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (strcmp (vd->r[mid].first, path) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo > 0 && strcmp (path, vd->r[lo - 1].last) <= 0);
+}
+
+/*
+ * re-read branches and check them against their manifests, or against
+ * a source tree (-S) when a branch has none.  finished chunks are
+ * logged to a state file so an interrupted scrub picks up where it
+ * stopped; the file goes away once a scrub completes.  today's branch
+ * may still grow under a range it logged, so it is always redone.
+ */
+int
+cmd_verify (int argc, char **argv)
+{
+	int c, idx, jdx, kdx, jobs, restart, n_files, n_branches, started;
+	int resumable;
+	char **branches, *state_fn, *fn, *p, today[32];
+	struct verify_file *files;
+	struct verify_chunk *vc, **tail;
+	struct verify_done *vd;
+	struct hash_table done;
+	struct hash_entry *hp;
+	pthread_t threads[MAX_JOBS];
+	unsigned long hdx;
+	struct dirent *de;
+	struct tm tm;
+	time_t now;
+	DIR *dir;
+
+	jobs = sysconf (_SC_NPROCESSORS_ONLN);
+	restart = 0;
+	state_fn = NULL;
+
+	while ((c = getopt (argc, argv, "j:R:S:s:r")) != EOF) {
+		switch (c) {
+		case 'j':
+			jobs = atoi (optarg);
+			break;
+		case 'R':
+			bk->read_limit.rate = parse_size (optarg);
+			break;
+		case 'S':
+			verify_source = optarg;
+			break;
+		case 's':
+			state_fn = xstrdup (optarg);
+			break;
+		case 'r':
+			restart = 1;
+			break;
+		default:
+			usage ();
+		}
+	}
+
+	if (jobs < 1)
+		jobs = 1;
+	if (jobs > MAX_JOBS)
+		jobs = MAX_JOBS;
+
+	if (!state_fn)
+		state_fn = meta_path ("verify.state", NULL);
+
+	branches = NULL;
+	n_branches = 0;
+
+	if (optind < argc) {
+		branches = argv + optind;
+		n_branches = argc - optind;
+	} else {
+		if ((dir = opendir (bk->backup_root)) == NULL) {
+			report ("failed to open %s: %m\n",
+				bk->backup_root);
+			return (1);
+		}
+
+		while ((de = readdir (dir)) != NULL) {
+			if (!is_branch_name (de->d_name))
+				continue;
+			branches = realloc (branches, (n_branches + 1)
+					    * sizeof *branches);
+			if (!branches) {
+				report ("out of memory\n");
+				exit (1);
+			}
+			branches[n_branches++] = xstrdup (de->d_name);
+		}
+
+		closedir (dir);
+	}
+
+	memset (&done, 0, sizeof done);
+
+	if (!restart && load_verify_state (state_fn, &done) == -1)
+		restart = 1;
+
+	if ((verify_state = meta_fopen (state_fn, restart ? "w" : "a")) == NULL)
+		report ("failed to open %s: %m, scrub will not be"
+			" resumable\n", state_fn);
+	else if (restart)
+		fputs (VERIFY_MAGIC, verify_state);
+
+	time (&now);
+	localtime_r (&now, &tm);
+	sprintf (today, "%04d-%02d-%02d", tm.tm_year + 1900, tm.tm_mon + 1,
+		 tm.tm_mday);
+
+	tail = &verify_queue;
+
+	for (idx = 0; idx < n_branches; idx++) {
+		if ((n_files = load_manifest (branches[idx], &files)) == -1)
+			n_files = walk_branch (branches[idx], &files);
+
+		qsort (files, n_files, sizeof *files, cmp_verify_file);
+
+		resumable = strncmp (branches[idx], today, strlen (today)) != 0;
+
+		vd = NULL;
+		if (resumable && (hp = hash_lookup (&done, branches[idx],
+						    strlen (branches[idx]))))
+			vd = hp->val;
+
+		/* what an earlier scrub finished is left out */
+		for (jdx = kdx = 0; vd && jdx < n_files; jdx++) {
+			if (verify_covered (vd, files[jdx].path))
+				free (files[jdx].path);
+			else
+				files[kdx++] = files[jdx];
+		}
+		if (vd)
+			n_files = kdx;
+
+		fn = pack_path ("pack", branches[idx], "idx");
+		p = pack_path ("recipe", branches[idx], "idx");
+		if ((access (fn, F_OK) == 0 || access (p, F_OK) == 0)
+		    && !(vd && vd->pack)) {
+			vc = xcalloc (1, sizeof *vc);
+			vc->branch = branches[idx];
+			vc->is_pack = 1;
+			vc->resumable = resumable;
+			*tail = vc;
+			tail = &vc->next;
+		}
+		free (fn);
+		free (p);
+
+		for (jdx = 0; jdx * VERIFY_CHUNK < n_files; jdx++) {
+			vc = xcalloc (1, sizeof *vc);
+			vc->branch = branches[idx];
+			vc->resumable = resumable;
+			vc->files = files + jdx * VERIFY_CHUNK;
+			vc->n_files = n_files - jdx * VERIFY_CHUNK;
+			if (vc->n_files > VERIFY_CHUNK)
+				vc->n_files = VERIFY_CHUNK;
+
+			*tail = vc;
+			tail = &vc->next;
+		}
+	}
+
+	for (hdx = 0; hdx < done.size; hdx++) {
+		for (hp = done.buckets[hdx]; hp; hp = hp->next) {
+			vd = hp->val;
+			for (idx = 0; idx < vd->n; idx++) {
+				free (vd->r[idx].first);
+				free (vd->r[idx].last);
+			}
+			free (vd->r);
+			free (vd);
+		}
+	}
+	hash_clear (&done);
+
+	for (started = 0; started < jobs - 1; started++) {
+		if (start_thread (&threads[started], verify_worker, NULL) != 0)
+			break;
+	}
+
+	verify_worker (NULL);
+
+	for (idx = 0; idx < started; idx++)
+		pthread_join (threads[idx], NULL);
+
+	if (verify_state) {
+		fclose (verify_state);
+		unlink (state_fn);
+	}
+
+	free (state_fn);
+
+	printf ("%lld files, %lld bytes verified, %lld mismatched,"
+		" %lld unreadable, %lld skipped\n", verify_files,
+		verify_bytes, verify_bad, verify_errors, verify_skipped);
+
+	return (verify_bad || verify_errors ? 1 : 0);
+}
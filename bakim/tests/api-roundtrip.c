@@ -0,0 +1,83 @@
+/*
+ * drives libbakim for api-roundtrip.test: api-roundtrip TARGET SRC.
+ * prints one line per step for the script to check.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include "bakim.h"
+
+int n_stored, n_messages;
+
+void
+stored (void *arg, const char *path, const char *slot)
+{
+	n_stored++;
+}
+
+void
+message (void *arg, const char *msg)
+{
+	n_messages++;
+}
+
+int
+main (int argc, char **argv)
+{
+	struct bakim_callbacks cb = { NULL, stored, NULL, NULL, message };
+	struct bakim_opts opts;
+	const char *targets[] = { argv[1], NULL };
+	const char *bad[] = { argv[0], NULL };
+	const char *all[] = { argv[2], NULL };
+	const char *some[] = { NULL, NULL };
+	const char *outside[] = { "/", NULL };
+	char path[4096];
+	struct bakim *b;
+	FILE *f;
+	int r;
+
+	if (argc != 3)
+		return (2);
+
+	errno = 0;
+	printf ("open file %s\n", bakim_open (bad) == NULL && errno == ENOTDIR
+		? "ENOTDIR" : "wrong");
+
+	if ((b = bakim_open (targets)) == NULL) {
+		printf ("open failed: %s\n", strerror (errno));
+		return (1);
+	}
+
+	r = bakim_option (b, 'x', "*.skip");
+	printf ("option x %d\n", r);
+	r = bakim_option (b, 't', "ssh host");
+	printf ("option t %d %s\n", r, bakim_error (b));
+
+	n_stored = 0;
+	r = bakim_backup_paths (b, all, NULL, &cb);
+	printf ("full %d stored %d\n", r, n_stored);
+
+	n_stored = 0;
+	r = bakim_backup_paths (b, all, NULL, &cb);
+	printf ("again %d stored %d\n", r, n_stored);
+
+	/* change one file and name only it */
+	snprintf (path, sizeof path, "%s/d/changed", argv[2]);
+	if ((f = fopen (path, "a")) == NULL)
+		return (1);
+	fputs ("new\n", f);
+	fclose (f);
+	some[0] = path;
+	opts.root = argv[2];
+	n_stored = 0;
+	r = bakim_backup_paths (b, some, &opts, &cb);
+	printf ("listed %d stored %d\n", r, n_stored);
+
+	n_messages = 0;
+	r = bakim_backup_paths (b, outside, &opts, &cb);
+	printf ("outside %d messages %d %s\n", r, n_messages, bakim_error (b));
+
+	bakim_close (b);
+
+	return (0);
+}
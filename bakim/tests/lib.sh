@@ -0,0 +1,59 @@
+# sourced by each test: $BAKIM is the binary under test, $T a scratch
+# directory removed on exit.  archives are made immutable, so this
+# wants root, as bakim itself does.
+
+BAKIM=${BAKIM:-$(dirname "$0")/../src/bakim}
+T=$(mktemp -d /tmp/bakim-test.XXXXXX) || exit 1
+
+cleanup ()
+{
+	chattr -R -i -a "$T" 2>/dev/null
+	rm -rf "$T"
+}
+trap cleanup EXIT
+
+fail ()
+{
+	echo "FAIL $(basename "$0"): $*" >&2
+	exit 1
+}
+
+# n little endian bytes of v
+le ()
+{
+	v=$1
+	n=$2
+	while [ "$n" -gt 0 ]; do
+		printf "\\$(printf %o $((v & 255)))"
+		v=$((v >> 8))
+		n=$((n - 1))
+	done
+}
+
+# a remote protocol frame of type $1 around the payload in file $2
+frame ()
+{
+	printf %s "$1"
+	le "$(wc -c < "$2")" 4
+	cat "$2"
+}
+
+# one entry of an E batch: id type level mode size path [target]
+entry ()
+{
+	le "$1" 4
+	printf %s "$2"
+	le "$3" 2
+	le "$4" 4
+	le 0 4
+	le 0 4
+	le "$5" 8
+	le 1000000000 8
+	le 1000000000 8
+	le ${#6} 2
+	printf %s "$6"
+	if [ "$2" = l ]; then
+		le ${#7} 2
+		printf %s "$7"
+	fi
+}
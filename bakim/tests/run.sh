@@ -0,0 +1,17 @@
+#!/bin/sh
+# run every test in this directory: sh run.sh [TEST]...
+
+cd "$(dirname "$0")" || exit 1
+
+[ $# -gt 0 ] || set -- *.test
+
+status=0
+for t in "$@"; do
+	if sh "$t"; then
+		echo "PASS $t"
+	else
+		status=1
+	fi
+done
+
+exit $status